@@ -31,6 +31,8 @@ int main (int argc, char *argv[]) {
     return 1;
   }
 
+  dtp_setopt(&client, DTP_COMPRESS, 1); /* If the server agrees. */
+
   stat = dtp_connect(&client);
   if( stat < 0 ) {
     perror("Connect :");
@@ -41,7 +43,7 @@ int main (int argc, char *argv[]) {
 	 ntohs(client.self.sin_port));
   printf("(%d) :: %s:%u\n",  client.status,
 	 inet_ntoa(client.addr.sin_addr), ntohs(client.addr.sin_port));
-  printf("InitSeq <Self : %u, Remote : %u>\n", client.seqno, client.ackno);
+  printf("InitSeq <Self : %llu, Remote : %llu>\n", client.seqno, client.ackno);
 
   FILE* file = fopen(argv[3], "rb");
   if( file == NULL ) {
@@ -62,8 +64,8 @@ int main (int argc, char *argv[]) {
 
   printf("File size acked : %lu\n", chksize);
 
-  const size_t BUFLEN = 1500;
-  char buff[BUFLEN];
+  const size_t BUFLEN = ZBLK;	/* Whole compression blocks. */
+  static char buff[ZBLK];
   while( 1 ) {
     size_t bytes = fread(buff, 1, BUFLEN, file);
     if( bytes == 0 )
@@ -76,6 +78,13 @@ int main (int argc, char *argv[]) {
 
   fclose(file);
 
+  struct dtp_zstats zs;
+  if( dtp_compress_stats(&client, &zs) == 0 && zs.raw_out > 0 )
+    printf("Compression : %llu -> %llu bytes (ratio %.2f), %.1f MiB/s%s\n",
+	   zs.raw_out, zs.wire_out, (double) zs.raw_out / zs.wire_out,
+	   zs.ns_comp > 0 ? zs.raw_out * 1e9 / zs.ns_comp / (1<<20) : 0.0,
+	   zs.active ? "" : " (off)");
+
   close_dtp_gate(&client);
 
   return 0;
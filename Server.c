@@ -23,6 +23,8 @@ int main (int argc, char *argv[]) {
   }
   printf("Server listening on port %u\n", ntohs(server.self.sin_port));
 
+  dtp_setopt(&server, DTP_COMPRESS, 1); /* If the client asks. */
+
   stat = dtp_listen(&server, client_ip, &client_port);
   if( stat < 0 ) {
     perror("Connect :");
@@ -30,7 +32,7 @@ int main (int argc, char *argv[]) {
   }
 
   printf("(%d) :: %s:%u\n",  server.status, client_ip, client_port);
-  printf("InitSeq <Self : %u, Remote : %u>\n", server.seqno, server.ackno);
+  printf("InitSeq <Self : %llu, Remote : %llu>\n", server.seqno, server.ackno);
 
   size_t filesize;
   dtp_recv(&server, &filesize, sizeof(size_t));
@@ -58,6 +60,12 @@ int main (int argc, char *argv[]) {
 
   printf("\nOutfile received.\n");
 
+  struct dtp_zstats zs;
+  if( dtp_compress_stats(&server, &zs) == 0 && zs.raw_in > 0 )
+    printf("Compression : %llu -> %llu bytes (ratio %.2f), %.1f MiB/s\n",
+	   zs.wire_in, zs.raw_in, (double) zs.raw_in / zs.wire_in,
+	   zs.ns_decomp > 0 ? zs.raw_in * 1e9 / zs.ns_decomp / (1<<20) : 0.0);
+
   fclose(outfile);
 
   close_dtp_gate(&server);
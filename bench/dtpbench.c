@@ -0,0 +1,884 @@
+#include "dtp.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <unistd.h>
+#include <time.h>
+
+#include <arpa/inet.h>
+#include <sys/resource.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+/**
+   DTP benchmark driver.
+
+   Runs both ends of a gate inside one process over loopback (or
+   through bench/impair when -c points at the proxy port) and prints
+   one JSON object per run on stdout.
+
+   Modes :
+     throughput  bulk one way transfer of -s bytes.
+     latency     -n ping pongs of -m byte messages, p50 / p99 / p999.
+     memory      resident memory of -g idle connected gate pairs.
+     multiplex   -s bytes over each of -g gate pairs, all driven by
+                 one epoll loop through dtp_try_send / dtp_try_recv.
+     connect     -n connections of one gate pair, time from dtp_connect
+                 to the first byte at the server, with the buffer pool
+                 and then without it.
+     prio        latency mode on the priority channel while the client
+                 keeps its outbuf full of bulk data (-U : on the bulk
+                 stream instead, behind the backlog).
+     mcast       -s bytes from one multicast sender to -g receivers on
+                 loopback, checked byte for byte, with the packets the
+                 sender put on the wire per packet of data.
+ */
+
+struct bench {
+  const char *mode;
+  port_t sport;			/* Server gate port. */
+  port_t cport;			/* Port the client connects to. */
+  size_t size;			/* Throughput transfer size. */
+  size_t msg;			/* Latency message size. */
+  size_t count;			/* Latency round trips. */
+  size_t gates;			/* Memory : gate pairs. */
+  int io;			/* DTP_IO backend. */
+  int compress;			/* DTP_COMPRESS. */
+  int fec;			/* DTP_FEC. */
+  int window;			/* DTP_WINDOW. */
+  int text;			/* Log like payload instead of a constant. */
+  size_t wsize;			/* Throughput write size. */
+  int nodelay;			/* DTP_NODELAY. */
+  int busy;			/* DTP_BUSYPOLL (us). */
+  int pin;			/* First core daemons are pinned to, -1 none. */
+  int prio;			/* Prio : DTP_PRIO_* of the ping pongs. */
+  int shm;			/* DTP_SHM. */
+  int sockbuf;			/* DTP_SOCKBUF. */
+  int core;			/* DTP_CORE. */
+  const char *group;		/* Mcast : group address. */
+  int evict;			/* Mcast : DTP_MC_EVICT (ms). */
+
+  dtp_server server;
+  dtp_client client;
+  double done;			/* Server side completion time. */
+  size_t sent, rcvd;		/* Multiplex progress. */
+};
+
+/* Multiplex : server threads only listen, the main loop does I/O. */
+static pthread_mutex_t mux_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t mux_cv = PTHREAD_COND_INITIALIZER;
+static size_t mux_ready;
+static int mux_close;
+
+static double now_s (void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static double cpu_s (void) {
+  struct rusage ru;
+  getrusage(RUSAGE_SELF, &ru);
+  return ru.ru_utime.tv_sec + ru.ru_stime.tv_sec
+    + (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) * 1e-6;
+}
+
+static long rss_bytes (void) {
+  long pages = 0, rss = 0;
+  FILE *f = fopen("/proc/self/statm", "r");
+  if( f == NULL )
+    return -1;
+  if( fscanf(f, "%ld %ld", &pages, &rss) != 2 )
+    rss = -1;
+  fclose(f);
+  return rss < 0 ? -1 : rss * sysconf(_SC_PAGESIZE);
+}
+
+/**
+   Hardware cycle counter covering every thread of the process.
+   Must be opened before the gate daemons are created.
+   Returns -1 where perf events are unavailable.
+ */
+static int cycles_open (void) {
+  struct perf_event_attr pe;
+  memset(&pe, 0, sizeof(pe));
+  pe.type = PERF_TYPE_HARDWARE;
+  pe.size = sizeof(pe);
+  pe.config = PERF_COUNT_HW_CPU_CYCLES;
+  pe.disabled = 1;
+  pe.inherit = 1;
+  pe.exclude_hv = 1;
+  return syscall(SYS_perf_event_open, &pe, 0, -1, -1, 0);
+}
+
+static long long cycles_read (int fd) {
+  long long val;
+  if( fd < 0 || read(fd, &val, sizeof(val)) != sizeof(val) )
+    return -1;
+  return val;
+}
+
+static int recv_all (struct dtp_gate *gate, void *buf, size_t len) {
+  byte_t *p = (byte_t*) buf;
+  while( len > 0 ) {
+    size_t n = dtp_recv(gate, p, len);
+    p += n;
+    len -= n;
+  }
+  return 0;
+}
+
+static int recv_all_prio (struct dtp_gate *gate, void *buf, size_t len, int prio) {
+  byte_t *p = (byte_t*) buf;
+  while( len > 0 ) {
+    ssize_t n = dtp_recv_prio(gate, p, len, prio);
+    if( n <= 0 )
+      return -1;
+    p += n;
+    len -= n;
+  }
+  return 0;
+}
+
+/* Prio : bulk data is framed as messages of this size, first byte 0,
+   so that pings sent with -U can be told apart. */
+#define PRIO_FRAME (1<<14)
+
+static volatile int prio_stop;
+
+/* Prio, server side : drain the bulk stream, echo pings. */
+static void * prio_echo (struct bench *b) {
+  byte_t *buf = malloc(PRIO_FRAME);
+  size_t i;
+  if( b->prio == DTP_PRIO_HIGH ) {
+    for( i = 0; i < b->count; i++ ) {
+      recv_all_prio(&b->server, buf, b->msg, DTP_PRIO_HIGH);
+      dtp_send_prio(&b->server, buf, b->msg, DTP_PRIO_HIGH);
+    }
+  }
+  free(buf);
+  return NULL;
+}
+
+static void prio_server (struct bench *b) {
+  pthread_t echo;
+  pthread_create(&echo, NULL, (void * (*) (void*)) prio_echo, b);
+  byte_t *buf = malloc(PRIO_FRAME);
+  while( recv_all(&b->server, buf, 1) == 0 ) {
+    if( buf[0] == 0 ) {		/* Bulk frame. */
+      recv_all(&b->server, buf + 1, PRIO_FRAME - 1);
+    } else if( buf[0] == 1 ) {	/* Ping on the bulk stream. */
+      recv_all(&b->server, buf + 1, b->msg - 1);
+      dtp_send(&b->server, buf, b->msg);
+    } else
+      break;			/* End. */
+  }
+  pthread_join(echo, NULL);
+  free(buf);
+}
+
+/* Connect : the server thread re-listens count times. */
+static void * connect_server (struct bench *b) {
+  char host[1<<5];
+  port_t port;
+  size_t i;
+  for( i = 0; i < b->count; i++ ) {
+    pthread_mutex_lock(&mux_mtx);
+    mux_ready++;		/* The socket queues the SYN from here. */
+    pthread_cond_broadcast(&mux_cv);
+    pthread_mutex_unlock(&mux_mtx);
+    if( dtp_listen(&b->server, host, &port) != 0 ) {
+      perror("dtp_listen");
+      exit(1);
+    }
+    byte_t c;
+    recv_all(&b->server, &c, 1);
+    b->done = now_s();
+    close_dtp_gate(&b->server);
+  }
+  return NULL;
+}
+
+static void * server_main (void *arg) {
+  struct bench *b = (struct bench*) arg;
+  char host[1<<5];
+  port_t port;
+  if( strcmp(b->mode, "connect") == 0 )
+    return connect_server(b);
+  if( dtp_listen(&b->server, host, &port) != 0 ) {
+    perror("dtp_listen");
+    exit(1);
+  }
+
+  if( strcmp(b->mode, "throughput") == 0 ) {
+    static byte_t buf[1<<16];
+    size_t rem = b->size;
+    while( rem > 0 )
+      rem -= dtp_recv(&b->server, buf, rem < sizeof(buf) ? rem : sizeof(buf));
+    b->done = now_s();
+  } else if( strcmp(b->mode, "latency") == 0 ) {
+    byte_t *buf = malloc(b->msg);
+    size_t i;
+    for( i = 0; i < b->count; i++ ) {
+      recv_all(&b->server, buf, b->msg);
+      dtp_send(&b->server, buf, b->msg);
+    }
+    free(buf);
+  } else if( strcmp(b->mode, "prio") == 0 ) {
+    prio_server(b);
+  } else if( strcmp(b->mode, "multiplex") == 0 ) {
+    pthread_mutex_lock(&mux_mtx);
+    mux_ready++;
+    pthread_cond_broadcast(&mux_cv);
+    while( !mux_close )
+      pthread_cond_wait(&mux_cv, &mux_mtx);
+    pthread_mutex_unlock(&mux_mtx);
+  }
+
+  close_dtp_gate(&b->server);
+  return NULL;
+}
+
+static void set_opts (struct bench *b, struct dtp_gate *gate) {
+  dtp_setopt(gate, DTP_IO, b->io);
+  dtp_setopt(gate, DTP_COMPRESS, b->compress);
+  dtp_setopt(gate, DTP_FEC, b->fec);
+  dtp_setopt(gate, DTP_WINDOW, b->window);
+  dtp_setopt(gate, DTP_BUSYPOLL, b->busy);
+  dtp_setopt(gate, DTP_NODELAY, b->nodelay);
+  dtp_setopt(gate, DTP_SHM, b->shm);
+  dtp_setopt(gate, DTP_SOCKBUF, b->sockbuf);
+  dtp_setopt(gate, DTP_CORE, b->core);
+  if( b->pin >= 0 ) {		/* Client daemons, then server daemons. */
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    int base = b->pin + (gate == &b->server ? 2 : 0);
+    dtp_setopt(gate, DTP_CPU_SND, base % ncpu);
+    dtp_setopt(gate, DTP_CPU_RCV, (base + 1) % ncpu);
+  }
+}
+
+static int connect_pair (struct bench *b, pthread_t *srv) {
+  if( init_dtp_server(&b->server, b->sport) != 0 ) {
+    perror("init_dtp_server");
+    return -1;
+  }
+  set_opts(b, &b->server);
+  if( pthread_create(srv, NULL, server_main, b) != 0 )
+    return -1;
+  if( init_dtp_client(&b->client, "127.0.0.1", b->cport) != 0 ) {
+    perror("init_dtp_client");
+    return -1;
+  }
+  set_opts(b, &b->client);
+  int tries;
+  for( tries = 0; tries < 10; tries++ )	/* Server thread may not listen yet. */
+    if( dtp_connect(&b->client) == 0 )
+      return 0;
+  perror("dtp_connect");
+  return -1;
+}
+
+static const char * io_name (struct dtp_gate *gate) {
+  int io = DTP_IO_SOCKET, shm = 0;
+  dtp_getopt(gate, DTP_IO, &io);
+  dtp_getopt(gate, DTP_SHM, &shm);
+  return shm ? "shm" : io == DTP_IO_URING_SQPOLL ? "uring_sqpoll" :
+    io == DTP_IO_URING ? "uring" : "socket";
+}
+
+/* The core that ran, see DTP_CORE. */
+static const char * core_name (struct dtp_gate *gate) {
+  int core = DTP_CORE_GENERIC;
+  dtp_getopt(gate, DTP_CORE, &core);
+  return dtp_cores[core]->name;
+}
+
+/* Compressible text, roughly an access log. */
+static void fill_text (byte_t *buf, size_t len) {
+  unsigned long long x = 88172645463325252ull;
+  size_t off = 0;
+  while( off < len ) {
+    char line[96];
+    x ^= x << 13; x ^= x >> 7; x ^= x << 17;
+    int n = snprintf(line, sizeof(line), "%llu,host-%02u,GET /api/v1/items/%u,%u,%u\n",
+		     1700000000ull + off / 64, (unsigned) (x % 41),
+		     (unsigned) (x >> 8) % 5000, x % 7 ? 200 : 404,
+		     (unsigned) (x >> 24) % 100000);
+    size_t k = (size_t) n < len - off ? (size_t) n : len - off;
+    memcpy(buf + off, line, k);
+    off += k;
+  }
+}
+
+static int cmp_double (const void *a, const void *b) {
+  double x = *(const double*) a, y = *(const double*) b;
+  return x < y ? -1 : x > y;
+}
+
+static int run_throughput (struct bench *b) {
+  int cyc = cycles_open();
+  pthread_t srv;
+  if( connect_pair(b, &srv) != 0 )
+    return 1;
+
+  static byte_t buf[1<<16];
+  if( b->text )
+    fill_text(buf, sizeof(buf));
+  else
+    memset(buf, 0xa5, sizeof(buf));
+  size_t rem = b->size;
+
+  if( cyc >= 0 )
+    ioctl(cyc, PERF_EVENT_IOC_ENABLE, 0);
+  const char *io = io_name(&b->client);
+  double c0 = cpu_s(), t0 = now_s();
+  while( rem > 0 ) {
+    size_t n = rem < b->wsize ? rem : b->wsize;
+    dtp_send(&b->client, buf, n);
+    rem -= n;
+  }
+  struct dtp_zstats zs;
+  double ratio = 1.0;
+  if( dtp_compress_stats(&b->client, &zs) == 0 && zs.wire_out > 0 )
+    ratio = (double) zs.raw_out / zs.wire_out;
+  close_dtp_gate(&b->client);
+  pthread_join(srv, NULL);
+  double secs = b->done - t0, cpu = cpu_s() - c0;
+  long long cycles = cycles_read(cyc);
+  struct dtp_drops rd, sd;	/* Receiver's kernel, sender's verdicts. */
+  dtp_drops(&b->server, &rd);
+  dtp_drops(&b->client, &sd);
+
+  printf("{\"mode\": \"throughput\", \"core\": \"%s\", \"io\": \"%s\", \"compress_ratio\": %.3f, "
+	 "\"write_bytes\": %zu, \"bytes\": %zu, \"seconds\": %.6f, \"mib_per_s\": %.3f, "
+	 "\"cpu_seconds\": %.6f, \"cpu_ns_per_byte\": %.4f, ",
+	 core_name(&b->client), io, ratio, b->wsize, b->size, secs, b->size / secs / (1 << 20), cpu, cpu * 1e9 / b->size);
+  printf("\"kernel_drops\": %llu, \"overflow_losses\": %llu, \"network_losses\": %llu, ",
+	 rd.local, sd.overflow, sd.network);
+  if( cycles >= 0 )
+    printf("\"cycles_per_byte\": %.4f}\n", (double) cycles / b->size);
+  else
+    printf("\"cycles_per_byte\": null}\n");
+  return 0;
+}
+
+static int run_latency (struct bench *b) {
+  pthread_t srv;
+  if( connect_pair(b, &srv) != 0 )
+    return 1;
+
+  byte_t *buf = calloc(1, b->msg);
+  double *rtt = malloc(b->count * sizeof(double));
+  if( buf == NULL || rtt == NULL )
+    return 1;
+  const char *io = io_name(&b->client);
+  size_t i;
+  for( i = 0; i < b->count; i++ ) {
+    double t0 = now_s();
+    dtp_send(&b->client, buf, b->msg);
+    recv_all(&b->client, buf, b->msg);
+    rtt[i] = (now_s() - t0) * 1e6;
+  }
+  close_dtp_gate(&b->client);
+  pthread_join(srv, NULL);
+
+  qsort(rtt, b->count, sizeof(double), cmp_double);
+  printf("{\"mode\": \"latency\", \"core\": \"%s\", \"io\": \"%s\", \"busy_poll_us\": %d, "
+	 "\"message_bytes\": %zu, "
+	 "\"round_trips\": %zu, \"p50_us\": %.2f, \"p99_us\": %.2f, "
+	 "\"p999_us\": %.2f, \"max_us\": %.2f}\n",
+	 core_name(&b->client), io, b->busy, b->msg, b->count,
+	 rtt[b->count * 50 / 100], rtt[b->count * 99 / 100],
+	 rtt[b->count * 999 / 1000], rtt[b->count - 1]);
+  free(buf);
+  free(rtt);
+  return 0;
+}
+
+static int run_memory (struct bench *b) {
+  struct bench *pairs = calloc(b->gates, sizeof(struct bench));
+  pthread_t *srv = calloc(b->gates, sizeof(pthread_t));
+  if( pairs == NULL || srv == NULL )
+    return 1;
+
+  long rss0 = rss_bytes();
+  double t0 = now_s();
+  size_t i;
+  for( i = 0; i < b->gates; i++ ) {
+    pairs[i] = *b;
+    pairs[i].sport = b->sport + i;
+    pairs[i].cport = b->sport + i;
+    if( connect_pair(pairs + i, srv + i) != 0 )
+      return 1;
+  }
+  double setup = now_s() - t0;
+  long rss1 = rss_bytes();
+
+  for( i = 0; i < b->gates; i++ ) {
+    close_dtp_gate(&pairs[i].client);
+    pthread_join(srv[i], NULL);
+  }
+
+  printf("{\"mode\": \"memory\", \"core\": \"%s\", \"gates\": %zu, \"gate_struct_bytes\": %zu, "
+	 "\"gate_buffer_bytes\": %zu, \"rss_bytes_per_gate\": %ld, "
+	 "\"connect_us_per_pair\": %.2f}\n",
+	 core_name(&pairs[0].client), 2 * b->gates, sizeof(struct dtp_gate),
+	 2 * b->window * sizeof(packet_t) + b->window * sizeof(byte_t),
+	 (rss1 - rss0) / (long) (2 * b->gates),
+	 setup * 1e6 / b->gates);
+  free(pairs);
+  free(srv);
+  return 0;
+}
+
+static int run_multiplex (struct bench *b) {
+  struct bench *pairs = calloc(b->gates, sizeof(struct bench));
+  pthread_t *srv = calloc(b->gates, sizeof(pthread_t));
+  int ep = epoll_create1(0);
+  if( pairs == NULL || srv == NULL || ep < 0 )
+    return 1;
+
+  size_t i;
+  for( i = 0; i < b->gates; i++ ) {
+    pairs[i] = *b;
+    pairs[i].sport = b->sport + i;
+    pairs[i].cport = b->sport + i;
+    if( connect_pair(pairs + i, srv + i) != 0 )
+      return 1;
+  }
+  pthread_mutex_lock(&mux_mtx);
+  while( mux_ready < b->gates )
+    pthread_cond_wait(&mux_cv, &mux_mtx);
+  pthread_mutex_unlock(&mux_mtx);
+
+  /* Even tags are senders, odd tags receivers. */
+  struct epoll_event ev;
+  ev.events = EPOLLIN | EPOLLET;
+  for( i = 0; i < b->gates; i++ ) {
+    ev.data.u64 = 2 * i;
+    epoll_ctl(ep, EPOLL_CTL_ADD, dtp_fd(&pairs[i].client), &ev);
+    ev.data.u64 = 2 * i + 1;
+    epoll_ctl(ep, EPOLL_CTL_ADD, dtp_fd(&pairs[i].server), &ev);
+  }
+
+  static byte_t buf[1<<16];
+  memset(buf, 0x5a, sizeof(buf));
+  size_t done = 0, wakeups = 0;
+  double c0 = cpu_s(), t0 = now_s();
+
+  /* Everyone starts out ready; serve a tag until it would block. */
+  size_t *ready = malloc(2 * b->gates * sizeof(size_t)), nready = 0;
+  struct epoll_event *evs = malloc(2 * b->gates * sizeof(struct epoll_event));
+  for( i = 0; i < 2 * b->gates; i++ )
+    ready[nready++] = i;
+  while( done < b->gates ) {
+    while( nready > 0 ) {
+      size_t tag = ready[--nready];
+      struct bench *p = pairs + tag / 2;
+      ssize_t n;
+      if( tag % 2 == 0 ) {
+	while( p->sent < b->size ) {
+	  size_t len = b->size - p->sent;
+	  n = dtp_try_send(&p->client, buf, len < sizeof(buf) ? len : sizeof(buf));
+	  if( n < 0 )
+	    break;
+	  p->sent += n;
+	}
+      } else {
+	while( p->rcvd < b->size &&
+	       (n = dtp_try_recv(&p->server, buf, sizeof(buf))) > 0 ) {
+	  p->rcvd += n;
+	  if( p->rcvd == b->size )
+	    done++;
+	}
+      }
+    }
+    if( done == b->gates )
+      break;
+    int k, nev = epoll_wait(ep, evs, 2 * b->gates, -1);
+    for( k = 0; k < nev; k++ ) {
+      size_t tag = evs[k].data.u64;
+      struct bench *p = pairs + tag / 2;
+      dtp_events(tag % 2 == 0 ? &p->client : &p->server);
+      ready[nready++] = tag;
+      wakeups++;
+    }
+  }
+  double secs = now_s() - t0, cpu = cpu_s() - c0;
+
+  pthread_mutex_lock(&mux_mtx);
+  mux_close = 1;
+  pthread_cond_broadcast(&mux_cv);
+  pthread_mutex_unlock(&mux_mtx);
+  for( i = 0; i < b->gates; i++ ) {
+    close_dtp_gate(&pairs[i].client);
+    pthread_join(srv[i], NULL);
+  }
+
+  printf("{\"mode\": \"multiplex\", \"gates\": %zu, \"bytes_per_pair\": %zu, "
+	 "\"seconds\": %.6f, \"mib_per_s\": %.3f, \"cpu_seconds\": %.6f, "
+	 "\"wakeups\": %zu}\n",
+	 b->gates, b->size, secs, b->gates * b->size / secs / (1 << 20),
+	 cpu, wakeups);
+  close(ep);
+  free(ready);
+  free(evs);
+  free(pairs);
+  free(srv);
+  return 0;
+}
+
+/* One pass of connect : count samples of connect to first byte. */
+static int connect_pass (struct bench *b, double *lat) {
+  pthread_t srv;
+  mux_ready = 0;
+  if( init_dtp_server(&b->server, b->sport) != 0 ) {
+    perror("init_dtp_server");
+    return -1;
+  }
+  set_opts(b, &b->server);
+  if( pthread_create(&srv, NULL, server_main, b) != 0 )
+    return -1;
+
+  static const byte_t c = 1;
+  size_t i;
+  for( i = 0; i < b->count; i++ ) {
+    pthread_mutex_lock(&mux_mtx);
+    while( mux_ready <= i )
+      pthread_cond_wait(&mux_cv, &mux_mtx);
+    pthread_mutex_unlock(&mux_mtx);
+    /* A fresh socket : stale segments of the last connection would
+       answer the SYN otherwise. */
+    if( init_dtp_client(&b->client, "127.0.0.1", b->cport) != 0 ) {
+      perror("init_dtp_client");
+      return -1;
+    }
+    set_opts(b, &b->client);
+    double t0 = now_s();
+    if( dtp_connect(&b->client) != 0 ) {
+      perror("dtp_connect");
+      return -1;
+    }
+    dtp_send(&b->client, &c, 1);
+    close_dtp_gate(&b->client);
+    close(b->client.socket);
+    /* The server is done with the byte once it listens again. */
+    pthread_mutex_lock(&mux_mtx);
+    while( mux_ready <= i + 1 && i + 1 < b->count )
+      pthread_cond_wait(&mux_cv, &mux_mtx);
+    pthread_mutex_unlock(&mux_mtx);
+    if( i + 1 == b->count )
+      pthread_join(srv, NULL);
+    lat[i] = (b->done - t0) * 1e6;
+  }
+  close(b->server.socket);
+  qsort(lat, b->count, sizeof(double), cmp_double);
+  return 0;
+}
+
+static int run_connect (struct bench *b) {
+  double *pool = malloc(b->count * sizeof(double));
+  double *heap = malloc(b->count * sizeof(double));
+  if( pool == NULL || heap == NULL )
+    return 1;
+  struct dtp_poolstats st;
+  if( dtp_pool_reserve(b->window, 2) != 0 )
+    return 1;
+  if( connect_pass(b, pool) != 0 )
+    return 1;
+  dtp_pool_stats(&st);
+  dtp_pool_config(0);
+  if( connect_pass(b, heap) != 0 )
+    return 1;
+
+  size_t n = b->count;
+  printf("{\"mode\": \"connect\", \"connections\": %zu, \"window\": %d, "
+	 "\"pool_hits\": %llu, \"pool_hugetlb\": %zu, \"pool_thp\": %zu, "
+	 "\"pool_p50_us\": %.2f, \"pool_p99_us\": %.2f, "
+	 "\"nopool_p50_us\": %.2f, \"nopool_p99_us\": %.2f}\n",
+	 n, b->window, st.hits, st.hugetlb, st.thp,
+	 pool[n / 2], pool[n * 99 / 100], heap[n / 2], heap[n * 99 / 100]);
+  free(pool);
+  free(heap);
+  return 0;
+}
+
+/* Prio : keeps the client's outbuf full. */
+static pthread_mutex_t prio_mtx = PTHREAD_MUTEX_INITIALIZER;
+static size_t prio_bulk;
+
+static void * prio_fill (void *arg) {
+  struct bench *b = (struct bench*) arg;
+  static byte_t frame[PRIO_FRAME];
+  memset(frame + 1, 0xa5, PRIO_FRAME - 1);
+  while( !prio_stop ) {
+    pthread_mutex_lock(&prio_mtx);	/* Frames stay whole. */
+    dtp_send(&b->client, frame, PRIO_FRAME);
+    pthread_mutex_unlock(&prio_mtx);
+    prio_bulk += PRIO_FRAME;
+  }
+  return NULL;
+}
+
+static int run_prio (struct bench *b) {
+  pthread_t srv, fill;
+  if( connect_pair(b, &srv) != 0 )
+    return 1;
+
+  byte_t *buf = calloc(1, b->msg);
+  double *rtt = malloc(b->count * sizeof(double));
+  if( buf == NULL || rtt == NULL )
+    return 1;
+  pthread_create(&fill, NULL, prio_fill, b);
+  usleep(100000);		/* Let the backlog build up. */
+  double t0 = now_s();
+  size_t bulk0 = prio_bulk, i;
+  for( i = 0; i < b->count; i++ ) {
+    double t = now_s();
+    if( b->prio == DTP_PRIO_HIGH ) {
+      dtp_send_prio(&b->client, buf, b->msg, DTP_PRIO_HIGH);
+      recv_all_prio(&b->client, buf, b->msg, DTP_PRIO_HIGH);
+    } else {
+      buf[0] = 1;
+      pthread_mutex_lock(&prio_mtx);
+      dtp_send(&b->client, buf, b->msg);
+      pthread_mutex_unlock(&prio_mtx);
+      recv_all(&b->client, buf, b->msg);
+    }
+    rtt[i] = (now_s() - t) * 1e6;
+  }
+  double secs = now_s() - t0;
+  size_t bulk = prio_bulk - bulk0;
+  prio_stop = 1;
+  pthread_join(fill, NULL);
+  byte_t end = 2;
+  dtp_send(&b->client, &end, 1);
+  close_dtp_gate(&b->client);
+  pthread_join(srv, NULL);
+
+  qsort(rtt, b->count, sizeof(double), cmp_double);
+  printf("{\"mode\": \"prio\", \"channel\": \"%s\", \"message_bytes\": %zu, "
+	 "\"round_trips\": %zu, \"p50_us\": %.2f, \"p99_us\": %.2f, "
+	 "\"p999_us\": %.2f, \"max_us\": %.2f, \"bulk_mib_per_s\": %.3f}\n",
+	 b->prio == DTP_PRIO_HIGH ? "high" : "bulk", b->msg, b->count,
+	 rtt[b->count * 50 / 100], rtt[b->count * 99 / 100],
+	 rtt[b->count * 999 / 1000], rtt[b->count - 1],
+	 bulk / secs / (1 << 20));
+  free(buf);
+  free(rtt);
+  return 0;
+}
+
+/* Mcast receiver, reading until the sender closes. */
+struct mc_rcv {
+  dtp_client gate;
+  size_t rcvd, bad;
+  double done;
+};
+
+static void * mcast_recv (void *arg) {
+  struct mc_rcv *r = (struct mc_rcv *) arg;
+  byte_t *buf = malloc(1 << 16);
+  size_t n, i;
+  while( buf != NULL && (n = dtp_recv(&r->gate, buf, 1 << 16)) > 0 ) {
+    for( i = 0; i < n; i++ )
+      r->bad += buf[i] != (byte_t) ((r->rcvd + i) % 251);
+    r->rcvd += n;
+  }
+  r->done = now_s();
+  close_dtp_gate(&r->gate);
+  free(buf);
+  return NULL;
+}
+
+static int run_mcast (struct bench *b) {
+  static struct dtp_mcast m;
+  if( init_dtp_mcast(&m, b->sport, b->group, b->sport + 1, "127.0.0.1") != 0 ) {
+    perror("init_dtp_mcast");
+    return 1;
+  }
+  dtp_mcast_setopt(&m, DTP_WINDOW, b->window);
+  dtp_mcast_setopt(&m, DTP_MC_EVICT, b->evict);
+
+  struct mc_rcv *rcv = calloc(b->gates, sizeof(struct mc_rcv));
+  pthread_t *tid = calloc(b->gates, sizeof(pthread_t));
+  if( rcv == NULL || tid == NULL )
+    return 1;
+  size_t i;
+  for( i = 0; i < b->gates; i++ ) {
+    if( init_dtp_client(&rcv[i].gate, "127.0.0.1", b->sport) != 0 )
+      return 1;
+    dtp_setopt(&rcv[i].gate, DTP_WINDOW, b->window);
+    if( dtp_connect(&rcv[i].gate) != 0 ) {
+      perror("dtp_connect");
+      return 1;
+    }
+  }
+  if( dtp_mcast_accept(&m, b->gates, 1000000) < b->gates ) {
+    fprintf(stderr, "receivers missing\n");
+    return 1;
+  }
+  for( i = 0; i < b->gates; i++ )
+    pthread_create(tid + i, NULL, mcast_recv, rcv + i);
+
+  static byte_t buf[251 << 8];	/* Whole periods of the pattern. */
+  for( i = 0; i < sizeof(buf); i++ )
+    buf[i] = i % 251;
+  size_t rem = b->size;
+  double c0 = cpu_s(), t0 = now_s();
+  while( rem > 0 ) {
+    size_t n = rem < sizeof(buf) ? rem : sizeof(buf);
+    dtp_mcast_send(&m, buf, n);
+    rem -= n;
+  }
+  struct dtp_mcast_stats st;
+  close_dtp_mcast(&m);
+  dtp_mcast_stats(&m, &st);
+  double last = t0;
+  size_t whole = 0, bad = 0;
+  for( i = 0; i < b->gates; i++ ) {
+    pthread_join(tid[i], NULL);
+    whole += rcv[i].rcvd == b->size;
+    bad += rcv[i].bad;
+    if( rcv[i].done > last )
+      last = rcv[i].done;
+  }
+  double secs = last - t0, cpu = cpu_s() - c0;
+  double data = (b->size + PAYLOAD - 1) / PAYLOAD;
+
+  printf("{\"mode\": \"mcast\", \"receivers\": %zu, \"complete\": %zu, "
+	 "\"evicted\": %zu, \"corrupt_bytes\": %zu, \"bytes\": %zu, "
+	 "\"seconds\": %.6f, \"mib_per_s\": %.3f, \"delivered_mib_per_s\": %.3f, "
+	 "\"cpu_seconds\": %.6f, \"repairs\": %llu, \"group_repairs\": %llu, "
+	 "\"wire_packets_per_data_packet\": %.3f}\n",
+	 b->gates, whole, st.evicted, bad, b->size, secs,
+	 b->size / secs / (1 << 20), whole * b->size / secs / (1 << 20), cpu,
+	 st.repairs, st.mrepairs,
+	 (st.packets + st.repairs + st.mrepairs) / data);
+  close(m.gate.socket);
+  free(rcv);
+  free(tid);
+  return whole + st.evicted == b->gates && bad == 0 ? 0 : 1;
+}
+
+/* Take the DTP_CORE named, and its window. */
+static int use_core (struct bench *b, const char *name) {
+  int i;
+  for( i = 0; i < DTP_CORES; i++ )
+    if( strcmp(dtp_cores[i]->name, name) == 0 ) {
+      b->core = i;
+      if( dtp_cores[i]->mxw != 0 )
+	b->window = dtp_cores[i]->mxw;
+      return 0;
+    }
+  return -1;
+}
+
+static void usage (const char *prog) {
+  fprintf(stderr,
+	  "Usage: %s <throughput|latency|memory|multiplex|connect|prio|mcast> [options]\n"
+	  "  -p <port>  server gate port (default 9300)\n"
+	  "  -c <port>  port the client connects to, e.g. bench/impair\n"
+	  "  -s <bytes> throughput transfer size (default 256MiB)\n"
+	  "  -W <bytes> throughput write size (default 64KiB)\n"
+	  "  -m <bytes> latency message size (default 64)\n"
+	  "  -n <count> latency round trips / connections (default 10000)\n"
+	  "  -g <count> memory / multiplex gate pairs, mcast receivers (default 8)\n"
+	  "  -i <io>    socket, uring or sqpoll (default socket)\n"
+	  "  -z         negotiate compression\n"
+	  "  -f         negotiate parity packets\n"
+	  "  -w <slots> buffer slots per gate (default 4096)\n"
+	  "  -N         send partial packets without delay\n"
+	  "  -B <us>    busy poll budget (default 0, off)\n"
+	  "  -P <cpu>   pin the gate daemons to cores from <cpu> on\n"
+	  "  -M         shared memory between the ends (DTP_SHM)\n"
+	  "  -k <bytes> socket buffers (default 0, sized for the window)\n"
+	  "  -C <name>  daemons of core generic, lan, wan or tiny (DTP_CORE)\n"
+	  "  -U         prio : ping pong on the bulk stream\n"
+	  "  -G <addr>  mcast : group (default 239.255.0.1, port + 1)\n"
+	  "  -E <ms>    mcast : evict receivers holding the others back\n"
+	  "  -t         throughput : log like text instead of constant bytes\n", prog);
+}
+
+int main (int argc, char *argv[]) {
+  if( argc < 2 ) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  static struct bench b;
+  b.mode = argv[1];
+  b.sport = 9300;
+  b.cport = 0;
+  b.size = 256 << 20;
+  b.msg = 64;
+  b.count = 10000;
+  b.gates = 8;
+  b.window = MXW;
+  b.pin = -1;
+  b.wsize = 1 << 16;
+  b.prio = DTP_PRIO_HIGH;
+  b.group = "239.255.0.1";
+
+  int opt;
+  optind = 2;
+  while( (opt = getopt(argc, argv, "p:c:s:m:n:g:i:ztfw:B:P:W:NUMG:E:k:C:")) != -1 ) {
+    switch( opt ) {
+    case 'p': b.sport = atoi(optarg); break;
+    case 'c': b.cport = atoi(optarg); break;
+    case 's': b.size = strtoull(optarg, NULL, 0); break;
+    case 'm': b.msg = strtoull(optarg, NULL, 0); break;
+    case 'n': b.count = strtoull(optarg, NULL, 0); break;
+    case 'g': b.gates = strtoull(optarg, NULL, 0); break;
+    case 'i':
+      b.io = strcmp(optarg, "uring") == 0 ? DTP_IO_URING :
+	strcmp(optarg, "sqpoll") == 0 ? DTP_IO_URING_SQPOLL : DTP_IO_SOCKET;
+      break;
+    case 'z': b.compress = 1; break;
+    case 't': b.text = 1; break;
+    case 'f': b.fec = 1; break;
+    case 'w': b.window = atoi(optarg); break;
+    case 'W': b.wsize = strtoull(optarg, NULL, 0); break;
+    case 'N': b.nodelay = 1; break;
+    case 'U': b.prio = DTP_PRIO_BULK; break;
+    case 'M': b.shm = 1; break;
+    case 'k': b.sockbuf = atoi(optarg); break;
+    case 'G': b.group = optarg; break;
+    case 'E': b.evict = atoi(optarg); break;
+    case 'B': b.busy = atoi(optarg); break;
+    case 'P': b.pin = atoi(optarg); break;
+    case 'C':
+      if( use_core(&b, optarg) != 0 ) {
+	usage(argv[0]);
+	return 1;
+      }
+      break;
+    default: usage(argv[0]); return 1;
+    }
+  }
+  if( b.cport == 0 )
+    b.cport = b.sport;
+
+  if( b.wsize == 0 || b.wsize > (1 << 16) )
+    b.wsize = 1 << 16;
+  if( strcmp(b.mode, "throughput") == 0 && b.size > 0 )
+    return run_throughput(&b);
+  if( strcmp(b.mode, "latency") == 0 && b.msg > 0 && b.count > 0 )
+    return run_latency(&b);
+  if( strcmp(b.mode, "memory") == 0 && b.gates > 0 )
+    return run_memory(&b);
+  if( strcmp(b.mode, "multiplex") == 0 && b.gates > 0 )
+    return run_multiplex(&b);
+  if( strcmp(b.mode, "connect") == 0 && b.count > 0 )
+    return run_connect(&b);
+  if( strcmp(b.mode, "prio") == 0 && b.msg > 0 && b.msg <= PRIO_FRAME && b.count > 0 )
+    return run_prio(&b);
+  if( strcmp(b.mode, "mcast") == 0 && b.size > 0 && b.gates > 0 )
+    return run_mcast(&b);
+  usage(argv[0]);
+  return 1;
+}
@@ -0,0 +1,117 @@
+#include "dtp.hpp"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+#include <vector>
+
+#include <unistd.h>
+
+/**
+   Coroutine benchmark : -s bytes over each of -g gate pairs, every
+   transfer a dtp::Task on one dtp::Executor (see dtp.hpp). Prints
+   one JSON object like dtpbench multiplex.
+ */
+
+struct Pair {
+  dtp::Gate server, client;
+  size_t rcvd = 0;
+};
+
+static size_t size = 16 << 20;
+
+static dtp::Task sender (Pair &p) {
+  static std::byte buf[1<<16];
+  size_t sent = 0;
+  while( sent < size ) {
+    size_t n = size - sent < sizeof(buf) ? size - sent : sizeof(buf);
+    co_await p.client.send(std::span(buf, n));
+    sent += n;
+  }
+}
+
+static dtp::Task receiver (Pair &p) {
+  std::vector<std::byte> buf(1<<16);
+  while( p.rcvd < size ) {
+    size_t n = co_await p.server.recv(buf);
+    if( n == 0 )
+      break;
+    p.rcvd += n;
+  }
+}
+
+static void usage (const char *prog) {
+  fprintf(stderr,
+	  "Usage: %s [options]\n"
+	  "  -p <port>  first server gate port (default 9360)\n"
+	  "  -g <count> gate pairs (default 16)\n"
+	  "  -s <bytes> per pair (default 16MiB)\n"
+	  "  -w <slots> buffer slots per gate (default 4096)\n", prog);
+}
+
+int main (int argc, char *argv[]) {
+  port_t port = 9360;
+  size_t gates = 16;
+  int window = MXW, opt;
+  while( (opt = getopt(argc, argv, "p:g:s:w:")) != -1 ) {
+    switch( opt ) {
+    case 'p': port = atoi(optarg); break;
+    case 'g': gates = strtoull(optarg, NULL, 0); break;
+    case 's': size = strtoull(optarg, NULL, 0); break;
+    case 'w': window = atoi(optarg); break;
+    default: usage(argv[0]); return 1;
+    }
+  }
+  if( gates == 0 ) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  std::vector<Pair> pairs(gates);
+  std::vector<std::thread> srv;
+  for( size_t i = 0; i < gates; i++ ) {
+    Pair &p = pairs[i];
+    p.server = dtp::Gate::server(port + i);
+    p.server.set(DTP_WINDOW, window);
+    srv.emplace_back([&p] { p.server.listen(); });
+    p.client = dtp::Gate::client("127.0.0.1", port + i);
+    p.client.set(DTP_WINDOW, window);
+    for( int tries = 0; ; tries++ ) { /* Server may not listen yet. */
+      try {
+	p.client.connect();
+	break;
+      } catch( const std::system_error &e ) {
+	if( tries == 9 )
+	  throw;
+      }
+    }
+  }
+  for( std::thread &t : srv )
+    t.join();
+  srv.clear();
+
+  dtp::Executor exec;
+  for( Pair &p : pairs ) {
+    exec.spawn(sender(p));
+    exec.spawn(receiver(p));
+  }
+  auto t0 = std::chrono::steady_clock::now();
+  exec.run();
+  double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+
+  size_t rcvd = 0;
+  for( Pair &p : pairs ) {	/* Both ends close at once. */
+    rcvd += p.rcvd;
+    srv.emplace_back([&p] { p.server.close(); });
+    p.client.close();
+  }
+  for( std::thread &t : srv )
+    t.join();
+
+  printf("{\"mode\": \"coroutines\", \"gates\": %zu, \"bytes_per_pair\": %zu, "
+	 "\"ok\": %s, \"seconds\": %.6f, \"mib_per_s\": %.3f}\n",
+	 gates, size, rcvd == gates * size ? "true" : "false",
+	 secs, rcvd / secs / (1 << 20));
+  return rcvd == gates * size ? 0 : 1;
+}
@@ -0,0 +1,177 @@
+#include "dtp.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <unistd.h>
+#include <time.h>
+
+/**
+   Simulated WAN transfer.
+
+   Pushes -s bytes through one gate pair over a simulated link
+   (include/sim.h) and prints a JSON summary. The virtual duration
+   and every counter depend only on the arguments, so two runs with
+   the same seed print the same numbers, apart from wall time.
+ */
+
+struct scenario {
+  size_t size;
+  unsigned long long sum_sent, sum_rcvd;
+  dtp_server server;
+  dtp_client client;
+  int failed;
+  struct dtp_fecstats fec;	/* Receiver side, if -f. */
+};
+
+static double now_s (void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* Deterministic payload, checked on arrival. */
+static void fill (byte_t *buf, size_t len, size_t off) {
+  size_t i;
+  for( i = 0; i < len; i++ )
+    buf[i] = (byte_t) ((off + i) * 2654435761u >> 13);
+}
+
+static unsigned long long digest (unsigned long long h,
+				  const byte_t *buf, size_t len) {
+  size_t i;
+  for( i = 0; i < len; i++ )
+    h = (h ^ buf[i]) * 1099511628211ull;
+  return h;
+}
+
+static void * server_main (void *arg) {
+  struct scenario *sc = (struct scenario*) arg;
+  char host[1<<5];
+  port_t port;
+  if( dtp_listen(&sc->server, host, &port) != 0 ) {
+    sc->failed = 1;
+    return NULL;
+  }
+  static byte_t buf[1<<16];
+  size_t rem = sc->size;
+  unsigned long long h = 14695981039346656037ull;
+  while( rem > 0 ) {
+    size_t n = dtp_recv(&sc->server, buf, rem < sizeof(buf) ? rem : sizeof(buf));
+    h = digest(h, buf, n);
+    rem -= n;
+  }
+  sc->sum_rcvd = h;
+  dtp_fec_stats(&sc->server, &sc->fec);
+  close_dtp_gate(&sc->server);
+  return NULL;
+}
+
+static void * client_main (void *arg) {
+  struct scenario *sc = (struct scenario*) arg;
+  if( dtp_connect(&sc->client) != 0 ) {
+    sc->failed = 1;
+    return NULL;
+  }
+  static byte_t buf[1<<16];
+  size_t off = 0;
+  unsigned long long h = 14695981039346656037ull;
+  while( off < sc->size ) {
+    size_t n = sc->size - off < sizeof(buf) ? sc->size - off : sizeof(buf);
+    fill(buf, n, off);
+    h = digest(h, buf, n);
+    dtp_send(&sc->client, buf, n);
+    off += n;
+  }
+  sc->sum_sent = h;
+  close_dtp_gate(&sc->client);
+  return NULL;
+}
+
+static void usage (const char *prog) {
+  fprintf(stderr,
+	  "Usage: %s [options]\n"
+	  "  -s <bytes>  transfer size (default 64MiB)\n"
+	  "  -b <mbps>   bottleneck bandwidth (default 100)\n"
+	  "  -r <ms>     round trip time (default 50)\n"
+	  "  -q <KiB>    bottleneck queue (default 1024, 0 unlimited)\n"
+	  "  -l <p>      random loss probability (default 0.001)\n"
+	  "  -B <p>      burst loss in the bad state (default 0)\n"
+	  "  -g <p>      good -> bad probability per packet (default 0)\n"
+	  "  -G <p>      bad -> good probability per packet (default 0)\n"
+	  "  -S <seed>   random seed (default 1)\n"
+	  "  -f          send parity packets (DTP_FEC)\n"
+	  "  -w <slots>  buffer slots per gate (DTP_WINDOW, default 4096)\n", prog);
+}
+
+int main (int argc, char *argv[]) {
+  static struct scenario sc;
+  struct dtp_link link;
+  unsigned long long seed = 1;
+  memset(&link, 0, sizeof(link));
+  sc.size = 64 << 20;
+  link.bandwidth = 100e6 / 8;
+  link.rtt = 50000000ull;
+  link.queue = 1 << 20;
+  link.loss = 0.001;
+
+  int opt, fec = 0, window = MXW;
+  while( (opt = getopt(argc, argv, "s:b:r:q:l:B:g:G:S:fw:")) != -1 ) {
+    switch( opt ) {
+    case 's': sc.size = strtoull(optarg, NULL, 0); break;
+    case 'b': link.bandwidth = atof(optarg) * 1e6 / 8; break;
+    case 'r': link.rtt = atof(optarg) * 1e6; break;
+    case 'q': link.queue = atof(optarg) * 1024; break;
+    case 'l': link.loss = atof(optarg); break;
+    case 'B': link.burst_loss = atof(optarg); break;
+    case 'g': link.p_bad = atof(optarg); break;
+    case 'G': link.p_good = atof(optarg); break;
+    case 'S': seed = strtoull(optarg, NULL, 0); break;
+    case 'f': fec = 1; break;
+    case 'w': window = atoi(optarg); break;
+    default: usage(argv[0]); return 1;
+    }
+  }
+
+  struct dtp_sim *sim = dtp_sim_create(seed, &link);
+  if( sim == NULL ||
+      init_dtp_sim_server(&sc.server, sim, 9000) != 0 ||
+      init_dtp_sim_client(&sc.client, sim, 9000) != 0 ) {
+    fprintf(stderr, "Cannot set up simulation.\n");
+    return 1;
+  }
+  dtp_setopt(&sc.server, DTP_FEC, fec);
+  dtp_setopt(&sc.client, DTP_FEC, fec);
+  if( dtp_setopt(&sc.server, DTP_WINDOW, window) != 0 ||
+      dtp_setopt(&sc.client, DTP_WINDOW, window) != 0 ) {
+    fprintf(stderr, "Bad window size.\n");
+    return 1;
+  }
+  dtp_sim_spawn(sim, server_main, &sc);
+  dtp_sim_spawn(sim, client_main, &sc);
+
+  double t0 = now_s();
+  int stat = dtp_sim_run(sim);
+  double wall = now_s() - t0;
+
+  struct dtp_sim_stats st;
+  dtp_sim_stats(sim, &st);
+  dtp_sim_destroy(sim);
+
+  int ok = stat == 0 && !sc.failed && sc.sum_sent == sc.sum_rcvd;
+  double vsecs = st.now / 1e9;
+  printf("{\"mode\": \"sim\", \"seed\": %llu, \"bytes\": %zu, "
+	 "\"bandwidth_mbps\": %g, \"rtt_ms\": %g, \"queue_bytes\": %zu, "
+	 "\"loss\": %g, \"ok\": %s, \"virtual_seconds\": %.6f, "
+	 "\"wall_seconds\": %.3f, \"goodput_mbps\": %.3f, "
+	 "\"packets\": %llu, \"lost\": %llu, \"overflow\": %llu, "
+	 "\"delivered\": %llu, \"switches\": %llu, \"fec\": %s, "
+	 "\"rebuilt\": %llu}\n",
+	 seed, sc.size, link.bandwidth * 8 / 1e6, link.rtt / 1e6, link.queue,
+	 link.loss, ok ? "true" : "false", vsecs, wall,
+	 vsecs > 0 ? sc.size * 8 / vsecs / 1e6 : 0.0,
+	 st.packets, st.lost, st.overflow, st.delivered, st.switches,
+	 fec ? "true" : "false", sc.fec.rebuilt_in);
+  return ok ? 0 : 1;
+}
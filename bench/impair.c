@@ -0,0 +1,286 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+
+#include <unistd.h>
+#include <poll.h>
+#include <time.h>
+
+#include <arpa/inet.h>
+#include <netinet/ip.h>
+#include <sys/socket.h>
+
+/**
+   Userspace UDP impairment proxy.
+
+   Listens on a local port, remembers the first peer that talks to it
+   ("client") and relays every datagram to the upstream address
+   ("server") and back, after passing it through a per direction
+   link model : random loss, fixed delay plus uniform jitter,
+   random reordering and a bandwidth cap with a bounded queue.
+ */
+
+#define MAXDGRAM 2048
+
+struct pending {
+  unsigned long long due;	/* Release time (ns). */
+  unsigned long long order;	/* Tie breaker, keeps FIFO among equals. */
+  int dir;			/* 0 : client -> server, 1 : reverse. */
+  size_t len;
+  unsigned char data[MAXDGRAM];
+};
+
+struct link {
+  double loss;			/* Drop probability. */
+  double reorder;		/* Probability of holding a packet back. */
+  unsigned long long delay;	/* One way delay (ns). */
+  unsigned long long jitter;	/* Uniform jitter (ns). */
+  double bandwidth;		/* Bytes per second, 0 for unlimited. */
+  unsigned long long qlimit;	/* Maximum queueing delay (ns). */
+  unsigned long long busy;	/* Serializer is busy until (ns). */
+  unsigned long long fwd, drop, qdrop, reord;
+};
+
+static struct pending **heap;
+static size_t heapsz, heapcap;
+static unsigned long long order;
+static unsigned long long rng;
+static volatile sig_atomic_t done;
+
+static unsigned long long now_ns (void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (unsigned long long) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* xorshift64*, seeded from the command line for repeatable runs. */
+static double uniform (void) {
+  rng ^= rng >> 12; rng ^= rng << 25; rng ^= rng >> 27;
+  return ((rng * 2685821657736338717ull) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static int earlier (const struct pending *a, const struct pending *b) {
+  return a->due != b->due ? a->due < b->due : a->order < b->order;
+}
+
+static void heap_push (struct pending *p) {
+  if( heapsz == heapcap ) {
+    heapcap = heapcap ? heapcap << 1 : 1024;
+    heap = realloc(heap, heapcap * sizeof(*heap));
+    if( heap == NULL ) {
+      perror("realloc");
+      exit(1);
+    }
+  }
+  size_t i = heapsz++;
+  while( i > 0 && earlier(p, heap[(i-1)>>1]) ) {
+    heap[i] = heap[(i-1)>>1];
+    i = (i-1)>>1;
+  }
+  heap[i] = p;
+}
+
+static struct pending * heap_pop (void) {
+  struct pending *top = heap[0], *last = heap[--heapsz];
+  size_t i = 0;
+  while( 1 ) {
+    size_t c = 2*i + 1;
+    if( c >= heapsz )
+      break;
+    if( c + 1 < heapsz && earlier(heap[c+1], heap[c]) )
+      c++;
+    if( !earlier(heap[c], last) )
+      break;
+    heap[i] = heap[c];
+    i = c;
+  }
+  if( heapsz > 0 )
+    heap[i] = last;
+  return top;
+}
+
+/* Runs one datagram through the link model. */
+static void admit (struct link *ln, int dir, const void *data, size_t len) {
+  unsigned long long t = now_ns();
+  if( ln->loss > 0 && uniform() < ln->loss ) {
+    ln->drop++;
+    return;
+  }
+  if( ln->bandwidth > 0 ) {
+    if( ln->busy < t )
+      ln->busy = t;
+    if( ln->qlimit > 0 && ln->busy - t > ln->qlimit ) {
+      ln->qdrop++;		/* Tail drop, queue is full. */
+      return;
+    }
+    ln->busy += (unsigned long long) (len * 1e9 / ln->bandwidth);
+    t = ln->busy;
+  }
+  t += ln->delay;
+  if( ln->jitter > 0 )
+    t += (unsigned long long) (uniform() * ln->jitter);
+  if( ln->reorder > 0 && uniform() < ln->reorder ) {
+    t += ln->delay + ln->jitter + 1000000ull; /* Overtaken by followers. */
+    ln->reord++;
+  }
+
+  struct pending *p = malloc(sizeof(struct pending));
+  if( p == NULL ) {
+    ln->drop++;
+    return;
+  }
+  p->due = t;
+  p->order = order++;
+  p->dir = dir;
+  p->len = len;
+  memcpy(p->data, data, len);
+  heap_push(p);
+}
+
+static void on_signal (int sig) {
+  (void) sig;
+  done = 1;
+}
+
+static void usage (const char *prog) {
+  fprintf(stderr,
+	  "Usage: %s -l <listen_port> -s <server_ip>:<port> [options]\n"
+	  "  -L <p>   loss probability per packet (0..1)\n"
+	  "  -d <ms>  one way delay\n"
+	  "  -j <ms>  uniform jitter added to the delay\n"
+	  "  -r <p>   reordering probability (0..1)\n"
+	  "  -b <kbps> bandwidth cap per direction\n"
+	  "  -q <ms>  queue limit under the bandwidth cap (default 100)\n"
+	  "  -S <n>   random seed\n"
+	  "Prints a JSON summary on SIGINT / SIGTERM.\n", prog);
+}
+
+int main (int argc, char *argv[]) {
+  struct link model;
+  memset(&model, 0, sizeof(model));
+  model.qlimit = 100000000ull;
+  unsigned short lport = 0;
+  char *upstream = NULL;
+  rng = 88172645463325252ull;
+
+  int opt;
+  while( (opt = getopt(argc, argv, "l:s:L:d:j:r:b:q:S:h")) != -1 ) {
+    switch( opt ) {
+    case 'l': lport = atoi(optarg); break;
+    case 's': upstream = optarg; break;
+    case 'L': model.loss = atof(optarg); break;
+    case 'd': model.delay = atof(optarg) * 1e6; break;
+    case 'j': model.jitter = atof(optarg) * 1e6; break;
+    case 'r': model.reorder = atof(optarg); break;
+    case 'b': model.bandwidth = atof(optarg) * 1000 / 8; break;
+    case 'q': model.qlimit = atof(optarg) * 1e6; break;
+    case 'S': rng = strtoull(optarg, NULL, 0) | 1; break;
+    default: usage(argv[0]); return 1;
+    }
+  }
+  char *colon = upstream ? strchr(upstream, ':') : NULL;
+  if( lport == 0 || colon == NULL ) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  struct link links[2] = { model, model };
+
+  struct sockaddr_in self, server, client;
+  memset(&self, 0, sizeof(self));
+  self.sin_family = AF_INET;
+  self.sin_port = htons(lport);
+  self.sin_addr.s_addr = INADDR_ANY;
+
+  *colon = '\0';
+  memset(&server, 0, sizeof(server));
+  server.sin_family = AF_INET;
+  server.sin_port = htons(atoi(colon + 1));
+  if( inet_aton(upstream, &server.sin_addr) == 0 ) {
+    fprintf(stderr, "Bad server address %s\n", upstream);
+    return 1;
+  }
+  memset(&client, 0, sizeof(client));
+  int have_client = 0;
+
+  /* Client facing and server facing sockets. */
+  int front = socket(AF_INET, SOCK_DGRAM, 0);
+  int back = socket(AF_INET, SOCK_DGRAM, 0);
+  if( front < 0 || back < 0 ) {
+    perror("socket");
+    return 1;
+  }
+  if( bind(front, (struct sockaddr*) &self, sizeof(self)) < 0 ) {
+    perror("bind");
+    return 1;
+  }
+  int bufsz = 1 << 23;
+  setsockopt(front, SOL_SOCKET, SO_RCVBUF, &bufsz, sizeof(int));
+  setsockopt(back, SOL_SOCKET, SO_RCVBUF, &bufsz, sizeof(int));
+
+  signal(SIGINT, on_signal);
+  signal(SIGTERM, on_signal);
+
+  struct pollfd fds[2] = { { front, POLLIN, 0 }, { back, POLLIN, 0 } };
+  unsigned char buf[MAXDGRAM];
+  while( !done ) {
+    int timeout = -1;
+    if( heapsz > 0 ) {
+      unsigned long long t = now_ns();
+      timeout = heap[0]->due > t ? (int) ((heap[0]->due - t + 999999) / 1000000) : 0;
+    }
+    if( poll(fds, 2, timeout) < 0 && errno != EINTR ) {
+      perror("poll");
+      return 1;
+    }
+
+    if( fds[0].revents & POLLIN ) {
+      struct sockaddr_in from;
+      socklen_t socklen = sizeof(from);
+      ssize_t n = recvfrom(front, buf, sizeof(buf), 0,
+			   (struct sockaddr*) &from, &socklen);
+      if( n >= 0 ) {
+	if( !have_client ) {
+	  client = from;
+	  have_client = 1;
+	}
+	admit(links, 0, buf, n);
+      }
+    }
+    if( fds[1].revents & POLLIN ) {
+      ssize_t n = recvfrom(back, buf, sizeof(buf), 0, NULL, NULL);
+      if( n >= 0 && have_client )
+	admit(links + 1, 1, buf, n);
+    }
+
+    /* Release everything that is due. */
+    unsigned long long t = now_ns();
+    while( heapsz > 0 && heap[0]->due <= t ) {
+      struct pending *p = heap_pop();
+      if( p->dir == 0 )
+	sendto(back, p->data, p->len, 0,
+	       (struct sockaddr*) &server, sizeof(server));
+      else
+	sendto(front, p->data, p->len, 0,
+	       (struct sockaddr*) &client, sizeof(client));
+      links[p->dir].fwd++;
+      free(p);
+    }
+  }
+
+  printf("{\"proxy\": {\"loss\": %g, \"delay_ms\": %g, \"jitter_ms\": %g, "
+	 "\"reorder\": %g, \"bandwidth_kbps\": %g",
+	 model.loss, model.delay / 1e6, model.jitter / 1e6,
+	 model.reorder, model.bandwidth * 8 / 1000);
+  const char *names[2] = { "upstream", "downstream" };
+  int d;
+  for( d = 0; d < 2; d++ )
+    printf(", \"%s\": {\"forwarded\": %llu, \"dropped\": %llu, "
+	   "\"queue_dropped\": %llu, \"reordered\": %llu}",
+	   names[d], links[d].fwd, links[d].drop,
+	   links[d].qdrop, links[d].reord);
+  printf("}}\n");
+  return 0;
+}
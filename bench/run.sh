@@ -0,0 +1,92 @@
+#!/bin/sh
+# Runs the DTP benchmark suite and prints a JSON document on stdout.
+# Invoked by `make bench` from the repository root.
+#
+# Environment overrides :
+#   BENCH_BYTES      loopback throughput transfer size.
+#   BENCH_WAN_BYTES  transfer size through the impairment proxy.
+#   BENCH_ROUNDS     latency round trips.
+#   BENCH_IMPAIR     bench/impair link options for the WAN runs.
+#   BENCH_LOSSY      bench/impair link options for the FEC comparison.
+#   BENCH_SIM        bench/dtpsim options for the simulated WAN run.
+
+BENCH=./bench/dtpbench
+IMPAIR=./bench/impair
+BYTES=${BENCH_BYTES:-67108864}
+WAN_BYTES=${BENCH_WAN_BYTES:-8388608}
+ROUNDS=${BENCH_ROUNDS:-5000}
+LINK=${BENCH_IMPAIR:--L 0.001 -d 5 -j 1 -r 0.001 -b 200000 -S 1}
+LOSSY=${BENCH_LOSSY:--L 0.02 -d 5 -b 200000 -S 1}
+SIM=${BENCH_SIM:--s 16777216 -b 100 -r 50 -l 0.001 -S 1}
+
+run_wan () {
+  $IMPAIR -l 9401 -s 127.0.0.1:9400 $LINK > bench_proxy.json &
+  proxy=$!
+  sleep 0.2
+  $BENCH "$@" -p 9400 -c 9401 | tr -d '\n'
+  kill -INT $proxy
+  wait $proxy
+  printf ', "link": '
+  tr -d '\n' < bench_proxy.json
+  rm -f bench_proxy.json
+}
+
+printf '{"version": 1, "date": "%s", "host": "%s", "results": [\n' \
+  "$(date -u +%Y-%m-%dT%H:%M:%SZ)" "$(uname -n)"
+printf '  {"name": "loopback_throughput", "result": %s},\n' \
+  "$($BENCH throughput -p 9310 -s $BYTES)"
+printf '  {"name": "loopback_throughput_256", "result": %s},\n' \
+  "$($BENCH throughput -p 9311 -s $BYTES -w 256)"
+printf '  {"name": "loopback_throughput_lan", "result": %s},\n' \
+  "$($BENCH throughput -p 9312 -s $BYTES -C lan)"
+printf '  {"name": "loopback_small_writes_64", "result": %s},\n' \
+  "$($BENCH throughput -p 9315 -s $((BYTES / 16)) -W 64)"
+printf '  {"name": "loopback_latency_64", "result": %s},\n' \
+  "$($BENCH latency -p 9320 -m 64 -n $ROUNDS)"
+printf '  {"name": "loopback_latency_64_256", "result": %s},\n' \
+  "$($BENCH latency -p 9321 -m 64 -n $ROUNDS -w 256)"
+printf '  {"name": "loopback_latency_64_lan", "result": %s},\n' \
+  "$($BENCH latency -p 9322 -m 64 -n $ROUNDS -C lan)"
+printf '  {"name": "loopback_latency_4096", "result": %s},\n' \
+  "$($BENCH latency -p 9330 -m 4096 -n $ROUNDS)"
+printf '  {"name": "loopback_latency_64_busypoll", "result": %s},\n' \
+  "$($BENCH latency -p 9335 -m 64 -n $ROUNDS -B 50 -P 0)"
+printf '  {"name": "loopback_prio_under_load_64", "result": %s},\n' \
+  "$($BENCH prio -p 9337 -m 64 -n $((ROUNDS / 10)))"
+printf '  {"name": "loopback_shm_throughput", "result": %s},\n' \
+  "$($BENCH throughput -p 9338 -s $BYTES -M)"
+printf '  {"name": "loopback_shm_latency_64", "result": %s},\n' \
+  "$($BENCH latency -p 9339 -m 64 -n $ROUNDS -M)"
+printf '  {"name": "memory", "result": %s},\n' \
+  "$($BENCH memory -p 9340 -g 8)"
+printf '  {"name": "memory_16", "result": %s},\n' \
+  "$($BENCH memory -p 9341 -g 8 -w 16)"
+printf '  {"name": "memory_tiny", "result": %s},\n' \
+  "$($BENCH memory -p 9342 -g 8 -C tiny)"
+printf '  {"name": "connect_first_byte", "result": %s},\n' \
+  "$($BENCH connect -p 9345 -n 200)"
+printf '  {"name": "multiplex_16", "result": %s},\n' \
+  "$($BENCH multiplex -p 9350 -g 16 -s $((BYTES / 16)))"
+printf '  {"name": "mcast_8", "result": %s},\n' \
+  "$($BENCH mcast -p 9366 -g 8 -s $((BYTES / 4)))"
+printf '  {"name": "coroutines_16", "result": %s},\n' \
+  "$(./bench/dtpco -p 9370 -g 16 -s $((BYTES / 16)))"
+printf '  {"name": "wan_throughput", "result": %s},\n' \
+  "$(run_wan throughput -s $WAN_BYTES)"
+printf '  {"name": "wan_throughput_16384", "result": %s},\n' \
+  "$(run_wan throughput -s $WAN_BYTES -w 16384)"
+printf '  {"name": "wan_throughput_wan", "result": %s},\n' \
+  "$(run_wan throughput -s $WAN_BYTES -C wan)"
+printf '  {"name": "wan_latency_64", "result": %s},\n' \
+  "$(run_wan latency -m 64 -n 200)"
+printf '  {"name": "lossy_throughput", "result": %s},\n' \
+  "$(LINK=$LOSSY; run_wan throughput -s $WAN_BYTES)"
+printf '  {"name": "lossy_throughput_16384", "result": %s},\n' \
+  "$(LINK=$LOSSY; run_wan throughput -s $WAN_BYTES -w 16384)"
+printf '  {"name": "lossy_throughput_wan", "result": %s},\n' \
+  "$(LINK=$LOSSY; run_wan throughput -s $WAN_BYTES -C wan)"
+printf '  {"name": "lossy_fec_throughput", "result": %s},\n' \
+  "$(LINK=$LOSSY; run_wan throughput -s $WAN_BYTES -f)"
+printf '  {"name": "sim_wan_throughput", "result": %s}\n' \
+  "$(./bench/dtpsim $SIM)"
+printf ']}\n'
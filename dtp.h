@@ -14,4 +14,18 @@
 
 #include "packet.h"
 
+#include "transport.h"
+
+#include "sim.h"
+
+#include "compress.h"
+
+#include "fec.h"
+
+#include "pool.h"
+
+#include "shm.h"
+
+#include "mcast.h"
+
 #endif
@@ -0,0 +1,354 @@
+#ifndef _DTP_HPP
+#define _DTP_HPP
+
+/* C++20 interface. Header only, link with libdtp as from C. */
+
+#include "dtp.h"
+
+#include <cerrno>
+#include <coroutine>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <memory>
+#include <span>
+#include <string>
+#include <system_error>
+#include <unordered_map>
+#include <utility>
+
+#include <sys/epoll.h>
+#include <unistd.h>
+
+/**
+   dtp::Gate owns a gate. The struct lives on the heap, where the
+   daemons keep pointing at it, so a Gate moves but does not copy; it
+   closes the connection and the socket when destroyed. read / write
+   block like dtp_recv / dtp_send. recv / send return awaitables for
+   dtp::Task coroutines : they complete right away when they can, and
+   otherwise suspend until dtp::Executor, watching dtp_fd, sees that
+   the call can make progress. One thread running an Executor thus
+   drives any number of gates.
+
+   Setting up a gate (init, options, listen, connect) throws
+   std::system_error on failure; transfers report like the C API.
+ */
+
+namespace dtp {
+
+class Executor;
+
+namespace detail {
+
+  /* A recv / send waiting for its gate. */
+  struct Op {
+    struct dtp_gate *gate;
+    Executor **exec;		/* The gate's, set on suspending. */
+    std::coroutine_handle<> h;
+    /* Try again. True once complete. */
+    virtual bool progress () = 0;
+  protected:
+    ~Op () = default;
+  };
+
+  /* The executor running on this thread, if any. */
+  inline thread_local Executor *current = nullptr;
+
+  [[noreturn]] inline void fail (const char *what, int err = 0) {
+    throw std::system_error(err ? err : errno ? errno : EIO,
+			    std::generic_category(), what);
+  }
+
+}
+
+/**
+   Coroutine started by Executor::spawn. Runs detached once spawned,
+   its frame goes away when it returns.
+ */
+class Task {
+public:
+  struct promise_type {
+    Task get_return_object () {
+      return Task(std::coroutine_handle<promise_type>::from_promise(*this));
+    }
+    std::suspend_always initial_suspend () noexcept { return {}; }
+    std::suspend_never final_suspend () noexcept { return {}; }
+    void return_void () {}
+    void unhandled_exception () { std::terminate(); }
+  };
+
+  Task (Task &&t) noexcept : h(std::exchange(t.h, nullptr)) {}
+  Task & operator= (Task &&t) noexcept {
+    if( this != &t ) {
+      if( h )
+	h.destroy();
+      h = std::exchange(t.h, nullptr);
+    }
+    return *this;
+  }
+  ~Task () {
+    if( h )			/* Never spawned. */
+      h.destroy();
+  }
+
+  std::coroutine_handle<> release () { return std::exchange(h, nullptr); }
+
+private:
+  explicit Task (std::coroutine_handle<promise_type> h) : h(h) {}
+  std::coroutine_handle<promise_type> h;
+};
+
+/**
+   Single threaded executor : runs spawned tasks and resumes those
+   waiting on a gate from one epoll loop over the gates' readiness
+   descriptors. Gates must outlive the operations waiting on them.
+ */
+class Executor {
+public:
+  Executor () : ep(epoll_create1(EPOLL_CLOEXEC)) {
+    if( ep < 0 )
+      detail::fail("epoll_create1");
+  }
+  ~Executor () { ::close(ep); }
+  Executor (const Executor&) = delete;
+  Executor & operator= (const Executor&) = delete;
+
+  void spawn (Task t) { post(t.release()); }
+
+  /* Resume h on the next turn of run. */
+  void post (std::coroutine_handle<> h) { ready.push_back(h); }
+
+  /* Run until no task is ready or waiting on a gate. */
+  void run () {
+    Executor *outer = std::exchange(detail::current, this);
+    epoll_event ev[64];
+    while( true ) {
+      while( !ready.empty() ) {
+	std::coroutine_handle<> h = ready.front();
+	ready.pop_front();
+	h.resume();
+      }
+      if( waiting == 0 )
+	break;
+      int n = epoll_wait(ep, ev, 64, -1);
+      for( int i = 0; i < n; i++ )
+	poll(static_cast<Entry*>(ev[i].data.ptr));
+    }
+    detail::current = outer;
+  }
+
+  /* Park op until its gate is ready. */
+  void wait (detail::Op *op, bool write) {
+    Entry &e = gates[op->gate];
+    if( e.gate == nullptr ) {
+      epoll_event ev{};
+      ev.events = EPOLLIN;
+      ev.data.ptr = &e;
+      if( epoll_ctl(ep, EPOLL_CTL_ADD, dtp_fd(op->gate), &ev) != 0 )
+	detail::fail("epoll_ctl");
+      e.gate = op->gate;
+    }
+    (write ? e.writer : e.reader) = op;
+    waiting++;
+  }
+
+  /* A gate is closing : stop watching it. */
+  void forget (struct dtp_gate *g) {
+    auto it = gates.find(g);
+    if( it == gates.end() )
+      return;
+    epoll_ctl(ep, EPOLL_CTL_DEL, dtp_fd(g), nullptr);
+    waiting -= (it->second.reader != nullptr) + (it->second.writer != nullptr);
+    gates.erase(it);
+  }
+
+private:
+  struct Entry {
+    struct dtp_gate *gate = nullptr;
+    detail::Op *reader = nullptr, *writer = nullptr;
+  };
+
+  void poll (Entry *e) {
+    dtp_events(e->gate);	/* Reset the descriptor, rearm. */
+    for( detail::Op **op : { &e->reader, &e->writer } )
+      if( *op != nullptr && (*op)->progress() ) {
+	ready.push_back((*op)->h);
+	*op = nullptr;
+	waiting--;
+      }
+  }
+
+  int ep;
+  size_t waiting = 0;
+  std::deque<std::coroutine_handle<>> ready;
+  std::unordered_map<struct dtp_gate*, Entry> gates; /* Stable nodes. */
+};
+
+/* co_await gate.recv(buf) : bytes read, 0 once the peer has closed. */
+class [[nodiscard]] RecvOp final : detail::Op {
+public:
+  RecvOp (struct dtp_gate *g, Executor **x, std::span<std::byte> buf) : buf(buf) {
+    gate = g;
+    exec = x;
+  }
+
+  bool await_ready () { return progress(); }
+  void await_suspend (std::coroutine_handle<> h) {
+    this->h = h;
+    if( detail::current == nullptr )
+      detail::fail("dtp::RecvOp outside dtp::Executor::run", EPERM);
+    *exec = detail::current;
+    detail::current->wait(this, false);
+  }
+  size_t await_resume () const { return n; }
+
+  bool progress () override {
+    ssize_t r = dtp_try_recv(gate, buf.data(), buf.size());
+    if( r < 0 )
+      return false;
+    n = r;
+    return true;
+  }
+
+private:
+  std::span<std::byte> buf;
+  size_t n = 0;
+};
+
+/* co_await gate.send(buf) : queues all of buf. */
+class [[nodiscard]] SendOp final : detail::Op {
+public:
+  SendOp (struct dtp_gate *g, Executor **x, std::span<const std::byte> buf) : rest(buf) {
+    gate = g;
+    exec = x;
+  }
+
+  bool await_ready () { return progress(); }
+  void await_suspend (std::coroutine_handle<> h) {
+    this->h = h;
+    if( detail::current == nullptr )
+      detail::fail("dtp::SendOp outside dtp::Executor::run", EPERM);
+    *exec = detail::current;
+    detail::current->wait(this, true);
+  }
+  void await_resume () const {}
+
+  bool progress () override {
+    while( !rest.empty() ) {
+      ssize_t r = dtp_try_send(gate, rest.data(), rest.size());
+      if( r < 0 )
+	return false;
+      rest = rest.subspan(r);
+    }
+    return true;
+  }
+
+private:
+  std::span<const std::byte> rest;
+};
+
+class Gate {
+public:
+  Gate () = default;
+  Gate (Gate &&g) noexcept
+    : gate(std::move(g.gate)), exec(std::exchange(g.exec, nullptr)) {}
+  Gate & operator= (Gate &&g) noexcept {
+    if( this != &g ) {
+      close();
+      gate = std::move(g.gate);
+      exec = std::exchange(g.exec, nullptr);
+    }
+    return *this;
+  }
+  ~Gate () { close(); }
+
+  /* Bound to port, 0 for any. */
+  static Gate server (port_t port) {
+    Gate g(new struct dtp_gate());
+    if( init_dtp_server(g.gate.get(), port) != 0 )
+      detail::fail("init_dtp_server");
+    return g;
+  }
+
+  static Gate client (const std::string &host, port_t port) {
+    Gate g(new struct dtp_gate());
+    if( init_dtp_client(g.gate.get(), host.c_str(), port) != 0 )
+      detail::fail("init_dtp_client");
+    return g;
+  }
+
+  /* dtp_setopt / dtp_getopt. */
+  void set (int opt, int val) {
+    if( dtp_setopt(gate.get(), opt, val) != 0 )
+      detail::fail("dtp_setopt", EINVAL);
+  }
+  int get (int opt) const {
+    int val = 0;
+    if( dtp_getopt(gate.get(), opt, &val) != 0 )
+      detail::fail("dtp_getopt", EINVAL);
+    return val;
+  }
+
+  /* dtp_drops. */
+  struct dtp_drops drops () const {
+    struct dtp_drops d;
+    dtp_drops(gate.get(), &d);
+    return d;
+  }
+
+  /* Wait for a client. Returns its host and port. */
+  std::pair<std::string, port_t> listen () {
+    char host[1<<5];
+    port_t port;
+    if( dtp_listen(gate.get(), host, &port) != 0 )
+      detail::fail("dtp_listen");
+    return { host, port };
+  }
+
+  void connect () {
+    if( dtp_connect(gate.get()) != 0 )
+      detail::fail("dtp_connect", ECONNREFUSED);
+  }
+
+  /* Blocking, as dtp_send_prio / dtp_recv_prio. */
+  int write (std::span<const std::byte> buf, int prio = DTP_PRIO_BULK) {
+    return dtp_send_prio(gate.get(), buf.data(), buf.size(), prio);
+  }
+  ssize_t read (std::span<std::byte> buf, int prio = DTP_PRIO_BULK) {
+    return dtp_recv_prio(gate.get(), buf.data(), buf.size(), prio);
+  }
+
+  RecvOp recv (std::span<std::byte> buf) { return RecvOp(gate.get(), &exec, buf); }
+  SendOp send (std::span<const std::byte> buf) { return SendOp(gate.get(), &exec, buf); }
+
+  /* Close the connection, the socket stays for another one. */
+  void shutdown () {
+    if( gate == nullptr || gate->status == IDLE )
+      return;
+    if( exec != nullptr )
+      exec->forget(gate.get());
+    exec = nullptr;
+    close_dtp_gate(gate.get());
+  }
+
+  /* Close the connection and the socket. */
+  void close () {
+    if( gate == nullptr )
+      return;
+    shutdown();
+    ::close(gate->socket);
+    gate.reset();
+  }
+
+  struct dtp_gate * native () const { return gate.get(); }
+  explicit operator bool () const { return gate != nullptr; }
+
+private:
+  explicit Gate (struct dtp_gate *g) : gate(g) {}
+  std::unique_ptr<struct dtp_gate> gate;
+  Executor *exec = nullptr;	/* Watching the gate, if any. */
+};
+
+}
+
+#endif
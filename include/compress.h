@@ -0,0 +1,91 @@
+#ifndef _COMPRESS_H
+#define _COMPRESS_H
+
+#include "types.h"
+#include "gate.h"
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+   Stream compression stage (DTP_COMPRESS).
+
+   Once both ends asked for it at connection time, dtp_send cuts the
+   stream into blocks of up to ZBLK bytes (a batch of packets) and
+   queues each one as a frame : an 8 byte header with the raw and
+   compressed lengths, then an LZ77 block, or the raw bytes when the
+   block does not shrink. dtp_recv reassembles frames from inbuf and
+   decodes them. Framing is invisible to the application.
+
+   The sender keeps compressing only while that is the faster way to
+   get data across : every ZPROBE blocks it compares the codec's
+   speed with the rate the peer acknowledges, and falls back to raw
+   frames when the CPU, not the link, would become the bottleneck, or
+   when the data does not compress. One block in ZPROBE_OFF is still
+   compressed while off, to notice when that changes.
+ */
+
+#define ZBLK (1<<15)		/* Raw block size. 32 packets. */
+#define ZHDR 8			/* Frame header. */
+#define ZPROBE 64		/* Blocks between decisions. */
+#define ZPROBE_OFF 16		/* Probe one block in this many while off. */
+
+/* Worst case compressed size of n bytes. */
+#define ZBOUND(n) ((n) + (n) / 255 + 16)
+
+struct dtp_zstats {
+  /* Sent. */
+  unsigned long long raw_out;	/* Application bytes. */
+  unsigned long long wire_out;	/* Framed bytes queued to the peer. */
+  unsigned long long blocks_out, stored_out; /* Frames, raw frames. */
+  unsigned long long ns_comp;	/* Time spent compressing. */
+  /* Received. */
+  unsigned long long raw_in, wire_in;
+  unsigned long long blocks_in;
+  unsigned long long ns_decomp;
+  int active;			/* Currently compressing outgoing blocks. */
+};
+
+/**
+   Compression statistics of a gate. Returns nonzero if the stage is
+   not in use on this connection.
+ */
+int dtp_compress_stats (struct dtp_gate*, struct dtp_zstats*);
+
+/* -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- */
+/* LZ block codec. */
+
+/**
+   Compress n bytes into at most cap bytes.
+   Returns the compressed size, or 0 if it does not fit.
+ */
+size_t dtp_lz_compress (const byte_t*, size_t, byte_t*, size_t);
+
+/**
+   Decompress a block into exactly rawlen bytes.
+   Returns 0 on success, nonzero on malformed input.
+ */
+int dtp_lz_decompress (const byte_t*, size_t, byte_t*, size_t);
+
+/* -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- */
+/* Gate stage, called from gate.c. */
+
+int z_setup (struct dtp_gate*);
+
+void z_free (struct dtp_gate*);
+
+int z_send (struct dtp_gate*, const void*, size_t);
+
+ssize_t z_try_send (struct dtp_gate*, const void*, size_t);
+
+/* Blocking unless the last argument is 0 (then -1 / EAGAIN). */
+ssize_t z_recv (struct dtp_gate*, void*, size_t, int);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
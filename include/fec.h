@@ -0,0 +1,82 @@
+#ifndef _FEC_H
+#define _FEC_H
+
+#include "types.h"
+#include "gate.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+   Forward error correction (DTP_FEC).
+
+   Once both ends asked for it at connection time, the sender follows
+   every group of k new data packets with a parity packet (flag FEC) :
+   the XOR of their payloads, lengths and sequence numbers,
+   along with the outbuf slot of the first one and the group size. A
+   partial group is closed as soon as the sender runs out of packets
+   to send, so the tail of a burst is covered too.
+
+   A receiver missing exactly one packet of a group rebuilds it from
+   the parity and the others, still in inbuf, and acknowledges it with
+   ACK|FEC and seq 1. Fast retransmission waits for the group's parity
+   before treating duplicate ACKs as a loss; a parity that finds more
+   than one hole in its group, or none but an older one, is answered
+   with ACK|FEC and seq 0, which triggers it right away.
+
+   k adapts to the loss the sender sees (packets rebuilt by the peer
+   and retransmission rounds) : from FEC_KMAX (3% overhead) on a clean
+   path down to FEC_KMIN (25%) at about 6% loss.
+ */
+
+#define FEC_KMIN 4
+#define FEC_KMAX 32
+#define FEC_EPOCH 256		/* New packets between adjustments of k. */
+
+struct dtp_fecstats {
+  unsigned long long data_out;	/* New data packets sent. */
+  unsigned long long parity_out; /* Parity packets sent. */
+  unsigned long long rebuilt_out; /* Of ours, rebuilt by the peer. */
+  unsigned long long rounds;	 /* Retransmission rounds. */
+  unsigned long long rebuilt_in; /* Packets rebuilt here. */
+  unsigned k;			 /* Current group size. */
+  double loss;			 /* Loss estimate. */
+};
+
+/**
+   FEC statistics of a gate. Returns nonzero if FEC is not in use on
+   this connection.
+ */
+int dtp_fec_stats (struct dtp_gate*, struct dtp_fecstats*);
+
+/* -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- */
+/* Gate side, called from the daemons with the named lock held. */
+
+int fec_setup (struct dtp_gate*);
+
+void fec_free (struct dtp_gate*);
+
+/* A packet from outbuf went out. outbuf_mtx. */
+void fec_sent (struct dtp_gate*, const packet_t*);
+
+/* The sender has nothing left to send : close the group. outbuf_mtx. */
+void fec_flush (struct dtp_gate*);
+
+/* The peer rebuilt one of our packets. outbuf_mtx. */
+void fec_rebuilt (struct dtp_gate*);
+
+/* Duplicate ACKs that signal a loss. outbuf_mtx. */
+unsigned fec_dupthresh (struct dtp_gate*);
+
+/**
+   A parity packet arrived. Returns 0 and the rebuilt packet if it
+   fills the one hole in its group. inbuf_mtx.
+ */
+int fec_recv (struct dtp_gate*, const packet_t*, packet_t*);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -2,23 +2,102 @@
 #define _GATE_H
 
 #include "types.h"
+#include "timer.h"
 
 #include <pthread.h>		/* POSIX thread library. */
+#include <sys/types.h>		/* ssize_t. */
 #include <sys/time.h>
 #include <time.h>
 
 #include <netinet/ip.h>		/* struct sockaddr_in. */
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 #define IDLE 0x01
 #define CONN 0x02
 #define FINS 0x03
 #define FINR 0x04
 #define CLSD 0x05
 
-/* Window constants. */
-#define MXW (1<<12)		/* 1 + Maximum window size. 4MiB */
-#define LIM (MXW-1)		/* Safe limit. */
-#define FUTURE_WINDOW (MXW>>2)	/* Maximum disorder. 1MiB */
+/* Window constants. Buffers have gate->mxw slots, a power of two
+   both ends agree on, MXW unless set with DTP_WINDOW. */
+#define MXW (1<<12)		/* Default 1 + maximum window size. 4MiB */
+#define MXW_MIN (1<<4)
+#define MXW_MAX (1<<20)		/* 1GiB, needs the wide header. */
+#define MXW_BASIC (1<<16)	/* Largest for the basic header. */
+#define FUTURE_WINDOW(g) ((g)->mxw>>2) /* Maximum disorder. */
+#define WRLOWAT(g) ((g)->mxw>>3) /* Free outbuf slots before a blocked
+				    writer is signalled. */
+
+#define RTO 1000000000ull	/* Retransmission timeout (ns). */
+#define SYN_RTO (RTO>>4)	/* First SYN retransmission, doubling. */
+#define SYN_TRIES 6		/* SYNs sent before dtp_connect gives up. */
+#define ACK_WAIT (SYN_RTO << (SYN_TRIES - 1)) /* Longest a client waits
+						 on its last ACK. */
+#define DTP_BACKLOG 8		/* Clients kept for the next dtp_listen. */
+#define PRIO_RTO (RTO>>4)	/* First priority retransmission, doubling
+				   up to RTO. */
+
+#define DTP_PRIO_BUF (1<<16)	/* Receive queue of the priority channel. */
+#define DTP_PRIO_PKTS (DTP_PRIO_BUF / PAYLOAD) /* Its send queue. */
+#define DTP_PRIO_QUEUE (1<<6)	/* Bulk packets in flight once the priority
+				   channel is in use, see dtp_send_prio. */
+
+/* Gate options, see dtp_setopt. */
+#define DTP_IO 0x01		/* Datagram I/O backend : */
+#define DTP_IO_SOCKET 0		/*   sendto / recvmsg. */
+#define DTP_IO_URING 1		/*   io_uring. */
+#define DTP_IO_URING_SQPOLL 2	/*   io_uring with a kernel polling thread. */
+
+#define DTP_COMPRESS 0x02	/* Compression stage, 0 or 1. */
+#define DTP_FEC 0x03		/* Parity packets, 0 or 1. */
+#define DTP_WINDOW 0x04		/* Buffer slots, see MXW. */
+#define DTP_BUSYPOLL 0x05	/* Spin budget (us) before blocking, 0 off. */
+#define DTP_CPU_SND 0x06	/* Core of the sender daemon, -1 any. */
+#define DTP_CPU_RCV 0x07	/* Core of the receiver daemon, -1 any. */
+#define DTP_NODELAY 0x08	/* Never hold back partial packets, 0 or 1. */
+#define DTP_SHM 0x09		/* Shared memory with a local peer, 0 or 1. */
+#define DTP_SOCKBUF 0x0a	/* Socket buffer bytes, 0 from the window. */
+#define DTP_CORE 0x0b		/* Daemons built for one kind of link : */
+#define DTP_CORE_GENERIC 0	/*   any window, every feature. */
+#define DTP_CORE_LAN 1		/*   256 slots, whole window, ACKs coalesced. */
+#define DTP_CORE_WAN 2		/*   16384 slots, ACKs coalesced. */
+#define DTP_CORE_TINY 3		/*   MXW_MIN slots, no parity, no priority. */
+#define DTP_CORES 4
+
+/* Traffic classes, see dtp_send_prio. */
+#define DTP_PRIO_BULK 0		/* The stream of dtp_send. */
+#define DTP_PRIO_HIGH 1		/* Priority channel. */
+
+/* Readiness bits, see dtp_events. */
+#define DTP_POLLIN 0x01
+#define DTP_POLLPRI 0x02
+#define DTP_POLLOUT 0x04
+
+/* Losses, see dtp_drops. */
+struct dtp_drops {
+  unsigned long long local;	/* Datagrams this end's kernel dropped,
+				   its socket buffer full. */
+  unsigned long long overflow;	/* Losses the peer put down to its own
+				   socket buffer : ssthresh kept. */
+  unsigned long long network;	/* Other losses (DUPACKs, timeouts) :
+				   ssthresh halved. */
+};
+
+struct dtp_transport;		/* See transport.h */
+struct dtp_zstate;		/* See compress.h */
+struct dtp_fec;			/* See fec.h */
+struct dtp_shm;			/* See shm.h */
+
+/* A client whose handshake ACK came while the gate was taken. */
+struct dtp_pending {
+  struct sockaddr_in addr;
+  uint32_t isn, ck;		/* Its ISN, and ours. */
+  unsigned syn[2];		/* Features and window it settled on. */
+  unsigned long long at;	/* Its last ACK. */
+};
 
 /**
   dtp_server and dtp_client (also called "gates")
@@ -30,18 +109,44 @@ struct dtp_gate {
   int socket;			/* Socket file descriptor for this gate. */
   struct sockaddr_in self;	/* Self address. */
   struct sockaddr_in addr;	/* Remote address. */
+  const struct dtp_transport *tp; /* Datagram transport and clock. */
+  void *tpctx;			/* Transport private data. */
+  long timeout;			/* Receive timeout (us), 0 if none. */
+  int io;			/* I/O backend, DTP_IO_*. */
+  int evfd;			/* Readiness eventfd, see dtp_fd. */
+  long spin;			/* Busy poll budget (ns), 0 if off. */
+  int cpu[2];			/* Cores of the sender / receiver, -1 if any. */
+  unsigned wakes;		/* Bumped by every wakeup while spinning. */
+  unsigned feat;		/* FEAT_* asked for, agreed once connected. */
+  struct dtp_zstate *z;		/* Compression stage, NULL if off. */
+  struct dtp_fec *fec;		/* Parity packets, NULL if off. */
+  struct dtp_shm *shm;		/* Shared memory rings, NULL if off. */
+  size_t mxw, lim;		/* Buffer slots, and mxw - 1 (slot mask). */
+  int wshift;			/* Window scale of wsz. */
+  int sockbuf;			/* DTP_SOCKBUF. */
+  int core;			/* DTP_CORE, the one running once
+				   connected. */
+  size_t kcap;			/* Datagrams the socket holds : the most
+				   receive window advertised. */
+  unsigned kdrops, kseen;	/* Socket drop counter, as last reported by
+				   the kernel and as last accounted for. */
+  struct dtp_drops drops;	/* Synched with outbuf_mtx. */
+  struct dtp_pending backlog[DTP_BACKLOG]; /* See handshake_backlog. */
+  int nbacklog;
 
   /* Connection state. */
-  struct timeval ackstamp;	/* Timestamp. */
-  pthread_cond_t tm_cv;		/* Timestamp semaphore.
-				   Synched with outbuf_mtx. */
+  struct dtp_timer rto;		/* Retransmission timer, pushed back by
+				   every ACK while data is in flight. */
+  int rtofired;			/* Set by rto, synched with outbuf_mtx. */
 
   /* Sequence numbers. */
   seq_t seqno, sndno;		/* Sent sequence numbers. */
   seq_t ackno, lstack, ackfr;	/* Acknowledgement metadata. */
+  seq_t dupthr;			/* DUPACKs that trigger a retransmission. */
 
   /* Packet buffers. */
   packet_t *inbuf, *outbuf;	 /* Incoming / outgoing data. */
+  packet_t *early;		 /* Came in before the receiver started. */
 
   /* Outgoing data flow control. */
   size_t sndsize, obufsize;
@@ -49,6 +154,23 @@ struct dtp_gate {
   size_t WND, AXW, SSTH;	/* Windowing variables / threshold. */
   pthread_mutex_t outbuf_mtx;	/* Guards out<var> */
   pthread_cond_t outbuf_var;	/* Guards out<var> */
+  int wrarm;			/* Signal evfd once WRLOWAT slots free up. */
+  int cork, nodelay;		/* See dtp_cork, DTP_NODELAY. */
+  int tailopen;			/* Last queued packet not sent yet, may
+				   take more bytes. */
+  seq_t smallno;		/* End of the last partial packet sent. */
+
+  /* Priority channel out, served before outbuf. Its own sequence
+     numbers, from 0, and credit : packets the peer has room for. */
+  packet_t *prout;		/* DTP_PRIO_PKTS slots once used. */
+  size_t pobeg, posize, posent;	/* First unacked, queued, sent. */
+  seq_t poseqno, posndno;	/* Acked / queued up to. */
+  size_t pocred;
+  unsigned podup;		/* DUPACKs of the channel. */
+  int poopen;			/* Last queued packet not sent yet. */
+  struct dtp_timer prto;	/* Its retransmission timer : ACKs of the
+				   main stream do not push it back. */
+  int poback;			/* Doublings of PRIO_RTO. */
 
   /* Incoming data flow control. */
   byte_t *rcvf;			 /* Received flags. */
@@ -56,8 +178,23 @@ struct dtp_gate {
   size_t inbeg, inend;		 /* Pointers to inbuf. */
   pthread_mutex_t inbuf_mtx;	 /* Guards in<var> */
   pthread_cond_t inbuf_var;	 /* Guards in<var> */
+  int rdarm;			 /* Signal evfd when data arrives. */
   size_t byte_offset;		 /* Byte offset in the last packet that has
 				    not been read completely yet. */
+  byte_t *prbuf;		 /* Priority channel queue, DTP_PRIO_BUF
+				    bytes once some arrive. */
+  size_t prbeg, prlen;
+  int prarm;			 /* Signal evfd when priority data arrives. */
+  seq_t prackno;		 /* Priority data taken up to. */
+  size_t pradv;			 /* Priority credit last advertised. */
+  seq_t rcvhi;			 /* End of the furthest packet received. */
+  int ovfl;			 /* Socket dropped packets past ovflno : ACKs
+				    carry OVFL for a window, see ack_flags. */
+  seq_t ovflno;
+  size_t wadv;			 /* Free slots last advertised. */
+  int finin;			 /* Peer's FIN is in order : no more data. */
+  int reset;			 /* Peer dropped us (RST) : reads end once
+				    inbuf is empty, see mcast.h. */
 
   pthread_t snd_dmn;	 /* Thread handling outgoing packet I/O. */
   pthread_t rcv_dmn;	 /* Thread handling incoming packet I/O. */
@@ -82,8 +219,8 @@ typedef struct dtp_gate dtp_client; /* Same struct, different usage. */
 int init_dtp_server (dtp_server*, port_t);
 
 /**
-   Listen for client.
-   Once connection is established, allocate resources.
+   Listen for client. SYNs are answered with a cookie and forgotten;
+   the first ACK bringing one back takes the gate, see handshake_backlog.
  */
 int dtp_listen (dtp_server*, char*, port_t*);
 
@@ -98,6 +235,11 @@ int init_dtp_client (dtp_client*, const char*, port_t);
 
 /**
    Try connecting to the server specified while initialization.
+   The SYN goes again after SYN_RTO, then after twice as long, up to
+   SYN_TRIES times. The ACK carries everything the server needs, and
+   goes the same way until the server answers it. Fails with
+   ECONNREFUSED if the server is taken and keeps no more clients,
+   ETIMEDOUT if the SYN or the ACK went unanswered.
  */
 int dtp_connect (dtp_client*);
 
@@ -116,6 +258,118 @@ int dtp_send (struct dtp_gate*, const void*, size_t);
  */
 size_t dtp_recv (struct dtp_gate*, void*, size_t);
 
+/**
+   Non blocking send. Queues as much of the data as fits in outbuf
+   and returns the number of bytes taken, or -1 with errno EAGAIN
+   if the buffer is full.
+ */
+ssize_t dtp_try_send (struct dtp_gate*, const void*, size_t);
+
+/**
+   Non blocking receive. Returns the number of bytes read (0 once
+   the peer has closed), or -1 with errno EAGAIN if there is no data.
+ */
+ssize_t dtp_try_recv (struct dtp_gate*, void*, size_t);
+
+/**
+   Readiness file descriptor of a connected gate, for poll / epoll.
+   It becomes readable when a dtp_try_* call that failed with EAGAIN
+   (or a dtp_events that reported the condition missing) can make
+   progress again. Watch it for reading only, whatever the direction.
+ */
+int dtp_fd (struct dtp_gate*);
+
+/**
+   Clear the readiness descriptor and return DTP_POLLIN / DTP_POLLOUT
+   as data can be read / sent right now, and DTP_POLLPRI as the
+   priority channel has data. Conditions not currently
+   met will signal the descriptor when they are.
+ */
+int dtp_events (struct dtp_gate*);
+
+/**
+   Small writes. dtp_send appends to the last queued packet as long
+   as it has not gone out, and a partial packet is held back while an
+   earlier partial one is unacknowledged (Nagle, Minshall's variant)
+   unless DTP_NODELAY is set. A corked gate holds partial packets
+   until dtp_uncork; dtp_flush sends what is queued right away.
+   Full packets are never held. Connected gates only.
+ */
+int dtp_cork (struct dtp_gate*);
+
+int dtp_uncork (struct dtp_gate*);
+
+int dtp_flush (struct dtp_gate*);
+
+/**
+   Priority classes. With DTP_PRIO_HIGH, dtp_send_prio queues the data
+   on a channel the sender serves before whatever dtp_send queued, and
+   the peer reads it with dtp_recv_prio, apart from the main stream, in
+   the order it was sent. The channel has its own sequence numbers and
+   ACKs, and only gets as much in flight as the DTP_PRIO_BUF bytes of
+   the peer's queue have room for : unread priority data holds up the
+   channel, never the main stream. It is uncompressed; the peer must
+   speak it too (FEAT_PRIO), both return -1 otherwise. DTP_PRIO_BULK
+   is dtp_send / dtp_recv. dtp_recv_prio blocks until some data
+   arrives and returns 0 once the peer has closed. dtp_events reports
+   DTP_POLLPRI while there is some. close_dtp_gate waits for the peer
+   to have taken what was sent on the channel. Once a gate has sent on
+   the channel, it keeps no more than DTP_PRIO_QUEUE bulk packets in
+   flight, which is all a priority packet waits behind in the peer's
+   socket.
+ */
+int dtp_send_prio (struct dtp_gate*, const void*, size_t, int);
+
+ssize_t dtp_recv_prio (struct dtp_gate*, void*, size_t, int);
+
+/* -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- */
+/* Options. */
+/**
+   Set a gate option. Call after init_dtp_* and before
+   dtp_listen / dtp_connect.
+   DTP_IO : DTP_IO_SOCKET (default), DTP_IO_URING or DTP_IO_URING_SQPOLL.
+   io_uring falls back to sockets where the kernel lacks it.
+   DTP_COMPRESS : 1 to compress the stream if the peer agrees.
+   DTP_FEC : 1 to send parity packets if the peer agrees.
+   DTP_WINDOW : slots of each buffer, a power of two from MXW_MIN to
+   MXW_MAX. Ends settle on the smaller of their values; past
+   MXW_BASIC both must also speak the wide header.
+   DTP_BUSYPOLL : microseconds the daemons and blocked callers spin
+   on the socket (or ring) and on the gate before they sleep, for low
+   latency at the cost of busy cores. 0 (default) never spins.
+   DTP_CPU_SND, DTP_CPU_RCV : pin the sender / receiver daemon to a
+   core, best on cores of their own when spinning.
+   DTP_NODELAY : 1 to send partial packets right away, see dtp_cork.
+   DTP_SHM : 1 to move the data onto shared memory rings when both
+   ends asked for it and turn out to run on the same host, see shm.h.
+   UDP gates only.
+   DTP_SOCKBUF : bytes of the socket's receive and send buffers. 0
+   (default) sizes them for the window once connected, see
+   dtp_udp_buffers.
+   DTP_CORE : DTP_CORE_GENERIC (default) or the daemons compiled for
+   one window, ACK policy and congestion controller, see dtp_core.
+   Sets DTP_WINDOW to that window and leaves out the priority channel
+   where the core has none. A gate whose agreed window or features
+   the core was not built for runs the generic one.
+ */
+int dtp_setopt (struct dtp_gate*, int, int);
+
+/**
+   Read a gate option. Once connected, DTP_IO, DTP_COMPRESS, DTP_FEC,
+   DTP_WINDOW, DTP_SHM, DTP_SOCKBUF (receive buffer, as the kernel
+   counts it) and DTP_CORE read back what is actually in use.
+ */
+int dtp_getopt (struct dtp_gate*, int, int*);
+
+/**
+   Losses so far. Packets the receiver's kernel drops because its
+   socket buffer is full are no sign of congestion : the receiver
+   flags its ACKs with OVFL until the holes are filled, and the
+   sender resends half its window's worth without lowering ssthresh,
+   where a network loss halves both. Counts so far, or in all
+   once closed.
+ */
+int dtp_drops (struct dtp_gate*, struct dtp_drops*);
 
 /* -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- */
 
@@ -128,15 +382,91 @@ int close_dtp_gate(struct dtp_gate*);
 /* -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- */
 
 /**
-   Sender thread code.
+   Sender and receiver thread code, compiled for a window (0 : the
+   gate's), an ACK policy and a congestion controller by src/core.inc.
+   fec and prio : parity packets and the priority channel built in.
  */
-void * sender_daemon (void *);
+struct dtp_core {
+  const char *name;
+  size_t mxw;
+  int fec, prio;
+  void * (*snd) (void *);
+  void * (*rcv) (void *);
+};
+
+extern const struct dtp_core *const dtp_cores[DTP_CORES];
 
 /**
-   Receiver thread code.
+   The core a gate about to start its daemons runs : the one of
+   DTP_CORE if built for its window and features, the generic one
+   otherwise, which gate->core then reads.
  */
-void * receiver_daemon (void *);
+const struct dtp_core * gate_core (struct dtp_gate *);
+
+/**
+   Retransmission timer callback.
+ */
+void rto_expire (struct dtp_timer *);
+
+/**
+   Priority channel retransmission timer callback.
+ */
+void prio_expire (struct dtp_timer *);
+
+/**
+   Queue one packet worth of data from [beg, end) into outbuf, or
+   top up the unsent tail packet. Caller holds outbuf_mtx and has
+   checked for space.
+   Returns the number of bytes taken.
+ */
+size_t gate_push (struct dtp_gate*, const byte_t*, const byte_t*);
+
+/**
+   Move up to n bytes out of inbuf. Caller holds inbuf_mtx.
+   Returns 0 if only a FIN was consumed.
+ */
+size_t gate_pull (struct dtp_gate*, byte_t*, size_t);
+
+/**
+   Tell the sender, after a read, that a window it was last told was
+   nearly shut has opened again : what it sent since found no room.
+   Caller holds inbuf_mtx.
+ */
+void gate_window_update (struct dtp_gate*);
+
+/**
+   The same for the priority channel, after dtp_recv_prio : its
+   credit was nearly used up and has come back. Caller holds
+   inbuf_mtx.
+ */
+void gate_prio_update (struct dtp_gate*);
+
+/**
+   Packet from some other host than the peer. A handshake ACK with a
+   valid cookie comes from a client that lost the race for the gate :
+   kept for the next dtp_listen while it waits, an RST if there is no
+   room.
+ */
+void handshake_backlog (struct dtp_gate*, const packet_t*,
+			const struct sockaddr_in*);
+
+/**
+   The ACK ending dtp_connect : both ISNs, the features and window the
+   client settled on.
+ */
+int handshake_ack (struct dtp_gate*);
+
+/**
+   The server's answer to it, a window update : the client waits for
+   it, or for anything else from the server, before it is connected.
+   Caller does not hold inbuf_mtx.
+ */
+int handshake_done (struct dtp_gate*);
 
 /* -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- */
 
+#ifdef __cplusplus
+}
+#endif
+
 #endif
@@ -0,0 +1,149 @@
+#ifndef _MCAST_H
+#define _MCAST_H
+
+#include "types.h"
+#include "gate.h"
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+   One-to-many distribution over IP multicast.
+
+   A struct dtp_mcast sender takes receivers on its unicast port : any
+   client gate joins with a plain dtp_connect, and learns from the
+   SYN|ACK (FEAT_MCAST) the group to listen on. The sender's buffer
+   works like a gate's outbuf, except that each slot goes out once to
+   the group, for all receivers. Receivers read with dtp_recv as from
+   any server; they only read, and send nothing but feedback.
+
+   Feedback is the usual cumulative ACK, sent to the sender's unicast
+   address. Receivers hold ACKs back while more packets are queued and
+   send at most one in MC_ACKS, but DUPACKs go out at once. Repairs :
+   the packet a receiver DUPACKs, or waits for over a tick, goes again
+   to that receiver alone, or to the group when more receivers miss
+   it; one that made no progress for an RTO gets its window again.
+
+   The window slides as the slowest receiver acknowledges, sized by
+   the smallest advertised window and halved on every loss reported,
+   so the group runs at the pace of its slowest member. With
+   DTP_MC_EVICT set, a receiver that holds the others back for longer
+   than that is dropped : it gets an RST, reads what it has, then 0,
+   with gate->reset set.
+
+   Receivers join until the first dtp_mcast_send; the window starts at
+   the sender's DTP_WINDOW, which they must be able to take.
+ */
+
+#define MC_ACKS 8		/* Receiver ACKs coalesced into one. */
+#define MC_TICK (RTO >> 4)	/* Sender's check on stalled receivers. */
+
+/* Options, see dtp_mcast_setopt. */
+#define DTP_MC_EVICT 0x101	/* Straggler timeout (ms), 0 never (default). */
+#define DTP_MC_TTL 0x102	/* Multicast hops, default 1. */
+
+/* Group address in the SYN|ACK payload, after the feature words. */
+struct dtp_mcast_group {
+  unsigned addr;		/* Network byte order. */
+  unsigned short port;		/* Network byte order. */
+};
+
+/* Receiver states, seen from the sender. */
+#define MC_JOINING 1		/* SYN|ACK sent, waiting for its ACK. */
+#define MC_LIVE 2
+#define MC_DONE 3		/* Sent its FIN. */
+#define MC_EVICTED 4
+
+struct dtp_mcast_peer {
+  struct sockaddr_in addr;
+  int state;
+  seq_t ackno;			/* Cumulative ACK. */
+  size_t wnd;			/* Free slots it advertised. */
+  unsigned ackfr;		/* DUPACKs of ackno. */
+  seq_t recover;		/* Sent when it lost a packet : ACKs short
+				   of it point at the next hole. */
+  unsigned long long moved;	/* Last time ackno moved (ns). */
+  unsigned long long kicked;	/* Last repair or RST meant for it. */
+  unsigned long long held;	/* Since when it holds the others back,
+				   0 if it does not. */
+};
+
+struct dtp_mcast_stats {
+  size_t receivers;		/* Live. */
+  size_t done, evicted;
+  unsigned long long packets;	/* Data packets sent to the group. */
+  unsigned long long bytes;	/* Their payload. */
+  unsigned long long repairs;	/* Packets sent again to one receiver. */
+  unsigned long long mrepairs;	/* Packets sent again to the group. */
+  size_t window;		/* Packets allowed in flight. */
+};
+
+struct dtp_mcast {
+  struct dtp_gate gate;		/* Socket, group address, outbuf. The
+				   daemons run on it. */
+  struct dtp_mcast_peer *peer;
+  size_t npeer, cap;
+  int started;			/* Data queued : no more joins. */
+  unsigned long long evict;	/* DTP_MC_EVICT (ns). */
+  seq_t mrpno;			/* Last packet repaired on the group, */
+  unsigned long long mrpat;	/* and when. */
+  seq_t recover;		/* Losses before : no other window cut. */
+  unsigned long long tick;	/* Next look at stalled receivers. */
+  unsigned long long finat;	/* FIN last sent to the group, 0 if not. */
+  struct dtp_mcast_stats st;
+};
+
+/* -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- */
+/* Sender. All functions return 0 on success, nonzero on failure. */
+
+/**
+   Bind a sender to a unicast port (0 for any) for joins and feedback,
+   sending to group (dotted quad) and gport through the interface with
+   address iface, or the default route's if NULL. Receivers start
+   joining right away.
+ */
+int init_dtp_mcast (struct dtp_mcast*, port_t, const char*, port_t,
+		    const char*);
+
+/**
+   DTP_MC_EVICT, DTP_MC_TTL, and DTP_WINDOW as long as nobody has
+   joined.
+ */
+int dtp_mcast_setopt (struct dtp_mcast*, int, int);
+
+/**
+   Wait until count receivers have joined, or for usec microseconds
+   (0 : no limit). Returns the receivers joined.
+ */
+size_t dtp_mcast_accept (struct dtp_mcast*, size_t, long);
+
+/* Queue data for every receiver. Blocks only if the buffer is full. */
+int dtp_mcast_send (struct dtp_mcast*, const void*, size_t);
+
+/* Counters so far, or in all once closed. */
+void dtp_mcast_stats (struct dtp_mcast*, struct dtp_mcast_stats*);
+
+/**
+   Send a FIN once everything is acknowledged and wait for the
+   receivers' FINs, a few RTOs at most. Stops the daemons; the socket
+   stays open.
+ */
+int close_dtp_mcast (struct dtp_mcast*);
+
+/* -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- */
+/* Receiver side, from dtp_connect. */
+
+/**
+   Join the group on a socket of its own, next to the gate's, and
+   move the gate onto a transport reading both.
+ */
+int dtp_mcast_attach (struct dtp_gate*, const struct dtp_mcast_group*);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -4,19 +4,56 @@
 #include "types.h"
 #include "gate.h"
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 #define RCV_OK      0
 #define RCV_TIMEOUT 1
 #define RCV_WRHOST  2
 #define RCV_ERROR   3
+#define RCV_BADPKT  4
+
+/**
+   Wire format. Fields are in host byte order.
+
+   Basic header, HDR_BASIC bytes, the one every peer speaks :
+     0  seq, low 32 bits     4  ack, low 32 bits
+     8  wptr, low 16 bits   10  len   12  wsz   14  flags
+   Receivers rebuild full sequence numbers from the ones they expect
+   (seq_expand), which is exact while less than 2GiB are in flight.
+
+   With WIDE in flags (only once both ends offered FEAT_WIDE) the
+   basic header is followed by the high halves, HDR_WIDE bytes :
+    16  seq >> 32   20  ack >> 32   24  wptr >> 16
+
+   wsz counts free slots of the receiver, shifted right by the
+   window scale agreed on at connection time.
+
+   Packets flagged URG belong to the priority channel : seq and ack
+   are its own, from 0, and wsz counts packets of credit.
+ */
 
 /* Returns nonzero if two addresses are different. */
 int validate_address (const struct sockaddr_in *,
 		      const struct sockaddr_in *);
 
 /**
-   Send a packet.
+   The 64 bit sequence number closest to ref with the given low
+   32 bits.
+ */
+seq_t seq_expand (seq_t, seq_t);
+
+/**
+   Send a packet. Encodes its header in place.
+ */
+int send_pkt (struct dtp_gate*, packet_t *);
+
+/**
+   Send a packet to another address than the gate's, straight on its
+   socket : no transport, so UDP gates only.
  */
-int send_pkt (struct dtp_gate*, const packet_t *);
+int send_pkt_to (struct dtp_gate*, packet_t *, const struct sockaddr_in *);
 
 /**
    Detect a packet. Sets gate address to the recieved address.
@@ -26,14 +63,25 @@ int detect_pkt (dtp_server*, packet_t *);
 
 /**
    Receive a packet. Checks if gate address is same as recieved address.
-   Returns error code on error / timeout.
+   Returns error code on error / timeout, RCV_BADPKT on a runt.
  */
 int recv_pkt (struct dtp_gate*, packet_t *);
 
+/**
+   Receive a packet from any address, stored in the last argument :
+   one sender tells its multicast receivers apart by it.
+   Returns error code on error / timeout, RCV_BADPKT on a runt.
+ */
+int recv_any (struct dtp_gate*, packet_t *, struct sockaddr_in *);
+
 /**
    Create a packet from the data buffer.
    Assumes write length < PAYLOAD.
  */
 int make_pkt (packet_t *, seq_t, seq_t, wptr_t, len_t, len_t, flag_t, const void*);
 
+#ifdef __cplusplus
+}
+#endif
+
 #endif
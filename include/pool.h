@@ -0,0 +1,66 @@
+#ifndef _POOL_H
+#define _POOL_H
+
+#include "types.h"
+#include "gate.h"
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+   Process wide pool of gate buffers.
+
+   A gate's inbuf, outbuf and rcvf come from one mapping, taken from
+   the pool by setup_gate and handed back by close_dtp_gate. Idle
+   mappings are kept (up to a byte budget) and reused as they are :
+   only rcvf is cleared, so a new connection neither faults pages in
+   nor zeroes megabytes. Buffers of 2MiB and more sit on explicit huge
+   pages where some are reserved (vm.nr_hugepages), else on
+   transparent ones (madvise), and are faulted in when mapped. A
+   buffer is reused preferably on the NUMA node it was faulted in on,
+   the node of the thread asking for it.
+ */
+
+#define POOL_BUDGET (256ul << 20)	/* Default idle bytes kept. */
+
+struct dtp_poolstats {
+  unsigned long long hits;	/* Buffers reused. */
+  unsigned long long misses;	/* Buffers mapped. */
+  size_t idle, idle_bytes;	/* Kept for reuse. */
+  size_t hugetlb, thp;		/* Live or idle buffers on huge pages,
+				   explicit / transparent. */
+};
+
+/**
+   Bytes of idle buffers to keep. 0 turns the pool off : every gate
+   then callocs its buffers and frees them on close.
+ */
+void dtp_pool_config (size_t);
+
+/**
+   Map count buffers for mxw slot windows ahead of the first
+   connections. Returns nonzero if memory ran out.
+ */
+int dtp_pool_reserve (size_t, size_t);
+
+/* Unmap every idle buffer. */
+void dtp_pool_drain (void);
+
+void dtp_pool_stats (struct dtp_poolstats*);
+
+/* -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- */
+/* Gate side. */
+
+/* Set inbuf, outbuf and rcvf (zeroed) for gate->mxw slots. */
+int pool_get (struct dtp_gate*);
+
+void pool_put (struct dtp_gate*);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,95 @@
+#ifndef _SHM_H
+#define _SHM_H
+
+#include "types.h"
+#include "gate.h"
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+   Shared memory fast path for peers on the same host (DTP_SHM).
+
+   A client that asked for it offers FEAT_SHM in its SYN along with
+   the kernel's boot id. A server that asked for it too and runs on
+   the same boot maps a memfd holding four byte rings (the bulk
+   stream and the priority channel, each way) and answers with its
+   pid, the descriptor and a random cookie (struct shm_offer). The
+   client opens the segment through /proc/<pid>/fd/<fd>, checks the
+   cookie, and its ACK carries the features it settled on. Anything
+   failing on the way (other host, other pid namespace, no access to
+   the server's /proc) leaves the connection on UDP.
+
+   On the rings dtp_send / dtp_recv copy straight from one process to
+   the other. A side sleeps on a futex in the segment only once the
+   DTP_BUSYPOLL budget is spent, and the other side makes a syscall
+   only to wake a sleeper : none while both keep up. Non blocking
+   callers are rung with an empty datagram, which the receiver daemon
+   turns into a signal on dtp_fd.
+
+   The socket keeps carrying the FIN exchange, so closing works as
+   over UDP. Closing marks the sending rings finished first : the
+   peer reads everything written before from the segment, which stays
+   mapped on its side, then gets 0. Packet buffers shrink to MXW_MIN
+   slots while DTP_WINDOW sizes the rings, and compression and parity
+   are off : they only cost CPU here.
+ */
+
+#define SHM_BOOTID 36		/* /proc/sys/kernel/random/boot_id */
+
+/* Server's part of the SYN|ACK payload, after the feature words. */
+struct shm_offer {
+  unsigned pid;			/* Server process. */
+  int fd;			/* Its memfd. */
+  unsigned long long cookie;	/* Found at the start of the segment. */
+};
+
+/* Read the boot id into SHM_BOOTID bytes. Returns 0 on success. */
+int shm_bootid (char*);
+
+/* Nonzero if a SYN's boot id, of the given length, is ours. */
+int shm_local (const byte_t*, size_t);
+
+/**
+   Server : map a segment with rings of the given slots (times
+   PAYLOAD bytes) each way, replacing any earlier one, and fill in
+   the offer. Returns 0 on success.
+ */
+int shm_create (struct dtp_gate*, size_t, struct shm_offer*);
+
+/* Client : map the server's segment. Returns 0 on success. */
+int shm_attach (struct dtp_gate*, const struct shm_offer*);
+
+/* Unmap, once the daemons are stopped. NULL safe. */
+void shm_free (struct dtp_gate*);
+
+/* Ring slots, what DTP_WINDOW reads back. */
+size_t shm_window (struct dtp_gate*);
+
+/* -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- */
+/* Gate stage, called from gate.c and connect.c. Class DTP_PRIO_*. */
+
+/* Blocking, queues all of it. */
+int shm_send (struct dtp_gate*, const void*, size_t, int);
+
+/* Bulk class. -1 / EAGAIN if the ring is full. */
+ssize_t shm_try_send (struct dtp_gate*, const void*, size_t);
+
+/* Blocking unless the last argument is 0 (then -1 / EAGAIN). */
+ssize_t shm_recv (struct dtp_gate*, void*, size_t, int, int);
+
+/* dtp_events on the rings. */
+int shm_events (struct dtp_gate*);
+
+/* No more data from this side, wakes the peer's readers. */
+void shm_close (struct dtp_gate*);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
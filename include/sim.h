@@ -0,0 +1,98 @@
+#ifndef _SIM_H
+#define _SIM_H
+
+#include "types.h"
+#include "gate.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+   Deterministic in-process network simulator.
+
+   Gates created with init_dtp_sim_server / client exchange packets
+   through simulated links instead of sockets, and their daemons run
+   on a virtual clock. Only one simulated thread runs at a time; when
+   all of them are blocked the clock jumps straight to the next
+   event (packet delivery or timer expiry). A run therefore depends
+   only on the seed and the link models, and an hour of network time
+   costs only the CPU time needed to process its packets.
+
+   Every call on a simulated gate must be made from a thread started
+   with dtp_sim_spawn (daemons are started by the simulator itself).
+ */
+
+/* Link model for one direction. */
+struct dtp_link {
+  double bandwidth;		/* Bytes per second, 0 for unlimited. */
+  unsigned long long rtt;	/* Round trip propagation delay (ns). */
+  size_t queue;			/* Bottleneck queue (bytes), 0 for unlimited. */
+  double loss;			/* Random loss probability. */
+  /* Gilbert-Elliott burst losses, all 0 to disable. */
+  double burst_loss;		/* Loss probability in the bad state. */
+  double p_bad;			/* Good -> bad transition, per packet. */
+  double p_good;		/* Bad -> good transition, per packet. */
+};
+
+struct dtp_sim_stats {
+  unsigned long long now;	/* Virtual time (ns). */
+  unsigned long long packets;	/* Datagrams offered to links. */
+  unsigned long long bytes;
+  unsigned long long lost;	/* Dropped by the loss model. */
+  unsigned long long overflow;	/* Dropped by full queues. */
+  unsigned long long delivered;
+  unsigned long long switches;	/* Thread handoffs. */
+};
+
+struct dtp_sim;
+
+/**
+   Create a simulated network. Links without an explicit model
+   (see dtp_sim_link) use the default one. Returns NULL on failure.
+ */
+struct dtp_sim * dtp_sim_create (unsigned long long seed,
+				 const struct dtp_link *);
+
+/**
+   Set the model of both directions between two ports.
+ */
+int dtp_sim_link (struct dtp_sim*, port_t, port_t, const struct dtp_link *);
+
+/**
+   Simulated counterparts of init_dtp_server / init_dtp_client.
+   Simulated hosts all live at 127.0.0.1, the client is given the next
+   free port above 40000.
+ */
+int init_dtp_sim_server (dtp_server*, struct dtp_sim*, port_t);
+
+int init_dtp_sim_client (dtp_client*, struct dtp_sim*, port_t);
+
+/**
+   Add an application thread to the simulation.
+   It starts running on dtp_sim_run.
+ */
+int dtp_sim_spawn (struct dtp_sim*, void *(*)(void*), void *);
+
+/**
+   Run until every application thread has returned.
+   Returns nonzero if they deadlocked instead.
+ */
+int dtp_sim_run (struct dtp_sim*);
+
+/**
+   Virtual time and counters.
+ */
+void dtp_sim_stats (struct dtp_sim*, struct dtp_sim_stats *);
+
+/**
+   Stop leftover daemons and free the simulator.
+   Gates should have been closed by then.
+ */
+void dtp_sim_destroy (struct dtp_sim*);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,99 @@
+#ifndef _TIMER_H
+#define _TIMER_H
+
+#include <pthread.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+   Hierarchical timing wheel.
+
+   Timers are intrusive (embedded in the gate) and are kept in
+   WHEEL_LEVELS levels of WHEEL_SLOTS buckets; level l covers
+   WHEEL_SLOTS^(l+1) ticks, a tick being 2^WHEEL_SHIFT ns (~1ms).
+   Adding, moving and cancelling a timer is O(1); far timers are
+   cascaded down a level as the wheel turns. Timers never fire early,
+   and late by at most one tick. A bitmap of the occupied buckets of
+   each level finds the next deadline without scanning them.
+
+   A wheel is driven by one worker, which calls dtp_wheel_run at the
+   deadlines it is told about through kick. Callbacks run on that
+   worker without the wheel lock held.
+ */
+
+#define WHEEL_SHIFT 20		/* Tick of 1.05ms. */
+#define WHEEL_BITS 6		/* Buckets of a level fit a uint64_t. */
+#define WHEEL_SLOTS (1<<WHEEL_BITS)
+#define WHEEL_LEVELS 4		/* 2^24 ticks, about 4.9 hours. */
+
+struct dtp_wheel;
+
+struct dtp_timer {
+  struct dtp_timer *next, **pprev; /* Bucket links, pprev NULL if idle. */
+  unsigned long long expires;	   /* Deadline (ns, wheel clock). */
+  struct dtp_wheel *wheel;
+  void (*fn) (struct dtp_timer*); /* Expiry callback. */
+};
+
+struct dtp_wheel {
+  pthread_mutex_t mtx;		/* Guards the wheel and its timers. */
+  pthread_cond_t idle;		/* A callback has returned. */
+  unsigned long long tick;	/* Next tick to be processed. */
+  unsigned long long armed;	/* Tick the worker wakes up at, 0 if none. */
+  size_t pending;
+  struct dtp_timer *running;	/* Callback in progress. */
+  struct dtp_timer *slot[WHEEL_LEVELS][WHEEL_SLOTS];
+  uint64_t used[WHEEL_LEVELS];	/* Bit i : slot[l][i] nonempty. */
+
+  /* Current time, only read to restart an empty wheel. */
+  unsigned long long (*clock) (struct dtp_wheel*);
+  /* Called with mtx held when the worker must wake up at the given
+     time (ns) instead, or never if 0. */
+  void (*kick) (struct dtp_wheel*, unsigned long long);
+  void *ctx;			/* Worker private data. */
+};
+
+/* -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- */
+/* Worker side. */
+
+int dtp_wheel_init (struct dtp_wheel*,
+		    unsigned long long (*) (struct dtp_wheel*),
+		    void (*) (struct dtp_wheel*, unsigned long long),
+		    void*);
+
+void dtp_wheel_destroy (struct dtp_wheel*);
+
+/**
+   Fire every timer due by the given time, then kick the worker with
+   the next deadline, which is also returned (0 if none).
+ */
+unsigned long long dtp_wheel_run (struct dtp_wheel*, unsigned long long);
+
+/* -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- */
+/* Timers. */
+
+void dtp_timer_init (struct dtp_timer*, struct dtp_wheel*,
+		     void (*) (struct dtp_timer*));
+
+/* (Re)arm a timer, pending or not. */
+void dtp_timer_mod (struct dtp_timer*, unsigned long long);
+
+/* Disarm a timer. Its callback may still be running. */
+void dtp_timer_del (struct dtp_timer*);
+
+/**
+   Disarm a timer and wait for its callback to return. Must not be
+   called with locks the callback takes.
+ */
+void dtp_timer_del_sync (struct dtp_timer*);
+
+int dtp_timer_pending (struct dtp_timer*);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
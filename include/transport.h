@@ -0,0 +1,134 @@
+#ifndef _TRANSPORT_H
+#define _TRANSPORT_H
+
+#include "types.h"
+#include "gate.h"
+
+#include <sys/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+   Datagram transport and clock behind a gate.
+
+   Every packet, every timestamp and every wait / wakeup of the gate
+   and its daemons goes through gate->tp, so that the same protocol
+   code runs over real UDP sockets (dtp_udp_transport) or inside the
+   simulated network of include/sim.h.
+   Times are nanoseconds on the transport's own clock.
+ */
+struct dtp_transport {
+  /* Send a datagram to gate->addr. Returns 0 on success. */
+  int (*send) (struct dtp_gate*, const void*, size_t);
+
+  /* Receive a datagram, honouring gate->timeout.
+     Returns its length, or -1 with errno set (EAGAIN on timeout). */
+  ssize_t (*recv) (struct dtp_gate*, void*, size_t, struct sockaddr_in*);
+
+  /* Set the receive timeout in microseconds, 0 to block. */
+  int (*timeout) (struct dtp_gate*, long);
+
+  /* Current time. */
+  unsigned long long (*now) (struct dtp_gate*);
+
+  /* Wait on a condition until woken, or until the deadline
+     (0 for none). Returns ETIMEDOUT on timeout. */
+  int (*wait) (struct dtp_gate*, pthread_cond_t*, pthread_mutex_t*,
+	       unsigned long long);
+
+  /* Wake all waiters of a condition. */
+  void (*wake) (struct dtp_gate*, pthread_cond_t*);
+
+  /* Start / stop (and reap) a daemon running on the gate. */
+  int (*spawn) (struct dtp_gate*, pthread_t*, void *(*)(void*));
+  void (*stop) (struct dtp_gate*, pthread_t);
+
+  /* Timer wheel for the gate's protocol timers, on the same clock
+     as now, started on first use. NULL if it cannot be started. */
+  struct dtp_wheel * (*wheel) (struct dtp_gate*);
+
+  /* Optional. Push out sends queued by send. */
+  void (*flush) (struct dtp_gate*);
+
+  /* Optional. Free per connection resources once the daemons are
+     stopped, and fall back to the transport the gate started on. */
+  void (*release) (struct dtp_gate*);
+
+  /* Optional. Nonzero if a datagram is waiting for recv. */
+  int (*pending) (struct dtp_gate*);
+};
+
+/* Default transport : UDP socket, monotonic clock, POSIX threads,
+   one timer wheel per process driven by a timerfd. */
+extern const struct dtp_transport dtp_udp_transport;
+
+/**
+   Move a connected UDP gate onto io_uring (src/uring.c).
+   Returns nonzero, leaving the gate untouched, where io_uring or
+   multishot receives are not available.
+ */
+int dtp_uring_attach (struct dtp_gate*);
+
+/**
+   Size both buffers of a UDP socket, in bytes, or for mxw full
+   datagrams if bytes is 0, and have the kernel count what
+   it drops for want of room (SO_RXQ_OVFL). Past net.core.rmem_max /
+   wmem_max only with CAP_NET_ADMIN. Returns nonzero if any of it
+   was refused; the socket stays usable either way.
+ */
+int dtp_udp_buffers (int, size_t, int);
+
+/* Full datagrams the receive buffer holds. */
+size_t dtp_udp_slots (int);
+
+/**
+   recvmsg into one buffer, flags as for recvfrom. Stores in the last
+   argument the socket's drop counter if the kernel reported it.
+ */
+ssize_t dtp_udp_recvmsg (int, void*, size_t, struct sockaddr_in*, int,
+			 unsigned*);
+
+/* Drop counter in control messages of len bytes, 0 if not there. */
+unsigned dtp_udp_cmsg_drops (const void*, size_t);
+
+/* -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- */
+/* Shorthands dispatching through gate->tp. */
+
+unsigned long long gate_now (struct dtp_gate*);
+
+int gate_wait (struct dtp_gate*, pthread_cond_t*, pthread_mutex_t*);
+
+int gate_timedwait (struct dtp_gate*, pthread_cond_t*, pthread_mutex_t*,
+		    unsigned long long);
+
+void gate_wake (struct dtp_gate*, pthread_cond_t*);
+
+int gate_timeout (struct dtp_gate*, long);
+
+int gate_spawn (struct dtp_gate*, pthread_t*, void *(*)(void*));
+
+void gate_stop (struct dtp_gate*, pthread_t);
+
+struct dtp_wheel * gate_wheel (struct dtp_gate*);
+
+void gate_flush (struct dtp_gate*);
+
+void gate_release (struct dtp_gate*);
+
+/* 0 where the transport cannot tell. */
+int gate_pending (struct dtp_gate*);
+
+/**
+   One round of a busy poll loop (DTP_BUSYPOLL) : a pause, or a
+   yield on a single core, where spinning only holds back the thread
+   being waited for.
+ */
+void dtp_relax (void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -4,9 +4,9 @@
 /* Packet typedefs. */
 typedef unsigned char byte_t;	/* 1 byte */
 typedef unsigned short len_t;	/* 2 bytes */
-typedef unsigned short wptr_t;
+typedef unsigned int wptr_t;	/* 4 bytes, 2 on the basic header. */
 typedef unsigned short flag_t;
-typedef unsigned int seq_t;	/* 4 bytes */
+typedef unsigned long long seq_t; /* 8 bytes, 4 on the basic header. */
 
 #define PAYLOAD 1024
 
@@ -14,14 +14,41 @@ typedef unsigned int seq_t;	/* 4 bytes */
 #define ACK 0x0001
 #define SYN 0x0002
 #define FIN 0x0004
-
+#define FEC 0x0008		/* Parity, see fec.h */
+#define WIDE 0x0010		/* Header extension follows. */
+#define URG 0x0020		/* Priority channel, see dtp_send_prio. */
+#define RST 0x0040		/* Dropped by a multicast sender, see mcast.h */
+#define OVFL 0x0080		/* On an ACK : the receiver's socket dropped
+				   packets, the loss is no congestion. */
+#define WUPD 0x0100		/* On an ACK : a read made room, not a
+				   DUPACK. */
+
+/* Feature bits offered in the SYN payload, and the subset both
+   ends support returned in the SYN|ACK one. */
+#define FEAT_LZ 0x00000001	/* Compression stage, see compress.h */
+#define FEAT_FEC 0x00000002	/* Parity packets, see fec.h */
+#define FEAT_WIDE 0x00000004	/* Extended header, see packet.h */
+#define FEAT_PRIO 0x00000008	/* Priority channel, offered by default. */
+#define FEAT_SHM 0x00000010	/* Shared memory rings, see shm.h */
+#define FEAT_MCAST 0x00000020	/* Multicast receiver, offered by default. */
+
+/* Wire header sizes, see packet.h. */
+#define HDR_BASIC 16
+#define HDR_WIDE 26
+
+/**
+   In memory packet. Sequence numbers are 64 bit whatever the header
+   on the wire; send_pkt / recv_pkt encode and decode it in hdr, just
+   in front of the data, so the payload is never copied.
+ */
 typedef struct packet_t {
-  seq_t seq;			/* 4 byte sequence number. */
-  seq_t ack;			/* 4 byte sequence number. */
-  wptr_t wptr;			/* 2 byte Window pointer. */
-  len_t len;			/* 2 byte data size. */
-  len_t wsz;			/* 2 byte broadcast window size. */
-  flag_t flags;			/* 2 byte flags. */
+  seq_t seq;			/* Sequence number. */
+  seq_t ack;			/* Acknowledged sequence number. */
+  wptr_t wptr;			/* Window pointer. */
+  len_t len;			/* Data size. */
+  len_t wsz;			/* Broadcast window size (scaled). */
+  flag_t flags;			/* Flags. */
+  byte_t hdr[HDR_WIDE];		/* Wire header, right aligned. */
   byte_t data[PAYLOAD];		/* <=1024 byte data. */
 } packet_t;
 
@@ -0,0 +1,423 @@
+#include "gate.h"
+#include "compress.h"
+#include "transport.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+
+/* -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- */
+/* LZ block codec.
+
+   LZ4 style sequences : a token byte with the literal length in the
+   high nibble and the match length - 4 in the low one (15 meaning
+   more length bytes follow, 255 at a time), the literals, then a
+   2 byte little endian offset. The last sequence only has literals. */
+
+#define LZ_HASHLOG 13
+#define LZ_MINMATCH 4
+#define LZ_LASTLITERALS 5	/* Block always ends with literals. */
+#define LZ_MFLIMIT 12		/* No match starts this close to the end. */
+#define LZ_MAXOFF 65535
+
+static uint32_t read32 (const byte_t *p) {
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static uint32_t lz_hash (uint32_t v) {
+  return (v * 2654435761u) >> (32 - LZ_HASHLOG);
+}
+
+/* Length byte run of a token nibble overflow. */
+static byte_t * lz_putlen (byte_t *op, size_t len) {
+  while( len >= 255 ) {
+    *op++ = 255;
+    len -= 255;
+  }
+  *op++ = (byte_t) len;
+  return op;
+}
+
+size_t dtp_lz_compress (const byte_t *src, size_t n, byte_t *dst, size_t cap) {
+  uint32_t table[1 << LZ_HASHLOG];
+  const byte_t *ip = src, *anchor = src, *iend = src + n;
+  const byte_t *mflimit = iend - LZ_MFLIMIT, *matchlimit = iend - LZ_LASTLITERALS;
+  byte_t *op = dst, *oend = dst + cap;
+
+  if( n > LZ_MFLIMIT ) {
+    memset(table, 0, sizeof(table));
+    ip++;
+    while( ip < mflimit ) {
+      uint32_t h = lz_hash(read32(ip));
+      const byte_t *ref = src + table[h];
+      table[h] = (uint32_t) (ip - src);
+      if( ref >= ip || ip - ref > LZ_MAXOFF || read32(ref) != read32(ip) ) {
+	ip += 1 + ((ip - anchor) >> 6); /* Skip faster through noise. */
+	continue;
+      }
+
+      while( ip > anchor && ref > src && ip[-1] == ref[-1] ) {
+	ip--;
+	ref--;
+      }
+      size_t len = LZ_MINMATCH;
+      while( ip + len < matchlimit && ip[len] == ref[len] )
+	len++;
+
+      size_t lit = ip - anchor;
+      if( (size_t) (oend - op) < 1 + lit + lit / 255 + 1 + 2 + len / 255 + 1 )
+	return 0;
+      byte_t *token = op++;
+      if( lit >= 15 ) {
+	*token = 15 << 4;
+	op = lz_putlen(op, lit - 15);
+      } else {
+	*token = (byte_t) (lit << 4);
+      }
+      memcpy(op, anchor, lit);
+      op += lit;
+
+      size_t off = ip - ref;
+      *op++ = (byte_t) off;
+      *op++ = (byte_t) (off >> 8);
+      size_t ml = len - LZ_MINMATCH;
+      if( ml >= 15 ) {
+	*token |= 15;
+	op = lz_putlen(op, ml - 15);
+      } else {
+	*token |= (byte_t) ml;
+      }
+
+      ip += len;
+      anchor = ip;
+      if( ip < mflimit )	/* Cheap extra entry for the next search. */
+	table[lz_hash(read32(ip - 2))] = (uint32_t) (ip - 2 - src);
+    }
+  }
+
+  size_t lit = iend - anchor;
+  if( (size_t) (oend - op) < 1 + lit + lit / 255 + 1 )
+    return 0;
+  byte_t *token = op++;
+  if( lit >= 15 ) {
+    *token = 15 << 4;
+    op = lz_putlen(op, lit - 15);
+  } else {
+    *token = (byte_t) (lit << 4);
+  }
+  memcpy(op, anchor, lit);
+  op += lit;
+  return op - dst;
+}
+
+int dtp_lz_decompress (const byte_t *src, size_t n, byte_t *dst, size_t rawlen) {
+  const byte_t *ip = src, *iend = src + n;
+  byte_t *op = dst, *oend = dst + rawlen;
+  while( ip < iend ) {
+    byte_t token = *ip++;
+    size_t lit = token >> 4;
+    if( lit == 15 ) {
+      byte_t b;
+      do {
+	if( ip >= iend )
+	  return -1;
+	b = *ip++;
+	lit += b;
+      } while( b == 255 );
+    }
+    if( lit > (size_t) (iend - ip) || lit > (size_t) (oend - op) )
+      return -1;
+    memcpy(op, ip, lit);
+    ip += lit;
+    op += lit;
+    if( ip == iend )
+      break;			/* Last sequence. */
+
+    if( iend - ip < 2 )
+      return -1;
+    size_t off = ip[0] | (ip[1] << 8);
+    ip += 2;
+    if( off == 0 || off > (size_t) (op - dst) )
+      return -1;
+    size_t ml = token & 15;
+    if( ml == 15 ) {
+      byte_t b;
+      do {
+	if( ip >= iend )
+	  return -1;
+	b = *ip++;
+	ml += b;
+      } while( b == 255 );
+    }
+    ml += LZ_MINMATCH;
+    if( ml > (size_t) (oend - op) )
+      return -1;
+    const byte_t *ref = op - off;
+    if( off >= ml ) {
+      memcpy(op, ref, ml);
+      op += ml;
+    } else {			/* Overlapping run. */
+      while( ml-- > 0 )
+	*op++ = *ref++;
+    }
+  }
+  return op == oend ? 0 : -1;
+}
+
+/* -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- */
+/* Gate stage. */
+
+struct dtp_zstate {
+  struct dtp_zstats st;
+  byte_t out[ZHDR + ZBOUND(ZBLK)];	/* Frame being queued. */
+
+  /* Adaptive switch, see compress.h. Guarded by outbuf_mtx. */
+  int on;
+  unsigned blocks;		/* In the current probe window. */
+  unsigned long long t0;	/* Window start. */
+  seq_t acked0;			/* gate->seqno at window start. */
+  unsigned long long raw, wire, ns; /* Compressed blocks of the window. */
+
+  /* Frame being reassembled, and its decoded bytes. Guarded by
+     inbuf_mtx. */
+  byte_t in[ZHDR + ZBOUND(ZBLK)];
+  size_t got;
+  byte_t dec[ZBLK];
+  size_t pos, len;
+};
+
+int z_setup (struct dtp_gate *gate) {
+  struct dtp_zstate *z = calloc(1, sizeof(struct dtp_zstate));
+  if( z == NULL )
+    return -1;
+  z->on = 1;
+  z->t0 = gate_now(gate);
+  z->acked0 = gate->seqno;
+  gate->z = z;
+  return 0;
+}
+
+void z_free (struct dtp_gate *gate) {
+  free(gate->z);
+  gate->z = NULL;
+}
+
+int dtp_compress_stats (struct dtp_gate *gate, struct dtp_zstats *st) {
+  struct dtp_zstate *z = gate->z;
+  if( z == NULL )
+    return -1;
+  pthread_mutex_lock(&(gate->outbuf_mtx));
+  pthread_mutex_lock(&(gate->inbuf_mtx));
+  *st = z->st;
+  st->active = z->on;
+  pthread_mutex_unlock(&(gate->inbuf_mtx));
+  pthread_mutex_unlock(&(gate->outbuf_mtx));
+  return 0;
+}
+
+/**
+   End of a probe window : keep compressing if the codec outruns
+   the link and the link carries more raw data compressed.
+   Caller holds outbuf_mtx.
+ */
+static void z_decide (struct dtp_gate *gate, struct dtp_zstate *z) {
+  unsigned long long now = gate_now(gate);
+  if( z->raw > 0 && now > z->t0 ) {
+    double link = (double) (seq_t) (gate->seqno - z->acked0) / (now - z->t0);
+    double ratio = z->wire > 0 ? (double) z->raw / z->wire : 1.0;
+    /* Simulated time does not move while computing. */
+    double codec = z->ns > 0 ? (double) z->raw / z->ns : 1e18;
+    z->on = ratio > 1.05 && codec > link;
+  }
+  z->blocks = 0;
+  z->t0 = now;
+  z->acked0 = gate->seqno;
+  z->raw = z->wire = z->ns = 0;
+}
+
+/**
+   Frame up to ZBLK bytes into z->out. Returns the frame length.
+   Caller holds outbuf_mtx.
+ */
+static size_t z_frame (struct dtp_gate *gate, struct dtp_zstate *z,
+		       const byte_t *src, size_t n) {
+  uint32_t hdr[2];
+  size_t clen = 0;
+  int probe = z->on || z->blocks % ZPROBE_OFF == 0;
+  if( probe && n > 64 ) {
+    unsigned long long t = gate_now(gate);
+    /* Only worth it if the block shrinks. */
+    clen = dtp_lz_compress(src, n, z->out + ZHDR, n - n / 32);
+    unsigned long long dt = gate_now(gate) - t;
+    z->raw += n;
+    z->wire += clen > 0 ? clen : n;
+    z->ns += dt;
+    z->st.ns_comp += dt;
+  }
+  if( clen == 0 ) {
+    memcpy(z->out + ZHDR, src, n);
+    z->st.stored_out++;
+  }
+  hdr[0] = n;
+  hdr[1] = clen;		/* 0 : stored. */
+  memcpy(z->out, hdr, ZHDR);
+
+  size_t flen = ZHDR + (clen > 0 ? clen : n);
+  z->st.raw_out += n;
+  z->st.wire_out += flen;
+  z->st.blocks_out++;
+  if( ++z->blocks >= ZPROBE )
+    z_decide(gate, z);
+  return flen;
+}
+
+/* Packets needed by the frame of an n byte block, at worst. */
+static size_t z_pkts (size_t n) {
+  return (ZHDR + ZBOUND(n) + PAYLOAD - 1) / PAYLOAD;
+}
+
+int z_send (struct dtp_gate *gate, const void *data, size_t len) {
+  struct dtp_zstate *z = gate->z;
+  const byte_t *beg = (const byte_t *) data, *end = beg + len;
+  pthread_mutex_lock(&(gate->outbuf_mtx));
+  while( beg != end ) {
+    size_t n = end - beg < ZBLK ? end - beg : ZBLK;
+    size_t flen = z_frame(gate, z, beg, n);
+    const byte_t *fb = z->out, *fe = z->out + flen;
+    while( fb != fe ) {
+      while( gate->obufsize >= gate->lim )
+	gate_wait(gate, &(gate->outbuf_var), &(gate->outbuf_mtx));
+      fb += gate_push(gate, fb, fe);
+      gate_wake(gate, &(gate->outbuf_var));
+    }
+    beg += n;
+  }
+  pthread_mutex_unlock(&(gate->outbuf_mtx));
+  return 0;
+}
+
+/* Largest block whose frame fits in free packets, at worst. */
+static size_t z_fit (size_t free) {
+  size_t room = free * PAYLOAD;
+  if( room <= ZHDR + 16 )
+    return 0;
+  size_t n = (room - ZHDR - 16) / 256 * 255;
+  return n < ZBLK ? n : ZBLK;
+}
+
+/**
+   Takes whole frames only, so that no frame is left half queued. A
+   first block that does not fit is cut to the room left : small
+   windows never have room for a whole one, and dtp_events reports
+   the gate writable with any slot free.
+ */
+ssize_t z_try_send (struct dtp_gate *gate, const void *data, size_t len) {
+  struct dtp_zstate *z = gate->z;
+  const byte_t *beg = (const byte_t *) data, *end = beg + len;
+  pthread_mutex_lock(&(gate->outbuf_mtx));
+  while( beg != end ) {
+    size_t n = end - beg < ZBLK ? end - beg : ZBLK;
+    if( gate->obufsize + z_pkts(n) > gate->lim ) {
+      size_t fit = gate->obufsize < gate->lim ?
+	z_fit(gate->lim - gate->obufsize) : 0;
+      if( beg != (const byte_t *) data || fit == 0 )
+	break;
+      n = n < fit ? n : fit;
+    }
+    size_t flen = z_frame(gate, z, beg, n);
+    const byte_t *fb = z->out, *fe = z->out + flen;
+    while( fb != fe )
+      fb += gate_push(gate, fb, fe);
+    beg += n;
+  }
+  if( beg == (const byte_t *) data && len > 0 ) {
+    gate->wrarm = 1;
+    pthread_mutex_unlock(&(gate->outbuf_mtx));
+    errno = EAGAIN;
+    return -1;
+  }
+  gate_wake(gate, &(gate->outbuf_var));
+  pthread_mutex_unlock(&(gate->outbuf_mtx));
+  return beg - (const byte_t *) data;
+}
+
+/* Decode the complete frame in z->in. Caller holds inbuf_mtx. */
+static int z_decode (struct dtp_gate *gate, struct dtp_zstate *z) {
+  uint32_t hdr[2];
+  memcpy(hdr, z->in, ZHDR);
+  int stat = 0;
+  if( hdr[1] == 0 ) {
+    memcpy(z->dec, z->in + ZHDR, hdr[0]);
+  } else {
+    unsigned long long t = gate_now(gate);
+    stat = dtp_lz_decompress(z->in + ZHDR, hdr[1], z->dec, hdr[0]);
+    z->st.ns_decomp += gate_now(gate) - t;
+  }
+  z->pos = 0;
+  z->len = stat == 0 ? hdr[0] : 0;
+  z->got = 0;
+  z->st.raw_in += z->len;
+  z->st.wire_in += ZHDR + (hdr[1] > 0 ? hdr[1] : hdr[0]);
+  z->st.blocks_in++;
+  return stat;
+}
+
+ssize_t z_recv (struct dtp_gate *gate, void *data, size_t maxsize, int block) {
+  struct dtp_zstate *z = gate->z;
+  pthread_mutex_lock(&(gate->inbuf_mtx));
+  while( z->pos == z->len ) {
+    if( gate->ibufsize == 0 ) {
+      if( gate->reset ) {	/* The sender gave up on us. */
+	pthread_mutex_unlock(&(gate->inbuf_mtx));
+	errno = EPIPE;
+	return -1;
+      }
+      if( !block ) {
+	gate->rdarm = 1;
+	pthread_mutex_unlock(&(gate->inbuf_mtx));
+	errno = EAGAIN;
+	return -1;
+      }
+      gate_wait(gate, &(gate->inbuf_var), &(gate->inbuf_mtx));
+      continue;
+    }
+
+    size_t want = ZHDR - z->got;
+    if( z->got >= ZHDR ) {
+      uint32_t hdr[2];
+      memcpy(hdr, z->in, ZHDR);
+      want = ZHDR + (hdr[1] > 0 ? hdr[1] : hdr[0]) - z->got;
+    }
+    size_t n = gate_pull(gate, z->in + z->got, want);
+    if( n == 0 ) {		/* Only a FIN was left : end of stream. */
+      pthread_mutex_unlock(&(gate->inbuf_mtx));
+      return 0;
+    }
+    z->got += n;
+
+    if( z->got == ZHDR ) {
+      uint32_t hdr[2];
+      memcpy(hdr, z->in, ZHDR);
+      if( hdr[0] > ZBLK || hdr[1] > ZBOUND(hdr[0]) ||
+	  (hdr[1] == 0 && hdr[0] == 0) )
+	goto corrupt;
+    } else if( z->got > ZHDR && n == want ) {
+      if( z_decode(gate, z) != 0 )
+	goto corrupt;
+    }
+  }
+
+  size_t n = z->len - z->pos < maxsize ? z->len - z->pos : maxsize;
+  memcpy(data, z->dec + z->pos, n);
+  z->pos += n;
+  pthread_mutex_unlock(&(gate->inbuf_mtx));
+  return n;
+
+ corrupt:
+  pthread_mutex_unlock(&(gate->inbuf_mtx));
+  errno = EBADMSG;
+  return -1;
+}
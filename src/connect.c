@@ -1,59 +1,233 @@
 #include "gate.h"
 #include "packet.h"
+#include "transport.h"
+#include "compress.h"
+#include "fec.h"
+#include "pool.h"
+#include "shm.h"
+#include "mcast.h"
 
 #include <arpa/inet.h>		/* inet_aton */
 
+#include <errno.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+
+#include <sys/eventfd.h>
+#include <sys/random.h>
+
+/* Sets up buffers and creates threads. The receiver takes early
+   first, if not NULL. */
+static int setup_gate (struct dtp_gate* gate, const packet_t *early) {
+  /* On shared memory, packets only carry the FIN exchange and
+     doorbells : small buffers, plain sockets. */
+  if( gate->shm != NULL ) {
+    gate->mxw = MXW_MIN;
+    gate->lim = MXW_MIN - 1;
+    gate->io = DTP_IO_SOCKET;
+  }
+
+  /* Room in the kernel for a full window : drops there are no
+     congestion, and cannot be told apart once they happen. */
+  gate->kcap = gate->mxw;
+  if( gate->shm == NULL && gate->socket >= 0 ) {
+    dtp_udp_buffers(gate->socket, gate->mxw, gate->sockbuf);
+    size_t slots = dtp_udp_slots(gate->socket);
+    if( slots < gate->kcap )	/* Capped by net.core.rmem_max. */
+      gate->kcap = slots > MXW_MIN ? slots : MXW_MIN;
+  }
+  gate->kdrops = gate->kseen = 0;
+  memset(&(gate->drops), 0, sizeof(gate->drops));
 
-/* Sets up buffers and creates threads. */
-int setup_gate (struct dtp_gate* gate) {
   /* Initialize buffers. */
-  gate->inbuf  = calloc(MXW, sizeof(packet_t));
-  gate->outbuf = calloc(MXW, sizeof(packet_t));
-  gate->rcvf   = calloc(MXW, sizeof(byte_t));
-  if( gate->inbuf == NULL ||
-      gate->outbuf == NULL ||
-      gate->rcvf == NULL )
+  if( pool_get(gate) != 0 )
     return -1;
   gate->sndsize = gate->obufsize = 0;
   gate->outbeg = gate->outsnd = gate->outend = 0;
   gate->inbeg = gate->inend = gate->ibufsize = 0;
   gate->WND = 1;		/* Initial window size. */
-  gate->SSTH = MXW >> 1;	/* Set initial ssthresh to MXW / 2 */
+  gate->SSTH = gate->mxw >> 1; /* Set initial ssthresh to mxw / 2 */
   gate->AXW = 0;		/* Auxiliary window size.
 				   Used to implement congestion avoidance. */
   gate->sndno = gate->seqno;	/* Sent sequence numbers. */
   gate->lstack = gate->ackno;	/* Last acknowledged sequence number. */
   gate->ackfr = 0;		/* Frequency of last acked sequence number. */
+  gate->dupthr = 3;		/* Triple DUPACK. */
+  gate->wshift = 0;		/* Window scale : wsz fits 16 bits. */
+  while( (gate->mxw >> gate->wshift) > 0xffff )
+    gate->wshift++;
   gate->byte_offset = 0;	/* Byte offset. */
+  gate->prbuf = NULL;		/* Priority queues, on first use. */
+  gate->prbeg = gate->prlen = 0;
+  gate->prarm = gate->finin = gate->reset = 0;
+  gate->prackno = 0;
+  gate->pradv = DTP_PRIO_PKTS;
+  gate->prout = NULL;
+  gate->early = NULL;
+  if( early != NULL &&
+      (gate->early = (packet_t *) malloc(sizeof(packet_t))) != NULL )
+    *(gate->early) = *early;
+  gate->pobeg = gate->posize = gate->posent = 0;
+  gate->poseqno = gate->posndno = 0;
+  gate->pocred = DTP_PRIO_PKTS;
+  gate->podup = 0;
+  gate->poopen = gate->poback = 0;
+  gate->rcvhi = gate->ackno;
+  gate->ovfl = 0;
+  gate->wadv = gate->mxw;
+  gate->rdarm = gate->wrarm = 0;
+  gate->cork = gate->tailopen = 0;
+  gate->smallno = gate->seqno;
+  gate->rtofired = 0;
+
+  /* Readiness descriptor for dtp_try_* users. */
+  gate->evfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if( gate->evfd < 0 )
+    return -1;
+
+  /* Optional io_uring datagram path, sockets if unavailable. */
+  if( gate->io != DTP_IO_SOCKET && dtp_uring_attach(gate) != 0 )
+    gate->io = DTP_IO_SOCKET;
 
   int stat;
   /* Initialize mutexes and semaphores. */
   stat = pthread_mutex_init(&(gate->outbuf_mtx), NULL);
   if( stat != 0 )
     return stat;
-  stat = pthread_cond_init(&(gate->outbuf_var), NULL);
+  pthread_condattr_t attr;	/* Waits use the monotonic clock. */
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  stat = pthread_cond_init(&(gate->outbuf_var), &attr);
   if( stat != 0 )
     return stat;
   stat = pthread_mutex_init(&(gate->inbuf_mtx), NULL);
   if( stat != 0 )
     return stat;
-  stat = pthread_cond_init(&(gate->inbuf_var), NULL);
-  if( stat != 0 )
-    return stat;
-  stat = pthread_cond_init(&(gate->tm_cv), NULL);
+  stat = pthread_cond_init(&(gate->inbuf_var), &attr);
   if( stat != 0 )
     return stat;
+  pthread_condattr_destroy(&attr);
+  /* Compression stage, if agreed on. */
+  if( (gate->feat & FEAT_LZ) && z_setup(gate) != 0 )
+    return -1;
+  /* Parity packets, likewise. */
+  if( (gate->feat & FEAT_FEC) && fec_setup(gate) != 0 )
+    return -1;
+  /* Retransmission timer. */
+  struct dtp_wheel *wheel = gate_wheel(gate);
+  if( wheel == NULL )
+    return -1;
+  dtp_timer_init(&(gate->rto), wheel, rto_expire);
+  dtp_timer_init(&(gate->prto), wheel, prio_expire);
+  const struct dtp_core *core = gate_core(gate);
   /* Initialize sender daemon. */
-  stat = pthread_create(&(gate->snd_dmn), NULL, &sender_daemon, gate);
+  stat = gate_spawn(gate, &(gate->snd_dmn), core->snd);
   if( stat != 0 )
     return stat;
   /* Initialize receiver deamon. */
-  stat = pthread_create(&(gate->rcv_dmn), NULL, receiver_daemon, gate);
+  stat = gate_spawn(gate, &(gate->rcv_dmn), core->rcv);
   return stat;
 }
 
+/**
+   Window both ends can take : the smaller one, and one the basic
+   header can address unless both speak the wide one.
+ */
+static size_t agree_window (unsigned peer, size_t self, unsigned feat) {
+  size_t mxw = peer;
+  if( mxw < MXW_MIN || mxw > MXW_MAX || (mxw & (mxw - 1)) != 0 )
+    mxw = MXW;			/* Older peers, default buffers. */
+  if( mxw > self )
+    mxw = self;
+  if( !(feat & FEAT_WIDE) && mxw > MXW_BASIC )
+    mxw = MXW_BASIC;
+  return mxw;
+}
+
+/* -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- */
+/* Handshake cookies. */
+
+#define COOKIE_SLOT (32 * RTO)	/* A cookie holds for one or two. */
+
+static uint64_t cookie_key[2];	/* Per process. */
+static pthread_once_t cookie_once = PTHREAD_ONCE_INIT;
+
+static void cookie_init (void) {
+  if( getrandom(cookie_key, sizeof(cookie_key), 0) != sizeof(cookie_key) ) {
+    struct timespec t;		/* No entropy yet : better than none. */
+    clock_gettime(CLOCK_REALTIME, &t);
+    cookie_key[0] = ((uint64_t) t.tv_sec << 32) ^ t.tv_nsec;
+    cookie_key[1] = ((uint64_t) getpid() << 32) ^ (uintptr_t) &t;
+  }
+}
+
+#define ROTL(x, b) (((x) << (b)) | ((x) >> (64 - (b))))
+#define SIPROUND do {						\
+    v0 += v1; v1 = ROTL(v1, 13); v1 ^= v0; v0 = ROTL(v0, 32);	\
+    v2 += v3; v3 = ROTL(v3, 16); v3 ^= v2;			\
+    v0 += v3; v3 = ROTL(v3, 21); v3 ^= v0;			\
+    v2 += v1; v1 = ROTL(v1, 17); v1 ^= v2; v2 = ROTL(v2, 32);	\
+  } while( 0 )
+
+/* SipHash-2-4 of two words under the process key. */
+static uint64_t keyed_hash (uint64_t m0, uint64_t m1) {
+  pthread_once(&cookie_once, cookie_init);
+  uint64_t v0 = cookie_key[0] ^ 0x736f6d6570736575ull;
+  uint64_t v1 = cookie_key[1] ^ 0x646f72616e646f6dull;
+  uint64_t v2 = cookie_key[0] ^ 0x6c7967656e657261ull;
+  uint64_t v3 = cookie_key[1] ^ 0x7465646279746573ull;
+  uint64_t m[3] = { m0, m1, 16ull << 56 };
+  int i;
+  for( i = 0; i < 3; i++ ) {
+    v3 ^= m[i];
+    SIPROUND; SIPROUND;
+    v0 ^= m[i];
+  }
+  v2 ^= 0xff;
+  SIPROUND; SIPROUND; SIPROUND; SIPROUND;
+  return v0 ^ v1 ^ v2 ^ v3;
+}
+
+static uint64_t addr_word (const struct sockaddr_in *addr) {
+  return (uint64_t) addr->sin_addr.s_addr << 16 | addr->sin_port;
+}
+
+/* The server's ISN for a client's, in the given time slot. */
+static uint32_t cookie (const struct sockaddr_in *addr, uint32_t isn,
+			unsigned long long slot) {
+  return keyed_hash(addr_word(addr), (uint64_t) slot << 32 | isn);
+}
+
+/* Nonzero if a cookie came from this gate's clock, now or a slot ago. */
+static int cookie_valid (struct dtp_gate *gate,
+			 const struct sockaddr_in *addr,
+			 uint32_t isn, uint32_t ck) {
+  unsigned long long slot = gate_now(gate) / COOKIE_SLOT;
+  return ck == cookie(addr, isn, slot) ||
+    (slot > 0 && ck == cookie(addr, isn, slot - 1));
+}
+
+/* The first client handshake_backlog kept that still waits, as the
+   ACK it sent. */
+static int backlog_pop (struct dtp_gate *gate, packet_t *pkt) {
+  while( gate->nbacklog > 0 ) {
+    struct dtp_pending p = gate->backlog[0];
+    gate->nbacklog--;
+    memmove(gate->backlog, gate->backlog + 1,
+	    gate->nbacklog * sizeof(p));
+    if( gate_now(gate) - p.at >= ACK_WAIT )
+      continue;			/* Gave up on us. */
+    gate->addr = p.addr;
+    make_pkt(pkt, p.isn, p.ck, 0, sizeof(p.syn), 0, ACK, p.syn);
+    return 1;
+  }
+  return 0;
+}
+
+/* -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- */
+
 int dtp_listen (dtp_server * server, char *hostname, port_t *port_no) {
 
   /* Check gate status. */
@@ -61,77 +235,100 @@ int dtp_listen (dtp_server * server, char *hostname, port_t *port_no) {
     return 1;
 
   int stat;
-
-  /* Timeout value. */
-  struct timeval timeout;
+  unsigned syn[2];		/* Features both ends support, window. */
+  byte_t reply[sizeof(syn) + sizeof(struct shm_offer)];
+  size_t rlen;
+  struct shm_offer offer;
+  struct sockaddr_in shm_to;	/* Client the shared memory is for, */
+  unsigned long long shm_at = 0; /* and since when. */
+  uint32_t isn = 0, ck = 0;
+
+  memset(&shm_to, 0, sizeof(shm_to));
+  /* Clear timeout on socket. */
+  if( gate_timeout(server, 0) < 0 )
+    goto fail;
 
   packet_t synpack;
   while ( 1 ) {			/* Connection not established. */
-    /* Clear timeout on socket. */
-    timeout.tv_sec = 0; timeout.tv_usec = 0;
-    stat = setsockopt(server->socket, SOL_SOCKET, SO_RCVTIMEO,
-		      &timeout, sizeof(struct timeval));
-    if( stat < 0 )
-      return -1;
-
-    stat = detect_pkt(server, &synpack);
+    stat = backlog_pop(server, &synpack) ? RCV_OK :
+      detect_pkt(server, &synpack);
+    if( stat == RCV_BADPKT )
+      continue;
     if( stat != RCV_OK )
-      return -1;		/* Non timeout error. */
-
-    if( synpack.flags & SYN ) {
-      server->ackno = synpack.seq;
-    } else {
-      continue;			/* Ignore non SYN packet. */
+      goto fail;		/* Non timeout error. */
+
+    if( (synpack.flags & (SYN|ACK)) == ACK ) {
+      /* The client's ISN, and ours, back : the ACK repeats what the
+	 client settled on, and the cookie vouches for the rest. */
+      isn = synpack.seq;
+      ck = synpack.ack;
+      if( synpack.len < sizeof(syn) )
+	continue;
+      memcpy(syn, synpack.data, sizeof(syn));
+      if( !cookie_valid(server, &(server->addr), isn, ck) )
+	continue;		/* Stale or forged. */
+      syn[0] &= server->feat;
+      if( syn[0] & FEAT_SHM ) {
+	if( server->shm == NULL ||
+	    validate_address(&shm_to, &(server->addr)) != 0 )
+	  continue;		/* Offered to another client, or expired. */
+	syn[0] &= ~(FEAT_LZ | FEAT_FEC);
+      }
+      syn[1] = agree_window(syn[1], server->mxw, syn[0]);
+      break;
     }
+    if( !(synpack.flags & SYN) )
+      continue;			/* Ignore non SYN packet. */
 
-    /* Initial sequence number. */
-    srand(time(NULL) ^
-	  (server->self).sin_addr.s_addr ^
-	  (server->self).sin_port);
-    server->seqno = rand();
-
-    make_pkt(&synpack, server->seqno, server->ackno, 0, 0, 0, SYN|ACK, NULL);
-    if( send_pkt(server, &synpack) < 0 )
-      continue;			/* Failure. */
-
-    /* Set 1 second timeout. */
-    timeout.tv_sec = 1; timeout.tv_usec = 0;
-    stat = setsockopt(server->socket, SOL_SOCKET, SO_RCVTIMEO,
-		      &timeout, sizeof(struct timeval));
-    if( stat < 0 )
-      return -1;
-
-    stat = recv_pkt(server, &synpack);
-    if( stat == RCV_TIMEOUT || stat == RCV_WRHOST ) {
-      continue;			/* Reset connection. */
-      /* If two clients simultaneuosly try to send SYN requests
-	 to DTP server, neither of them will get a connection. */
-    } else if( stat != RCV_OK ) {
-      return -1;		/* Other error. */
+    isn = synpack.seq;
+    syn[0] = syn[1] = 0;	/* Older clients offer nothing. */
+    memcpy(syn, synpack.data,
+	   synpack.len < sizeof(syn) ? synpack.len : sizeof(syn));
+    syn[0] &= server->feat;
+    syn[1] = agree_window(syn[1], server->mxw, syn[0]);
+
+    /* Shared memory : the client's boot id follows the words. Only
+       ever one offer out : it stands until its client ACKs or its
+       cookies expire, other local clients meanwhile get plain UDP. */
+    rlen = sizeof(syn);
+    if( syn[0] & FEAT_SHM ) {
+      int again = server->shm != NULL &&
+	validate_address(&shm_to, &(server->addr)) == 0;
+      if( server->shm != NULL && !again &&
+	  gate_now(server) - shm_at >= 2 * COOKIE_SLOT )
+	shm_free(server);	/* Its client never came. */
+      if( (server->shm == NULL || again) && synpack.len > sizeof(syn) &&
+	  shm_local(synpack.data + sizeof(syn), synpack.len - sizeof(syn)) &&
+	  (again || shm_create(server, syn[1], &offer) == 0) ) {
+	syn[0] &= ~(FEAT_LZ | FEAT_FEC);
+	memcpy(reply + rlen, &offer, sizeof(offer));
+	rlen += sizeof(offer);
+	if( !again )
+	  shm_at = gate_now(server);
+	shm_to = server->addr;
+      } else
+	syn[0] &= ~FEAT_SHM;
     }
+    memcpy(reply, syn, sizeof(syn));
 
-    if( synpack.flags & ACK ) {
-      if( synpack.ack != server->seqno )
-	continue;		/* Ignore. */
-      break;
-    }
+    /* Our initial sequence number is the cookie. */
+    ck = cookie(&(server->addr), isn, gate_now(server) / COOKIE_SLOT);
+    make_pkt(&synpack, ck, isn, 0, rlen, 0, SYN|ACK, reply);
+    send_pkt(server, &synpack);	/* Lost : the client sends again. */
   }
 
-  /* Clear timeout on socket. */
-  timeout.tv_sec = 0; timeout.tv_usec = 0;
-
-  stat = setsockopt(server->socket, SOL_SOCKET, SO_RCVTIMEO,
-		    &timeout, sizeof(struct timeval));
-  if( stat < 0 )
-    return -1;
-
-  stat = setsockopt(server->socket, SOL_SOCKET, SO_SNDTIMEO,
-		    &timeout, sizeof(struct timeval));
-  if( stat < 0 )
-    return -1;
+  /* An offer not taken : its client could not map it, or it was for
+     another client, which is refused on its ACK. */
+  if( !(syn[0] & FEAT_SHM) )
+    shm_free(server);
 
   /* Set connection status. */
   server->status = CONN;
+  server->feat = syn[0];
+  server->mxw = syn[1];
+  server->lim = syn[1] - 1;
+  server->seqno = ck;
+  server->ackno = isn;
 
   char * ret = inet_ntoa((server->addr).sin_addr);
   ssize_t buflen = 0;
@@ -142,8 +339,60 @@ int dtp_listen (dtp_server * server, char *hostname, port_t *port_no) {
 
   *port_no = ntohs((server->addr).sin_port);
 
-  /* Set up gate resources. */
-  return setup_gate(server);
+  /* Set up gate resources, then tell the client the gate is its. */
+  if( setup_gate(server, NULL) != 0 )
+    return -1;
+  handshake_done(server);
+  return 0;
+
+ fail:
+  shm_free(server);		/* Offered to a client that never came. */
+  return -1;
+}
+
+void handshake_backlog (struct dtp_gate *gate, const packet_t *pkt,
+			const struct sockaddr_in *from) {
+  unsigned syn[2];
+  if( (pkt->flags & (SYN|ACK)) != ACK || pkt->len < sizeof(syn) ||
+      !cookie_valid(gate, from, pkt->seq, pkt->ack) )
+    return;
+  memcpy(syn, pkt->data, sizeof(syn));
+
+  /* Its ACK again keeps its turn. Those that gave up make room.
+     Shared memory was offered by this gate, and goes with its
+     connection. */
+  unsigned long long now = gate_now(gate);
+  int i, n = 0;
+  for( i = 0; i < gate->nbacklog; i++ )
+    if( now - gate->backlog[i].at < ACK_WAIT )
+      gate->backlog[n++] = gate->backlog[i];
+  gate->nbacklog = n;
+  for( i = 0; i < n; i++ )
+    if( validate_address(&(gate->backlog[i].addr), from) == 0 )
+      break;
+  if( i == DTP_BACKLOG || (syn[0] & FEAT_SHM) ) {
+    packet_t rst;
+    make_pkt(&rst, 0, 0, 0, 0, 0, RST, NULL);
+    send_pkt_to(gate, &rst, from);
+    return;
+  }
+  if( i == n )
+    gate->nbacklog++;
+  struct dtp_pending *p = gate->backlog + i;
+  p->addr = *from;
+  p->isn = pkt->seq;
+  p->ck = pkt->ack;
+  memcpy(p->syn, syn, sizeof(syn));
+  p->at = now;
+}
+
+/* The ACK returns both ISNs and tells the server what this end
+   settled on : all it needs to set up its side. */
+int handshake_ack (struct dtp_gate *client) {
+  unsigned syn[2] = { client->feat, client->mxw };
+  packet_t ack;
+  make_pkt(&ack, client->seqno, client->ackno, 0, sizeof(syn), 0, ACK, syn);
+  return send_pkt(client, &ack);
 }
 
 int dtp_connect (dtp_client* client) {
@@ -152,43 +401,98 @@ int dtp_connect (dtp_client* client) {
   if( client->status != IDLE )
     return 1;
 
-  int stat;
-
-  /* Set 1 second timeout on socket. */
-  struct timeval timeout;
-  timeout.tv_sec = 1; timeout.tv_usec = 0;
-
-  stat = setsockopt(client->socket, SOL_SOCKET, SO_SNDTIMEO,
-		    &timeout, sizeof(struct timeval));
-  if( stat < 0 )
-    return -1;
-
-  stat = setsockopt(client->socket, SOL_SOCKET, SO_RCVTIMEO,
-		    &timeout, sizeof(struct timeval));
-  if( stat < 0 )
-    return -1;
-
   /* Initial sequence number. */
-  srand(time(NULL));
-  client->seqno = rand();
+  client->seqno = (uint32_t)
+    keyed_hash(addr_word(&(client->addr)), gate_now(client));
 
   packet_t synpack;
-  make_pkt(&synpack, client->seqno, 0, 0, 0, 0, SYN, NULL);
-
-  if( send_pkt(client, &synpack) < 0 )
-    return -1;
+  unsigned syn[2] = { client->feat, client->mxw };
+  byte_t hello[sizeof(syn) + SHM_BOOTID];
+  size_t hlen = sizeof(syn);
+  if( (client->feat & FEAT_SHM) && shm_bootid((char *) hello + hlen) == 0 )
+    hlen += SHM_BOOTID;		/* Lets the server tell it is local. */
+  memcpy(hello, syn, sizeof(syn));
+
+  /* SYN until a SYN|ACK for it comes, backing off. */
+  long rto = SYN_RTO / 1000;
+  int tries = 0, stat;
+  while( 1 ) {
+    if( tries++ == SYN_TRIES ) {
+      errno = ETIMEDOUT;
+      return -1;
+    }
+    make_pkt(&synpack, client->seqno, 0, 0, hlen, 0, SYN, hello);
+    if( send_pkt(client, &synpack) < 0 ||
+	gate_timeout(client, rto) < 0 )
+      return -1;
+    do
+      stat = recv_pkt(client, &synpack);
+    while( stat == RCV_WRHOST || stat == RCV_BADPKT ||
+	   (stat == RCV_OK && ((synpack.flags & (SYN|ACK)) != (SYN|ACK) ||
+			       (uint32_t) synpack.ack != client->seqno)) );
+    if( stat == RCV_OK )
+      break;
+    if( stat != RCV_TIMEOUT )
+      return -1;
+    rto <<= 1;
+  }
 
-  if( recv_pkt(client, &synpack) != RCV_OK || !(synpack.flags & ACK) )
-    return -1;
+  client->ackno = synpack.seq;	/* Read initial sequence number. */
 
-  if( client->seqno != synpack.ack ) /* Validate sent sequence number. */
-    return -1;			     /* Abort connection. */
+  syn[0] = syn[1] = 0;		/* What the server agreed to. */
+  memcpy(syn, synpack.data,
+	 synpack.len < sizeof(syn) ? synpack.len : sizeof(syn));
+  client->feat &= syn[0];
+  client->mxw = agree_window(syn[1], client->mxw, client->feat);
+  client->lim = client->mxw - 1;
+
+  if( client->feat & FEAT_SHM ) {
+    struct shm_offer offer;
+    if( synpack.len < sizeof(syn) + sizeof(offer) )
+      client->feat &= ~FEAT_SHM;
+    else {
+      memcpy(&offer, synpack.data + sizeof(syn), sizeof(offer));
+      if( shm_attach(client, &offer) != 0 )
+	client->feat &= ~FEAT_SHM; /* Not ours to open : stay on UDP. */
+    }
+  }
 
-  client->ackno = synpack.seq;	/* Read initial sequence number. */
+  /* A multicast sender : the data comes on its group. */
+  if( client->feat & FEAT_MCAST ) {
+    struct dtp_mcast_group group;
+    if( synpack.len < sizeof(syn) + sizeof(group) )
+      return -1;
+    memcpy(&group, synpack.data + sizeof(syn), sizeof(group));
+    if( dtp_mcast_attach(client, &group) != 0 )
+      return -1;
+  }
 
-  make_pkt(&synpack, 0, client->ackno, 0, 0, 0, ACK, NULL);
-  if( send_pkt(client, &synpack) < 0 )
-    return -1;
+  /* ACK until the server shows it took the gate : anything from it
+     but the SYN|ACK again. An RST : it is taken, and keeps no more
+     clients. */
+  rto = SYN_RTO / 1000;
+  tries = 0;
+  while( 1 ) {
+    if( tries++ == SYN_TRIES ) {
+      errno = ETIMEDOUT;
+      goto refused;
+    }
+    if( handshake_ack(client) < 0 || gate_timeout(client, rto) < 0 )
+      goto refused;
+    do
+      stat = recv_pkt(client, &synpack);
+    while( stat == RCV_WRHOST || stat == RCV_BADPKT );
+    if( stat == RCV_OK && (synpack.flags & RST) ) {
+      errno = ECONNREFUSED;
+      goto refused;
+    }
+    if( stat == RCV_OK && !(synpack.flags & SYN) )
+      break;
+    if( stat != RCV_OK && stat != RCV_TIMEOUT )
+      goto refused;
+    if( stat == RCV_TIMEOUT )
+      rto <<= 1;
+  }
 
   /* Set connection status. */
   client->status = CONN;
@@ -200,30 +504,31 @@ int dtp_connect (dtp_client* client) {
 	      &socklen);
 
   /* Clear timeout. */
-  timeout.tv_sec = 0; timeout.tv_usec = 0;
-
-  stat = setsockopt(client->socket, SOL_SOCKET, SO_SNDTIMEO,
-		    &timeout, sizeof(struct timeval));
-  if( stat < 0 )
+  if( gate_timeout(client, 0) < 0 )
     return -1;
 
-  stat = setsockopt(client->socket, SOL_SOCKET, SO_RCVTIMEO,
-		    &timeout, sizeof(struct timeval));
-  if( stat < 0 )
-    return -1;
+  /* Set up gate resources. Data that came instead of the server's
+     answer goes to the receiver first. */
+  return setup_gate(client, (synpack.flags & ACK) ? NULL : &synpack);
 
-  /* Set up gate resources. */
-  return setup_gate(client);
+ refused:
+  shm_free(client);
+  gate_release(client);
+  return -1;
 }
 
 /* Frees buffers and closes connection. */
 int close_dtp_gate (struct dtp_gate * gate) {
+  if( gate->shm != NULL && (gate->status == CONN || gate->status == FINR) )
+    shm_close(gate);		/* Data so far is on the rings. */
   if( gate->status == CONN || gate->status == FINR ) {
     pthread_mutex_lock(&(gate->outbuf_mtx));
     seq_t finno = gate->sndno;
 
-    while( gate->obufsize >= LIM )
-      pthread_cond_wait(&(gate->outbuf_var), &(gate->outbuf_mtx));
+    /* Priority data goes before the FIN, or a reader taking the FIN
+       for the end of it all would miss some. */
+    while( gate->obufsize >= gate->lim || gate->posize > 0 )
+      gate_wait(gate, &(gate->outbuf_var), &(gate->outbuf_mtx));
 
     make_pkt((gate->outbuf)+(gate->outend),
 	     finno,
@@ -233,43 +538,70 @@ int close_dtp_gate (struct dtp_gate * gate) {
 	     0,
 	     FIN,
 	     NULL);
-    gate->outend = (gate->outend + 1)%MXW;
+    gate->outend = (gate->outend + 1) & gate->lim;
     gate->obufsize++;
-    pthread_cond_broadcast(&(gate->outbuf_var));
+    gate->tailopen = 0;
+    gate_wake(gate, &(gate->outbuf_var));
 
     if( gate->status == CONN ) { /* If connected, wait for acket. */
-      while( gate->seqno != finno )
-	pthread_cond_wait(&(gate->outbuf_var), &(gate->outbuf_mtx));
+      /* The FIN takes no sequence space : also wait for it to be on
+	 the wire, or the peer's FIN could tear us down before. */
+      while( gate->seqno != finno || gate->outsnd != gate->outend )
+	gate_wait(gate, &(gate->outbuf_var), &(gate->outbuf_mtx));
     } else {
+      /* Peer is waiting for this FIN, don't stop the sender before
+	 it has been transmitted. */
+      while( gate->outsnd != gate->outend )
+	gate_wait(gate, &(gate->outbuf_var), &(gate->outbuf_mtx));
       gate->status = CLSD;
     }
 
     pthread_mutex_unlock(&(gate->outbuf_mtx));
-
-    if( gate->status == CONN )
-      gate->status = FINS;	/* FIN sent */
   }
 
+  /* The receiver moves status under inbuf_mtx : a FIN of the peer
+     may have come in meanwhile. */
   pthread_mutex_lock(&(gate->inbuf_mtx));
+  if( gate->status == CONN )
+    gate->status = FINS;	/* FIN sent */
   while( gate->status == FINS )
-    pthread_cond_wait(&(gate->inbuf_var), &(gate->inbuf_mtx));
+    gate_wait(gate, &(gate->inbuf_var), &(gate->inbuf_mtx));
   pthread_mutex_unlock(&(gate->inbuf_mtx));
 
   /* Stop daemons. Where were they hiding? */
-  pthread_cancel(gate->snd_dmn);
-  pthread_cancel(gate->rcv_dmn);
-
-  /* Destroy buffers. */
-  free(gate->inbuf);
-  free(gate->outbuf);
-  free(gate->rcvf);
+  /* The receiver goes first : it takes outbuf_mtx on every ACK, which
+     a sender cancelled inside pthread_cond_wait would keep locked.
+     So does the RTO callback; status is CLSD by now, so once the
+     receiver is gone nothing re-arms the timer. */
+  gate_stop(gate, gate->rcv_dmn);
+  pthread_mutex_lock(&(gate->outbuf_mtx));
+  pthread_mutex_unlock(&(gate->outbuf_mtx)); /* Sender sees CLSD. */
+  dtp_timer_del_sync(&(gate->rto));
+  dtp_timer_del_sync(&(gate->prto));
+  gate_stop(gate, gate->snd_dmn);
+  gate_release(gate);
+  if( gate->z != NULL )
+    z_free(gate);
+  if( gate->fec != NULL )
+    fec_free(gate);
+  shm_free(gate);
+
+  /* Return buffers to the pool. */
+  pool_put(gate);
+  free(gate->prbuf);
+  gate->prbuf = NULL;
+  free(gate->prout);
+  gate->prout = NULL;
+  free(gate->early);
+  gate->early = NULL;
+  close(gate->evfd);
+  gate->evfd = -1;
 
   /* Free mutexes / semaphores. */
   pthread_mutex_destroy(&(gate->outbuf_mtx));
   pthread_cond_destroy(&(gate->outbuf_var));
   pthread_mutex_destroy(&(gate->inbuf_mtx));
   pthread_cond_destroy(&(gate->inbuf_var));
-  pthread_cond_destroy(&(gate->tm_cv));
   gate->status = IDLE;
   return 0;
 }
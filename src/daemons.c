@@ -1,227 +1,275 @@
 #include "gate.h"
 #include "packet.h"
+#include "transport.h"
+#include "fec.h"
 
 #include <errno.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
 
-#ifdef DTP_DBG
-#include <stdio.h>
-#endif
+#include <sys/eventfd.h>
 
-/* Handles outgoing data packets. */
-void * sender_daemon (void * arg) {
-  struct dtp_gate* gate = (struct dtp_gate *) arg;
-  struct timespec timeout;
-  int stat;
-  while( 1 ) {
-    pthread_mutex_lock(&(gate->outbuf_mtx));
-    while( gate->sndsize ==
-	   (gate->WND < gate->obufsize ?
-	    gate->WND : gate->obufsize) ) {
-      if( gate->sndsize > 0 ) { /* Sender window is fully sent. */
-	gettimeofday(&(gate->ackstamp), NULL);
-	timeout.tv_nsec = gate->ackstamp.tv_usec * 1000;
-	timeout.tv_sec = gate->ackstamp.tv_sec + 1;
-	stat = pthread_cond_timedwait(&(gate->tm_cv),
-				      &(gate->outbuf_mtx),
-				      &timeout);
-	if(stat == ETIMEDOUT) {
 #ifdef DTP_DBG
-	  fprintf(stderr, "Timeout detected <%lu, %lu, %lu> (%lu/%lu) (%lu | %lu)\n",
-		  gate->outbeg, gate->outsnd, gate->outend,
-		  gate->sndsize, gate->obufsize,
-		  gate->WND, gate->SSTH);
-	  fflush(stderr);
+#include <stdio.h>
 #endif
-	  /* Trigger timeout. */
-	  gate->SSTH = (gate->SSTH + 1) >> 1; /* Halve ssthresh. */
-	  gate->WND = 1;		/* Set current window to 1 packet. */
-	  gate->AXW = 0;		/* Set auxiliary window to 0. */
-	  gate->outsnd = gate->outbeg;	/* Resend window. */
-	  gate->sndsize = 0;
-	  pthread_cond_broadcast(&(gate->outbuf_var));
-	}
-      } else {			/* Wait for next packet to be sent. */
-	pthread_cond_wait(&(gate->outbuf_var), &(gate->outbuf_mtx));
-      }
-    }
 
-#ifdef DTP_DBG
-    fprintf(stderr, "Sending outvar=<%lu, %lu, %lu> outsize=(%lu/%lu) outlim=(%lu|%lu) seq=%u\n",
-	    gate->outbeg, gate->outsnd, gate->outend,
-	    gate->sndsize, gate->obufsize,
-	    gate->WND, gate->SSTH, (gate->outbuf[gate->outsnd]).seq);
-    fflush(stderr);
-#endif
+/* Signal the readiness descriptor if a non blocking call is waiting. */
+static void notify (struct dtp_gate *gate, int *armed) {
+  *armed = 0;
+  eventfd_write(gate->evfd, 1);
+}
 
-    send_pkt(gate, (gate->outbuf) + (gate->outsnd));
-    gate->outsnd = (gate->outsnd + 1) % MXW;
+/* RTO expiry, on the timer wheel's worker. */
+void rto_expire (struct dtp_timer *t) {
+  struct dtp_gate *gate =
+    (struct dtp_gate *) ((byte_t *) t - offsetof(struct dtp_gate, rto));
+  pthread_mutex_lock(&(gate->outbuf_mtx));
+  /* Ignore a timer pushed back while this callback was starting. */
+  if( gate->sndsize > 0 && !dtp_timer_pending(t) ) {
+    gate->rtofired = 1;
+    gate_wake(gate, &(gate->outbuf_var));
+  }
+  pthread_mutex_unlock(&(gate->outbuf_mtx));
+}
 
-    gate->sndsize++;
+/* (Re)start the RTO. Caller holds outbuf_mtx. */
+static void rto_arm (struct dtp_gate *gate) {
+  if( gate->status != CLSD )	/* Being torn down. */
+    dtp_timer_mod(&(gate->rto), gate_now(gate) + RTO);
+}
 
-    pthread_cond_broadcast(&(gate->outbuf_var));
-    pthread_mutex_unlock(&(gate->outbuf_mtx));
+/* Priority packets in flight : go back over them. */
+void prio_expire (struct dtp_timer *t) {
+  struct dtp_gate *gate =
+    (struct dtp_gate *) ((byte_t *) t - offsetof(struct dtp_gate, prto));
+  pthread_mutex_lock(&(gate->outbuf_mtx));
+  if( gate->posent > 0 && !dtp_timer_pending(t) ) {
+    gate->posent = 0;
+    if( (PRIO_RTO << gate->poback) < RTO )
+      gate->poback++;
+    gate_wake(gate, &(gate->outbuf_var));
   }
-  pthread_exit(NULL);
+  pthread_mutex_unlock(&(gate->outbuf_mtx));
+}
+
+/* (Re)start the priority RTO. Caller holds outbuf_mtx. */
+static void prio_arm (struct dtp_gate *gate) {
+  if( gate->status != CLSD )
+    dtp_timer_mod(&(gate->prto), gate_now(gate) + (PRIO_RTO << gate->poback));
+}
+
+/* Free inbuf slots, no more than the socket takes in one go. */
+static size_t rcv_free (struct dtp_gate *gate) {
+  size_t free = gate->mxw - gate->ibufsize;
+  return free < gate->kcap ? free : gate->kcap;
 }
 
-/* Handles incoming data packets. */
-void * receiver_daemon (void * arg) {
-  struct dtp_gate* gate = (struct dtp_gate *) arg;
+/* Free slots to advertise, scaled and rounded up : never 0. Caller
+   holds inbuf_mtx. */
+static len_t rcv_window (struct dtp_gate *gate) {
+  size_t unit = (size_t) 1 << gate->wshift;
+  gate->wadv = rcv_free(gate);
+  return (gate->wadv + unit - 1) >> gate->wshift;
+}
+
+void gate_window_update (struct dtp_gate *gate) {
+  size_t room = gate->kcap < gate->mxw ? gate->kcap : gate->mxw;
+  if( gate->status == IDLE || gate->wadv >= (room >> 3) ||
+      rcv_free(gate) < (room >> 2) )
+    return;
   packet_t packet;
-  while( 1 ) {
-    int dbg_stat;
-    if( (dbg_stat = recv_pkt(gate, &packet)) == RCV_WRHOST ) {
-#ifdef DTP_DBG
-      fprintf(stderr, "Received packet from unknown host.\n");
-      fflush(stderr);
-#endif
-      continue;
-    }
+  packet.flags = ACK | WUPD;
+  packet.seq = 0;
+  packet.wptr = 0;
+  packet.len = 0;
+  packet.ack = gate->ackno;
+  packet.wsz = rcv_window(gate);
+  send_pkt(gate, &packet);
+}
 
-    /* Reset timeout. */
-    pthread_cond_broadcast(&(gate->tm_cv));
+int handshake_done (struct dtp_gate *gate) {
+  packet_t packet;
+  pthread_mutex_lock(&(gate->inbuf_mtx));
+  make_pkt(&packet, 0, gate->ackno, 0, 0, rcv_window(gate), ACK | WUPD, NULL);
+  pthread_mutex_unlock(&(gate->inbuf_mtx));
+  return send_pkt(gate, &packet);
+}
 
-    /* Acknowledgement. */
-    if( packet.flags & ACK ) {
-      pthread_mutex_lock(&(gate->outbuf_mtx));
-      seq_t ack = packet.ack;
+/* Packets of the priority channel prbuf has room for. */
+static size_t prio_credit (struct dtp_gate *gate) {
+  return (DTP_PRIO_BUF - gate->prlen) / PAYLOAD;
+}
 
-#ifdef DTP_DBG
-      fprintf(stderr, "Ackrcvd outvar=<%lu, %lu, %lu> outsize=(%lu/%lu) outlim=(%lu|%lu) ((%u))\n",
-	      gate->outbeg, gate->outsnd, gate->outend,
-	      gate->sndsize, gate->obufsize,
-	      gate->WND, gate->SSTH, packet.seq);
-      if( (gate->seqno <= gate->sndno ) ?
-	  (gate->seqno <= ack && ack <= gate->sndno) :
-	  (gate->seqno <= ack || ack <= gate->sndno) ) {
-      } else {
-	fprintf(stderr, "Out of order ack.\n");
-      }
-      fflush(stderr);
-#endif
+/* ACK of the priority channel, with its credit. Caller holds
+   inbuf_mtx. */
+static int prio_ack (struct dtp_gate *gate, flag_t flags) {
+  packet_t packet;
+  gate->pradv = prio_credit(gate);
+  make_pkt(&packet, 0, gate->prackno, 0, 0, gate->pradv, ACK | URG | flags, NULL);
+  return send_pkt(gate, &packet);
+}
 
-      /* Validate sequence number range. */
-      if( (gate->seqno <= gate->sndno ) ?
-	  (gate->seqno <= ack && ack <= gate->sndno) :
-	  (gate->seqno <= ack || ack <= gate->sndno) ) {
-
-	packet_t *pkt;
-	while( gate->seqno != ack ) { /* Shift window. */
-	  pkt = (gate->outbuf) + (gate->outbeg);
-	  gate->seqno = pkt->seq + pkt->len;
-	  gate->outbeg = (gate->outbeg + 1) % MXW;
-	  gate->obufsize--;
-
-	  if( gate->sndsize == 0 )
-	    gate->outsnd = gate->outbeg;
-	  else
-	    gate->sndsize--;
-
-	  if( gate->WND >= gate->SSTH ) {
-	    gate->AXW++;
-	    if( gate->AXW == gate->WND ) {
-	      gate->AXW = 0;
-	      if( gate->WND < LIM ) {
-		gate->WND++;	/* Additive increase. */
-		gate->SSTH++;
-	      }
-	    }
-	  } else {
-	    if( gate->WND < LIM )
-	      gate->WND++;	/* Exponential start. */
-	  }
-
-	  /* Limit by receiver window size. */
-	  if( gate->WND > packet.wsz )
-	    gate->WND = packet.wsz; 
-
-	  /* Reset sent size. Ignore sent packets. */
-	  if( gate->WND < gate->sndsize ) {
-	    gate->outsnd = (gate->outbeg + gate->WND)%MXW;
-	    gate->sndsize = gate->WND;
-	  }
-	}
-
-	pthread_cond_broadcast(&(gate->outbuf_var));
-      }
-
-      /* Detect DUPACKS. */
-      if( ack == gate->lstack ) {
-	gate->ackfr++;
-	if( gate->ackfr == 3 ) { /* Detect 3 DUPACKS */
-#ifdef DTP_DBG
-	  fprintf(stderr, "Triple DUPACK.\n");
-	  fflush(stderr);
-#endif
-	  gate->SSTH = (gate->SSTH + 1) >> 1; /* Halve ssthresh */
-	  gate->WND = 1 + gate->WND / 2;      /* Also halve WND.*/
-	  gate->AXW = 0;
-	  gate->outsnd = gate->outbeg; /* Resend window. */
-	  gate->sndsize = 0;
-	  pthread_cond_broadcast(&(gate->outbuf_var));
-	}
-      } else {
-	gate->lstack = ack;
-	gate->ackfr = 0;
-      }
-      pthread_mutex_unlock(&(gate->outbuf_mtx));
-    }
-
-    if( packet.len > 0 || (packet.flags & FIN) ) { /* Data or FIN. */
-      pthread_mutex_lock(&(gate->inbuf_mtx));
-
-      size_t wpt = packet.wptr;
-
-      if( (wpt + MXW - gate->inend)%MXW < FUTURE_WINDOW
-	  && gate->rcvf[wpt] == 0
-	  && gate->ibufsize < LIM ) { /* Ack only if receiver buffer is nonfull. */
-
-	(gate->rcvf)[wpt] = 1;
-	(gate->inbuf)[wpt] = packet;
-
-	packet_t *pkt;
-	while( gate->ibufsize < LIM &&
-	       (gate->rcvf)[(gate->inend)] == 1 ) {
-	  pkt = (gate->inbuf) + (gate->inend);
-	  if( gate->ackno != pkt->seq ) {
-#ifdef DTP_DBG
-	    fprintf(stderr, "Window wrapping...\n");
-	    fflush(stderr);
-#endif
-	    break;
-	  }
-	  gate->ackno = pkt->seq + pkt->len;
-	  gate->inend = (gate->inend + 1) % MXW;
-	  gate->ibufsize++;
-	  pthread_cond_broadcast(&(gate->inbuf_var));
-	}
-#ifdef DTP_DBG
-	fprintf(stderr, "Datrcvd [%lu, %lu]@%u. Expecting : %u\n",
-		gate->inbeg, gate->inend, wpt, gate->ackno);
-	fflush(stderr);
-#endif
+void gate_prio_update (struct dtp_gate *gate) {
+  if( gate->pradv < DTP_PRIO_PKTS / 4 && prio_credit(gate) >= DTP_PRIO_PKTS / 2 )
+    prio_ack(gate, WUPD);
+}
+
+/**
+   OVFL until the holes left by the socket's drops are filled and a
+   window has gone by : the sender goes back over the whole window,
+   and the copies of what got through bring DUPACKs of their own.
+   Receiver daemon only.
+ */
+static flag_t ack_flags (struct dtp_gate *gate) {
+  if( gate->ovfl && gate->ackno >= gate->rcvhi &&
+      gate->ackno - gate->ovflno > (seq_t) gate->mxw * PAYLOAD )
+    gate->ovfl = 0;
+  return gate->ovfl ? OVFL : 0;
+}
+
+/**
+   Copy a priority packet to prbuf if it is the next one and fits :
+   the sender goes back to the first one dropped. Caller holds
+   inbuf_mtx.
+   Returns nonzero if the packet was dropped.
+ */
+static int take_prio (struct dtp_gate *gate, const packet_t *pkt) {
+  if( pkt->seq != gate->prackno || DTP_PRIO_BUF - gate->prlen < pkt->len )
+    return 1;
+  if( gate->prbuf == NULL &&
+      (gate->prbuf = (byte_t *) malloc(DTP_PRIO_BUF)) == NULL )
+    return 1;
+  size_t end = (gate->prbeg + gate->prlen) & (DTP_PRIO_BUF - 1),
+    run = DTP_PRIO_BUF - end;
+  if( run > pkt->len )
+    run = pkt->len;
+  memcpy(gate->prbuf + end, pkt->data, run);
+  memcpy(gate->prbuf, pkt->data + run, pkt->len - run);
+  gate->prlen += pkt->len;
+  gate->prackno += pkt->len;
+  gate_wake(gate, &(gate->inbuf_var));
+  if( gate->prarm )
+    notify(gate, &(gate->prarm));
+  return 0;
+}
+
+/**
+   ACK of the priority channel : let go of what it covers, go back
+   over the rest on 3 DUPACKs or a window update, and take the new
+   credit. Receiver daemon only.
+ */
+static void prio_acked (struct dtp_gate *gate, const packet_t *packet) {
+  pthread_mutex_lock(&(gate->outbuf_mtx));
+  size_t n = gate->posize;
+  while( gate->posize > 0 ) {
+    const packet_t *pkt = (gate->prout) + gate->pobeg;
+    if( pkt->seq + pkt->len > packet->ack )
+      break;
+    gate->poseqno = pkt->seq + pkt->len;
+    gate->pobeg = (gate->pobeg + 1) & (DTP_PRIO_PKTS - 1);
+    gate->posize--;
+    if( gate->posent > 0 )
+      gate->posent--;
+  }
+  if( gate->posize != n ) {
+    gate->podup = 0;
+    gate->poback = 0;
+    if( gate->posize == 0 )
+      gate->poopen = 0;
+    if( gate->posent > 0 )
+      prio_arm(gate);
+    else
+      dtp_timer_del(&(gate->prto));
+  } else if( packet->ack == gate->poseqno && gate->posent > 0 &&
+	     ((packet->flags & WUPD) || ++(gate->podup) == 3) ) {
+    gate->podup = 0;
+    gate->posent = 0;		/* Resend the channel's window. */
+    dtp_timer_del(&(gate->prto));
+  }
+  gate->pocred = packet->wsz;
+  gate_wake(gate, &(gate->outbuf_var));
+  pthread_mutex_unlock(&(gate->outbuf_mtx));
+}
+
+
+/**
+   A priority packet may go : queued, not sent, and credit for it. With
+   none, one goes anyway as a probe, answered with the credit again.
+   Caller holds outbuf_mtx.
+ */
+static int prio_sendable (const struct dtp_gate *gate) {
+  size_t cred = gate->pocred > 0 ? gate->pocred : 1;
+  return gate->posent < gate->posize && gate->posent < cred;
+}
+
+/**
+   Cumulative ACK of the data in order so far, over the data packet
+   just taken, or a packet of its own if NULL. Caller holds inbuf_mtx.
+ */
+static void data_ack (struct dtp_gate *gate, packet_t *packet) {
+  packet_t ack;
+  if( packet == NULL ) {
+    packet = &ack;
+    packet->seq = 0;
+    packet->wptr = 0;
+  }
+  packet->flags = ACK | ack_flags(gate);
+  packet->len = 0;
+  packet->ack = gate->ackno;
+  packet->wsz = rcv_window(gate); /* Receiver window size. */
+  send_pkt(gate, packet);
+}
+
+/* -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- */
+/* Sender and receiver daemons, once per core. */
+
+#define CC_AIMD 0		/* Slow start, additive increase, halved
+				   on loss. */
+#define CC_FIXED 1		/* The whole window, kept through losses :
+				   links of one's own. */
+
+#define CORE generic
+#define CORE_MXW 0
+#define CORE_ACK 1
+#define CORE_CC CC_AIMD
+#define CORE_FEC 1
+#define CORE_PRIO 1
+#include "core.inc"
+
+#define CORE lan
+#define CORE_MXW (1<<8)
+#define CORE_ACK 8
+#define CORE_CC CC_FIXED
+#define CORE_FEC 0
+#define CORE_PRIO 1
+#include "core.inc"
+
+#define CORE wan
+#define CORE_MXW (1<<14)
+#define CORE_ACK 4
+#define CORE_CC CC_AIMD
+#define CORE_FEC 1
+#define CORE_PRIO 1
+#include "core.inc"
+
+#define CORE tiny
+#define CORE_MXW MXW_MIN
+#define CORE_ACK 1
+#define CORE_CC CC_AIMD
+#define CORE_FEC 0
+#define CORE_PRIO 0
+#include "core.inc"
+
+const struct dtp_core *const dtp_cores[DTP_CORES] = {
+  &core_generic, &core_lan, &core_wan, &core_tiny
+};
 
-	/* If a FIN packet arrives. */
-	if( packet.flags & FIN ) {
-	  if( gate->status == CONN ) {
-	    gate->status = FINR;
-	  } else if( gate->status == FINS ) {
-	    gate->status = CLSD;
-	    pthread_cond_broadcast(&(gate->inbuf_var));
-	  }
-	}
-
-      }
-
-      /* Send cumulative acknowledgement packet. */
-      packet.flags = ACK;
-      packet.len = 0;
-      packet.ack = gate->ackno;
-      packet.wsz = MXW - gate->ibufsize; /* Receiver window size. */
-      send_pkt(gate, &packet);
-
-      pthread_mutex_unlock(&(gate->inbuf_mtx));
-    } /* Data packet. */
-  } /* while (1)  */
-  pthread_exit(NULL);
+const struct dtp_core * gate_core (struct dtp_gate *gate) {
+  const struct dtp_core *c = dtp_cores[gate->core];
+  if( gate->shm != NULL || (c->mxw != 0 && c->mxw != gate->mxw) ||
+      (!c->fec && gate->fec != NULL) ||
+      (!c->prio && (gate->feat & FEAT_PRIO)) )
+    c = dtp_cores[gate->core = DTP_CORE_GENERIC];
+  return c;
 }
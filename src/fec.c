@@ -0,0 +1,181 @@
+#include "gate.h"
+#include "fec.h"
+#include "packet.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+struct dtp_fec {
+  struct dtp_fecstats st;
+
+  /* Sender side, guarded by outbuf_mtx. */
+  packet_t par;			/* Parity of the open group. */
+  unsigned n;			/* Packets in it. */
+  seq_t next;			/* Sequence number of the next new packet. */
+  int resending;		/* Inside a retransmission round. */
+  unsigned sent, lost;		/* This epoch. */
+};
+
+/* dst ^= src, n bytes. */
+static void xor_bytes (byte_t *dst, const byte_t *src, size_t n) {
+  size_t i = 0;
+  for( ; i + sizeof(uint64_t) <= n; i += sizeof(uint64_t) ) {
+    uint64_t a, b;
+    memcpy(&a, dst + i, sizeof(a));
+    memcpy(&b, src + i, sizeof(b));
+    a ^= b;
+    memcpy(dst + i, &a, sizeof(a));
+  }
+  for( ; i < n; i++ )
+    dst[i] ^= src[i];
+}
+
+int fec_setup (struct dtp_gate *gate) {
+  struct dtp_fec *f = calloc(1, sizeof(struct dtp_fec));
+  if( f == NULL )
+    return -1;
+  f->next = gate->sndno;
+  f->st.k = 16;
+  f->st.loss = 1.0 / (4 * f->st.k);
+  gate->fec = f;
+  return 0;
+}
+
+void fec_free (struct dtp_gate *gate) {
+  free(gate->fec);
+  gate->fec = NULL;
+}
+
+int dtp_fec_stats (struct dtp_gate *gate, struct dtp_fecstats *st) {
+  struct dtp_fec *f = gate->fec;
+  if( f == NULL )
+    return -1;
+  pthread_mutex_lock(&(gate->outbuf_mtx));
+  pthread_mutex_lock(&(gate->inbuf_mtx));
+  *st = f->st;
+  pthread_mutex_unlock(&(gate->inbuf_mtx));
+  pthread_mutex_unlock(&(gate->outbuf_mtx));
+  return 0;
+}
+
+/**
+   End of an epoch : fold its loss into the estimate and size groups
+   so that two losses in one of them stay rare, k ~ 1 / 4p.
+ */
+static void fec_adapt (struct dtp_fec *f) {
+  double sample = (double) f->lost / f->sent;
+  f->st.loss += (sample - f->st.loss) / 4;
+  double k = f->st.loss > 0 ? 1 / (4 * f->st.loss) : FEC_KMAX;
+  f->st.k = k < FEC_KMIN ? FEC_KMIN : k > FEC_KMAX ? FEC_KMAX : (unsigned) k;
+  f->sent = f->lost = 0;
+}
+
+void fec_flush (struct dtp_gate *gate) {
+  struct dtp_fec *f = gate->fec;
+  if( f->n == 0 )
+    return;
+  f->par.flags = FEC;
+  f->par.wsz = f->n;
+  send_pkt(gate, &(f->par));
+  f->st.parity_out++;
+  f->n = 0;
+}
+
+void fec_sent (struct dtp_gate *gate, const packet_t *pkt) {
+  struct dtp_fec *f = gate->fec;
+  if( pkt->flags & FIN ) {	/* Not covered, ends the stream. */
+    fec_flush(gate);
+    return;
+  }
+  if( pkt->seq != f->next ) {	/* Going back over the window. */
+    if( !f->resending ) {
+      f->resending = 1;
+      f->st.rounds++;
+      f->lost++;
+    }
+  } else {
+    f->resending = 0;
+    f->next = pkt->seq + pkt->len;
+    f->st.data_out++;
+    if( ++(f->sent) == FEC_EPOCH )
+      fec_adapt(f);
+  }
+
+  /* Groups are runs of consecutive slots, retransmissions included. */
+  packet_t *par = &(f->par);
+  if( f->n > 0 && pkt->wptr != ((par->wptr + f->n) & gate->lim) )
+    fec_flush(gate);
+  if( f->n == 0 ) {
+    par->seq = par->ack = 0;
+    par->wptr = pkt->wptr;
+    par->len = 0;
+  }
+  if( pkt->len > par->len ) {	/* Zero pad the parity. */
+    memset(par->data + par->len, 0, pkt->len - par->len);
+    par->len = pkt->len;
+  }
+  par->seq ^= pkt->seq;
+  par->ack ^= pkt->len;
+  xor_bytes(par->data, pkt->data, pkt->len);
+  f->n++;
+  if( f->n >= f->st.k )
+    fec_flush(gate);
+}
+
+void fec_rebuilt (struct dtp_gate *gate) {
+  gate->fec->st.rebuilt_out++;
+  gate->fec->lost++;
+}
+
+unsigned fec_dupthresh (struct dtp_gate *gate) {
+  /* The rest of the group and its parity come first. */
+  return 3 + gate->fec->st.k;
+}
+
+int fec_recv (struct dtp_gate *gate, const packet_t *par, packet_t *out) {
+  size_t n = par->wsz, first = par->wptr, none = gate->mxw, hole = none, i;
+  if( n == 0 || n > FEC_KMAX || first > gate->lim || par->len > PAYLOAD )
+    return 1;
+
+  seq_t seq = par->seq, len = par->ack;
+  memcpy(out->data, par->data, par->len);
+  for( i = 0; i < n; i++ ) {
+    size_t w = (first + i) & gate->lim;
+    /* Slots from inend on are there if flagged. The ones before it
+       arrived in order, and their data stays in inbuf after being
+       read until the window comes round again. */
+    if( ((w - gate->inend) & gate->lim) < FUTURE_WINDOW(gate) &&
+	gate->rcvf[w] == 0 ) {
+      if( hole != none )
+	return -1;		/* Two losses, no luck. */
+      hole = w;
+      continue;
+    }
+    const packet_t *pkt = gate->inbuf + w;
+    if( pkt->len > par->len )
+      return 1;			/* Not this group. */
+    seq ^= pkt->seq;
+    len ^= pkt->len;
+    xor_bytes(out->data, pkt->data, pkt->len);
+  }
+  /* A complete group past a hole : the hole's own parity is lost. */
+  size_t ahead = (first - gate->inend) & gate->lim;
+  if( hole == none && ahead > 0 && ahead < FUTURE_WINDOW(gate) &&
+      gate->rcvf[gate->inend] == 0 )
+    return -1;
+  /* Only the low 32 bits are carried by a basic header. */
+  seq = seq_expand(gate->ackno, seq);
+  if( hole == none || len == 0 || len > par->len ||
+      seq < gate->ackno || seq - gate->ackno >= FUTURE_WINDOW(gate) * PAYLOAD )
+    return 1;
+
+  out->seq = seq;
+  out->ack = 0;
+  out->wptr = hole;
+  out->len = len;
+  out->wsz = 0;
+  out->flags = 0;
+  gate->fec->st.rebuilt_in++;
+  return 0;
+}
@@ -1,9 +1,17 @@
 #include "gate.h"
 #include "packet.h"
+#include "transport.h"
+#include "compress.h"
+#include "shm.h"
 
 #include <arpa/inet.h>		/* inet_aton */
 
+#include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include <sys/eventfd.h>
 
 #ifdef DTP_DBG
 #include <stdio.h>
@@ -36,6 +44,26 @@ int init_dtp_server (dtp_server* server, port_t port_no) {
   if( stat < 0 )
     return -1;
 
+  server->tp = &dtp_udp_transport;
+  server->tpctx = NULL;
+  server->timeout = 0;
+  server->io = DTP_IO_SOCKET;
+  server->evfd = -1;
+  server->spin = 0;
+  server->cpu[0] = server->cpu[1] = -1;
+  server->wakes = 0;
+  server->nodelay = 0;
+  server->sockbuf = 0;
+  memset(&(server->drops), 0, sizeof(server->drops));
+  server->feat = FEAT_PRIO;
+  server->z = NULL;
+  server->fec = NULL;
+  server->shm = NULL;
+  server->mxw = MXW;
+  server->lim = MXW - 1;
+  server->wshift = 0;
+  server->nbacklog = 0;
+  server->core = DTP_CORE_GENERIC;
   server->status = IDLE;
 
   return 0;
@@ -63,40 +91,333 @@ int init_dtp_client (dtp_client* client, const char* hostname, port_t port_no) {
   if( stat < 0 )
     return -1;
 
+  client->tp = &dtp_udp_transport;
+  client->tpctx = NULL;
+  client->timeout = 0;
+  client->io = DTP_IO_SOCKET;
+  client->evfd = -1;
+  client->spin = 0;
+  client->cpu[0] = client->cpu[1] = -1;
+  client->wakes = 0;
+  client->nodelay = 0;
+  client->sockbuf = 0;
+  memset(&(client->drops), 0, sizeof(client->drops));
+  client->feat = FEAT_PRIO | FEAT_MCAST;
+  client->z = NULL;
+  client->fec = NULL;
+  client->shm = NULL;
+  client->mxw = MXW;
+  client->lim = MXW - 1;
+  client->wshift = 0;
+  client->nbacklog = 0;
+  client->core = DTP_CORE_GENERIC;
   client->status = IDLE;
 
   return 0;
 }
 
+int dtp_setopt (struct dtp_gate* gate, int opt, int val) {
+  if( gate->status != IDLE )
+    return -1;			/* Options are fixed while connected. */
+  switch( opt ) {
+  case DTP_IO:
+    if( val != DTP_IO_SOCKET && val != DTP_IO_URING &&
+	val != DTP_IO_URING_SQPOLL )
+      return -1;
+    gate->io = val;
+    return 0;
+  case DTP_COMPRESS:
+    if( val )
+      gate->feat |= FEAT_LZ;
+    else
+      gate->feat &= ~FEAT_LZ;
+    return 0;
+  case DTP_FEC:
+    if( val )
+      gate->feat |= FEAT_FEC;
+    else
+      gate->feat &= ~FEAT_FEC;
+    return 0;
+  case DTP_WINDOW:
+    if( val < MXW_MIN || val > MXW_MAX || (val & (val - 1)) != 0 )
+      return -1;
+    gate->mxw = val;
+    gate->lim = val - 1;
+    if( gate->mxw > MXW_BASIC )	/* Slot numbers outgrow 16 bits. */
+      gate->feat |= FEAT_WIDE;
+    else
+      gate->feat &= ~FEAT_WIDE;
+    return 0;
+  case DTP_BUSYPOLL:
+    if( val < 0 )
+      return -1;
+    gate->spin = val * 1000l;
+    /* Let the driver poll too. Needs CAP_NET_ADMIN above
+       net.core.busy_read, spinning in userspace works regardless. */
+    if( gate->tp == &dtp_udp_transport )
+      setsockopt(gate->socket, SOL_SOCKET, SO_BUSY_POLL, &val, sizeof(val));
+    return 0;
+  case DTP_NODELAY:
+    gate->nodelay = val != 0;
+    return 0;
+  case DTP_SHM:
+    if( gate->tp != &dtp_udp_transport )
+      return -1;		/* No host to share with. */
+    if( val )
+      gate->feat |= FEAT_SHM;
+    else
+      gate->feat &= ~FEAT_SHM;
+    return 0;
+  case DTP_SOCKBUF:
+    if( val < 0 || gate->socket < 0 )
+      return -1;
+    gate->sockbuf = val;
+    return 0;
+  case DTP_CPU_SND:
+  case DTP_CPU_RCV:
+    if( val < -1 || val >= sysconf(_SC_NPROCESSORS_CONF) )
+      return -1;
+    gate->cpu[opt == DTP_CPU_RCV] = val;
+    return 0;
+  case DTP_CORE:
+    if( val < 0 || val >= DTP_CORES )
+      return -1;
+    gate->core = val;
+    if( dtp_cores[val]->mxw != 0 )
+      dtp_setopt(gate, DTP_WINDOW, dtp_cores[val]->mxw);
+    if( dtp_cores[val]->prio )
+      gate->feat |= FEAT_PRIO;
+    else
+      gate->feat &= ~FEAT_PRIO;
+    return 0;
+  }
+  return -1;
+}
+
+int dtp_getopt (struct dtp_gate* gate, int opt, int* val) {
+  switch( opt ) {
+  case DTP_IO:
+    *val = gate->io;
+    return 0;
+  case DTP_COMPRESS:
+    *val = (gate->feat & FEAT_LZ) != 0;
+    return 0;
+  case DTP_FEC:
+    *val = (gate->feat & FEAT_FEC) != 0;
+    return 0;
+  case DTP_WINDOW:
+    *val = gate->shm != NULL ? shm_window(gate) : gate->mxw;
+    return 0;
+  case DTP_BUSYPOLL:
+    *val = gate->spin / 1000;
+    return 0;
+  case DTP_NODELAY:
+    *val = gate->nodelay;
+    return 0;
+  case DTP_SHM:
+    *val = (gate->feat & FEAT_SHM) != 0;
+    return 0;
+  case DTP_SOCKBUF: {
+    socklen_t len = sizeof(*val);
+    if( gate->status == IDLE ) {
+      *val = gate->sockbuf;
+      return 0;
+    }
+    return getsockopt(gate->socket, SOL_SOCKET, SO_RCVBUF, val, &len) < 0;
+  }
+  case DTP_CPU_SND:
+  case DTP_CPU_RCV:
+    *val = gate->cpu[opt == DTP_CPU_RCV];
+    return 0;
+  case DTP_CORE:
+    *val = gate->core;
+    return 0;
+  }
+  return -1;
+}
+
+int dtp_drops (struct dtp_gate* gate, struct dtp_drops* drops) {
+  if( gate->status == IDLE ) {	/* Closed, or not yet connected. */
+    *drops = gate->drops;
+    return 0;
+  }
+  pthread_mutex_lock(&(gate->outbuf_mtx));
+  *drops = gate->drops;
+  pthread_mutex_unlock(&(gate->outbuf_mtx));
+  return 0;
+}
+
+size_t gate_push (struct dtp_gate* gate,
+		  const byte_t* beg, const byte_t* end) {
+  size_t blk = end-beg;
+  if( gate->tailopen ) {	/* Coalesce into the unsent tail. */
+    packet_t *tail = (gate->outbuf) + ((gate->outend - 1) & gate->lim);
+    if( tail->len < PAYLOAD ) {
+      if( blk > (size_t) (PAYLOAD - tail->len) )
+	blk = PAYLOAD - tail->len;
+      memcpy(tail->data + tail->len, beg, blk);
+      tail->len += blk;
+      gate->sndno += blk;
+      return blk;
+    }
+  }
+  if( blk > PAYLOAD )
+    blk = PAYLOAD;
+  make_pkt((gate->outbuf)+(gate->outend),
+	   gate->sndno,
+	   0,
+	   gate->outend,
+	   blk,
+	   0,
+	   0,
+	   beg);
+  gate->sndno += blk;
+  gate->outend = (gate->outend + 1) & gate->lim;
+  gate->obufsize++;
+  gate->tailopen = 1;
+  return blk;
+}
+
+size_t gate_pull (struct dtp_gate* gate, byte_t* beg, size_t maxsize) {
+  size_t bytes_read = 0;
+  while( maxsize > 0 && gate->ibufsize > 0 ) {
+    packet_t *pkt = (gate->inbuf) + (gate->inbeg);
+    if( (pkt->flags & FIN) && bytes_read > 0 )
+      break;			/* Left for the next call to return 0. */
+    size_t wr_len = maxsize,
+      rem = (pkt->len - gate->byte_offset);
+    if( wr_len >= rem ) {
+      wr_len = rem;
+      /* Write packet data. */
+      memcpy(beg, pkt->data + gate->byte_offset, wr_len);
+      (gate->rcvf)[gate->inbeg] = 0; /* Clear bit. */
+      (gate->inbeg) = (gate->inbeg + 1) & gate->lim;
+      gate->ibufsize--;
+      gate->byte_offset = 0;	/* Reset offset. */
+      gate_wake(gate, &(gate->inbuf_var));
+    } else {
+      memcpy(beg, pkt->data + gate->byte_offset, wr_len);
+      gate->byte_offset += wr_len;
+    }
+    beg += wr_len;
+    bytes_read += wr_len;
+    maxsize -= wr_len;
+  }
+  if( bytes_read > 0 )
+    gate_window_update(gate);
+  return bytes_read;
+}
+
+/* Room on prout : a free slot, or an unsent tail to top up. */
+static int prio_room (const struct dtp_gate* gate) {
+  const packet_t *last =
+    (gate->prout) + ((gate->pobeg + gate->posize - 1) & (DTP_PRIO_PKTS - 1));
+  return gate->posize < DTP_PRIO_PKTS || (gate->poopen && last->len < PAYLOAD);
+}
+
+/**
+   Queue one packet worth of priority data from [beg, end) on prout,
+   or top up its last packet if it has not gone out. Caller holds
+   outbuf_mtx and has checked for room.
+   Returns the number of bytes taken.
+ */
+static size_t gate_push_prio (struct dtp_gate* gate,
+			      const byte_t* beg, const byte_t* end) {
+  size_t blk = end-beg;
+  packet_t *last =
+    (gate->prout) + ((gate->pobeg + gate->posize - 1) & (DTP_PRIO_PKTS - 1));
+  if( gate->poopen && last->len < PAYLOAD ) {
+    if( blk > (size_t) (PAYLOAD - last->len) )
+      blk = PAYLOAD - last->len;
+    memcpy(last->data + last->len, beg, blk);
+    last->len += blk;
+  } else {
+    if( blk > PAYLOAD )
+      blk = PAYLOAD;
+    make_pkt((gate->prout) + ((gate->pobeg + gate->posize) & (DTP_PRIO_PKTS - 1)),
+	     gate->posndno, 0, 0, blk, 0, URG, beg);
+    gate->posize++;
+    gate->poopen = 1;
+  }
+  gate->posndno += blk;
+  return blk;
+}
+
+int dtp_send_prio(struct dtp_gate* gate, const void* data, size_t len, int prio) {
+  if( prio == DTP_PRIO_BULK )
+    return dtp_send(gate, data, len);
+  if( prio != DTP_PRIO_HIGH || !(gate->feat & FEAT_PRIO) ||
+      (gate->status != CONN && gate->status != FINR) )
+    return -1;
+  if( gate->shm != NULL )
+    return shm_send(gate, data, len, prio);
+  const byte_t * beg = (const byte_t *)data,
+    * end = beg + len;
+  while( beg != end ) {
+    pthread_mutex_lock(&(gate->outbuf_mtx));
+    if( gate->prout == NULL &&
+	(gate->prout = (packet_t *) malloc(DTP_PRIO_PKTS * sizeof(packet_t))) == NULL ) {
+      pthread_mutex_unlock(&(gate->outbuf_mtx));
+      return -1;
+    }
+    while( !prio_room(gate) )
+      gate_wait(gate, &(gate->outbuf_var), &(gate->outbuf_mtx));
+    beg += gate_push_prio(gate, beg, end);
+    gate_wake(gate, &(gate->outbuf_var));
+    pthread_mutex_unlock(&(gate->outbuf_mtx));
+  }
+  return 0;
+}
+
+ssize_t dtp_recv_prio(struct dtp_gate* gate, void* data, size_t maxsize, int prio) {
+  if( prio == DTP_PRIO_BULK )
+    return dtp_recv(gate, data, maxsize);
+  if( prio != DTP_PRIO_HIGH || !(gate->feat & FEAT_PRIO) || gate->status == IDLE )
+    return -1;
+  if( gate->shm != NULL )
+    return shm_recv(gate, data, maxsize, prio, 1);
+  pthread_mutex_lock(&(gate->inbuf_mtx));
+  while( gate->prlen == 0 && !gate->finin && !gate->reset )
+    gate_wait(gate, &(gate->inbuf_var), &(gate->inbuf_mtx));
+
+  byte_t *p = (byte_t *) data;
+  size_t n = 0;
+  while( n < maxsize && gate->prlen > 0 ) { /* At most two runs. */
+    size_t run = DTP_PRIO_BUF - gate->prbeg;
+    if( run > gate->prlen )
+      run = gate->prlen;
+    if( run > maxsize - n )
+      run = maxsize - n;
+    memcpy(p + n, gate->prbuf + gate->prbeg, run);
+    gate->prbeg = (gate->prbeg + run) & (DTP_PRIO_BUF - 1);
+    gate->prlen -= run;
+    n += run;
+  }
+  if( n > 0 )
+    gate_prio_update(gate);
+  pthread_mutex_unlock(&(gate->inbuf_mtx));
+  return n;
+}
+
 /**
    DTP send function. Keeps pushing data into gate's outbuf until
    all data has been sent and is blocked until all of the data has 
    been acknowledged by the receiver.
  */
 int dtp_send(struct dtp_gate* gate, const void* data, size_t len) {
+  if( gate->shm != NULL )
+    return shm_send(gate, data, len, DTP_PRIO_BULK);
+  if( gate->z != NULL )
+    return z_send(gate, data, len);
   const byte_t * beg = (const byte_t *)data,
     * end = beg + len; /* Convert to byte pointers. */
   while( beg != end ) {
-    size_t blk = end-beg;
-    if( blk > PAYLOAD )
-      blk = PAYLOAD;
     pthread_mutex_lock(&(gate->outbuf_mtx));
     /* Wait for space on buffer. */
-    while( gate->obufsize >= LIM )
-      pthread_cond_wait(&(gate->outbuf_var), &(gate->outbuf_mtx));
-    make_pkt((gate->outbuf)+(gate->outend),
-	     gate->sndno,
-	     0,
-	     gate->outend,
-	     blk,
-	     0,
-	     0,
-	     beg);
-    gate->sndno += blk;
-    gate->outend = (gate->outend + 1)%MXW;
-    gate->obufsize++;
-    beg += blk;
-    pthread_cond_broadcast(&(gate->outbuf_var));
+    while( gate->obufsize >= gate->lim )
+      gate_wait(gate, &(gate->outbuf_var), &(gate->outbuf_mtx));
+    beg += gate_push(gate, beg, end);
+    gate_wake(gate, &(gate->outbuf_var));
     pthread_mutex_unlock(&(gate->outbuf_mtx));
   }
   return 0;
@@ -107,36 +428,121 @@ int dtp_send(struct dtp_gate* gate, const void* data, size_t len) {
    at least 1 byte of data. Returns number of bytes read.
  */
 size_t dtp_recv(struct dtp_gate* gate, void* data, size_t maxsize) {
-  byte_t * beg = (byte_t *) data;
-  size_t bytes_read = 0;
+  if( gate->shm != NULL )
+    return shm_recv(gate, data, maxsize, DTP_PRIO_BULK, 1);
+  if( gate->z != NULL ) {
+    ssize_t n = z_recv(gate, data, maxsize, 1);
+    return n < 0 ? 0 : n;	/* Corrupt stream ends it. */
+  }
   pthread_mutex_lock(&(gate->inbuf_mtx));
 
-  /* Block until receiver buffer is nonempty. */
-  while( gate->ibufsize == 0 )
-    pthread_cond_wait(&(gate->inbuf_var), &(gate->inbuf_mtx));
+  /* Block until receiver buffer is nonempty, or the sender gave up
+     on us. */
+  while( gate->ibufsize == 0 && !gate->reset )
+    gate_wait(gate, &(gate->inbuf_var), &(gate->inbuf_mtx));
 
-  while( maxsize > 0 && gate->ibufsize > 0 ) {
-    packet_t *pkt = (gate->inbuf) + (gate->inbeg);
-    size_t wr_len = maxsize,
-      rem = (pkt->len - gate->byte_offset);
-    if( wr_len >= rem ) {
-      wr_len = rem;
-      /* Write packet data. */
-      memcpy(beg, pkt->data + gate->byte_offset, wr_len);
-      (gate->rcvf)[gate->inbeg] = 0; /* Clear bit. */
-      (gate->inbeg) = (gate->inbeg + 1)%MXW;
-      gate->ibufsize--;
-      gate->byte_offset = 0;	/* Reset offset. */
-      pthread_cond_broadcast(&(gate->inbuf_var));
-    } else {
-      memcpy(beg, pkt->data + gate->byte_offset, wr_len);
-      gate->byte_offset += wr_len;
-    }
-    beg += wr_len;
-    bytes_read += wr_len;
-    maxsize -= wr_len;
+  size_t bytes_read = gate_pull(gate, (byte_t *) data, maxsize);
+
+  pthread_mutex_unlock(&(gate->inbuf_mtx));
+  return bytes_read;
+}
+
+ssize_t dtp_try_send(struct dtp_gate* gate, const void* data, size_t len) {
+  if( gate->shm != NULL )
+    return shm_try_send(gate, data, len);
+  if( gate->z != NULL )
+    return z_try_send(gate, data, len);
+  const byte_t * beg = (const byte_t *)data,
+    * end = beg + len;
+  pthread_mutex_lock(&(gate->outbuf_mtx));
+  if( gate->obufsize >= gate->lim && len > 0 ) {
+    gate->wrarm = 1;		/* Receiver signals evfd on ACKs. */
+    pthread_mutex_unlock(&(gate->outbuf_mtx));
+    errno = EAGAIN;
+    return -1;
   }
+  while( beg != end && gate->obufsize < gate->lim )
+    beg += gate_push(gate, beg, end);
+  gate_wake(gate, &(gate->outbuf_var));
+  pthread_mutex_unlock(&(gate->outbuf_mtx));
+  return beg - (const byte_t *)data;
+}
+
+int dtp_cork (struct dtp_gate* gate) {
+  if( gate->status != CONN && gate->status != FINR )
+    return -1;
+  pthread_mutex_lock(&(gate->outbuf_mtx));
+  gate->cork = 1;
+  pthread_mutex_unlock(&(gate->outbuf_mtx));
+  return 0;
+}
+
+/* Seals the tail packet : nothing holds it back any more. */
+int dtp_flush (struct dtp_gate* gate) {
+  if( gate->status != CONN && gate->status != FINR )
+    return -1;
+  pthread_mutex_lock(&(gate->outbuf_mtx));
+  gate->tailopen = 0;
+  gate_wake(gate, &(gate->outbuf_var));
+  pthread_mutex_unlock(&(gate->outbuf_mtx));
+  return 0;
+}
 
+int dtp_uncork (struct dtp_gate* gate) {
+  if( gate->status != CONN && gate->status != FINR )
+    return -1;
+  pthread_mutex_lock(&(gate->outbuf_mtx));
+  gate->cork = 0;
+  gate->tailopen = 0;
+  gate_wake(gate, &(gate->outbuf_var));
+  pthread_mutex_unlock(&(gate->outbuf_mtx));
+  return 0;
+}
+
+ssize_t dtp_try_recv(struct dtp_gate* gate, void* data, size_t maxsize) {
+  if( gate->shm != NULL )
+    return shm_recv(gate, data, maxsize, DTP_PRIO_BULK, 0);
+  if( gate->z != NULL )
+    return z_recv(gate, data, maxsize, 0);
+  pthread_mutex_lock(&(gate->inbuf_mtx));
+  if( gate->ibufsize == 0 && !gate->reset ) {
+    gate->rdarm = 1;		/* Receiver signals evfd on data. */
+    pthread_mutex_unlock(&(gate->inbuf_mtx));
+    errno = EAGAIN;
+    return -1;
+  }
+  size_t bytes_read = gate_pull(gate, (byte_t *) data, maxsize);
   pthread_mutex_unlock(&(gate->inbuf_mtx));
   return bytes_read;
 }
+
+int dtp_fd(struct dtp_gate* gate) {
+  return gate->evfd;
+}
+
+int dtp_events(struct dtp_gate* gate) {
+  eventfd_t cnt;
+  int ev = 0;
+  eventfd_read(gate->evfd, &cnt); /* Non blocking, only resets it. */
+  if( gate->shm != NULL )
+    return shm_events(gate);
+
+  pthread_mutex_lock(&(gate->inbuf_mtx));
+  if( gate->ibufsize > 0 || gate->reset )
+    ev |= DTP_POLLIN;
+  else
+    gate->rdarm = 1;
+  if( gate->prlen > 0 )
+    ev |= DTP_POLLPRI;
+  else
+    gate->prarm = 1;
+  pthread_mutex_unlock(&(gate->inbuf_mtx));
+
+  pthread_mutex_lock(&(gate->outbuf_mtx));
+  if( gate->obufsize < gate->lim )
+    ev |= DTP_POLLOUT;
+  else
+    gate->wrarm = 1;
+  pthread_mutex_unlock(&(gate->outbuf_mtx));
+  return ev;
+}
@@ -0,0 +1,858 @@
+#include "mcast.h"
+#include "packet.h"
+#include "transport.h"
+#include "pool.h"
+
+#include <arpa/inet.h>		/* inet_aton */
+
+#include <errno.h>
+#include <poll.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/socket.h>
+
+#define MC_DUPTHR 3		/* DUPACKs before a repair. */
+#define MC_FINS 3		/* FINs sent before giving up on the
+				   receivers' ones. */
+
+static struct dtp_mcast * mcast_of (struct dtp_gate *gate) {
+  return (struct dtp_mcast *) ((byte_t *) gate -
+			       offsetof(struct dtp_mcast, gate));
+}
+
+/* Window scale of wsz for mxw slots, as setup_gate does. */
+static void set_window (struct dtp_gate *g, size_t mxw) {
+  g->mxw = mxw;
+  g->lim = mxw - 1;
+  if( mxw > MXW_BASIC )
+    g->feat |= FEAT_WIDE;
+  else
+    g->feat &= ~FEAT_WIDE;
+  g->wshift = 0;
+  while( (g->mxw >> g->wshift) > 0xffff )
+    g->wshift++;
+  g->WND = 1;
+  g->SSTH = mxw >> 1;
+  g->AXW = 0;
+}
+
+/* Send to one receiver instead of the group. Caller holds outbuf_mtx. */
+static void send_to (struct dtp_mcast *m, packet_t *pkt,
+		     const struct sockaddr_in *to) {
+  struct sockaddr_in group = m->gate.addr;
+  m->gate.addr = *to;
+  send_pkt(&(m->gate), pkt);
+  m->gate.addr = group;
+}
+
+/* Sequence number of the first packet not sent yet. */
+static seq_t sent_end (struct dtp_gate *g) {
+  return g->outsnd != g->outend ? g->outbuf[g->outsnd].seq : g->sndno;
+}
+
+/**
+   Lowest ACK of the live receivers, and the highest in top if not
+   NULL. With nobody live, whatever was sent counts as delivered.
+ */
+static seq_t mc_floor (struct dtp_mcast *m, seq_t *top) {
+  seq_t lo = sent_end(&(m->gate)), hi = m->gate.seqno;
+  size_t i;
+  for( i = 0; i < m->npeer; i++ ) {
+    struct dtp_mcast_peer *p = m->peer + i;
+    if( p->state != MC_LIVE )
+      continue;
+    if( p->ackno < lo )
+      lo = p->ackno;
+    if( p->ackno > hi )
+      hi = p->ackno;
+  }
+  if( top != NULL )
+    *top = hi;
+  return lo;
+}
+
+/* Packets the group may have out : the congestion window, no more
+   than the fullest receiver takes. */
+static size_t mc_window (struct dtp_mcast *m) {
+  size_t w = m->gate.WND, i;
+  for( i = 0; i < m->npeer; i++ )
+    if( m->peer[i].state == MC_LIVE && m->peer[i].wnd < w )
+      w = m->peer[i].wnd;
+  return w > 0 ? w : 1;
+}
+
+/**
+   Drop the packets every live receiver has and grow the window, as
+   the unicast sender does on ACKs. Caller holds outbuf_mtx.
+ */
+static void mc_slide (struct dtp_mcast *m) {
+  struct dtp_gate *g = &(m->gate);
+  seq_t lo = mc_floor(m, NULL);
+  while( g->seqno != lo ) {
+    packet_t *pkt = (g->outbuf) + (g->outbeg);
+    g->seqno = pkt->seq + pkt->len;
+    g->outbeg = (g->outbeg + 1) & g->lim;
+    g->obufsize--;
+    g->sndsize--;
+
+    if( g->WND >= g->SSTH ) {
+      g->AXW++;
+      if( g->AXW == g->WND ) {
+	g->AXW = 0;
+	if( g->WND < g->lim ) {
+	  g->WND++;		/* Additive increase. */
+	  g->SSTH++;
+	}
+      }
+    } else if( g->WND < g->lim ) {
+      g->WND++;			/* Exponential start. */
+    }
+  }
+  gate_wake(g, &(g->outbuf_var));
+}
+
+/* Slot of the sent packet starting at seq, mxw if there is none. */
+static size_t mc_slot (struct dtp_gate *g, seq_t seq) {
+  size_t i;
+  for( i = g->outbeg; i != g->outsnd; i = (i + 1) & g->lim )
+    if( g->outbuf[i].seq == seq )
+      return i;
+  return g->mxw;
+}
+
+/**
+   Send up to n packets from seq on again, to one receiver or, if to
+   is NULL, to the group. Caller holds outbuf_mtx.
+ */
+static void mc_repair (struct dtp_mcast *m, seq_t seq, size_t n,
+		       const struct sockaddr_in *to) {
+  struct dtp_gate *g = &(m->gate);
+  size_t i = mc_slot(g, seq), k;
+  if( i == g->mxw )
+    return;
+  for( k = 0; i != g->outsnd && k < n; i = (i + 1) & g->lim, k++ ) {
+    if( to != NULL )
+      send_to(m, (g->outbuf) + i, to);
+    else
+      send_pkt(g, (g->outbuf) + i);
+  }
+  if( to != NULL )
+    m->st.repairs += k;
+  else
+    m->st.mrepairs += k;
+}
+
+/* Live receivers at this ACK. */
+static size_t mc_count (struct dtp_mcast *m, seq_t ack) {
+  size_t i, n = 0;
+  for( i = 0; i < m->npeer; i++ )
+    n += m->peer[i].state == MC_LIVE && m->peer[i].ackno == ack;
+  return n;
+}
+
+/* Drop a receiver. Caller holds outbuf_mtx. */
+static void mc_reset (struct dtp_mcast *m, struct dtp_mcast_peer *p,
+		      unsigned long long now) {
+  packet_t rst;
+  if( p->state == MC_LIVE )
+    m->st.receivers--;
+  if( p->state != MC_EVICTED )
+    m->st.evicted++;
+  p->state = MC_EVICTED;
+  p->kicked = now;
+  make_pkt(&rst, 0, 0, 0, 0, 0, RST, NULL);
+  send_to(m, &rst, &(p->addr));
+}
+
+/**
+   The packet a receiver waits for : again to it alone, or to the
+   group when others wait for the same one, at most once a tick.
+ */
+static void mc_fix (struct dtp_mcast *m, struct dtp_mcast_peer *p,
+		    unsigned long long now) {
+  if( mc_count(m, p->ackno) > 1 ) {
+    if( m->mrpno != p->ackno || now - m->mrpat >= MC_TICK ) {
+      mc_repair(m, p->ackno, 1, NULL);
+      m->mrpno = p->ackno;
+      m->mrpat = now;
+    }
+  } else
+    mc_repair(m, p->ackno, 1, &(p->addr));
+  p->kicked = now;
+}
+
+/**
+   A receiver stalled for a tick gets the packet it waits for, after
+   an RTO its window, to the group if more are stuck at the same
+   place; stragglers go. Caller holds outbuf_mtx.
+ */
+static void mc_tick (struct dtp_mcast *m, unsigned long long now) {
+  struct dtp_gate *g = &(m->gate);
+  seq_t top, lo = mc_floor(m, &top), end = sent_end(g);
+  int evicted = 0;
+  size_t i, j;
+  for( i = 0; i < m->npeer; i++ ) {
+    struct dtp_mcast_peer *p = m->peer + i;
+    if( p->state != MC_LIVE )
+      continue;
+    if( p->ackno == end )
+      p->moved = now;		/* Has it all. */
+    else if( now - p->moved >= MC_TICK && now - p->kicked >= MC_TICK &&
+	     now - p->moved < RTO ) {
+      /* No DUPACKs come for a lost tail : probe with the packet it
+	 waits for, then follow its ACKs. */
+      p->recover = end;
+      mc_fix(m, p, now);
+    } else if( now - p->moved >= RTO && now - p->kicked >= RTO ) {
+      g->SSTH = (g->SSTH + 1) >> 1;
+      g->WND = 1;
+      g->AXW = 0;
+      m->recover = end;
+      if( mc_count(m, p->ackno) > 1 ) {
+	for( j = 0; j < m->npeer; j++ )
+	  if( m->peer[j].state == MC_LIVE && m->peer[j].ackno == p->ackno )
+	    m->peer[j].kicked = now;
+	mc_repair(m, p->ackno, g->SSTH, NULL);
+      } else {
+	p->kicked = now;
+	mc_repair(m, p->ackno, g->SSTH, &(p->addr));
+      }
+    }
+
+    /* Stragglers : last while others are ahead, or no progress at
+       all, for DTP_MC_EVICT. */
+    if( m->evict > 0 && p->ackno == lo && lo < top ) {
+      if( p->held == 0 )
+	p->held = now;
+    } else
+      p->held = 0;
+    if( m->evict > 0 &&
+	((p->held != 0 && now - p->held >= m->evict) ||
+	 (p->ackno != end && now - p->moved >= m->evict)) ) {
+      mc_reset(m, p, now);
+      evicted = 1;
+    }
+  }
+  if( evicted )
+    mc_slide(m);
+}
+
+/* ACK of a receiver. Caller holds outbuf_mtx. */
+static void mc_ack (struct dtp_mcast *m, struct dtp_mcast_peer *p,
+		    const packet_t *pkt, unsigned long long now) {
+  struct dtp_gate *g = &(m->gate);
+  seq_t ack = pkt->ack;
+  p->wnd = (size_t) pkt->wsz << g->wshift;
+
+  if( p->state == MC_JOINING ) {
+    if( ack < g->seqno || ack > sent_end(g) ) {
+      mc_reset(m, p, now);	/* Its first packets are gone. */
+      return;
+    }
+    p->state = MC_LIVE;
+    p->ackno = ack;
+    p->moved = now;
+    m->st.receivers++;
+    gate_wake(g, &(g->outbuf_var));
+    return;
+  }
+
+  if( p->ackno < ack && ack <= sent_end(g) ) {
+    int floor = p->ackno == g->seqno;
+    p->ackno = ack;
+    p->ackfr = 0;
+    p->moved = now;
+    /* Repaired, but short of what was out then : the next hole. */
+    if( p->kicked != 0 && ack < p->recover )
+      mc_fix(m, p, now);
+    if( floor )
+      mc_slide(m);
+  } else if( ack == p->ackno && !(pkt->flags & WUPD) &&
+	     ++(p->ackfr) == MC_DUPTHR ) {
+    p->recover = sent_end(g);
+    mc_fix(m, p, now);
+    if( ack >= m->recover ) {	/* One cut per window of losses. */
+      if( !(pkt->flags & OVFL) )	/* Its socket's, see dtp_drops. */
+	g->SSTH = (g->SSTH + 1) >> 1;
+      g->WND = 1 + g->WND / 2;
+      g->AXW = 0;
+      m->recover = sent_end(g);
+    }
+  }
+}
+
+/* Receiver at this address, NULL if unknown. */
+static struct dtp_mcast_peer * mc_peer (struct dtp_mcast *m,
+					const struct sockaddr_in *addr) {
+  size_t i;
+  for( i = 0; i < m->npeer; i++ )
+    if( validate_address(&(m->peer[i].addr), addr) == 0 )
+      return m->peer + i;
+  return NULL;
+}
+
+/**
+   SYN of a receiver : it must take our window and header, and can
+   only come in before the data starts. Answers with the group.
+   Caller holds outbuf_mtx.
+ */
+static void mc_join (struct dtp_mcast *m, struct dtp_mcast_peer *p,
+		     const packet_t *pkt, const struct sockaddr_in *from) {
+  struct dtp_gate *g = &(m->gate);
+  unsigned syn[2] = { 0, 0 };
+  memcpy(syn, pkt->data, pkt->len < sizeof(syn) ? pkt->len : sizeof(syn));
+  if( !(syn[0] & FEAT_MCAST) )
+    return;			/* Plain unicast client. */
+  size_t mxw = syn[1];
+  if( mxw < MXW_MIN || mxw > MXW_MAX || (mxw & (mxw - 1)) != 0 )
+    mxw = MXW;
+  if( mxw < g->mxw || ((g->feat & FEAT_WIDE) && !(syn[0] & FEAT_WIDE)) )
+    return;
+
+  if( p == NULL ) {
+    if( m->started )
+      return;
+    if( m->npeer == m->cap ) {
+      size_t cap = m->cap > 0 ? 2 * m->cap : 8;
+      struct dtp_mcast_peer *peer =
+	realloc(m->peer, cap * sizeof(struct dtp_mcast_peer));
+      if( peer == NULL )
+	return;
+      m->peer = peer;
+      m->cap = cap;
+    }
+    p = m->peer + m->npeer++;
+    memset(p, 0, sizeof(struct dtp_mcast_peer));
+    p->addr = *from;
+    p->state = MC_JOINING;
+    p->ackno = g->seqno;
+    p->wnd = g->mxw;
+  } else if( p->state != MC_JOINING )
+    return;
+
+  byte_t reply[sizeof(syn) + sizeof(struct dtp_mcast_group)];
+  struct dtp_mcast_group group;
+  memset(&group, 0, sizeof(group));
+  group.addr = g->addr.sin_addr.s_addr;
+  group.port = g->addr.sin_port;
+  syn[0] = FEAT_MCAST | (g->feat & FEAT_WIDE);
+  syn[1] = g->mxw;
+  memcpy(reply, syn, sizeof(syn));
+  memcpy(reply + sizeof(syn), &group, sizeof(group));
+
+  packet_t synack;
+  make_pkt(&synack, p->ackno, pkt->seq, 0, sizeof(reply), 0, SYN|ACK, reply);
+  send_to(m, &synack, from);
+}
+
+/* Feedback of the receivers : joins, ACKs, FINs. */
+static void * mc_feedback (void *arg) {
+  struct dtp_gate *g = (struct dtp_gate *) arg;
+  struct dtp_mcast *m = mcast_of(g);
+  packet_t packet;
+  struct sockaddr_in from;
+  int cancel;
+  while( 1 ) {
+    if( recv_any(g, &packet, &from) != RCV_OK )
+      continue;
+    /* Sends under the lock : not a place to be cancelled in. */
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &cancel);
+    pthread_mutex_lock(&(g->outbuf_mtx));
+    struct dtp_mcast_peer *p = mc_peer(m, &from);
+    unsigned long long now = gate_now(g);
+    if( packet.flags & SYN ) {
+      mc_join(m, p, &packet, &from);
+    } else if( p == NULL || p->state == MC_DONE ) {
+      /* Unknown, or done. */
+    } else if( p->state == MC_EVICTED ) {
+      if( now - p->kicked >= MC_TICK )
+	mc_reset(m, p, now);	/* Its RST got lost. */
+    } else if( packet.flags & FIN ) {
+      if( p->state == MC_LIVE )
+	m->st.receivers--;
+      p->state = MC_DONE;
+      m->st.done++;
+      mc_slide(m);
+    } else if( (packet.flags & ACK) && packet.len > 0 ) {
+      /* Its handshake ACK, first or again : tell it it joined. */
+      if( p->state == MC_JOINING )
+	mc_ack(m, p, &packet, now);
+      if( p->state == MC_LIVE ) {
+	packet_t ack;
+	make_pkt(&ack, 0, packet.seq, 0, 0, 0, ACK | WUPD, NULL);
+	send_to(m, &ack, &from);
+      }
+    } else if( packet.flags & ACK ) {
+      mc_ack(m, p, &packet, now);
+    }
+    pthread_mutex_unlock(&(g->outbuf_mtx));
+    pthread_setcancelstate(cancel, NULL);
+  }
+  pthread_exit(NULL);
+}
+
+/* Sends each packet once to the group, and looks after stalls. */
+static void * mc_sender (void *arg) {
+  struct dtp_gate *g = (struct dtp_gate *) arg;
+  struct dtp_mcast *m = mcast_of(g);
+  size_t i;
+  while( 1 ) {
+    pthread_mutex_lock(&(g->outbuf_mtx));
+    unsigned long long now = gate_now(g);
+    while( g->outsnd == g->outend || g->sndsize >= mc_window(m) ) {
+      if( g->sndsize > 0 && now >= m->tick ) {
+	mc_tick(m, now);
+	m->tick = now + MC_TICK;
+      }
+      gate_timedwait(g, &(g->outbuf_var), &(g->outbuf_mtx),
+		     g->sndsize > 0 ? m->tick : 0);
+      now = gate_now(g);
+    }
+
+    if( g->sndsize == 0 ) {	/* Nothing was in flight. */
+      for( i = 0; i < m->npeer; i++ )
+	m->peer[i].moved = now;
+      m->tick = now + MC_TICK;
+    } else if( now >= m->tick ) {
+      mc_tick(m, now);
+      m->tick = now + MC_TICK;
+    }
+
+    packet_t *pkt = (g->outbuf) + (g->outsnd);
+    send_pkt(g, pkt);
+    if( pkt->flags & FIN )
+      m->finat = now;
+    else {
+      m->st.packets++;
+      m->st.bytes += pkt->len;
+    }
+    if( g->outsnd == ((g->outend - 1) & g->lim) )
+      g->tailopen = 0;		/* On the wire, no more appending. */
+    g->outsnd = (g->outsnd + 1) & g->lim;
+    g->sndsize++;
+
+    gate_wake(g, &(g->outbuf_var));
+    pthread_mutex_unlock(&(g->outbuf_mtx));
+  }
+  pthread_exit(NULL);
+}
+
+int init_dtp_mcast (struct dtp_mcast *m, port_t port_no, const char *group,
+		    port_t gport, const char *iface) {
+  struct dtp_gate *g = &(m->gate);
+  int stat;
+  memset(m, 0, sizeof(struct dtp_mcast));
+
+  /* Create socket. */
+  stat = g->socket = socket(AF_INET, SOCK_DGRAM, 0);
+  if( stat < 0 )
+    return -1;
+
+  /* Self address, joins and feedback come in there. */
+  struct sockaddr_in* host = &(g->self);
+  host->sin_family = AF_INET;
+  host->sin_port = htons(port_no);
+  host->sin_addr.s_addr = INADDR_ANY;
+  stat = bind(g->socket, (struct sockaddr*) host, sizeof(struct sockaddr_in));
+  if( stat < 0 )
+    return -1;
+  socklen_t socklen = sizeof(struct sockaddr_in);
+  getsockname(g->socket, (struct sockaddr*) host, &socklen);
+
+  /* Group address, data goes there. */
+  host = &(g->addr);
+  host->sin_family = AF_INET;
+  host->sin_port = htons(gport);
+  if( inet_aton(group, &(host->sin_addr)) == 0 ||
+      !IN_MULTICAST(ntohl(host->sin_addr.s_addr)) )
+    return -1;
+
+  /* Outgoing interface, one hop, and a copy for receivers on this
+     host. */
+  struct in_addr ifa;
+  ifa.s_addr = INADDR_ANY;
+  if( iface != NULL && inet_aton(iface, &ifa) == 0 )
+    return -1;
+  unsigned char ttl = 1, loop = 1;
+  if( setsockopt(g->socket, IPPROTO_IP, IP_MULTICAST_IF,
+		 &ifa, sizeof(ifa)) < 0 ||
+      setsockopt(g->socket, IPPROTO_IP, IP_MULTICAST_TTL,
+		 &ttl, sizeof(ttl)) < 0 ||
+      setsockopt(g->socket, IPPROTO_IP, IP_MULTICAST_LOOP,
+		 &loop, sizeof(loop)) < 0 )
+    return -1;
+
+  g->tp = &dtp_udp_transport;
+  g->tpctx = NULL;
+  g->io = DTP_IO_SOCKET;
+  g->evfd = -1;
+  g->cpu[0] = g->cpu[1] = -1;
+  set_window(g, MXW);
+  dtp_udp_buffers(g->socket, g->mxw, 0);
+  g->status = CONN;		/* Sends the full header at once. */
+
+  /* Initial sequence number, the same for every receiver. */
+  srand(gate_now(g) ^ g->self.sin_port);
+  g->seqno = g->sndno = rand();
+  g->ackno = 0;			/* Receivers' own are never checked. */
+  m->recover = g->seqno;
+
+  if( pool_get(g) != 0 )
+    return -1;
+
+  stat = pthread_mutex_init(&(g->outbuf_mtx), NULL);
+  if( stat != 0 )
+    return stat;
+  pthread_condattr_t attr;	/* Waits use the monotonic clock. */
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  stat = pthread_cond_init(&(g->outbuf_var), &attr);
+  pthread_condattr_destroy(&attr);
+  if( stat != 0 )
+    return stat;
+
+  stat = gate_spawn(g, &(g->snd_dmn), &mc_sender);
+  if( stat != 0 )
+    return stat;
+  return gate_spawn(g, &(g->rcv_dmn), &mc_feedback);
+}
+
+int dtp_mcast_setopt (struct dtp_mcast *m, int opt, int val) {
+  struct dtp_gate *g = &(m->gate);
+  int stat = -1;
+  switch( opt ) {
+  case DTP_MC_EVICT:
+    if( val < 0 )
+      return -1;
+    pthread_mutex_lock(&(g->outbuf_mtx));
+    m->evict = val * 1000000ull;
+    pthread_mutex_unlock(&(g->outbuf_mtx));
+    return 0;
+  case DTP_MC_TTL: {
+    unsigned char ttl = val;
+    if( val < 0 || val > 255 )
+      return -1;
+    return setsockopt(g->socket, IPPROTO_IP, IP_MULTICAST_TTL,
+		      &ttl, sizeof(ttl)) < 0 ? -1 : 0;
+  }
+  case DTP_WINDOW:
+    if( val < MXW_MIN || val > MXW_MAX || (val & (val - 1)) != 0 )
+      return -1;
+    pthread_mutex_lock(&(g->outbuf_mtx));
+    if( m->npeer == 0 && !m->started ) {
+      pool_put(g);
+      set_window(g, val);
+      dtp_udp_buffers(g->socket, g->mxw, 0);
+      stat = pool_get(g);
+    }
+    pthread_mutex_unlock(&(g->outbuf_mtx));
+    return stat;
+  }
+  return -1;
+}
+
+size_t dtp_mcast_accept (struct dtp_mcast *m, size_t count, long usec) {
+  struct dtp_gate *g = &(m->gate);
+  pthread_mutex_lock(&(g->outbuf_mtx));
+  unsigned long long deadline = usec > 0 ? gate_now(g) + usec * 1000ull : 0;
+  while( m->st.receivers < count )
+    if( gate_timedwait(g, &(g->outbuf_var), &(g->outbuf_mtx),
+		       deadline) == ETIMEDOUT )
+      break;
+  size_t n = m->st.receivers;
+  pthread_mutex_unlock(&(g->outbuf_mtx));
+  return n;
+}
+
+int dtp_mcast_send (struct dtp_mcast *m, const void *data, size_t len) {
+  struct dtp_gate *g = &(m->gate);
+  const byte_t * beg = (const byte_t *)data,
+    * end = beg + len;
+  while( beg != end ) {
+    pthread_mutex_lock(&(g->outbuf_mtx));
+    m->started = 1;
+    while( g->obufsize >= g->lim )
+      gate_wait(g, &(g->outbuf_var), &(g->outbuf_mtx));
+    beg += gate_push(g, beg, end);
+    gate_wake(g, &(g->outbuf_var));
+    pthread_mutex_unlock(&(g->outbuf_mtx));
+  }
+  return 0;
+}
+
+void dtp_mcast_stats (struct dtp_mcast *m, struct dtp_mcast_stats *st) {
+  if( m->gate.status == IDLE ) {	/* Closed : the totals. */
+    *st = m->st;
+    st->window = 0;
+    return;
+  }
+  pthread_mutex_lock(&(m->gate.outbuf_mtx));
+  *st = m->st;
+  st->window = mc_window(m);
+  pthread_mutex_unlock(&(m->gate.outbuf_mtx));
+}
+
+int close_dtp_mcast (struct dtp_mcast *m) {
+  struct dtp_gate *g = &(m->gate);
+  pthread_mutex_lock(&(g->outbuf_mtx));
+  m->started = 1;
+  while( g->obufsize >= g->lim )
+    gate_wait(g, &(g->outbuf_var), &(g->outbuf_mtx));
+  seq_t finno = g->sndno;
+  make_pkt((g->outbuf)+(g->outend), finno, 0, g->outend, 0, 0, FIN, NULL);
+  g->outend = (g->outend + 1) & g->lim;
+  g->obufsize++;
+  g->tailopen = 0;
+  gate_wake(g, &(g->outbuf_var));
+
+  /* Every live receiver has it all, and the FIN is out. */
+  while( g->seqno != finno || g->outsnd != g->outend )
+    gate_wait(g, &(g->outbuf_var), &(g->outbuf_mtx));
+
+  /* Their FINs, ours again now and then for those who missed it. */
+  unsigned fins = 1;
+  while( m->st.receivers > 0 && fins < MC_FINS ) {
+    unsigned long long now = gate_now(g);
+    if( now >= m->finat + RTO ) {
+      send_pkt(g, (g->outbuf) + ((g->outend - 1) & g->lim));
+      m->finat = now;
+      fins++;
+    } else
+      gate_timedwait(g, &(g->outbuf_var), &(g->outbuf_mtx), m->finat + RTO);
+  }
+  g->status = CLSD;
+  pthread_mutex_unlock(&(g->outbuf_mtx));
+
+  /* The feedback daemon goes first, as the receiver of a gate. */
+  gate_stop(g, g->rcv_dmn);
+  gate_stop(g, g->snd_dmn);
+
+  pool_put(g);
+  free(m->peer);
+  m->peer = NULL;
+  m->npeer = m->cap = 0;
+  pthread_mutex_destroy(&(g->outbuf_mtx));
+  pthread_cond_destroy(&(g->outbuf_var));
+  g->status = IDLE;
+  return 0;
+}
+
+/* -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- */
+/* Receiver transport : the gate's socket and the group's. */
+
+struct mc_rx {
+  int fd;			/* Group socket. */
+  int turn;			/* Read the group first, for fairness. */
+  pthread_mutex_t mtx;		/* Sender and receiver daemons both send. */
+  byte_t held[HDR_WIDE];	/* ACK held back, */
+  size_t hlen;			/* its size, 0 if none, */
+  unsigned nheld;		/* and the ACKs it stands for. */
+  uint32_t lastack;		/* Last ACK passed on, low bits. */
+  unsigned kdrops[2];		/* Drop counters of either socket. */
+};
+
+/* Send the ACK held back. Caller holds rx->mtx. */
+static void rx_flush (struct dtp_gate *gate, struct mc_rx *rx) {
+  if( rx->hlen > 0 )
+    dtp_udp_transport.send(gate, rx->held, rx->hlen);
+  rx->hlen = 0;
+  rx->nheld = 0;
+}
+
+/* A new cumulative ACK is held until MC_ACKS of them, or until
+   nothing more is queued; anything else goes out at once, after it. */
+static int rx_send (struct dtp_gate *gate, const void *buf, size_t len) {
+  struct mc_rx *rx = (struct mc_rx *) gate->tpctx;
+  const byte_t *h = (const byte_t *) buf;
+  uint16_t flags, dlen;
+  uint32_t ack;
+  memcpy(&ack, h + 4, sizeof(ack));
+  memcpy(&dlen, h + 10, sizeof(dlen));
+  memcpy(&flags, h + 14, sizeof(flags));
+  flags &= ~WIDE;
+
+  int cancel, stat = 0;
+  pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &cancel);
+  pthread_mutex_lock(&(rx->mtx));
+  if( flags == ACK && dlen == 0 && len <= HDR_WIDE && ack != rx->lastack ) {
+    memcpy(rx->held, buf, len);
+    rx->hlen = len;
+    rx->lastack = ack;
+    if( ++(rx->nheld) >= MC_ACKS )
+      rx_flush(gate, rx);
+  } else {			/* DUPACK, FIN, handshake. */
+    rx_flush(gate, rx);
+    stat = dtp_udp_transport.send(gate, buf, len);
+  }
+  pthread_mutex_unlock(&(rx->mtx));
+  pthread_setcancelstate(cancel, NULL);
+  return stat;
+}
+
+/* Group packets from the sender's port are the sender's. */
+static ssize_t rx_recv (struct dtp_gate *gate, void *buf, size_t len,
+			struct sockaddr_in *from) {
+  struct mc_rx *rx = (struct mc_rx *) gate->tpctx;
+  while( 1 ) {
+    int i;
+    for( i = 0; i < 2; i++ ) {
+      int group = (rx->turn + i) & 1;
+      ssize_t n = dtp_udp_recvmsg(group ? rx->fd : gate->socket, buf, len,
+				  from, MSG_DONTWAIT, rx->kdrops + group);
+      if( n < 0 ) {
+	if( errno != EAGAIN && errno != EWOULDBLOCK )
+	  return -1;
+	continue;
+      }
+      gate->kdrops = rx->kdrops[0] + rx->kdrops[1];
+      rx->turn = !group;
+      if( group ) {
+	if( from->sin_port != gate->addr.sin_port )
+	  break;		/* Someone else on the group. */
+	*from = gate->addr;
+      }
+      return n;
+    }
+    if( i < 2 )
+      continue;
+
+    /* Nothing queued : the ACK held back goes out before sleeping. */
+    int cancel;
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &cancel);
+    pthread_mutex_lock(&(rx->mtx));
+    rx_flush(gate, rx);
+    pthread_mutex_unlock(&(rx->mtx));
+    pthread_setcancelstate(cancel, NULL);
+
+    struct pollfd pfd[2];
+    pfd[0].fd = gate->socket;
+    pfd[1].fd = rx->fd;
+    pfd[0].events = pfd[1].events = POLLIN;
+    int stat = poll(pfd, 2, gate->timeout > 0 ?
+		    (int) ((gate->timeout + 999) / 1000) : -1);
+    if( stat == 0 ) {
+      errno = EAGAIN;
+      return -1;
+    }
+    if( stat < 0 && errno != EINTR )
+      return -1;
+  }
+}
+
+static int rx_timeout (struct dtp_gate *gate, long usec) {
+  return dtp_udp_transport.timeout(gate, usec);
+}
+
+static unsigned long long rx_now (struct dtp_gate *gate) {
+  return dtp_udp_transport.now(gate);
+}
+
+static int rx_wait (struct dtp_gate *gate, pthread_cond_t *cv,
+		    pthread_mutex_t *mtx, unsigned long long deadline) {
+  return dtp_udp_transport.wait(gate, cv, mtx, deadline);
+}
+
+static void rx_wake (struct dtp_gate *gate, pthread_cond_t *cv) {
+  dtp_udp_transport.wake(gate, cv);
+}
+
+static int rx_spawn (struct dtp_gate *gate, pthread_t *tid,
+		     void *(*daemon)(void*)) {
+  return dtp_udp_transport.spawn(gate, tid, daemon);
+}
+
+static void rx_stop (struct dtp_gate *gate, pthread_t tid) {
+  dtp_udp_transport.stop(gate, tid);
+}
+
+static struct dtp_wheel * rx_wheel (struct dtp_gate *gate) {
+  return dtp_udp_transport.wheel(gate);
+}
+
+/* Daemons are stopped by now. Closing the socket leaves the group. */
+static void rx_release (struct dtp_gate *gate) {
+  struct mc_rx *rx = (struct mc_rx *) gate->tpctx;
+  close(rx->fd);
+  pthread_mutex_destroy(&(rx->mtx));
+  free(rx);
+  gate->tp = &dtp_udp_transport;
+  gate->tpctx = NULL;
+}
+
+static const struct dtp_transport dtp_mcast_transport = {
+  rx_send,
+  rx_recv,
+  rx_timeout,
+  rx_now,
+  rx_wait,
+  rx_wake,
+  rx_spawn,
+  rx_stop,
+  rx_wheel,
+  NULL,
+  rx_release,
+  NULL
+};
+
+/* Address of the interface the sender is reached through. */
+static int local_iface (struct dtp_gate *gate, struct in_addr *ifa) {
+  struct sockaddr_in self;
+  socklen_t socklen = sizeof(struct sockaddr_in);
+  int fd = socket(AF_INET, SOCK_DGRAM, 0);
+  if( fd < 0 )
+    return -1;
+  int stat = connect(fd, (struct sockaddr*) &(gate->addr),
+		     sizeof(struct sockaddr_in));
+  if( stat == 0 )
+    stat = getsockname(fd, (struct sockaddr*) &self, &socklen);
+  close(fd);
+  if( stat == 0 )
+    *ifa = self.sin_addr;
+  return stat;
+}
+
+int dtp_mcast_attach (struct dtp_gate *gate,
+		      const struct dtp_mcast_group *group) {
+  if( gate->tp != &dtp_udp_transport )
+    return -1;
+  if( !IN_MULTICAST(ntohl(group->addr)) )
+    return -1;
+
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = group->port;
+  addr.sin_addr.s_addr = group->addr;
+  struct ip_mreq mreq;
+  mreq.imr_multiaddr = addr.sin_addr;
+  if( local_iface(gate, &(mreq.imr_interface)) != 0 )
+    return -1;
+
+  struct mc_rx *rx = calloc(1, sizeof(struct mc_rx));
+  if( rx == NULL )
+    return -1;
+  /* Every receiver on this host binds the group's port. */
+  int optval = 1;
+  rx->fd = socket(AF_INET, SOCK_DGRAM, 0);
+  if( rx->fd < 0 ||
+      setsockopt(rx->fd, SOL_SOCKET, SO_REUSEADDR,
+		 &optval, sizeof(optval)) < 0 ||
+      bind(rx->fd, (struct sockaddr*) &addr, sizeof(addr)) < 0 ||
+      setsockopt(rx->fd, IPPROTO_IP, IP_ADD_MEMBERSHIP,
+		 &mreq, sizeof(mreq)) < 0 ) {
+    if( rx->fd >= 0 )
+      close(rx->fd);
+    free(rx);
+    return -1;
+  }
+  dtp_udp_buffers(rx->fd, gate->mxw, gate->sockbuf);
+  pthread_mutex_init(&(rx->mtx), NULL);
+
+  gate->tp = &dtp_mcast_transport;
+  gate->tpctx = rx;
+  return 0;
+}
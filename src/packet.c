@@ -1,7 +1,9 @@
 #include "types.h"
 #include "packet.h"
+#include "transport.h"
 
 #include <string.h>
+#include <stdint.h>
 
 #include <sys/socket.h>
 #include <errno.h>
@@ -24,22 +26,113 @@ int validate_address (const struct sockaddr_in *addr0,
   return 0;
 }
 
-int send_pkt (struct dtp_gate* gate, const packet_t *packet) {
-  static socklen_t socklen = sizeof(struct sockaddr_in);
-  ssize_t stat = sendto(gate->socket,
-			packet,
-			sizeof(packet_t) - PAYLOAD + packet->len,
-			0,
-			(const struct sockaddr*) &(gate->addr),
-			socklen);
+seq_t seq_expand (seq_t ref, seq_t low) {
+  seq_t x = (ref & ~0xffffffffull) | (low & 0xffffffffull);
+  if( x + 0x80000000ull < ref )
+    x += 1ull << 32;
+  else if( x > ref + 0x80000000ull && x >= (1ull << 32) )
+    x -= 1ull << 32;
+  return x;
+}
+
+static void put16 (byte_t *p, unsigned v) {
+  uint16_t x = v;
+  memcpy(p, &x, sizeof(x));
+}
+
+static void put32 (byte_t *p, unsigned v) {
+  uint32_t x = v;
+  memcpy(p, &x, sizeof(x));
+}
+
+static unsigned get16 (const byte_t *p) {
+  uint16_t x;
+  memcpy(&x, p, sizeof(x));
+  return x;
+}
+
+static unsigned get32 (const byte_t *p) {
+  uint32_t x;
+  memcpy(&x, p, sizeof(x));
+  return x;
+}
+
+/* Header this gate sends, and expects. Always basic during the
+   handshake. */
+static size_t hdr_size (const struct dtp_gate *gate) {
+  return gate->status != IDLE && (gate->feat & FEAT_WIDE) ?
+    HDR_WIDE : HDR_BASIC;
+}
+
+/* Write the header in front of the data. Returns its size. */
+static size_t encode (const struct dtp_gate *gate, packet_t *packet) {
+  size_t n = hdr_size(gate);
+  byte_t *h = packet->data - n;
+  flag_t flags = packet->flags;
+  if( n == HDR_WIDE ) {
+    flags |= WIDE;
+    put32(h + 16, packet->seq >> 32);
+    put32(h + 20, packet->ack >> 32);
+    put16(h + 24, packet->wptr >> 16);
+  }
+  put32(h, packet->seq);
+  put32(h + 4, packet->ack);
+  put16(h + 8, packet->wptr);
+  put16(h + 10, packet->len);
+  put16(h + 12, packet->wsz);
+  put16(h + 14, flags);
+  return n;
+}
+
+/* Read a header received at h and move the data in place. */
+static int decode (const struct dtp_gate *gate, packet_t *packet,
+		   const byte_t *h, size_t got) {
+  if( got < HDR_BASIC )
+    return RCV_BADPKT;
+  seq_t seq = get32(h), ack = get32(h + 4);
+  wptr_t wptr = get16(h + 8);
+  len_t len = get16(h + 10);
+  flag_t flags = get16(h + 14);
+  size_t n = HDR_BASIC;
+  if( flags & WIDE ) {
+    if( got < HDR_WIDE )
+      return RCV_BADPKT;
+    seq |= (seq_t) get32(h + 16) << 32;
+    ack |= (seq_t) get32(h + 20) << 32;
+    wptr |= (wptr_t) get16(h + 24) << 16;
+    flags &= ~WIDE;
+    n = HDR_WIDE;
+  } else if( flags & ACK ) {
+    ack = seq_expand(flags & URG ? gate->poseqno : gate->seqno, ack);
+  } else if( flags & URG ) {	/* Priority channel, see dtp_send_prio. */
+    seq = seq_expand(gate->prackno, seq);
+  } else if( !(flags & FEC) ) {	/* Parity carries no real seq. */
+    seq = seq_expand(gate->ackno, seq);
+  }
+  if( len > PAYLOAD || len > got - n )
+    return RCV_BADPKT;
+  if( h + n != packet->data )	/* Other header than expected. */
+    memmove(packet->data, h + n, len);
+  packet->seq = seq;
+  packet->ack = ack;
+  packet->wptr = wptr;
+  packet->len = len;
+  packet->wsz = get16(h + 12);
+  packet->flags = flags;
+  return RCV_OK;
+}
+
+int send_pkt (struct dtp_gate* gate, packet_t *packet) {
+  size_t n = encode(gate, packet);
+  int stat = gate->tp->send(gate, packet->data - n, n + packet->len);
 
 #ifdef PACKET_TRACE
   if((packet->flags)&ACK) {
-    fprintf(stderr, ">>> ACK(%u)\n", packet->ack);
+    fprintf(stderr, ">>> ACK(%llu)\n", packet->ack);
   } else if((packet->flags)&FIN) {
-    fprintf(stderr, ">>> FIN(%u/%u)\n", packet->seq, packet->ack);
+    fprintf(stderr, ">>> FIN(%llu/%llu)\n", packet->seq, packet->ack);
   } else {
-    fprintf(stderr, ">>> DAT(%u)\n", packet->seq);
+    fprintf(stderr, ">>> DAT(%llu)\n", packet->seq);
   }
   fflush(stderr);
 #endif
@@ -47,47 +140,71 @@ int send_pkt (struct dtp_gate* gate, const packet_t *packet) {
   return stat < 0 ? -1 : 0;
 }
 
+int send_pkt_to (struct dtp_gate* gate, packet_t *packet,
+		 const struct sockaddr_in *to) {
+  if( gate->socket < 0 )
+    return -1;
+  size_t n = encode(gate, packet);
+  ssize_t stat = sendto(gate->socket, packet->data - n, n + packet->len, 0,
+			(const struct sockaddr *) to, sizeof(*to));
+  return stat < 0 ? -1 : 0;
+}
+
 int recv_pkt (struct dtp_gate* gate, packet_t *packet) {
-  static socklen_t socklen = sizeof(struct sockaddr_in);
   struct sockaddr_in recv_addr;	/* Recieved address. */
-  ssize_t stat = recvfrom(gate->socket,
-			  packet,
-			  sizeof(packet_t),
-			  0,
-			  (struct sockaddr*) &recv_addr,
-			  &socklen);
+  size_t n = hdr_size(gate);
+  byte_t *h = packet->data - n;
+  ssize_t stat = gate->tp->recv(gate,
+				h,
+				n + PAYLOAD,
+				&recv_addr);
   if ( stat < 0 ) {
     if( errno != EAGAIN && errno != EWOULDBLOCK )
       return RCV_ERROR;
     return RCV_TIMEOUT;
   }
 
+  if( validate_address(&recv_addr, &(gate->addr)) != 0 )
+    return RCV_WRHOST;
+  if( decode(gate, packet, h, stat) != RCV_OK )
+    return RCV_BADPKT;
+
 #ifdef PACKET_TRACE
   if((packet->flags)&ACK) {
-    fprintf(stderr, "<<< ACK(%u)\n", packet->ack);
+    fprintf(stderr, "<<< ACK(%llu)\n", packet->ack);
   } else if((packet->flags)&FIN) {
-    fprintf(stderr, "<<< FIN(%u/%u)\n", packet->seq, packet->ack);
+    fprintf(stderr, "<<< FIN(%llu/%llu)\n", packet->seq, packet->ack);
   } else {
-    fprintf(stderr, "<<< DAT(%u)\n", packet->seq);
+    fprintf(stderr, "<<< DAT(%llu)\n", packet->seq);
   }
   fflush(stderr);
 #endif
 
-  stat = validate_address(&recv_addr, &(gate->addr));
-  return stat != 0 ? RCV_WRHOST : RCV_OK;
+  return RCV_OK;
+}
+
+int recv_any (struct dtp_gate* gate, packet_t *packet,
+	      struct sockaddr_in *from) {
+  size_t n = hdr_size(gate);
+  byte_t *h = packet->data - n;
+  ssize_t stat = gate->tp->recv(gate, h, n + PAYLOAD, from);
+  if ( stat < 0 ) {
+    if( errno != EAGAIN && errno != EWOULDBLOCK )
+      return RCV_ERROR;
+    return RCV_TIMEOUT;
+  }
+  return decode(gate, packet, h, stat);
 }
 
 int detect_pkt (dtp_server* server, packet_t *packet) {
-  static socklen_t socklen = sizeof(struct sockaddr_in);
-  ssize_t stat = recvfrom(server->socket,
-			  packet,
-			  sizeof(packet_t),
-			  0,
-			  (struct sockaddr*) &(server->addr),
-			  &socklen);
+  byte_t *h = packet->data - HDR_BASIC;
+  ssize_t stat = server->tp->recv(server,
+				  h,
+				  HDR_BASIC + PAYLOAD,
+				  &(server->addr));
   if ( stat < 0 )
     return RCV_ERROR;
-  return RCV_OK;
+  return decode(server, packet, h, stat);
 }
 
 int make_pkt (packet_t *packet,
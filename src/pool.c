@@ -0,0 +1,247 @@
+#define _GNU_SOURCE		/* MAP_HUGETLB, MADV_HUGEPAGE */
+
+#include "pool.h"
+#include "packet.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#ifndef MADV_POPULATE_WRITE
+#define MADV_POPULATE_WRITE 23	/* Linux 5.14. */
+#endif
+
+#define HUGE_SZ (2ul << 20)
+#define POOL_HDR 64		/* Header room, keeps packets aligned. */
+
+enum { BUF_HEAP, BUF_MMAP, BUF_THP, BUF_HUGETLB };
+
+/* Sits at the start of every buffer, inbuf follows. */
+struct pool_buf {
+  struct pool_buf *next;	/* Idle list. */
+  size_t size;			/* Mapped bytes. */
+  size_t mxw;
+  int kind;
+  int node;			/* NUMA node it was faulted in on. */
+};
+
+static struct {
+  pthread_mutex_t mtx;
+  size_t budget;
+  struct pool_buf *idle;
+  struct dtp_poolstats st;
+} pool = { PTHREAD_MUTEX_INITIALIZER, POOL_BUDGET, NULL, { 0 } };
+
+static size_t buf_bytes (size_t mxw) {
+  return POOL_HDR + 2 * mxw * sizeof(packet_t) + mxw;
+}
+
+static int cur_node (void) {
+  unsigned cpu, node;
+  if( syscall(SYS_getcpu, &cpu, &node, NULL) != 0 )
+    return 0;
+  return node;
+}
+
+/* Fault a mapping in, on the caller's node. */
+static void populate (void *p, size_t size) {
+  if( madvise(p, size, MADV_POPULATE_WRITE) == 0 )
+    return;
+  size_t pg = sysconf(_SC_PAGESIZE), i;
+  for( i = 0; i < size; i += pg )
+    ((volatile byte_t*)p)[i] = 0;
+}
+
+/* Map a buffer, faulted in right away if prefault. */
+static struct pool_buf *map_buf (size_t mxw, int prefault) {
+  size_t need = buf_bytes(mxw), size;
+  void *p = MAP_FAILED;
+  int kind = BUF_MMAP;
+  int pop = prefault ? MAP_POPULATE : 0;
+
+  if( need >= HUGE_SZ ) {
+    size = (need + HUGE_SZ - 1) & ~(HUGE_SZ - 1);
+    p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+	     MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | pop, -1, 0);
+    if( p != MAP_FAILED )
+      kind = BUF_HUGETLB;
+  }
+  if( p == MAP_FAILED && need >= HUGE_SZ && prefault ) {
+    /* None reserved. Map 2MiB aligned so that THP can back it. Only
+       when asked to fault it in : THP would make every fresh gate
+       resident in 2MiB steps. */
+    byte_t *raw = mmap(NULL, size + HUGE_SZ, PROT_READ | PROT_WRITE,
+		       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if( raw == MAP_FAILED )
+      return NULL;
+    size_t lead = (HUGE_SZ - ((uintptr_t)raw & (HUGE_SZ - 1))) & (HUGE_SZ - 1);
+    if( lead > 0 )
+      munmap(raw, lead);
+    munmap(raw + lead + size, HUGE_SZ - lead);
+    p = raw + lead;
+    kind = madvise(p, size, MADV_HUGEPAGE) == 0 ? BUF_THP : BUF_MMAP;
+    populate(p, size);
+  }
+  if( p == MAP_FAILED ) {
+    size_t pg = sysconf(_SC_PAGESIZE);
+    size = (need + pg - 1) & ~(pg - 1);
+    p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+	     MAP_PRIVATE | MAP_ANONYMOUS | pop, -1, 0);
+    if( p == MAP_FAILED )
+      return NULL;
+  }
+
+  struct pool_buf *buf = p;
+  buf->next = NULL;
+  buf->size = size;
+  buf->mxw = mxw;
+  buf->kind = kind;
+  buf->node = cur_node();
+  return buf;
+}
+
+static void unmap_buf (struct pool_buf *buf) {
+  munmap(buf, buf->size);
+}
+
+/* Huge page accounting, called with pool.mtx held. */
+static void count_buf (struct pool_buf *buf, long d) {
+  if( buf->kind == BUF_HUGETLB )
+    pool.st.hugetlb += d;
+  else if( buf->kind == BUF_THP )
+    pool.st.thp += d;
+}
+
+/* Park a buffer, or hand it back if over budget. Takes pool.mtx. */
+static void park (struct pool_buf *buf) {
+  pthread_mutex_lock(&(pool.mtx));
+  if( buf->kind != BUF_HEAP &&
+      pool.st.idle_bytes + buf->size <= pool.budget ) {
+    buf->next = pool.idle;
+    pool.idle = buf;
+    pool.st.idle++;
+    pool.st.idle_bytes += buf->size;
+    buf = NULL;
+  } else if( buf->kind != BUF_HEAP )
+    count_buf(buf, -1);
+  pthread_mutex_unlock(&(pool.mtx));
+
+  if( buf == NULL )
+    return;
+  if( buf->kind == BUF_HEAP )
+    free(buf);
+  else
+    unmap_buf(buf);
+}
+
+/* -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- */
+
+void dtp_pool_config (size_t budget) {
+  pthread_mutex_lock(&(pool.mtx));
+  pool.budget = budget;
+  pthread_mutex_unlock(&(pool.mtx));
+  if( budget == 0 )
+    dtp_pool_drain();
+}
+
+int dtp_pool_reserve (size_t mxw, size_t count) {
+  while( count-- > 0 ) {
+    struct pool_buf *buf = map_buf(mxw, 1);
+    if( buf == NULL )
+      return -1;
+    pthread_mutex_lock(&(pool.mtx));
+    count_buf(buf, 1);
+    pthread_mutex_unlock(&(pool.mtx));
+    park(buf);
+  }
+  return 0;
+}
+
+void dtp_pool_drain (void) {
+  pthread_mutex_lock(&(pool.mtx));
+  struct pool_buf *buf = pool.idle, *next;
+  pool.idle = NULL;
+  for( next = buf; next != NULL; next = next->next )
+    count_buf(next, -1);
+  pool.st.idle = pool.st.idle_bytes = 0;
+  pthread_mutex_unlock(&(pool.mtx));
+  for( ; buf != NULL; buf = next ) {
+    next = buf->next;
+    unmap_buf(buf);
+  }
+}
+
+void dtp_pool_stats (struct dtp_poolstats *st) {
+  pthread_mutex_lock(&(pool.mtx));
+  *st = pool.st;
+  pthread_mutex_unlock(&(pool.mtx));
+}
+
+/* -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- */
+
+int pool_get (struct dtp_gate *gate) {
+  struct pool_buf *buf = NULL;
+  int node = cur_node();
+
+  pthread_mutex_lock(&(pool.mtx));
+  if( pool.budget == 0 ) {
+    pthread_mutex_unlock(&(pool.mtx));
+    buf = calloc(1, buf_bytes(gate->mxw));
+    if( buf == NULL )
+      return -1;
+    buf->mxw = gate->mxw;
+    buf->kind = BUF_HEAP;
+  } else {
+    /* Same window, same node if there is one. */
+    struct pool_buf **pp, **hit = NULL;
+    for( pp = &(pool.idle); *pp != NULL; pp = &((*pp)->next) ) {
+      if( (*pp)->mxw != gate->mxw )
+	continue;
+      if( hit == NULL || (*pp)->node == node )
+	hit = pp;
+      if( (*pp)->node == node )
+	break;
+    }
+    if( hit != NULL ) {
+      buf = *hit;
+      *hit = buf->next;
+      pool.st.idle--;
+      pool.st.idle_bytes -= buf->size;
+      pool.st.hits++;
+    } else
+      pool.st.misses++;
+    pthread_mutex_unlock(&(pool.mtx));
+
+    if( buf == NULL ) {
+      buf = map_buf(gate->mxw, 0);
+      if( buf == NULL )
+	return -1;
+      pthread_mutex_lock(&(pool.mtx));
+      count_buf(buf, 1);
+      pthread_mutex_unlock(&(pool.mtx));
+    }
+  }
+
+  byte_t *p = (byte_t*)buf + POOL_HDR;
+  gate->inbuf = (packet_t*)p;
+  gate->outbuf = gate->inbuf + gate->mxw;
+  gate->rcvf = (byte_t*)(gate->outbuf + gate->mxw);
+  return 0;
+}
+
+void pool_put (struct dtp_gate *gate) {
+  if( gate->inbuf == NULL )
+    return;
+  struct pool_buf *buf = (struct pool_buf*)((byte_t*)gate->inbuf - POOL_HDR);
+  /* Stale packets are never read before being overwritten; only the
+     received flags must start clear. */
+  memset(gate->rcvf, 0, buf->mxw);
+  gate->inbuf = gate->outbuf = NULL;
+  gate->rcvf = NULL;
+  park(buf);
+}
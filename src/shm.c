@@ -0,0 +1,418 @@
+#define _GNU_SOURCE		/* memfd_create */
+
+#include "shm.h"
+#include "packet.h"
+#include "transport.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/random.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#define SHM_MAGIC 0x31306d6873505444ull /* "DTPshm01" */
+#define SHM_HDR 4096		/* Header page, rings follow. */
+
+enum { CONS, PROD };		/* Sides of a ring. */
+
+/**
+   Single producer, single consumer byte ring in the segment. head
+   and tail count bytes for ever and sit on lines of their own.
+ */
+struct shm_ring {
+  uint64_t head __attribute__((aligned(64))); /* Written by the producer. */
+  uint64_t tail __attribute__((aligned(64))); /* Written by the consumer. */
+  uint32_t sig[2] __attribute__((aligned(64))); /* Futex words, bumped to
+						   wake that side. */
+  int sleep[2];			/* That side sleeps on sig. */
+  int arm[2];			/* That side waits on its dtp_fd. */
+  int fin;			/* Producer has closed. */
+  uint64_t off, size;		/* Data, from the segment start. */
+};
+
+/* Ring (class, direction) : 0 client to server, 1 back. */
+#define RING(prio, dir) (2 * (prio) + (dir))
+
+struct shm_seg {
+  uint64_t magic, cookie;
+  struct shm_ring ring[4];
+};
+
+/* One end of a ring, in this process. Where and how large the ring
+   is was read once : the peer could change it in the segment since. */
+struct shm_end {
+  struct shm_ring *r;
+  byte_t *data;
+  uint64_t size;
+  pthread_mutex_t mtx;		/* Callers of the gate on this end. */
+};
+
+struct dtp_shm {
+  struct shm_seg *seg;
+  size_t len;			/* Mapped bytes. */
+  int fd;			/* Server's memfd, -1 on the client. */
+  size_t mxw;
+  struct shm_end tx[2], rx[2];	/* By class. */
+};
+
+static int futex (uint32_t *word, int op, uint32_t val) {
+  return syscall(SYS_futex, word, op, val, NULL, NULL, 0);
+}
+
+int shm_bootid (char *id) {
+  int fd = open("/proc/sys/kernel/random/boot_id", O_RDONLY | O_CLOEXEC);
+  if( fd < 0 )
+    return -1;
+  ssize_t n = read(fd, id, SHM_BOOTID);
+  close(fd);
+  return n == SHM_BOOTID ? 0 : -1;
+}
+
+int shm_local (const byte_t *id, size_t len) {
+  char self[SHM_BOOTID];
+  return len >= SHM_BOOTID && shm_bootid(self) == 0 &&
+    memcmp(self, id, SHM_BOOTID) == 0;
+}
+
+/* Point this process's ends at the rings, at offsets off and of size
+   bytes by ring. dir is the one it sends on. */
+static void shm_bind (struct dtp_shm *s, int dir, const uint64_t *off,
+		      const uint64_t *size) {
+  int prio;
+  for( prio = 0; prio < 2; prio++ ) {
+    struct shm_end *e[2] = { &(s->tx[prio]), &(s->rx[prio]) };
+    int i;
+    for( i = 0; i < 2; i++ ) {
+      int k = RING(prio, i ? !dir : dir);
+      e[i]->r = &(s->seg->ring[k]);
+      e[i]->data = (byte_t *) s->seg + off[k];
+      e[i]->size = size[k];
+      pthread_mutex_init(&(e[i]->mtx), NULL);
+    }
+  }
+}
+
+int shm_create (struct dtp_gate *gate, size_t mxw, struct shm_offer *off) {
+  shm_free(gate);
+  struct dtp_shm *s = (struct dtp_shm *) calloc(1, sizeof(struct dtp_shm));
+  if( s == NULL )
+    return -1;
+  size_t bulk = mxw * PAYLOAD;
+  s->len = SHM_HDR + 2 * bulk + 2 * (size_t) DTP_PRIO_BUF;
+  s->mxw = mxw;
+  s->fd = memfd_create("dtp", MFD_CLOEXEC);
+  if( s->fd < 0 || ftruncate(s->fd, s->len) != 0 )
+    goto fail;
+  s->seg = mmap(NULL, s->len, PROT_READ | PROT_WRITE, MAP_SHARED, s->fd, 0);
+  if( s->seg == MAP_FAILED )
+    goto fail;
+
+  uint64_t at = SHM_HDR, pos[4], size[4];
+  int i;
+  for( i = 0; i < 4; i++ ) {	/* Bulk rings first. */
+    struct shm_ring *r = &(s->seg->ring[i]);
+    r->size = size[i] = i < 2 ? bulk : DTP_PRIO_BUF;
+    r->off = pos[i] = at;
+    at += size[i];
+  }
+  if( getrandom(&(s->seg->cookie), sizeof(s->seg->cookie), 0) !=
+      sizeof(s->seg->cookie) )
+    s->seg->cookie = gate_now(gate) ^ ((uint64_t) getpid() << 32);
+  __atomic_store_n(&(s->seg->magic), SHM_MAGIC, __ATOMIC_RELEASE);
+
+  shm_bind(s, 1, pos, size);
+  off->pid = getpid();
+  off->fd = s->fd;
+  off->cookie = s->seg->cookie;
+  gate->shm = s;
+  return 0;
+
+ fail:
+  if( s->fd >= 0 )
+    close(s->fd);
+  free(s);
+  return -1;
+}
+
+int shm_attach (struct dtp_gate *gate, const struct shm_offer *off) {
+  char path[64];
+  struct stat st;
+  snprintf(path, sizeof(path), "/proc/%u/fd/%d", off->pid, off->fd);
+  int fd = open(path, O_RDWR | O_CLOEXEC);
+  if( fd < 0 )
+    return -1;
+  if( fstat(fd, &st) != 0 || (size_t) st.st_size < SHM_HDR ) {
+    close(fd);
+    return -1;
+  }
+  struct shm_seg *seg = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE,
+			     MAP_SHARED, fd, 0);
+  close(fd);			/* The mapping holds it. */
+  if( seg == MAP_FAILED )
+    return -1;
+
+  /* Someone else's descriptor of that number : not our server. */
+  int ok = __atomic_load_n(&(seg->magic), __ATOMIC_ACQUIRE) == SHM_MAGIC &&
+    seg->cookie == off->cookie;
+  uint64_t at[4], size[4];
+  int i;
+  for( i = 0; ok && i < 4; i++ ) {
+    at[i] = __atomic_load_n(&(seg->ring[i].off), __ATOMIC_RELAXED);
+    size[i] = __atomic_load_n(&(seg->ring[i].size), __ATOMIC_RELAXED);
+    ok = at[i] >= SHM_HDR && size[i] > 0 && (size[i] & (size[i] - 1)) == 0 &&
+      size[i] <= (uint64_t) st.st_size && at[i] <= (uint64_t) st.st_size - size[i];
+  }
+  struct dtp_shm *s = ok ? (struct dtp_shm *) calloc(1, sizeof(struct dtp_shm)) : NULL;
+  if( s == NULL ) {
+    munmap(seg, st.st_size);
+    return -1;
+  }
+  s->seg = seg;
+  s->len = st.st_size;
+  s->fd = -1;
+  s->mxw = size[RING(DTP_PRIO_BULK, 0)] / PAYLOAD;
+  shm_bind(s, 0, at, size);
+  gate->shm = s;
+  return 0;
+}
+
+void shm_free (struct dtp_gate *gate) {
+  struct dtp_shm *s = gate->shm;
+  if( s == NULL )
+    return;
+  int i;
+  for( i = 0; i < 2; i++ ) {
+    pthread_mutex_destroy(&(s->tx[i].mtx));
+    pthread_mutex_destroy(&(s->rx[i].mtx));
+  }
+  munmap(s->seg, s->len);
+  if( s->fd >= 0 )
+    close(s->fd);
+  free(s);
+  gate->shm = NULL;
+}
+
+size_t shm_window (struct dtp_gate *gate) {
+  return gate->shm->mxw;
+}
+
+/* -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- */
+/* Rings. */
+
+/* Bytes in the ring. More than it holds : the peer broke it. */
+static size_t ring_used (const struct shm_end *e) {
+  return __atomic_load_n(&(e->r->head), __ATOMIC_ACQUIRE) -
+    __atomic_load_n(&(e->r->tail), __ATOMIC_ACQUIRE);
+}
+
+/* Something to read, or nothing more to come. */
+static int can_read (const struct shm_end *e) {
+  return ring_used(e) > 0 || __atomic_load_n(&(e->r->fin), __ATOMIC_ACQUIRE);
+}
+
+/* Priority data, fin aside : dtp_events reports it as for UDP. */
+static int has_data (const struct shm_end *e) {
+  return ring_used(e) > 0;
+}
+
+/* Room enough to be worth waking a blocked writer for, or a broken
+   ring to report. */
+static int can_write (const struct shm_end *e) {
+  size_t used = ring_used(e);
+  return used > e->size || e->size - used >= e->size >> 3;
+}
+
+/**
+   Wake side who of a ring if it sleeps or waits on its dtp_fd, after
+   this side moved head, tail or fin. The fence pairs with the one in
+   ring_wait / ring_arm : either they see the move or we see them.
+ */
+static void ring_kick (struct dtp_gate *gate, struct shm_ring *r, int who) {
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if( __atomic_load_n(&(r->sleep[who]), __ATOMIC_RELAXED) ) {
+    __atomic_add_fetch(&(r->sig[who]), 1, __ATOMIC_RELEASE);
+    futex(&(r->sig[who]), FUTEX_WAKE, 1);
+  }
+  if( __atomic_load_n(&(r->arm[who]), __ATOMIC_RELAXED) &&
+      __atomic_exchange_n(&(r->arm[who]), 0, __ATOMIC_ACQ_REL) ) {
+    packet_t bell;		/* Doorbell, see the receiver in core.inc. */
+    make_pkt(&bell, 0, 0, 0, 0, 0, 0, NULL);
+    send_pkt(gate, &bell);
+  }
+}
+
+/* Block side who until ready, spinning first within DTP_BUSYPOLL. */
+static void ring_wait (struct dtp_gate *gate, struct shm_end *e, int who,
+		       int (*ready) (const struct shm_end *)) {
+  struct shm_ring *r = e->r;
+  unsigned long long end = gate->spin > 0 ? gate_now(gate) + gate->spin : 0;
+  while( !ready(e) ) {
+    if( end != 0 && gate_now(gate) < end ) {
+      dtp_relax();
+      continue;
+    }
+    uint32_t seen = __atomic_load_n(&(r->sig[who]), __ATOMIC_ACQUIRE);
+    __atomic_store_n(&(r->sleep[who]), 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if( !ready(e) )
+      futex(&(r->sig[who]), FUTEX_WAIT, seen);
+    __atomic_store_n(&(r->sleep[who]), 0, __ATOMIC_RELAXED);
+  }
+}
+
+/* Ask for a doorbell on side who. Returns nonzero if ready already. */
+static int ring_arm (struct shm_end *e, int who,
+		     int (*ready) (const struct shm_end *)) {
+  __atomic_store_n(&(e->r->arm[who]), 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  return ready(e);
+}
+
+/* Copy up to len bytes in. Returns the bytes taken, -1 if the peer
+   broke the ring. */
+static ssize_t ring_put (struct dtp_gate *gate, struct shm_end *e,
+			 const byte_t *src, size_t len) {
+  struct shm_ring *r = e->r;
+  uint64_t head = r->head;	/* Ours. */
+  size_t used = head - __atomic_load_n(&(r->tail), __ATOMIC_ACQUIRE);
+  if( used > e->size )
+    return -1;
+  if( len > e->size - used )
+    len = e->size - used;
+  if( len == 0 )
+    return 0;
+  size_t at = head & (e->size - 1), run = e->size - at;
+  if( run > len )
+    run = len;
+  memcpy(e->data + at, src, run);
+  memcpy(e->data, src + run, len - run);
+  __atomic_store_n(&(r->head), head + len, __ATOMIC_RELEASE);
+  ring_kick(gate, r, CONS);
+  return len;
+}
+
+/* Copy up to len bytes out. Returns the bytes read, -1 if the peer
+   broke the ring. */
+static ssize_t ring_get (struct dtp_gate *gate, struct shm_end *e,
+			 byte_t *dst, size_t len) {
+  struct shm_ring *r = e->r;
+  uint64_t tail = r->tail;	/* Ours. */
+  size_t used = __atomic_load_n(&(r->head), __ATOMIC_ACQUIRE) - tail;
+  if( used > e->size )
+    return -1;
+  if( len > used )
+    len = used;
+  if( len == 0 )
+    return 0;
+  size_t at = tail & (e->size - 1), run = e->size - at;
+  if( run > len )
+    run = len;
+  memcpy(dst, e->data + at, run);
+  memcpy(dst + run, e->data, len - run);
+  __atomic_store_n(&(r->tail), tail + len, __ATOMIC_RELEASE);
+  if( can_write(e) )		/* No point waking a writer for less. */
+    ring_kick(gate, r, PROD);
+  return len;
+}
+
+/* -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- */
+/* Gate stage. */
+
+/* The peer broke a ring : the connection is as good as reset. */
+static ssize_t ring_broken (struct dtp_gate *gate, struct shm_end *e) {
+  pthread_mutex_unlock(&(e->mtx));
+  gate->reset = 1;
+  errno = EPIPE;
+  return -1;
+}
+
+int shm_send (struct dtp_gate *gate, const void *data, size_t len, int prio) {
+  struct shm_end *e = &(gate->shm->tx[prio]);
+  const byte_t *p = (const byte_t *) data;
+  pthread_mutex_lock(&(e->mtx));
+  while( len > 0 ) {
+    ssize_t n = ring_put(gate, e, p, len);
+    if( n < 0 )
+      return ring_broken(gate, e);
+    if( n == 0 )
+      ring_wait(gate, e, PROD, can_write);
+    p += n;
+    len -= n;
+  }
+  pthread_mutex_unlock(&(e->mtx));
+  return 0;
+}
+
+ssize_t shm_try_send (struct dtp_gate *gate, const void *data, size_t len) {
+  struct shm_end *e = &(gate->shm->tx[DTP_PRIO_BULK]);
+  pthread_mutex_lock(&(e->mtx));
+  ssize_t n = ring_put(gate, e, (const byte_t *) data, len);
+  if( n == 0 && len > 0 && !ring_arm(e, PROD, can_write) ) {
+    pthread_mutex_unlock(&(e->mtx));
+    errno = EAGAIN;
+    return -1;
+  }
+  if( n == 0 )			/* Room came while arming. */
+    n = ring_put(gate, e, (const byte_t *) data, len);
+  if( n < 0 )
+    return ring_broken(gate, e);
+  pthread_mutex_unlock(&(e->mtx));
+  return n;
+}
+
+ssize_t shm_recv (struct dtp_gate *gate, void *data, size_t maxsize,
+		  int prio, int block) {
+  struct shm_end *e = &(gate->shm->rx[prio]);
+  pthread_mutex_lock(&(e->mtx));
+  if( !can_read(e) ) {
+    if( block )
+      ring_wait(gate, e, CONS, can_read);
+    else if( !ring_arm(e, CONS, can_read) ) {
+      pthread_mutex_unlock(&(e->mtx));
+      errno = EAGAIN;
+      return -1;
+    }
+  }
+  ssize_t n = ring_get(gate, e, (byte_t *) data, maxsize);
+  if( n < 0 ) {			/* Reads end, as on an RST. */
+    ring_broken(gate, e);
+    return 0;
+  }
+  pthread_mutex_unlock(&(e->mtx));
+  return n;			/* 0 : finished and drained. */
+}
+
+int shm_events (struct dtp_gate *gate) {
+  struct dtp_shm *s = gate->shm;
+  int ev = 0;
+  if( can_read(&(s->rx[DTP_PRIO_BULK])) ||
+      ring_arm(&(s->rx[DTP_PRIO_BULK]), CONS, can_read) )
+    ev |= DTP_POLLIN;
+  if( has_data(&(s->rx[DTP_PRIO_HIGH])) ||
+      ring_arm(&(s->rx[DTP_PRIO_HIGH]), CONS, has_data) )
+    ev |= DTP_POLLPRI;
+  if( ring_used(&(s->tx[DTP_PRIO_BULK])) < s->tx[DTP_PRIO_BULK].size ||
+      ring_arm(&(s->tx[DTP_PRIO_BULK]), PROD, can_write) )
+    ev |= DTP_POLLOUT;
+  return ev;
+}
+
+void shm_close (struct dtp_gate *gate) {
+  int prio;
+  for( prio = 0; prio < 2; prio++ ) {
+    struct shm_end *e = &(gate->shm->tx[prio]);
+    pthread_mutex_lock(&(e->mtx));
+    __atomic_store_n(&(e->r->fin), 1, __ATOMIC_RELEASE);
+    ring_kick(gate, e->r, CONS);
+    pthread_mutex_unlock(&(e->mtx));
+  }
+}
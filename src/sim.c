@@ -0,0 +1,773 @@
+#include "gate.h"
+#include "transport.h"
+#include "sim.h"
+#include "timer.h"
+
+#include <arpa/inet.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#define SIM_PORTS (1<<16)
+#define SIM_EPHEMERAL 40000
+
+/* Datagram in flight or waiting in a port queue. */
+struct sim_pkt {
+  unsigned long long due, order; /* Delivery time, FIFO tie breaker. */
+  port_t src, dst;
+  size_t len;
+  struct sim_pkt *next;		/* Port queue link. */
+  byte_t data[];
+};
+
+/* One direction of a link. */
+struct sim_link {
+  port_t from, to;
+  struct dtp_link model;
+  int bad;			/* Gilbert-Elliott state. */
+  unsigned long long busy;	/* Bottleneck busy until. */
+  struct sim_link *next;
+};
+
+/* A bound simulated socket. Doubles as the gate's tpctx. */
+struct sim_port {
+  struct dtp_sim *sim;
+  struct sim_pkt *head, *tail;
+};
+
+struct sim_thread {
+  struct dtp_sim *sim;
+  pthread_cond_t cv;		/* Signalled when handed the baton. */
+  pthread_t tid;
+  void *(*fn)(void*);
+  void *arg;
+  int app;			/* Application thread (vs. gate daemon). */
+  int cancelled, timedout;
+  const void *chan;		/* Waited on, NULL if runnable. */
+  unsigned long long deadline;	/* Wait deadline, 0 if none. */
+  struct sim_thread *prev, *next; /* Ready queue or wait list. */
+  struct sim_thread *all;	/* List of live threads. */
+};
+
+struct dtp_sim {
+  pthread_mutex_t mtx;		/* Guards everything below. */
+  pthread_cond_t done;		/* Run / destroy completion. */
+  unsigned long long now;	/* Virtual time (ns). */
+  unsigned long long order, rng;
+  struct dtp_link model;	/* Default link model. */
+  struct sim_link *links;
+  struct sim_port *ports[SIM_PORTS];
+  port_t ephemeral;
+
+  struct sim_pkt **heap;	/* Packets in flight, by delivery time. */
+  size_t heapsz, heapcap;
+
+  struct sim_thread *running;	/* Holder of the baton. */
+  struct sim_thread *rhead, *rtail; /* Ready queue. */
+  struct sim_thread *whead, *wtail; /* Blocked threads. */
+  struct sim_thread *threads;
+  size_t nthreads, apps;
+  int stalled;			/* Nothing can run any more. */
+  struct dtp_sim_stats st;
+
+  struct dtp_wheel wheel;	/* Protocol timers on virtual time. */
+  int wheeled;			/* Wheel and its daemon are up. */
+};
+
+static __thread struct sim_thread *sim_self;
+
+/* -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- */
+/* Helpers. All called with sim->mtx held. */
+
+/* xorshift64*, the only source of randomness in a run. */
+static double uniform (struct dtp_sim *sim) {
+  sim->rng ^= sim->rng >> 12; sim->rng ^= sim->rng << 25; sim->rng ^= sim->rng >> 27;
+  return ((sim->rng * 2685821657736338717ull) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static int earlier (const struct sim_pkt *a, const struct sim_pkt *b) {
+  return a->due != b->due ? a->due < b->due : a->order < b->order;
+}
+
+static int heap_push (struct dtp_sim *sim, struct sim_pkt *p) {
+  if( sim->heapsz == sim->heapcap ) {
+    size_t cap = sim->heapcap ? sim->heapcap << 1 : 1024;
+    struct sim_pkt **heap = realloc(sim->heap, cap * sizeof(*heap));
+    if( heap == NULL )
+      return -1;
+    sim->heap = heap;
+    sim->heapcap = cap;
+  }
+  size_t i = sim->heapsz++;
+  while( i > 0 && earlier(p, sim->heap[(i-1)>>1]) ) {
+    sim->heap[i] = sim->heap[(i-1)>>1];
+    i = (i-1)>>1;
+  }
+  sim->heap[i] = p;
+  return 0;
+}
+
+static struct sim_pkt * heap_pop (struct dtp_sim *sim) {
+  struct sim_pkt *top = sim->heap[0], *last = sim->heap[--sim->heapsz];
+  size_t i = 0;
+  while( 1 ) {
+    size_t c = 2*i + 1;
+    if( c >= sim->heapsz )
+      break;
+    if( c + 1 < sim->heapsz && earlier(sim->heap[c+1], sim->heap[c]) )
+      c++;
+    if( !earlier(sim->heap[c], last) )
+      break;
+    sim->heap[i] = sim->heap[c];
+    i = c;
+  }
+  if( sim->heapsz > 0 )
+    sim->heap[i] = last;
+  return top;
+}
+
+static void ready_push (struct dtp_sim *sim, struct sim_thread *t) {
+  t->chan = NULL;
+  t->next = NULL;
+  t->prev = sim->rtail;
+  if( sim->rtail )
+    sim->rtail->next = t;
+  else
+    sim->rhead = t;
+  sim->rtail = t;
+}
+
+static struct sim_thread * ready_pop (struct dtp_sim *sim) {
+  struct sim_thread *t = sim->rhead;
+  sim->rhead = t->next;
+  if( sim->rhead )
+    sim->rhead->prev = NULL;
+  else
+    sim->rtail = NULL;
+  return t;
+}
+
+static void wait_add (struct dtp_sim *sim, struct sim_thread *t,
+		      const void *chan, unsigned long long deadline) {
+  t->chan = chan;
+  t->deadline = deadline;
+  t->timedout = 0;
+  t->next = NULL;
+  t->prev = sim->wtail;
+  if( sim->wtail )
+    sim->wtail->next = t;
+  else
+    sim->whead = t;
+  sim->wtail = t;
+}
+
+/* Blocked -> ready. */
+static void wake_thread (struct dtp_sim *sim, struct sim_thread *t) {
+  if( t->prev )
+    t->prev->next = t->next;
+  else
+    sim->whead = t->next;
+  if( t->next )
+    t->next->prev = t->prev;
+  else
+    sim->wtail = t->prev;
+  ready_push(sim, t);
+}
+
+static void wake_chan (struct dtp_sim *sim, const void *chan) {
+  struct sim_thread *t = sim->whead, *next;
+  for( ; t != NULL; t = next ) {
+    next = t->next;
+    if( t->chan == chan )
+      wake_thread(sim, t);
+  }
+}
+
+/**
+   Jump to the next event : deliver due packets, expire due waits.
+   Returns 0 if there is no future event at all.
+ */
+static int sim_advance (struct dtp_sim *sim) {
+  int have = sim->heapsz > 0;
+  unsigned long long next = have ? sim->heap[0]->due : 0;
+  struct sim_thread *t, *tn;
+  for( t = sim->whead; t != NULL; t = t->next )
+    if( t->deadline != 0 && (!have || t->deadline < next) ) {
+      next = t->deadline;
+      have = 1;
+    }
+  if( !have )
+    return 0;
+  if( next > sim->now )
+    sim->now = next;
+
+  while( sim->heapsz > 0 && sim->heap[0]->due <= sim->now ) {
+    struct sim_pkt *p = heap_pop(sim);
+    struct sim_port *port = sim->ports[p->dst];
+    if( port == NULL ) {	/* Nobody bound there. */
+      free(p);
+      continue;
+    }
+    p->next = NULL;
+    if( port->tail )
+      port->tail->next = p;
+    else
+      port->head = p;
+    port->tail = p;
+    sim->st.delivered++;
+    wake_chan(sim, port);
+  }
+
+  for( t = sim->whead; t != NULL; t = tn ) {
+    tn = t->next;
+    if( t->deadline != 0 && t->deadline <= sim->now ) {
+      t->timedout = 1;
+      wake_thread(sim, t);
+    }
+  }
+  return 1;
+}
+
+/**
+   Hand the baton to the next ready thread, advancing the clock
+   whenever nothing is ready. Once all application threads are gone
+   the clock stops, and only what is already ready gets to run.
+ */
+static void sim_schedule (struct dtp_sim *sim) {
+  while( sim->rhead == NULL ) {
+    if( sim->apps == 0 || !sim_advance(sim) ) {
+      sim->running = NULL;
+      if( sim->apps > 0 )
+	sim->stalled = 1;	/* Deadlock. */
+      pthread_cond_broadcast(&(sim->done));
+      return;
+    }
+  }
+  sim->running = ready_pop(sim);
+  sim->st.switches++;
+  pthread_cond_signal(&(sim->running->cv));
+}
+
+/* Give up the baton and sleep until it comes back. */
+static void sim_block (struct dtp_sim *sim, struct sim_thread *self) {
+  sim_schedule(sim);
+  while( sim->running != self )
+    pthread_cond_wait(&(self->cv), &(sim->mtx));
+}
+
+/* Retire the calling thread. Releases sim->mtx. */
+static void sim_exit (struct dtp_sim *sim, struct sim_thread *self) {
+  struct sim_thread **pt = &(sim->threads);
+  while( *pt != self )
+    pt = &((*pt)->all);
+  *pt = self->all;
+  sim->nthreads--;
+  if( self->app )
+    sim->apps--;
+  if( sim->running == self )
+    sim_schedule(sim);
+  pthread_cond_broadcast(&(sim->done));
+  pthread_mutex_unlock(&(sim->mtx));
+  pthread_cond_destroy(&(self->cv));
+  free(self);
+}
+
+static void sim_check_cancel (struct dtp_sim *sim, struct sim_thread *self) {
+  if( self->cancelled ) {
+    sim_exit(sim, self);
+    pthread_exit(NULL);
+  }
+}
+
+static void * sim_trampoline (void *arg) {
+  struct sim_thread *self = (struct sim_thread *) arg;
+  struct dtp_sim *sim = self->sim;
+  sim_self = self;
+
+  pthread_mutex_lock(&(sim->mtx));
+  while( sim->running != self )
+    pthread_cond_wait(&(self->cv), &(sim->mtx));
+  sim_check_cancel(sim, self);
+  pthread_mutex_unlock(&(sim->mtx));
+
+  void *ret = self->fn(self->arg);
+
+  pthread_mutex_lock(&(sim->mtx));
+  sim_exit(sim, self);
+  return ret;
+}
+
+static int sim_spawn (struct dtp_sim *sim, pthread_t *tid,
+		      void *(*fn)(void*), void *arg, int app) {
+  struct sim_thread *t = calloc(1, sizeof(struct sim_thread));
+  if( t == NULL )
+    return -1;
+  t->sim = sim;
+  t->fn = fn;
+  t->arg = arg;
+  t->app = app;
+  pthread_cond_init(&(t->cv), NULL);
+
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  t->all = sim->threads;
+  sim->threads = t;
+  sim->nthreads++;
+  sim->apps += app;
+  ready_push(sim, t);
+  int stat = pthread_create(&(t->tid), &attr, sim_trampoline, t);
+  pthread_attr_destroy(&attr);
+  if( stat != 0 ) {
+    sim->threads = t->all;
+    sim->nthreads--;
+    sim->apps -= app;
+    sim->rtail = t->prev;
+    if( sim->rtail )
+      sim->rtail->next = NULL;
+    else
+      sim->rhead = NULL;
+    pthread_cond_destroy(&(t->cv));
+    free(t);
+    return stat;
+  }
+  if( tid != NULL )
+    *tid = t->tid;
+  return 0;
+}
+
+static struct sim_link * sim_link_get (struct dtp_sim *sim,
+				       port_t from, port_t to) {
+  struct sim_link *ln;
+  for( ln = sim->links; ln != NULL; ln = ln->next )
+    if( ln->from == from && ln->to == to )
+      return ln;
+  ln = calloc(1, sizeof(struct sim_link));
+  if( ln == NULL )
+    return NULL;
+  ln->from = from;
+  ln->to = to;
+  ln->model = sim->model;
+  ln->next = sim->links;
+  sim->links = ln;
+  return ln;
+}
+
+static struct sim_port * sim_port_open (struct dtp_sim *sim, port_t port) {
+  if( sim->ports[port] != NULL )
+    return NULL;		/* Address in use. */
+  struct sim_port *sp = calloc(1, sizeof(struct sim_port));
+  if( sp == NULL )
+    return NULL;
+  sp->sim = sim;
+  sim->ports[port] = sp;
+  return sp;
+}
+
+static struct sim_thread * sim_current (void) {
+  if( sim_self == NULL ) {
+    fprintf(stderr, "dtp sim : simulated gate used outside dtp_sim_spawn.\n");
+    abort();
+  }
+  return sim_self;
+}
+
+/* -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- */
+/* Simulated transport. */
+
+static int sim_send (struct dtp_gate *gate, const void *buf, size_t len) {
+  struct dtp_sim *sim = ((struct sim_port *) gate->tpctx)->sim;
+  port_t src = ntohs(gate->self.sin_port), dst = ntohs(gate->addr.sin_port);
+  pthread_mutex_lock(&(sim->mtx));
+
+  struct sim_link *ln = sim_link_get(sim, src, dst);
+  if( ln == NULL ) {
+    pthread_mutex_unlock(&(sim->mtx));
+    return -1;
+  }
+  sim->st.packets++;
+  sim->st.bytes += len;
+
+  /* Loss model. */
+  const struct dtp_link *m = &(ln->model);
+  if( m->p_bad > 0 || m->p_good > 0 ) {
+    if( ln->bad ) {
+      if( uniform(sim) < m->p_good )
+	ln->bad = 0;
+    } else if( uniform(sim) < m->p_bad ) {
+      ln->bad = 1;
+    }
+  }
+  double loss = ln->bad ? m->burst_loss : m->loss;
+  if( loss > 0 && uniform(sim) < loss ) {
+    sim->st.lost++;
+    pthread_mutex_unlock(&(sim->mtx));
+    return 0;
+  }
+
+  /* Bottleneck queue and serialization. */
+  unsigned long long depart = sim->now;
+  if( m->bandwidth > 0 ) {
+    if( ln->busy > depart )
+      depart = ln->busy;
+    if( m->queue > 0 &&
+	(depart - sim->now) * m->bandwidth / 1e9 > m->queue ) {
+      sim->st.overflow++;
+      pthread_mutex_unlock(&(sim->mtx));
+      return 0;
+    }
+    depart += (unsigned long long) (len * 1e9 / m->bandwidth);
+    ln->busy = depart;
+  }
+
+  struct sim_pkt *p = malloc(sizeof(struct sim_pkt) + len);
+  if( p == NULL ) {
+    pthread_mutex_unlock(&(sim->mtx));
+    return -1;
+  }
+  p->due = depart + m->rtt / 2;
+  p->order = sim->order++;
+  p->src = src;
+  p->dst = dst;
+  p->len = len;
+  memcpy(p->data, buf, len);
+  if( heap_push(sim, p) < 0 ) {
+    free(p);
+    pthread_mutex_unlock(&(sim->mtx));
+    return -1;
+  }
+  pthread_mutex_unlock(&(sim->mtx));
+  return 0;
+}
+
+static ssize_t sim_recv (struct dtp_gate *gate, void *buf, size_t len,
+			 struct sockaddr_in *from) {
+  struct sim_port *port = (struct sim_port *) gate->tpctx;
+  struct dtp_sim *sim = port->sim;
+  struct sim_thread *self = sim_current();
+  pthread_mutex_lock(&(sim->mtx));
+
+  unsigned long long deadline =
+    gate->timeout > 0 ? sim->now + gate->timeout * 1000ull : 0;
+  while( port->head == NULL ) {
+    if( deadline != 0 && sim->now >= deadline ) {
+      pthread_mutex_unlock(&(sim->mtx));
+      errno = EAGAIN;
+      return -1;
+    }
+    wait_add(sim, self, port, deadline);
+    sim_block(sim, self);
+    sim_check_cancel(sim, self);
+  }
+
+  struct sim_pkt *p = port->head;
+  port->head = p->next;
+  if( port->head == NULL )
+    port->tail = NULL;
+  pthread_mutex_unlock(&(sim->mtx));
+
+  if( len > p->len )
+    len = p->len;
+  memcpy(buf, p->data, len);
+  if( from != NULL ) {
+    memset(from, 0, sizeof(struct sockaddr_in));
+    from->sin_family = AF_INET;
+    from->sin_port = htons(p->src);
+    from->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  }
+  free(p);
+  return len;
+}
+
+static int sim_timeout (struct dtp_gate *gate, long usec) {
+  gate->timeout = usec;
+  return 0;
+}
+
+static unsigned long long sim_now (struct dtp_gate *gate) {
+  struct dtp_sim *sim = ((struct sim_port *) gate->tpctx)->sim;
+  pthread_mutex_lock(&(sim->mtx));
+  unsigned long long now = sim->now;
+  pthread_mutex_unlock(&(sim->mtx));
+  return now;
+}
+
+static int sim_wait (struct dtp_gate *gate, pthread_cond_t *cv,
+		     pthread_mutex_t *mtx, unsigned long long deadline) {
+  struct dtp_sim *sim = ((struct sim_port *) gate->tpctx)->sim;
+  struct sim_thread *self = sim_current();
+  pthread_mutex_lock(&(sim->mtx));
+  if( deadline != 0 && deadline <= sim->now ) {
+    pthread_mutex_unlock(&(sim->mtx));
+    return ETIMEDOUT;
+  }
+  wait_add(sim, self, cv, deadline);
+  pthread_mutex_unlock(mtx);
+  sim_block(sim, self);
+  sim_check_cancel(sim, self);
+  int timedout = self->timedout;
+  pthread_mutex_unlock(&(sim->mtx));
+  pthread_mutex_lock(mtx);	/* Uncontended, we hold the baton. */
+  return timedout ? ETIMEDOUT : 0;
+}
+
+static void sim_wake (struct dtp_gate *gate, pthread_cond_t *cv) {
+  struct dtp_sim *sim = ((struct sim_port *) gate->tpctx)->sim;
+  pthread_mutex_lock(&(sim->mtx));
+  wake_chan(sim, cv);
+  pthread_mutex_unlock(&(sim->mtx));
+}
+
+/* -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- */
+/* Timers. The wheel is turned by a daemon of the simulation itself,
+   which sleeps until the next deadline on virtual time. */
+
+static unsigned long long sim_clock (struct dtp_wheel *w) {
+  struct dtp_sim *sim = (struct dtp_sim *) w->ctx;
+  pthread_mutex_lock(&(sim->mtx));
+  unsigned long long now = sim->now;
+  pthread_mutex_unlock(&(sim->mtx));
+  return now;
+}
+
+/* Called by the baton holder : the daemon is asleep, or is the caller. */
+static void sim_kick (struct dtp_wheel *w, unsigned long long when) {
+  struct dtp_sim *sim = (struct dtp_sim *) w->ctx;
+  pthread_mutex_lock(&(sim->mtx));
+  wake_chan(sim, w);
+  pthread_mutex_unlock(&(sim->mtx));
+}
+
+static void * sim_timer_daemon (void *arg) {
+  struct dtp_sim *sim = (struct dtp_sim *) arg;
+  struct sim_thread *self = sim_current();
+  unsigned long long next = dtp_wheel_run(&(sim->wheel), sim_clock(&(sim->wheel)));
+  while( 1 ) {
+    pthread_mutex_lock(&(sim->mtx));
+    if( next == 0 || next > sim->now ) {
+      wait_add(sim, self, &(sim->wheel), next);
+      sim_block(sim, self);
+      sim_check_cancel(sim, self);
+    }
+    unsigned long long now = sim->now;
+    pthread_mutex_unlock(&(sim->mtx));
+    next = dtp_wheel_run(&(sim->wheel), now);
+  }
+  return NULL;
+}
+
+static struct dtp_wheel * sim_wheel (struct dtp_gate *gate) {
+  struct dtp_sim *sim = ((struct sim_port *) gate->tpctx)->sim;
+  pthread_mutex_lock(&(sim->mtx));
+  int up = sim->wheeled;
+  pthread_mutex_unlock(&(sim->mtx));
+  if( up )
+    return &(sim->wheel);
+
+  if( dtp_wheel_init(&(sim->wheel), sim_clock, sim_kick, sim) != 0 )
+    return NULL;
+  pthread_mutex_lock(&(sim->mtx));
+  int stat = sim_spawn(sim, NULL, sim_timer_daemon, sim, 0);
+  sim->wheeled = stat == 0;
+  pthread_mutex_unlock(&(sim->mtx));
+  if( stat != 0 ) {
+    dtp_wheel_destroy(&(sim->wheel));
+    return NULL;
+  }
+  return &(sim->wheel);
+}
+
+static int sim_gate_spawn (struct dtp_gate *gate, pthread_t *tid,
+			   void *(*daemon)(void*)) {
+  struct dtp_sim *sim = ((struct sim_port *) gate->tpctx)->sim;
+  pthread_mutex_lock(&(sim->mtx));
+  int stat = sim_spawn(sim, tid, daemon, gate, 0);
+  pthread_mutex_unlock(&(sim->mtx));
+  return stat;
+}
+
+static void sim_stop (struct dtp_gate *gate, pthread_t tid) {
+  struct dtp_sim *sim = ((struct sim_port *) gate->tpctx)->sim;
+  pthread_mutex_lock(&(sim->mtx));
+  struct sim_thread *t;
+  for( t = sim->threads; t != NULL; t = t->all )
+    if( pthread_equal(t->tid, tid) ) {
+      t->cancelled = 1;
+      if( t->chan != NULL )
+	wake_thread(sim, t);
+      break;
+    }
+  pthread_mutex_unlock(&(sim->mtx));
+}
+
+static const struct dtp_transport dtp_sim_transport = {
+  sim_send,
+  sim_recv,
+  sim_timeout,
+  sim_now,
+  sim_wait,
+  sim_wake,
+  sim_gate_spawn,
+  sim_stop,
+  sim_wheel,
+  NULL,
+  NULL,
+  NULL
+};
+
+/* -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- */
+
+struct dtp_sim * dtp_sim_create (unsigned long long seed,
+				 const struct dtp_link *model) {
+  struct dtp_sim *sim = calloc(1, sizeof(struct dtp_sim));
+  if( sim == NULL )
+    return NULL;
+  pthread_mutex_init(&(sim->mtx), NULL);
+  pthread_cond_init(&(sim->done), NULL);
+  sim->rng = seed * 2654435761ull + 88172645463325252ull;
+  if( sim->rng == 0 )
+    sim->rng = 1;
+  if( model != NULL )
+    sim->model = *model;
+  sim->ephemeral = SIM_EPHEMERAL;
+  return sim;
+}
+
+int dtp_sim_link (struct dtp_sim *sim, port_t a, port_t b,
+		  const struct dtp_link *model) {
+  pthread_mutex_lock(&(sim->mtx));
+  struct sim_link *ab = sim_link_get(sim, a, b);
+  struct sim_link *ba = sim_link_get(sim, b, a);
+  if( ab != NULL )
+    ab->model = *model;
+  if( ba != NULL )
+    ba->model = *model;
+  pthread_mutex_unlock(&(sim->mtx));
+  return ab == NULL || ba == NULL ? -1 : 0;
+}
+
+static int init_sim_gate (struct dtp_gate *gate, struct dtp_sim *sim,
+			  port_t port) {
+  pthread_mutex_lock(&(sim->mtx));
+  if( port == 0 )
+    while( sim->ports[sim->ephemeral] != NULL )
+      sim->ephemeral++;
+  struct sim_port *sp = sim_port_open(sim, port ? port : sim->ephemeral);
+  pthread_mutex_unlock(&(sim->mtx));
+  if( sp == NULL )
+    return -1;
+
+  struct sockaddr_in* host = &(gate->self);
+  host->sin_family = AF_INET;
+  host->sin_port = htons(port ? port : sim->ephemeral);
+  host->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  memset(host->sin_zero, 0, sizeof(host->sin_zero));
+
+  gate->socket = -1;
+  gate->tp = &dtp_sim_transport;
+  gate->tpctx = sp;
+  gate->timeout = 0;
+  gate->io = DTP_IO_SOCKET;
+  gate->spin = 0;
+  gate->cpu[0] = gate->cpu[1] = -1;
+  gate->wakes = 0;
+  gate->nodelay = 0;
+  gate->evfd = -1;
+  gate->feat = FEAT_PRIO;
+  gate->z = NULL;
+  gate->fec = NULL;
+  gate->shm = NULL;
+  gate->mxw = MXW;
+  gate->lim = MXW - 1;
+  gate->wshift = 0;
+  gate->nbacklog = 0;
+  gate->core = DTP_CORE_GENERIC;
+  gate->status = IDLE;
+  return 0;
+}
+
+int init_dtp_sim_server (dtp_server* server, struct dtp_sim *sim,
+			 port_t port_no) {
+  return init_sim_gate(server, sim, port_no);
+}
+
+int init_dtp_sim_client (dtp_client* client, struct dtp_sim *sim,
+			 port_t port_no) {
+  if( init_sim_gate(client, sim, 0) != 0 )
+    return -1;
+  struct sockaddr_in* host = &(client->addr);
+  host->sin_family = AF_INET;
+  host->sin_port = htons(port_no);
+  host->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  memset(host->sin_zero, 0, sizeof(host->sin_zero));
+  return 0;
+}
+
+int dtp_sim_spawn (struct dtp_sim *sim, void *(*fn)(void*), void *arg) {
+  pthread_mutex_lock(&(sim->mtx));
+  int stat = sim_spawn(sim, NULL, fn, arg, 1);
+  pthread_mutex_unlock(&(sim->mtx));
+  return stat;
+}
+
+int dtp_sim_run (struct dtp_sim *sim) {
+  pthread_mutex_lock(&(sim->mtx));
+  sim->stalled = 0;
+  if( sim->running == NULL )
+    sim_schedule(sim);
+  while( (sim->apps > 0 && !sim->stalled) || sim->running != NULL )
+    pthread_cond_wait(&(sim->done), &(sim->mtx));
+  int stat = sim->apps > 0 ? -1 : 0;
+  pthread_mutex_unlock(&(sim->mtx));
+  return stat;
+}
+
+void dtp_sim_stats (struct dtp_sim *sim, struct dtp_sim_stats *st) {
+  pthread_mutex_lock(&(sim->mtx));
+  *st = sim->st;
+  st->now = sim->now;
+  pthread_mutex_unlock(&(sim->mtx));
+}
+
+void dtp_sim_destroy (struct dtp_sim *sim) {
+  pthread_mutex_lock(&(sim->mtx));
+  /* Every leftover thread exits as soon as it gets the baton. */
+  struct sim_thread *t;
+  for( t = sim->threads; t != NULL; t = t->all )
+    t->cancelled = 1;
+  while( sim->whead != NULL )
+    wake_thread(sim, sim->whead);
+  if( sim->running == NULL && sim->rhead != NULL )
+    sim_schedule(sim);
+  while( sim->nthreads > 0 )
+    pthread_cond_wait(&(sim->done), &(sim->mtx));
+  pthread_mutex_unlock(&(sim->mtx));
+
+  size_t i;
+  for( i = 0; i < sim->heapsz; i++ )
+    free(sim->heap[i]);
+  free(sim->heap);
+  for( i = 0; i < SIM_PORTS; i++ ) {
+    struct sim_port *sp = sim->ports[i];
+    if( sp == NULL )
+      continue;
+    while( sp->head != NULL ) {
+      struct sim_pkt *p = sp->head;
+      sp->head = p->next;
+      free(p);
+    }
+    free(sp);
+  }
+  while( sim->links != NULL ) {
+    struct sim_link *ln = sim->links;
+    sim->links = ln->next;
+    free(ln);
+  }
+  if( sim->wheeled )
+    dtp_wheel_destroy(&(sim->wheel));
+  pthread_mutex_destroy(&(sim->mtx));
+  pthread_cond_destroy(&(sim->done));
+  free(sim);
+}
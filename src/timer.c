@@ -0,0 +1,226 @@
+#include "timer.h"
+
+#include <string.h>
+
+#define WHEEL_MASK (WHEEL_SLOTS - 1)
+#define WHEEL_SPAN (1ull << (WHEEL_BITS * WHEEL_LEVELS))
+
+/* -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- */
+/* Helpers. All called with wheel->mtx held. */
+
+static void unlink_timer (struct dtp_wheel *w, struct dtp_timer *t) {
+  *(t->pprev) = t->next;
+  if( t->next != NULL )
+    t->next->pprev = t->pprev;
+  else {
+    /* Was alone in its bucket if pprev is the bucket head. */
+    uintptr_t off = (uintptr_t) t->pprev - (uintptr_t) w->slot;
+    if( off < sizeof(w->slot) ) {
+      size_t b = off / sizeof(struct dtp_timer*);
+      w->used[b >> WHEEL_BITS] &= ~(1ull << (b & WHEEL_MASK));
+    }
+  }
+  t->next = NULL;
+  t->pprev = NULL;
+  w->pending--;
+}
+
+/* Bucket a timer relative to the current tick. Returns its tick. */
+static unsigned long long link_timer (struct dtp_wheel *w, struct dtp_timer *t) {
+  /* Round up : never fire early. */
+  unsigned long long when =
+    (t->expires + (1ull << WHEEL_SHIFT) - 1) >> WHEEL_SHIFT;
+  if( when < w->tick )
+    when = w->tick;		/* Overdue, next tick. */
+  if( when - w->tick >= WHEEL_SPAN )
+    when = w->tick + WHEEL_SPAN - 1; /* Re-bucketed on cascade. */
+
+  unsigned long long delta = when - w->tick;
+  int l = 0;
+  while( l < WHEEL_LEVELS - 1 &&
+	 delta >= (1ull << (WHEEL_BITS * (l + 1))) )
+    l++;
+
+  unsigned idx = (when >> (WHEEL_BITS * l)) & WHEEL_MASK;
+  struct dtp_timer **slot = &(w->slot[l][idx]);
+  w->used[l] |= 1ull << idx;
+  t->next = *slot;
+  if( t->next != NULL )
+    t->next->pprev = &(t->next);
+  t->pprev = slot;
+  *slot = t;
+  w->pending++;
+  return when;
+}
+
+/* Move the buckets that come due at this tick one level down. */
+static void cascade (struct dtp_wheel *w) {
+  int l;
+  for( l = 1; l < WHEEL_LEVELS; l++ ) {
+    unsigned idx = (w->tick >> (WHEEL_BITS * l)) & WHEEL_MASK;
+    struct dtp_timer *t = w->slot[l][idx], *next;
+    w->slot[l][idx] = NULL;
+    w->used[l] &= ~(1ull << idx);
+    for( ; t != NULL; t = next ) {
+      next = t->next;
+      w->pending--;
+      link_timer(w, t);
+    }
+    if( idx != 0 )
+      break;
+  }
+}
+
+/* The used bits of a level rotated so that bit 0 is bucket idx. */
+static uint64_t used_from (const struct dtp_wheel *w, int l, unsigned idx) {
+  uint64_t m = w->used[l];
+  return idx == 0 ? m : (m >> idx) | (m << (WHEEL_SLOTS - idx));
+}
+
+/**
+   Earliest tick at which the wheel has work : a level 0 bucket to
+   fire, or a higher bucket to cascade. 0 if empty.
+ */
+static unsigned long long next_tick (struct dtp_wheel *w) {
+  if( w->pending == 0 )
+    return 0;
+  unsigned long long best = 0;
+  int l;
+  for( l = 0; l < WHEEL_LEVELS; l++ ) {
+    int shift = WHEEL_BITS * l;
+    unsigned long long cur = w->tick >> shift;
+    uint64_t m = used_from(w, l, cur & WHEEL_MASK);
+    if( m == 0 )
+      continue;
+    unsigned long long at;
+    if( l == 0 )
+      at = cur + __builtin_ctzll(m);
+    else if( (m & 1) && (w->tick & ((1ull << shift) - 1)) == 0 )
+      at = w->tick;		/* Cascaded at this very tick. */
+    else if( (m & ~1ull) != 0 )
+      at = (cur + __builtin_ctzll(m & ~1ull)) << shift;
+    else			/* The current bucket only comes round again
+				   after a full turn. */
+      at = (cur + WHEEL_SLOTS) << shift;
+    if( best == 0 || at < best )
+      best = at;
+  }
+  return best;
+}
+
+static void rekick (struct dtp_wheel *w) {
+  w->armed = next_tick(w);
+  w->kick(w, w->armed << WHEEL_SHIFT);
+}
+
+/* -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- */
+
+int dtp_wheel_init (struct dtp_wheel *w,
+		    unsigned long long (*clock) (struct dtp_wheel*),
+		    void (*kick) (struct dtp_wheel*, unsigned long long),
+		    void *ctx) {
+  memset(w, 0, sizeof(struct dtp_wheel));
+  w->clock = clock;
+  w->kick = kick;
+  w->ctx = ctx;
+  int stat = pthread_mutex_init(&(w->mtx), NULL);
+  if( stat != 0 )
+    return stat;
+  stat = pthread_cond_init(&(w->idle), NULL);
+  if( stat != 0 )
+    return stat;
+  w->tick = clock(w) >> WHEEL_SHIFT;
+  return 0;
+}
+
+void dtp_wheel_destroy (struct dtp_wheel *w) {
+  pthread_mutex_destroy(&(w->mtx));
+  pthread_cond_destroy(&(w->idle));
+}
+
+unsigned long long dtp_wheel_run (struct dtp_wheel *w, unsigned long long now) {
+  unsigned long long target = now >> WHEEL_SHIFT;
+  pthread_mutex_lock(&(w->mtx));
+  while( w->tick <= target ) {
+    /* Skip idle stretches in one go. */
+    unsigned long long work = next_tick(w);
+    if( work == 0 || work > target ) {
+      w->tick = target + 1;
+      break;
+    }
+    w->tick = work;
+
+    if( (w->tick & WHEEL_MASK) == 0 )
+      cascade(w);
+    struct dtp_timer **slot = &(w->slot[0][w->tick & WHEEL_MASK]);
+    while( *slot != NULL ) {
+      struct dtp_timer *t = *slot;
+      unlink_timer(w, t);
+      w->running = t;
+      pthread_mutex_unlock(&(w->mtx));
+      t->fn(t);
+      pthread_mutex_lock(&(w->mtx));
+      w->running = NULL;
+      pthread_cond_broadcast(&(w->idle));
+    }
+    w->tick++;
+  }
+  rekick(w);
+  unsigned long long next = w->armed << WHEEL_SHIFT;
+  pthread_mutex_unlock(&(w->mtx));
+  return next;
+}
+
+void dtp_timer_init (struct dtp_timer *t, struct dtp_wheel *w,
+		     void (*fn) (struct dtp_timer*)) {
+  t->next = NULL;
+  t->pprev = NULL;
+  t->expires = 0;
+  t->wheel = w;
+  t->fn = fn;
+}
+
+void dtp_timer_mod (struct dtp_timer *t, unsigned long long expires) {
+  struct dtp_wheel *w = t->wheel;
+  pthread_mutex_lock(&(w->mtx));
+  if( t->pprev != NULL )
+    unlink_timer(w, t);
+  else if( w->pending == 0 && w->running == NULL ) {
+    /* Nothing moved the wheel while it was empty. */
+    unsigned long long tick = w->clock(w) >> WHEEL_SHIFT;
+    if( tick > w->tick )
+      w->tick = tick;
+  }
+  t->expires = expires;
+  /* Only a new earliest deadline costs the worker a wakeup; pushing
+     a timer back (e.g. an RTO on every ACK) just relinks it. */
+  if( link_timer(w, t) < w->armed || w->armed == 0 )
+    rekick(w);
+  pthread_mutex_unlock(&(w->mtx));
+}
+
+void dtp_timer_del (struct dtp_timer *t) {
+  struct dtp_wheel *w = t->wheel;
+  pthread_mutex_lock(&(w->mtx));
+  if( t->pprev != NULL )
+    unlink_timer(w, t);
+  pthread_mutex_unlock(&(w->mtx));
+}
+
+void dtp_timer_del_sync (struct dtp_timer *t) {
+  struct dtp_wheel *w = t->wheel;
+  pthread_mutex_lock(&(w->mtx));
+  if( t->pprev != NULL )
+    unlink_timer(w, t);
+  while( w->running == t )
+    pthread_cond_wait(&(w->idle), &(w->mtx));
+  pthread_mutex_unlock(&(w->mtx));
+}
+
+int dtp_timer_pending (struct dtp_timer *t) {
+  struct dtp_wheel *w = t->wheel;
+  pthread_mutex_lock(&(w->mtx));
+  int pending = t->pprev != NULL;
+  pthread_mutex_unlock(&(w->mtx));
+  return pending;
+}
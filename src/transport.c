@@ -0,0 +1,349 @@
+#define _GNU_SOURCE		/* pthread_setaffinity_np */
+
+#include "gate.h"
+#include "transport.h"
+#include "timer.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+/* -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- */
+/* UDP transport. */
+
+static int udp_send (struct dtp_gate *gate, const void *buf, size_t len) {
+  static socklen_t socklen = sizeof(struct sockaddr_in);
+  ssize_t stat = sendto(gate->socket,
+			buf,
+			len,
+			0,
+			(const struct sockaddr*) &(gate->addr),
+			socklen);
+  return stat < 0 ? -1 : 0;
+}
+
+static unsigned long long mono_now (void);
+
+static ssize_t udp_recv (struct dtp_gate *gate, void *buf, size_t len,
+			 struct sockaddr_in *from) {
+  if( gate->spin > 0 ) {	/* Busy poll before blocking. */
+    unsigned long long end = mono_now() + gate->spin;
+    do {
+      ssize_t n = dtp_udp_recvmsg(gate->socket, buf, len, from,
+				  MSG_DONTWAIT, &(gate->kdrops));
+      if( n >= 0 || errno != EAGAIN )
+	return n;
+      dtp_relax();
+    } while( mono_now() < end );
+  }
+  return dtp_udp_recvmsg(gate->socket, buf, len, from, 0, &(gate->kdrops));
+}
+
+/* FIONREAD : size of the next datagram, 0 if none. */
+static int udp_pending (struct dtp_gate *gate) {
+  int n = 0;
+  return ioctl(gate->socket, FIONREAD, &n) == 0 && n > 0;
+}
+
+/* Socket options are only touched when the timeout actually changes. */
+static int udp_timeout (struct dtp_gate *gate, long usec) {
+  if( gate->timeout == usec )
+    return 0;
+  struct timeval timeout;
+  timeout.tv_sec = usec / 1000000; timeout.tv_usec = usec % 1000000;
+  int stat = setsockopt(gate->socket, SOL_SOCKET, SO_RCVTIMEO,
+			&timeout, sizeof(struct timeval));
+  if( stat < 0 )
+    return -1;
+  stat = setsockopt(gate->socket, SOL_SOCKET, SO_SNDTIMEO,
+		    &timeout, sizeof(struct timeval));
+  if( stat < 0 )
+    return -1;
+  gate->timeout = usec;
+  return 0;
+}
+
+static unsigned long long mono_now (void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (unsigned long long) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* Gate condition variables are set up on CLOCK_MONOTONIC too. */
+static unsigned long long udp_now (struct dtp_gate *gate) {
+  return mono_now();
+}
+
+/**
+   While busy polling, watch gate->wakes for up to the spin budget
+   with the mutex released before sleeping on the condition. Waiters
+   recheck their predicate, so any wakeup of the gate will do.
+ */
+static int udp_wait (struct dtp_gate *gate, pthread_cond_t *cv,
+		     pthread_mutex_t *mtx, unsigned long long deadline) {
+  if( gate->spin > 0 ) {
+    unsigned seen = __atomic_load_n(&(gate->wakes), __ATOMIC_ACQUIRE);
+    unsigned long long now = mono_now(), end = now + gate->spin;
+    if( deadline != 0 && deadline < end )
+      end = deadline;
+    pthread_mutex_unlock(mtx);
+    while( __atomic_load_n(&(gate->wakes), __ATOMIC_ACQUIRE) == seen &&
+	   now < end ) {
+      dtp_relax();
+      pthread_testcancel();
+      now = mono_now();
+    }
+    pthread_mutex_lock(mtx);
+    /* Wakers hold mtx, so none is missed from here on. */
+    if( gate->wakes != seen )
+      return 0;
+    if( deadline != 0 && now >= deadline )
+      return ETIMEDOUT;
+  }
+  if( deadline == 0 )
+    return pthread_cond_wait(cv, mtx);
+  struct timespec timeout;
+  timeout.tv_sec = deadline / 1000000000ull;
+  timeout.tv_nsec = deadline % 1000000000ull;
+  return pthread_cond_timedwait(cv, mtx, &timeout);
+}
+
+static void udp_wake (struct dtp_gate *gate, pthread_cond_t *cv) {
+  if( gate->spin > 0 )
+    __atomic_add_fetch(&(gate->wakes), 1, __ATOMIC_RELEASE);
+  pthread_cond_broadcast(cv);
+}
+
+/* Daemons go to the cores chosen with DTP_CPU_SND / DTP_CPU_RCV. */
+static int udp_spawn (struct dtp_gate *gate, pthread_t *tid,
+		      void *(*daemon)(void*)) {
+  int cpu = tid == &(gate->snd_dmn) ? gate->cpu[0] :
+    tid == &(gate->rcv_dmn) ? gate->cpu[1] : -1;
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  if( cpu >= 0 ) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
+  }
+  int stat = pthread_create(tid, &attr, daemon, gate);
+  pthread_attr_destroy(&attr);
+  return stat;
+}
+
+static void udp_stop (struct dtp_gate *gate, pthread_t tid) {
+  pthread_cancel(tid);
+  pthread_join(tid, NULL);
+}
+
+/* Process wide wheel, turned by a detached thread sleeping on a
+   timerfd that is only re-armed for earlier deadlines. */
+static struct dtp_wheel udp_timers;
+static int udp_tfd = -1;
+static pthread_once_t udp_timers_once = PTHREAD_ONCE_INIT;
+
+static unsigned long long udp_clock (struct dtp_wheel *w) {
+  return mono_now();
+}
+
+static void udp_kick (struct dtp_wheel *w, unsigned long long when) {
+  struct itimerspec its;
+  memset(&its, 0, sizeof(its));
+  its.it_value.tv_sec = when / 1000000000ull; /* 0 disarms. */
+  its.it_value.tv_nsec = when % 1000000000ull;
+  timerfd_settime(udp_tfd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+static void * udp_timer_daemon (void *arg) {
+  uint64_t expirations;
+  while( 1 ) {
+    if( read(udp_tfd, &expirations, sizeof(expirations)) < 0 &&
+	errno != EINTR && errno != EAGAIN )
+      break;
+    dtp_wheel_run(&udp_timers, mono_now());
+  }
+  return NULL;
+}
+
+static void udp_timers_start (void) {
+  pthread_t tid;
+  pthread_attr_t attr;
+  udp_tfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+  if( udp_tfd < 0 )
+    return;
+  if( dtp_wheel_init(&udp_timers, udp_clock, udp_kick, NULL) != 0 )
+    goto fail;
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  int stat = pthread_create(&tid, &attr, udp_timer_daemon, NULL);
+  pthread_attr_destroy(&attr);
+  if( stat == 0 )
+    return;
+ fail:
+  close(udp_tfd);
+  udp_tfd = -1;
+}
+
+static struct dtp_wheel * udp_wheel (struct dtp_gate *gate) {
+  pthread_once(&udp_timers_once, udp_timers_start);
+  return udp_tfd < 0 ? NULL : &udp_timers;
+}
+
+const struct dtp_transport dtp_udp_transport = {
+  udp_send,
+  udp_recv,
+  udp_timeout,
+  udp_now,
+  udp_wait,
+  udp_wake,
+  udp_spawn,
+  udp_stop,
+  udp_wheel,
+  NULL,
+  NULL,
+  udp_pending
+};
+
+/* -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- */
+
+/* Receive buffer a full datagram takes as the kernel counts it : a
+   2KiB data buffer and the sk_buff around it. */
+#define UDP_TRUESIZE 2560
+
+int dtp_udp_buffers (int fd, size_t mxw, int bytes) {
+  int on = 1, stat = 0;
+  if( bytes <= 0 )		/* From the window, the kernel doubles it. */
+    bytes = mxw < INT_MAX / UDP_TRUESIZE ? mxw * UDP_TRUESIZE / 2 : INT_MAX / 2;
+  /* Past net.core.[rw]mem_max only with CAP_NET_ADMIN. */
+  if( setsockopt(fd, SOL_SOCKET, SO_RCVBUFFORCE, &bytes, sizeof(bytes)) < 0 &&
+      setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &bytes, sizeof(bytes)) < 0 )
+    stat = -1;
+  if( setsockopt(fd, SOL_SOCKET, SO_SNDBUFFORCE, &bytes, sizeof(bytes)) < 0 &&
+      setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &bytes, sizeof(bytes)) < 0 )
+    stat = -1;
+  if( setsockopt(fd, SOL_SOCKET, SO_RXQ_OVFL, &on, sizeof(on)) < 0 )
+    stat = -1;
+  return stat;
+}
+
+size_t dtp_udp_slots (int fd) {
+  int bytes = 0;
+  socklen_t len = sizeof(bytes);
+  if( getsockopt(fd, SOL_SOCKET, SO_RCVBUF, &bytes, &len) < 0 )
+    return 0;
+  return bytes / UDP_TRUESIZE;
+}
+
+unsigned dtp_udp_cmsg_drops (const void *control, size_t len) {
+  struct msghdr msg;
+  struct cmsghdr *c;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_control = (void *) control;
+  msg.msg_controllen = len;
+  for( c = CMSG_FIRSTHDR(&msg); c != NULL; c = CMSG_NXTHDR(&msg, c) )
+    if( c->cmsg_level == SOL_SOCKET && c->cmsg_type == SO_RXQ_OVFL ) {
+      uint32_t drops;
+      memcpy(&drops, CMSG_DATA(c), sizeof(drops));
+      return drops;
+    }
+  return 0;
+}
+
+ssize_t dtp_udp_recvmsg (int fd, void *buf, size_t len,
+			 struct sockaddr_in *from, int flags,
+			 unsigned *drops) {
+  union {			/* Aligned for cmsghdr. */
+    struct cmsghdr c;
+    byte_t b[CMSG_SPACE(sizeof(uint32_t))];
+  } control;
+  struct iovec iov;
+  struct msghdr msg;
+  iov.iov_base = buf;
+  iov.iov_len = len;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_name = from;
+  msg.msg_namelen = sizeof(struct sockaddr_in);
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = &control;
+  msg.msg_controllen = sizeof(control);
+  ssize_t n = recvmsg(fd, &msg, flags);
+  /* Only there once the socket dropped something. */
+  if( n >= 0 && msg.msg_controllen > 0 )
+    *drops = dtp_udp_cmsg_drops(&control, msg.msg_controllen);
+  return n;
+}
+
+/* -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- */
+
+unsigned long long gate_now (struct dtp_gate *gate) {
+  return gate->tp->now(gate);
+}
+
+int gate_wait (struct dtp_gate *gate, pthread_cond_t *cv,
+	       pthread_mutex_t *mtx) {
+  return gate->tp->wait(gate, cv, mtx, 0);
+}
+
+int gate_timedwait (struct dtp_gate *gate, pthread_cond_t *cv,
+		    pthread_mutex_t *mtx, unsigned long long deadline) {
+  return gate->tp->wait(gate, cv, mtx, deadline);
+}
+
+void gate_wake (struct dtp_gate *gate, pthread_cond_t *cv) {
+  gate->tp->wake(gate, cv);
+}
+
+int gate_timeout (struct dtp_gate *gate, long usec) {
+  return gate->tp->timeout(gate, usec);
+}
+
+int gate_spawn (struct dtp_gate *gate, pthread_t *tid,
+		void *(*daemon)(void*)) {
+  return gate->tp->spawn(gate, tid, daemon);
+}
+
+void gate_stop (struct dtp_gate *gate, pthread_t tid) {
+  gate->tp->stop(gate, tid);
+}
+
+struct dtp_wheel * gate_wheel (struct dtp_gate *gate) {
+  return gate->tp->wheel(gate);
+}
+
+void gate_flush (struct dtp_gate *gate) {
+  if( gate->tp->flush != NULL )
+    gate->tp->flush(gate);
+}
+
+void gate_release (struct dtp_gate *gate) {
+  if( gate->tp->release != NULL )
+    gate->tp->release(gate);
+}
+
+int gate_pending (struct dtp_gate *gate) {
+  return gate->tp->pending != NULL && gate->tp->pending(gate);
+}
+
+void dtp_relax (void) {
+  static int ncpu = 0;
+  if( ncpu == 0 )
+    ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+  if( ncpu <= 1 ) {
+    sched_yield();
+    return;
+  }
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#elif defined(__aarch64__)
+  __asm__ __volatile__ ("yield");
+#endif
+}
@@ -0,0 +1,514 @@
+#include "gate.h"
+#include "transport.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+
+#ifdef __NR_io_uring_setup
+#include <linux/io_uring.h>
+#endif
+
+/**
+   io_uring datagram path.
+
+   Each attached gate owns two rings. The receive ring keeps one
+   multishot recvmsg posted on the socket, filling buffers from a
+   provided buffer ring, and is only touched by the receiver daemon.
+   The send ring takes a SENDMSG per packet from a pool of staging
+   slots; entries are queued by send and handed to the kernel in one
+   go by flush (or without any syscall under SQPOLL).
+   Kernels or headers without multishot recvmsg keep using sockets.
+ */
+
+#if defined(__NR_io_uring_setup) && defined(IORING_RECV_MULTISHOT)
+
+#define URING_ENTRIES 256	/* Submission queue depth. */
+#define URING_BATCH 32		/* Submit at least this often. */
+#define URING_BUFS 1024		/* Provided receive buffers (power of 2). */
+#define URING_STAGES 256	/* Send staging slots. */
+#define URING_WAIT 50000000ll	/* Longest blocking wait (ns), so that
+				   the receiver notices cancellation. */
+
+#define URING_CMSG CMSG_SPACE(sizeof(uint32_t)) /* SO_RXQ_OVFL. */
+#define URING_BUFSZ (sizeof(struct io_uring_recvmsg_out) \
+		     + sizeof(struct sockaddr_in) + URING_CMSG \
+		     + sizeof(packet_t))
+
+struct ring {
+  int fd;
+  unsigned entries;
+  unsigned *sq_head, *sq_tail, *sq_mask, *sq_flags, *sq_array;
+  unsigned *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+  void *sq_ptr, *cq_ptr;
+  size_t sq_sz, cq_sz;
+  int sqpoll;
+  unsigned unsubmitted;		/* Queued since the last enter. */
+};
+
+/* Datagram waiting to be sent. */
+struct stage {
+  struct msghdr msg;
+  struct iovec iov;
+  struct sockaddr_in addr;
+  byte_t data[sizeof(packet_t)];
+};
+
+struct uring_gate {
+  struct ring snd, rcv;
+  pthread_mutex_t snd_mtx;	/* Sender and receiver daemons both send. */
+  struct stage *stages;
+  unsigned short freelist[URING_STAGES];
+  unsigned nfree;
+
+  struct io_uring_buf_ring *br;	/* Provided buffer ring. */
+  byte_t *bufs;
+  size_t br_sz, bufs_sz;
+  unsigned short br_tail;
+  struct msghdr rmsg;		/* Multishot recvmsg layout. */
+  int armed;			/* Multishot recvmsg is posted. */
+  int legacy;			/* Multishot refused, use recvfrom. */
+};
+
+static int sys_enter (int fd, unsigned submit, unsigned wait,
+		      unsigned flags, void *arg, size_t argsz) {
+  return syscall(__NR_io_uring_enter, fd, submit, wait, flags, arg, argsz);
+}
+
+static void ring_exit (struct ring *r) {
+  if( r->sqes != NULL && r->sqes != MAP_FAILED )
+    munmap(r->sqes, r->entries * sizeof(struct io_uring_sqe));
+  if( r->cq_ptr != NULL && r->cq_ptr != MAP_FAILED && r->cq_ptr != r->sq_ptr )
+    munmap(r->cq_ptr, r->cq_sz);
+  if( r->sq_ptr != NULL && r->sq_ptr != MAP_FAILED )
+    munmap(r->sq_ptr, r->sq_sz);
+  if( r->fd >= 0 )
+    close(r->fd);
+  r->fd = -1;
+}
+
+static int ring_init (struct ring *r, int sqpoll, int attach) {
+  struct io_uring_params p;
+  memset(&p, 0, sizeof(p));
+  memset(r, 0, sizeof(struct ring));
+  if( sqpoll ) {
+    p.flags = IORING_SETUP_SQPOLL;
+    p.sq_thread_idle = 1000;	/* ms before the poller sleeps. */
+    if( attach >= 0 ) {
+      p.flags |= IORING_SETUP_ATTACH_WQ;
+      p.wq_fd = attach;
+    }
+  }
+  r->fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+  if( r->fd < 0 )
+    return -1;
+  if( !(p.features & IORING_FEAT_EXT_ARG) ) {
+    ring_exit(r);
+    return -1;
+  }
+  r->entries = p.sq_entries;
+  r->sqpoll = sqpoll;
+
+  r->sq_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  r->cq_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if( p.features & IORING_FEAT_SINGLE_MMAP ) {
+    if( r->cq_sz > r->sq_sz )
+      r->sq_sz = r->cq_sz;
+    r->cq_sz = r->sq_sz;
+  }
+  r->sq_ptr = mmap(NULL, r->sq_sz, PROT_READ | PROT_WRITE,
+		   MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+  if( r->sq_ptr == MAP_FAILED ) {
+    ring_exit(r);
+    return -1;
+  }
+  if( p.features & IORING_FEAT_SINGLE_MMAP )
+    r->cq_ptr = r->sq_ptr;
+  else
+    r->cq_ptr = mmap(NULL, r->cq_sz, PROT_READ | PROT_WRITE,
+		     MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+  r->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+		 PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		 r->fd, IORING_OFF_SQES);
+  if( r->cq_ptr == MAP_FAILED || r->sqes == MAP_FAILED ) {
+    ring_exit(r);
+    return -1;
+  }
+
+  byte_t *sq = (byte_t*) r->sq_ptr, *cq = (byte_t*) r->cq_ptr;
+  r->sq_head = (unsigned*) (sq + p.sq_off.head);
+  r->sq_tail = (unsigned*) (sq + p.sq_off.tail);
+  r->sq_mask = (unsigned*) (sq + p.sq_off.ring_mask);
+  r->sq_flags = (unsigned*) (sq + p.sq_off.flags);
+  r->sq_array = (unsigned*) (sq + p.sq_off.array);
+  r->cq_head = (unsigned*) (cq + p.cq_off.head);
+  r->cq_tail = (unsigned*) (cq + p.cq_off.tail);
+  r->cq_mask = (unsigned*) (cq + p.cq_off.ring_mask);
+  r->cqes = (struct io_uring_cqe*) (cq + p.cq_off.cqes);
+  return 0;
+}
+
+/* Hand queued entries to the kernel. */
+static int ring_submit (struct ring *r) {
+  if( r->sqpoll ) {
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if( __atomic_load_n(r->sq_flags, __ATOMIC_RELAXED) & IORING_SQ_NEED_WAKEUP )
+      sys_enter(r->fd, 0, 0, IORING_ENTER_SQ_WAKEUP, NULL, 0);
+    r->unsubmitted = 0;
+    return 0;
+  }
+  while( r->unsubmitted > 0 ) {
+    int n = sys_enter(r->fd, r->unsubmitted, 0, 0, NULL, 0);
+    if( n < 0 ) {
+      if( errno == EINTR )
+	continue;
+      return -1;
+    }
+    r->unsubmitted -= n;
+  }
+  return 0;
+}
+
+/* Next free submission entry, NULL if the queue is full. */
+static struct io_uring_sqe * ring_sqe (struct ring *r) {
+  unsigned tail = *(r->sq_tail);
+  unsigned head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+  if( tail - head >= r->entries )
+    return NULL;
+  struct io_uring_sqe *sqe = r->sqes + (tail & *(r->sq_mask));
+  memset(sqe, 0, sizeof(struct io_uring_sqe));
+  return sqe;
+}
+
+static void ring_push (struct ring *r) {
+  unsigned tail = *(r->sq_tail);
+  r->sq_array[tail & *(r->sq_mask)] = tail & *(r->sq_mask);
+  __atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+  r->unsubmitted++;
+}
+
+static struct io_uring_cqe * ring_peek (struct ring *r) {
+  unsigned head = *(r->cq_head);
+  if( head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE) )
+    return NULL;
+  return r->cqes + (head & *(r->cq_mask));
+}
+
+static void ring_pop (struct ring *r) {
+  __atomic_store_n(r->cq_head, *(r->cq_head) + 1, __ATOMIC_RELEASE);
+}
+
+/* Block for a completion, at most URING_WAIT ns. */
+static int ring_wait (struct ring *r, long long ns) {
+  struct __kernel_timespec ts;
+  struct io_uring_getevents_arg arg;
+  ts.tv_sec = ns / 1000000000ll;
+  ts.tv_nsec = ns % 1000000000ll;
+  memset(&arg, 0, sizeof(arg));
+  arg.ts = (unsigned long long) (unsigned long) &ts;
+  unsigned submit = r->sqpoll ? 0 : r->unsubmitted;
+  int n = sys_enter(r->fd, submit, 1,
+		    IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG,
+		    &arg, sizeof(arg));
+  if( n > 0 )
+    r->unsubmitted -= n;
+  return n < 0 && errno != ETIME && errno != EINTR ? -1 : 0;
+}
+
+/* -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- */
+
+/* Return the staging slots of completed sends. */
+static void reap_sends (struct uring_gate *ug) {
+  struct io_uring_cqe *cqe;
+  while( (cqe = ring_peek(&(ug->snd))) != NULL ) {
+    ug->freelist[ug->nfree++] = (unsigned short) cqe->user_data;
+    ring_pop(&(ug->snd));
+  }
+}
+
+static int uring_send (struct dtp_gate *gate, const void *buf, size_t len) {
+  struct uring_gate *ug = (struct uring_gate *) gate->tpctx;
+  struct io_uring_sqe *sqe;
+  pthread_mutex_lock(&(ug->snd_mtx));
+  reap_sends(ug);
+  while( ug->nfree == 0 || (sqe = ring_sqe(&(ug->snd))) == NULL ) {
+    if( ring_wait(&(ug->snd), URING_WAIT) < 0 ) {
+      pthread_mutex_unlock(&(ug->snd_mtx));
+      return -1;
+    }
+    reap_sends(ug);
+  }
+
+  unsigned short id = ug->freelist[--ug->nfree];
+  struct stage *st = ug->stages + id;
+  memcpy(st->data, buf, len);
+  st->addr = gate->addr;
+  st->iov.iov_base = st->data;
+  st->iov.iov_len = len;
+  memset(&(st->msg), 0, sizeof(struct msghdr));
+  st->msg.msg_name = &(st->addr);
+  st->msg.msg_namelen = sizeof(struct sockaddr_in);
+  st->msg.msg_iov = &(st->iov);
+  st->msg.msg_iovlen = 1;
+
+  sqe->opcode = IORING_OP_SENDMSG;
+  sqe->fd = gate->socket;
+  sqe->addr = (unsigned long) &(st->msg);
+  sqe->len = 1;
+  sqe->user_data = id;
+  ring_push(&(ug->snd));
+
+  int stat = 0;
+  if( ug->snd.unsubmitted >= URING_BATCH )
+    stat = ring_submit(&(ug->snd));
+  pthread_mutex_unlock(&(ug->snd_mtx));
+  return stat;
+}
+
+static void uring_flush (struct dtp_gate *gate) {
+  struct uring_gate *ug = (struct uring_gate *) gate->tpctx;
+  pthread_mutex_lock(&(ug->snd_mtx));
+  if( ug->snd.unsubmitted > 0 )
+    ring_submit(&(ug->snd));
+  pthread_mutex_unlock(&(ug->snd_mtx));
+}
+
+static int arm_recv (struct dtp_gate *gate, struct uring_gate *ug) {
+  struct io_uring_sqe *sqe = ring_sqe(&(ug->rcv));
+  if( sqe == NULL )
+    return -1;
+  sqe->opcode = IORING_OP_RECVMSG;
+  sqe->fd = gate->socket;
+  sqe->addr = (unsigned long) &(ug->rmsg);
+  sqe->len = 1;
+  sqe->ioprio = IORING_RECV_MULTISHOT;
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = 0;
+  ring_push(&(ug->rcv));
+  if( ring_submit(&(ug->rcv)) < 0 )
+    return -1;
+  ug->armed = 1;
+  return 0;
+}
+
+static void recycle (struct uring_gate *ug, unsigned short bid) {
+  struct io_uring_buf *b = ug->br->bufs + (ug->br_tail & (URING_BUFS - 1));
+  b->addr = (unsigned long) (ug->bufs + (size_t) bid * URING_BUFSZ);
+  b->len = URING_BUFSZ;
+  b->bid = bid;
+  ug->br_tail++;
+  __atomic_store_n(&(ug->br->tail), ug->br_tail, __ATOMIC_RELEASE);
+}
+
+static ssize_t uring_recv (struct dtp_gate *gate, void *buf, size_t len,
+			   struct sockaddr_in *from) {
+  struct uring_gate *ug = (struct uring_gate *) gate->tpctx;
+  if( ug->legacy )
+    return dtp_udp_transport.recv(gate, buf, len, from);
+
+  unsigned long long deadline =
+    gate->timeout > 0 ? gate_now(gate) + gate->timeout * 1000ull : 0;
+  /* Busy poll the completion ring before sleeping in the kernel. */
+  unsigned long long spin_end =
+    gate->spin > 0 ? gate_now(gate) + gate->spin : 0;
+  while( 1 ) {
+    if( !ug->armed && arm_recv(gate, ug) < 0 )
+      return -1;
+
+    struct io_uring_cqe *cqe = ring_peek(&(ug->rcv));
+    if( cqe != NULL ) {
+      int res = cqe->res;
+      unsigned flags = cqe->flags;
+      ring_pop(&(ug->rcv));
+      if( !(flags & IORING_CQE_F_MORE) )
+	ug->armed = 0;
+      if( res < 0 ) {
+	if( res == -EINVAL || res == -EOPNOTSUPP ) {
+	  ug->legacy = 1;	/* No multishot recvmsg here. */
+	  return dtp_udp_transport.recv(gate, buf, len, from);
+	}
+	if( res == -ENOBUFS || res == -EINTR )
+	  continue;		/* Re-armed above. */
+	errno = -res;
+	return -1;
+      }
+      if( !(flags & IORING_CQE_F_BUFFER) )
+	continue;
+
+      unsigned short bid = flags >> IORING_CQE_BUFFER_SHIFT;
+      byte_t *b = ug->bufs + (size_t) bid * URING_BUFSZ;
+      struct io_uring_recvmsg_out *out = (struct io_uring_recvmsg_out *) b;
+      byte_t *name = b + sizeof(struct io_uring_recvmsg_out);
+      byte_t *payload = name + ug->rmsg.msg_namelen + ug->rmsg.msg_controllen;
+      if( out->controllen > 0 )
+	gate->kdrops = dtp_udp_cmsg_drops(name + ug->rmsg.msg_namelen,
+					  out->controllen);
+      size_t n = out->payloadlen < len ? out->payloadlen : len;
+      memcpy(buf, payload, n);
+      if( from != NULL )
+	memcpy(from, name, sizeof(struct sockaddr_in));
+      recycle(ug, bid);
+      return n;
+    }
+
+    /* Nothing yet. Push out pending acknowledgements, then sleep. */
+    uring_flush(gate);
+    if( spin_end != 0 && gate_now(gate) < spin_end ) {
+      dtp_relax();
+      pthread_testcancel();
+      continue;
+    }
+    long long wait = URING_WAIT;
+    if( deadline != 0 ) {
+      unsigned long long now = gate_now(gate);
+      if( now >= deadline ) {
+	errno = EAGAIN;
+	return -1;
+      }
+      if( deadline - now < (unsigned long long) wait )
+	wait = deadline - now;
+    }
+    if( ring_wait(&(ug->rcv), wait) < 0 )
+      return -1;
+    pthread_testcancel();	/* io_uring_enter is no cancellation point. */
+  }
+}
+
+static int uring_timeout (struct dtp_gate *gate, long usec) {
+  gate->timeout = usec;
+  return 0;
+}
+
+static unsigned long long uring_now (struct dtp_gate *gate) {
+  return dtp_udp_transport.now(gate);
+}
+
+static int uring_wait (struct dtp_gate *gate, pthread_cond_t *cv,
+		       pthread_mutex_t *mtx, unsigned long long deadline) {
+  return dtp_udp_transport.wait(gate, cv, mtx, deadline);
+}
+
+static void uring_wake (struct dtp_gate *gate, pthread_cond_t *cv) {
+  dtp_udp_transport.wake(gate, cv);
+}
+
+static int uring_spawn (struct dtp_gate *gate, pthread_t *tid,
+			void *(*daemon)(void*)) {
+  return dtp_udp_transport.spawn(gate, tid, daemon);
+}
+
+static void uring_stop (struct dtp_gate *gate, pthread_t tid) {
+  dtp_udp_transport.stop(gate, tid);
+}
+
+static struct dtp_wheel * uring_wheel (struct dtp_gate *gate) {
+  return dtp_udp_transport.wheel(gate);
+}
+
+static void uring_free (struct uring_gate *ug) {
+  ring_exit(&(ug->rcv));
+  ring_exit(&(ug->snd));
+  if( ug->br != NULL && ug->br != MAP_FAILED )
+    munmap(ug->br, ug->br_sz);
+  if( ug->bufs != NULL && ug->bufs != MAP_FAILED )
+    munmap(ug->bufs, ug->bufs_sz);
+  free(ug->stages);
+  pthread_mutex_destroy(&(ug->snd_mtx));
+  free(ug);
+}
+
+/* Daemons are stopped by now. */
+static void uring_release (struct dtp_gate *gate) {
+  uring_free((struct uring_gate *) gate->tpctx);
+  gate->tp = &dtp_udp_transport;
+  gate->tpctx = NULL;
+}
+
+static const struct dtp_transport dtp_uring_transport = {
+  uring_send,
+  uring_recv,
+  uring_timeout,
+  uring_now,
+  uring_wait,
+  uring_wake,
+  uring_spawn,
+  uring_stop,
+  uring_wheel,
+  uring_flush,
+  uring_release,
+  NULL
+};
+
+int dtp_uring_attach (struct dtp_gate *gate) {
+  if( gate->tp != &dtp_udp_transport )
+    return -1;			/* Simulated or already attached. */
+  struct uring_gate *ug = calloc(1, sizeof(struct uring_gate));
+  if( ug == NULL )
+    return -1;
+  ug->snd.fd = ug->rcv.fd = -1;
+  pthread_mutex_init(&(ug->snd_mtx), NULL);
+
+  int sqpoll = gate->io == DTP_IO_URING_SQPOLL;
+  if( ring_init(&(ug->snd), sqpoll, -1) < 0 ||
+      ring_init(&(ug->rcv), sqpoll, ug->snd.fd) < 0 ) {
+    uring_free(ug);
+    return -1;
+  }
+
+  ug->stages = calloc(URING_STAGES, sizeof(struct stage));
+  if( ug->stages == NULL ) {
+    uring_free(ug);
+    return -1;
+  }
+  for( ug->nfree = 0; ug->nfree < URING_STAGES; ug->nfree++ )
+    ug->freelist[ug->nfree] = ug->nfree;
+
+  /* Provided buffer ring for the receive side. */
+  ug->br_sz = URING_BUFS * sizeof(struct io_uring_buf);
+  ug->bufs_sz = URING_BUFS * URING_BUFSZ;
+  ug->br = mmap(NULL, ug->br_sz, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  ug->bufs = mmap(NULL, ug->bufs_sz, PROT_READ | PROT_WRITE,
+		  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if( ug->br == MAP_FAILED || ug->bufs == MAP_FAILED ) {
+    uring_free(ug);
+    return -1;
+  }
+  struct io_uring_buf_reg reg;
+  memset(&reg, 0, sizeof(reg));
+  reg.ring_addr = (unsigned long) ug->br;
+  reg.ring_entries = URING_BUFS;
+  reg.bgid = 0;
+  if( syscall(__NR_io_uring_register, ug->rcv.fd,
+	      IORING_REGISTER_PBUF_RING, &reg, 1) < 0 ) {
+    uring_free(ug);
+    return -1;
+  }
+  unsigned short i;
+  for( i = 0; i < URING_BUFS; i++ )
+    recycle(ug, i);
+
+  memset(&(ug->rmsg), 0, sizeof(struct msghdr));
+  ug->rmsg.msg_namelen = sizeof(struct sockaddr_in);
+  ug->rmsg.msg_controllen = URING_CMSG;
+
+  gate->tp = &dtp_uring_transport;
+  gate->tpctx = ug;
+  return 0;
+}
+
+#else  /* No io_uring in these headers. */
+
+int dtp_uring_attach (struct dtp_gate *gate) {
+  return -1;
+}
+
+#endif
@@ -0,0 +1,1300 @@
+#include "dtp.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+
+#include <fcntl.h>
+#include <ftw.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/**
+   dtpcp : parallel, resumable file copy over DTP.
+
+     dtpcp serve [-p port] [-d dir] [options]
+     dtpcp send [-j streams] [-c MiB] [options] host port path...
+
+   The sender walks the given files and directory trees and opens a
+   control gate to the server with the file table. The server answers
+   with one data gate port per stream, set up for this session only,
+   and with the chunks of each file it already holds. The sender then
+   spreads the missing chunks over the streams. Each chunk goes with
+   its checksum, is written in place with pwrite and acknowledged once
+   it verifies; chunks that do not are sent again.
+
+   Files are assembled as <path>.part next to a <path>.dtpcp manifest
+   holding the checksum of every chunk written. A later transfer of
+   the same file (same size and mtime) re-reads the chunks listed in
+   the manifest and only asks for those that are missing or do not
+   verify. Complete files are synced and renamed into place. Paths
+   are relative to the server's directory, absolute ones and ".."
+   are refused.
+
+   With -D, a file the server holds an older copy of goes as a delta
+   against it, rsync style, as one job on a data gate : the server
+   streams the rolling and strong checksum of each block of its copy
+   while it reads it, the sender looks them up at every offset of its
+   own with a rolling hash and sends literal data and runs of blocks
+   to copy, and the server rebuilds <path>.part from both with pwrite.
+   The chunk checksums close the delta; if any does not verify the
+   file goes again in chunks.
+
+   Integers travel in host order, like DTP's own headers.
+ */
+
+#define CP_MAGIC 0x43505444u	/* "DTPC" */
+#define CP_VERSION 2
+#define CP_STREAMS 4		/* Default data gates per transfer. */
+#define CP_STREAMS_MAX 64
+#define CP_CHUNK (4ull << 20)	/* Default chunk size. */
+#define CP_CHUNK_MAX (256ull << 20)
+#define CP_INFLIGHT 2		/* Unacknowledged chunks per stream. */
+#define CP_PATH 4096
+#define CP_TRIES 30		/* Connection attempts, a second each. */
+#define CP_END 0xffffffffu	/* Chunk header file index : stream done. */
+#define CP_WHOLE (~0ull)	/* Chunk index : the whole file as a delta. */
+#define CP_DELTA 1		/* Hello flag : deltas welcome. */
+#define CP_BLOCK_MIN (2u << 10)	/* Delta block, about the square root */
+#define CP_BLOCK_MAX (128u << 10) /* of the size within these. */
+#define CP_SIGBATCH 1024	/* Block checksums computed, then sent. */
+#define CP_LITERAL (64u << 10)	/* Longest literal op. */
+
+/* Control gate, sender to server. */
+struct cp_hello {
+  uint32_t magic, version;
+  uint32_t nfiles, streams;
+  uint64_t chunk;
+  uint32_t flags, pad;
+};
+
+/* Then one per file, followed by its path. */
+struct cp_file {
+  uint64_t size;
+  int64_t mtime;
+  uint32_t mode, pathlen;
+};
+
+/* Server to sender, then per file one byte per chunk, 1 if held,
+   2 for all of them if the file goes as a delta. */
+struct cp_welcome {
+  uint32_t status;		/* 0, or errno. */
+  uint32_t streams;
+  uint16_t port[CP_STREAMS_MAX];
+};
+
+/* Data gates, sender to server, followed by len bytes. */
+struct cp_chunk {
+  uint32_t file, pad;
+  uint64_t index, len, sum;
+};
+
+/* Server to sender. */
+struct cp_ack {
+  uint32_t file, ok;
+  uint64_t index;
+};
+
+/**
+   Delta of a file, on a data gate, after a cp_chunk of index CP_WHOLE :
+   the server sends cp_sigs and a cp_sig per full block of its copy,
+   the sender the checksum of every chunk then cp_ops up to
+   CP_OP_END, and the server a cp_ack.
+ */
+struct cp_sigs {
+  uint64_t block, count;
+};
+
+struct cp_sig {
+  uint32_t weak, pad;
+  uint64_t strong;
+};
+
+#define CP_OP_COPY 1		/* count blocks from block arg of the copy. */
+#define CP_OP_DATA 2		/* arg bytes follow. */
+#define CP_OP_END 3
+
+struct cp_op {
+  uint32_t kind, count;
+  uint64_t arg;
+};
+
+/* On disk, followed by one checksum per chunk, 0 if missing. */
+struct cp_manifest {
+  uint32_t magic, version;
+  uint64_t size;
+  int64_t mtime;
+  uint64_t chunk, nchunks;
+};
+
+struct cp_opts {
+  port_t port;
+  const char *dir;
+  int streams;
+  uint64_t chunk;
+  int window;
+  int compress;
+  int quiet;
+  int delta;
+};
+
+static struct cp_opts opts = { 9400, ".", CP_STREAMS, CP_CHUNK, MXW, 0, 0, 0 };
+
+/* -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- */
+/* Helpers. */
+
+static double now_s (void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static uint64_t rotl (uint64_t x, int r) {
+  return (x << r) | (x >> (64 - r));
+}
+
+/* 64 bit checksum, four multiply-rotate lanes. Never 0. */
+static uint64_t chunk_sum (const byte_t *p, size_t n) {
+  const uint64_t P1 = 0x9e3779b185ebca87ull, P2 = 0xc2b2ae3d27d4eb4full;
+  uint64_t a[4] = { P1 + P2, P2, 0, -P1 }, w, h;
+  size_t i = 0;
+  int k;
+  for( ; i + 32 <= n; i += 32 )
+    for( k = 0; k < 4; k++ ) {
+      memcpy(&w, p + i + 8 * k, 8);
+      a[k] = rotl(a[k] + w * P2, 31) * P1;
+    }
+  h = rotl(a[0], 1) + rotl(a[1], 7) + rotl(a[2], 12) + rotl(a[3], 18) + n;
+  for( ; i < n; i++ )
+    h = rotl(h ^ (p[i] * P1), 11) * P2;
+  h ^= h >> 33; h *= P2;
+  h ^= h >> 29; h *= P1;
+  h ^= h >> 32;
+  return h != 0 ? h : 1;
+}
+
+/**
+   Rolling checksum of a block (rsync's) : the low half sums the
+   bytes, the high half weighs each by its distance to the end. Eight
+   lanes the compiler keeps in vector registers, each with its sum and
+   the sum of its sums, which weighs its bytes by the rounds left.
+ */
+static uint32_t weak_sum (const byte_t *p, size_t n) {
+  uint32_t a[8] = { 0 }, c[8] = { 0 }, sa = 0, sb = 0;
+  size_t i = 0;
+  int k;
+  for( ; i + 8 <= n; i += 8 )
+    for( k = 0; k < 8; k++ ) {
+      a[k] += p[i + k];
+      c[k] += a[k];
+    }
+  for( k = 0; k < 8; k++ ) {
+    sa += a[k];
+    sb += 8 * c[k] - k * a[k];
+  }
+  sb += (n - i) * sa;
+  for( ; i < n; i++ ) {
+    sa += p[i];
+    sb += (uint32_t) (n - i) * p[i];
+  }
+  return (sa & 0xffff) | sb << 16;
+}
+
+/* Slide a weak_sum of n bytes one byte on, dropping out and taking in. */
+static uint32_t weak_roll (uint32_t w, size_t n, byte_t out, byte_t in) {
+  uint32_t a = (w & 0xffff) - out + in;
+  uint32_t b = (w >> 16) - (uint32_t) n * out + a;
+  return (a & 0xffff) | b << 16;
+}
+
+static uint64_t delta_block (uint64_t size) {
+  uint64_t b = CP_BLOCK_MIN;
+  while( b < CP_BLOCK_MAX && b * b < size )
+    b <<= 1;
+  return b;
+}
+
+static uint64_t nchunks (uint64_t size, uint64_t chunk) {
+  return (size + chunk - 1) / chunk;
+}
+
+static int recv_all (struct dtp_gate *gate, void *buf, size_t len) {
+  byte_t *p = (byte_t*) buf;
+  while( len > 0 ) {
+    size_t n = dtp_recv(gate, p, len);
+    if( n == 0 )
+      return -1;		/* Peer closed. */
+    p += n;
+    len -= n;
+  }
+  return 0;
+}
+
+static int read_at (int fd, void *buf, size_t len, off_t off) {
+  byte_t *p = (byte_t*) buf;
+  while( len > 0 ) {
+    ssize_t n = pread(fd, p, len, off);
+    if( n <= 0 )
+      return -1;
+    p += n;
+    off += n;
+    len -= n;
+  }
+  return 0;
+}
+
+static int write_at (int fd, const void *buf, size_t len, off_t off) {
+  const byte_t *p = (const byte_t*) buf;
+  while( len > 0 ) {
+    ssize_t n = pwrite(fd, p, len, off);
+    if( n < 0 )
+      return -1;
+    p += n;
+    off += n;
+    len -= n;
+  }
+  return 0;
+}
+
+static void set_opts (struct dtp_gate *gate) {
+  dtp_setopt(gate, DTP_WINDOW, opts.window);
+  dtp_setopt(gate, DTP_COMPRESS, opts.compress);
+}
+
+/* -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- */
+/* Server. */
+
+struct srv_file {
+  char *path;			/* Final path. */
+  uint64_t size, chunks, done;
+  int64_t mtime;
+  uint32_t mode;
+  uint64_t *sums;		/* Per chunk, 0 if missing. */
+  int mfd;			/* Manifest, -1 once complete. */
+  int delta;			/* Goes as a delta against path. */
+};
+
+struct session {
+  pthread_mutex_t mtx;
+  struct in_addr peer;
+  uint64_t chunk;
+  uint32_t nfiles;
+  struct srv_file *files;
+  int streams, live;		/* Data gates, those still running. */
+  dtp_server gates[CP_STREAMS_MAX];
+};
+
+struct stream {
+  struct session *s;
+  int i;
+};
+
+static char * suffixed (const char *path, const char *sfx) {
+  char *p = malloc(strlen(path) + strlen(sfx) + 1);
+  if( p != NULL )
+    sprintf(p, "%s%s", path, sfx);
+  return p;
+}
+
+/* Relative, and no ".." component. */
+static int safe_path (const char *rel) {
+  if( rel[0] == '\0' || rel[0] == '/' )
+    return 0;
+  const char *c = rel;
+  while( *c != '\0' ) {
+    size_t n = strcspn(c, "/");
+    if( n == 2 && c[0] == '.' && c[1] == '.' )
+      return 0;
+    c += n;
+    while( *c == '/' )
+      c++;
+  }
+  return 1;
+}
+
+static int make_parents (char *path) {
+  char *c;
+  for( c = path + 1; *c != '\0'; c++ ) {
+    if( *c != '/' )
+      continue;
+    *c = '\0';
+    int stat = mkdir(path, 0755);
+    *c = '/';
+    if( stat != 0 && errno != EEXIST )
+      return -1;
+  }
+  return 0;
+}
+
+/* Rename a complete file into place. Called with the session locked. */
+static int finish_file (struct srv_file *f) {
+  char *part = suffixed(f->path, ".part"), *man = suffixed(f->path, ".dtpcp");
+  int stat = -1;
+  if( part == NULL || man == NULL )
+    goto out;
+  int fd = open(part, O_WRONLY);
+  if( fd < 0 )
+    goto out;
+  stat = fsync(fd);
+  close(fd);
+  if( stat == 0 )
+    stat = rename(part, f->path);
+  if( stat == 0 ) {
+    struct timespec ts[2];
+    ts[0].tv_sec = ts[1].tv_sec = f->mtime;
+    ts[0].tv_nsec = ts[1].tv_nsec = 0;
+    chmod(f->path, f->mode & 07777);
+    utimensat(AT_FDCWD, f->path, ts, 0);
+    unlink(man);
+  }
+ out:
+  if( f->mfd >= 0 )
+    close(f->mfd);
+  f->mfd = -1;
+  free(part);
+  free(man);
+  return stat;
+}
+
+/**
+   Open or resume a file : load its manifest if it matches, and keep
+   the chunks that still verify.
+ */
+static int open_file (struct srv_file *f, uint64_t chunk, byte_t *buf) {
+  struct stat st;
+  f->chunks = nchunks(f->size, chunk);
+  f->done = 0;
+  f->mfd = -1;
+  f->sums = calloc(f->chunks + 1, sizeof(uint64_t));
+  char *part = suffixed(f->path, ".part"), *man = suffixed(f->path, ".dtpcp");
+  if( f->sums == NULL || part == NULL || man == NULL || make_parents(f->path) != 0 )
+    goto fail;
+
+  /* Already there from an earlier run. */
+  if( stat(f->path, &st) == 0 && S_ISREG(st.st_mode) &&
+      (uint64_t) st.st_size == f->size && st.st_mtime == f->mtime &&
+      access(man, F_OK) != 0 ) {
+    for( f->done = 0; f->done < f->chunks; f->done++ )
+      f->sums[f->done] = 1;
+    free(part);
+    free(man);
+    return 0;
+  }
+
+  struct cp_manifest hdr, want = { CP_MAGIC, CP_VERSION, f->size, f->mtime,
+				   chunk, f->chunks };
+  f->mfd = open(man, O_RDWR | O_CREAT, 0644);
+  if( f->mfd < 0 )
+    goto fail;
+  int fd = open(part, O_RDWR | O_CREAT, 0644);
+  if( fd < 0 )
+    goto fail;
+  if( read_at(f->mfd, &hdr, sizeof(hdr), 0) == 0 &&
+      memcmp(&hdr, &want, sizeof(hdr)) == 0 &&
+      read_at(f->mfd, f->sums, f->chunks * sizeof(uint64_t), sizeof(hdr)) == 0 ) {
+    uint64_t i;			/* Trust data, not the manifest. */
+    for( i = 0; i < f->chunks; i++ ) {
+      if( f->sums[i] == 0 )
+	continue;
+      uint64_t len = i + 1 < f->chunks ? chunk : f->size - i * chunk;
+      if( read_at(fd, buf, len, i * chunk) == 0 && chunk_sum(buf, len) == f->sums[i] )
+	f->done++;
+      else
+	f->sums[i] = 0;
+    }
+  } else {
+    memset(f->sums, 0, f->chunks * sizeof(uint64_t));
+    if( ftruncate(f->mfd, 0) != 0 ||
+	write_at(f->mfd, &want, sizeof(want), 0) != 0 ||
+	write_at(f->mfd, f->sums, f->chunks * sizeof(uint64_t), sizeof(want)) != 0 )
+      f->chunks = 0;
+  }
+  int stat = ftruncate(fd, f->size);
+  close(fd);
+  if( stat != 0 )
+    goto fail;
+  free(part);
+  free(man);
+  if( f->done == f->chunks )
+    return finish_file(f);
+  return 0;
+ fail:
+  free(part);
+  free(man);
+  return -1;
+}
+
+static void free_session (struct session *s) {
+  uint32_t i;
+  for( i = 0; i < s->nfiles; i++ ) {
+    if( s->files[i].mfd >= 0 )
+      close(s->files[i].mfd);
+    free(s->files[i].path);
+    free(s->files[i].sums);
+  }
+  free(s->files);
+  pthread_mutex_destroy(&(s->mtx));
+  free(s);
+}
+
+/* Verify, store and record one chunk. Returns nonzero if it does not check out. */
+static int store_chunk (struct session *s, const struct cp_chunk *c, const byte_t *buf) {
+  if( c->file >= s->nfiles )
+    return -1;
+  struct srv_file *f = s->files + c->file;
+  if( c->index >= f->chunks ||
+      c->len != (c->index + 1 < f->chunks ? s->chunk : f->size - c->index * s->chunk) ||
+      chunk_sum(buf, c->len) != c->sum )
+    return -1;
+
+  char *part = suffixed(f->path, ".part");
+  int fd = part != NULL ? open(part, O_WRONLY) : -1;
+  free(part);
+  if( fd < 0 )
+    return -1;
+  int stat = write_at(fd, buf, c->len, c->index * s->chunk);
+  close(fd);
+  if( stat != 0 )
+    return -1;
+
+  pthread_mutex_lock(&(s->mtx));
+  if( f->mfd >= 0 && f->sums[c->index] == 0 ) {
+    f->sums[c->index] = c->sum;
+    write_at(f->mfd, &(c->sum), sizeof(uint64_t),
+	     sizeof(struct cp_manifest) + c->index * sizeof(uint64_t));
+    if( ++(f->done) == f->chunks )
+      stat = finish_file(f);
+  }
+  pthread_mutex_unlock(&(s->mtx));
+  return stat;
+}
+
+/**
+   Delta bytes up to end are in buf from the start of their chunk :
+   once that chunk is whole, check and write it. Returns nonzero if
+   it does not check out.
+ */
+static int delta_chunk (struct session *s, struct srv_file *f, int pfd,
+			const byte_t *buf, const uint64_t *sums, uint64_t end) {
+  if( end % s->chunk != 0 && end != f->size )
+    return 0;
+  uint64_t i = (end - 1) / s->chunk, len = end - i * s->chunk;
+  return chunk_sum(buf, len) != sums[i] ||
+    write_at(pfd, buf, len, i * s->chunk) != 0;
+}
+
+/**
+   Delta of a file : block checksums of the old copy out, batch by
+   batch while the next is read, then the sender's chunk checksums
+   and ops in, applied to <path>.part. Returns 0 once it verifies, 1
+   if it does not, -1 if the stream is broken.
+ */
+static int delta_recv (struct session *s, struct dtp_gate *gate, uint32_t fi,
+		       byte_t *buf) {
+  if( fi >= s->nfiles || !s->files[fi].delta )
+    return -1;
+  struct srv_file *f = s->files + fi;
+  char *part = suffixed(f->path, ".part");
+  int bfd = open(f->path, O_RDONLY);
+  int pfd = part != NULL ? open(part, O_WRONLY) : -1;
+  free(part);
+  struct stat st;
+  struct cp_sigs sh = { CP_BLOCK_MIN, 0 }; /* Unreadable : all literal. */
+  if( bfd >= 0 && fstat(bfd, &st) == 0 ) {
+    sh.block = delta_block(st.st_size);
+    sh.count = st.st_size / sh.block;
+  }
+  int stat = 0;
+  dtp_send(gate, &sh, sizeof(sh));
+
+  struct cp_sig sig[CP_SIGBATCH];
+  uint64_t per = s->chunk / sh.block < CP_SIGBATCH ? s->chunk / sh.block : CP_SIGBATCH;
+  uint64_t i, k, n;
+  for( i = 0; i < sh.count; i += n ) {
+    n = sh.count - i < per ? sh.count - i : per;
+    if( read_at(bfd, buf, n * sh.block, i * sh.block) != 0 )
+      memset(buf, 0, n * sh.block); /* Changed under us : no match. */
+    for( k = 0; k < n; k++ ) {
+      sig[k].weak = weak_sum(buf + k * sh.block, sh.block);
+      sig[k].pad = 0;
+      sig[k].strong = chunk_sum(buf + k * sh.block, sh.block);
+    }
+    dtp_send(gate, sig, n * sizeof(struct cp_sig));
+  }
+
+  /* Ops, in file order, rebuilding chunk by chunk in buf. */
+  uint64_t *sums = malloc((f->chunks + 1) * sizeof(uint64_t));
+  if( sums == NULL || recv_all(gate, sums, f->chunks * sizeof(uint64_t)) != 0 )
+    goto broken;
+  struct cp_op op;
+  uint64_t out = 0, len, from = 0;
+  while( 1 ) {
+    if( recv_all(gate, &op, sizeof(op)) != 0 )
+      goto broken;
+    if( op.kind == CP_OP_END )
+      break;
+    if( op.kind == CP_OP_DATA && op.arg <= CP_LITERAL )
+      len = op.arg;
+    else if( op.kind == CP_OP_COPY && op.arg <= sh.count &&
+	     op.count <= sh.count - op.arg ) {
+      len = op.count * sh.block;
+      from = op.arg * sh.block;
+    } else
+      goto broken;
+    if( len > f->size - out )
+      goto broken;
+    while( len > 0 ) {
+      uint64_t at = out % s->chunk, m = s->chunk - at < len ? s->chunk - at : len;
+      if( op.kind == CP_OP_DATA ) {
+	if( recv_all(gate, buf + at, m) != 0 )
+	  goto broken;
+      } else if( read_at(bfd, buf + at, m, from) != 0 )
+	stat = 1;
+      from += m;
+      out += m;
+      len -= m;
+      if( delta_chunk(s, f, pfd, buf, sums, out) != 0 )
+	stat = 1;
+    }
+  }
+  close(bfd);
+  if( pfd >= 0 )
+    close(pfd);
+  if( out != f->size )
+    stat = 1;
+  if( stat == 0 ) {
+    pthread_mutex_lock(&(s->mtx));
+    memcpy(f->sums, sums, f->chunks * sizeof(uint64_t));
+    write_at(f->mfd, sums, f->chunks * sizeof(uint64_t), sizeof(struct cp_manifest));
+    f->done = f->chunks;
+    stat = finish_file(f) != 0;
+    pthread_mutex_unlock(&(s->mtx));
+  }
+  f->delta = 0;			/* Chunks from here on. */
+  free(sums);
+  return stat;
+
+ broken:
+  free(sums);
+  if( bfd >= 0 )
+    close(bfd);
+  if( pfd >= 0 )
+    close(pfd);
+  return -1;
+}
+
+static void * data_main (void *arg) {
+  struct stream *st = (struct stream*) arg;
+  struct session *s = st->s;
+  dtp_server *gate = s->gates + st->i;
+  free(st);
+
+  char host[1<<5];
+  port_t port;
+  byte_t *buf = malloc(s->chunk);
+  while( buf != NULL && dtp_listen(gate, host, &port) == 0 ) {
+    if( gate->addr.sin_addr.s_addr == s->peer.s_addr )
+      break;
+    close_dtp_gate(gate);	/* Not our sender. */
+  }
+  if( buf != NULL && gate->status != IDLE ) {
+    struct cp_chunk c;
+    while( recv_all(gate, &c, sizeof(c)) == 0 && c.file != CP_END ) {
+      struct cp_ack ack = { c.file, 0, c.index };
+      if( c.index == CP_WHOLE ) {
+	int stat = delta_recv(s, gate, c.file, buf);
+	if( stat < 0 )
+	  break;
+	ack.ok = stat == 0;
+      } else if( c.len <= s->chunk && recv_all(gate, buf, c.len) == 0 )
+	ack.ok = store_chunk(s, &c, buf) == 0;
+      else
+	break;
+      dtp_send(gate, &ack, sizeof(ack));
+    }
+    close_dtp_gate(gate);
+  }
+  close(gate->socket);
+  free(buf);
+
+  pthread_mutex_lock(&(s->mtx));
+  int last = --(s->live) == 0;
+  pthread_mutex_unlock(&(s->mtx));
+  if( last ) {
+    if( !opts.quiet )
+      fprintf(stderr, "dtpcp: session from %s done\n", inet_ntoa(s->peer));
+    free_session(s);
+  }
+  return NULL;
+}
+
+/* Read the file table and set up the data gates. Replies on ctl. */
+static int start_session (dtp_server *ctl) {
+  struct cp_hello hello;
+  struct cp_welcome w;
+  memset(&w, 0, sizeof(w));
+  if( recv_all(ctl, &hello, sizeof(hello)) != 0 )
+    return -1;
+  if( hello.magic != CP_MAGIC || hello.version != CP_VERSION ||
+      hello.streams == 0 || hello.streams > CP_STREAMS_MAX ||
+      hello.chunk < CP_BLOCK_MAX || hello.chunk > CP_CHUNK_MAX ) {
+    w.status = EPROTO;		/* Deltas take whole blocks per chunk. */
+    dtp_send(ctl, &w, sizeof(w));
+    return -1;
+  }
+
+  struct session *s = calloc(1, sizeof(struct session));
+  byte_t *buf = malloc(hello.chunk);
+  if( s == NULL || buf == NULL ||
+      (s->files = calloc(hello.nfiles + 1, sizeof(struct srv_file))) == NULL ) {
+    free(s);
+    free(buf);
+    return -1;
+  }
+  pthread_mutex_init(&(s->mtx), NULL);
+  s->peer = ctl->addr.sin_addr;
+  s->chunk = hello.chunk;
+  s->streams = hello.streams;
+
+  uint32_t i;
+  char rel[CP_PATH];
+  for( i = 0; i < hello.nfiles && w.status == 0; i++ ) {
+    struct cp_file cf;
+    struct srv_file *f = s->files + i;
+    f->mfd = -1;
+    s->nfiles = i + 1;
+    if( recv_all(ctl, &cf, sizeof(cf)) != 0 || cf.pathlen >= CP_PATH ||
+	recv_all(ctl, rel, cf.pathlen) != 0 ) {
+      w.status = EPROTO;
+      break;
+    }
+    rel[cf.pathlen] = '\0';
+    f->size = cf.size;
+    f->mtime = cf.mtime;
+    f->mode = cf.mode;
+    f->path = malloc(strlen(opts.dir) + cf.pathlen + 2);
+    if( !safe_path(rel) )
+      w.status = EACCES;
+    else if( f->path == NULL )
+      w.status = ENOMEM;
+    else {
+      sprintf(f->path, "%s/%s", opts.dir, rel);
+      struct stat st;
+      if( open_file(f, s->chunk, buf) != 0 )
+	w.status = errno != 0 ? errno : EIO;
+      else if( (hello.flags & CP_DELTA) && f->mfd >= 0 && f->done == 0 &&
+	       stat(f->path, &st) == 0 && S_ISREG(st.st_mode) &&
+	       (uint64_t) st.st_size >= CP_BLOCK_MIN )
+	f->delta = 1;		/* An older copy to start from. */
+    }
+    if( w.status != 0 )
+      fprintf(stderr, "dtpcp: %s : %s\n", rel, strerror(w.status));
+  }
+  free(buf);
+
+  for( i = 0; i < (uint32_t) s->streams && w.status == 0; i++ ) {
+    struct sockaddr_in a;
+    socklen_t alen = sizeof(a);
+    if( init_dtp_server(s->gates + i, 0) != 0 ||
+	getsockname(s->gates[i].socket, (struct sockaddr*) &a, &alen) != 0 ) {
+      w.status = errno;
+      break;
+    }
+    set_opts(s->gates + i);
+    w.port[i] = ntohs(a.sin_port);
+  }
+  w.streams = i;
+
+  if( w.status != 0 ) {
+    while( i-- > 0 )
+      close(s->gates[i].socket);
+    dtp_send(ctl, &w, sizeof(w));
+    free_session(s);
+    return -1;
+  }
+
+  s->live = s->streams;
+  for( i = 0; i < (uint32_t) s->streams; i++ ) {
+    struct stream *st = malloc(sizeof(struct stream));
+    pthread_t tid;
+    st->s = s;
+    st->i = i;
+    pthread_create(&tid, NULL, data_main, st);
+    pthread_detach(tid);
+  }
+  /* Tell the sender what is there already. */
+  dtp_send(ctl, &w, sizeof(w));
+  for( i = 0; i < s->nfiles; i++ ) {
+    struct srv_file *f = s->files + i;
+    uint64_t k;
+    byte_t have[256];
+    for( k = 0; k < f->chunks; k++ ) {
+      have[k % sizeof(have)] = f->delta ? 2 : f->sums[k] != 0;
+      if( k % sizeof(have) == sizeof(have) - 1 || k + 1 == f->chunks )
+	dtp_send(ctl, have, k % sizeof(have) + 1);
+    }
+  }
+  return 0;
+}
+
+static int serve (void) {
+  dtp_server ctl;
+  char host[1<<5];
+  port_t port;
+  if( init_dtp_server(&ctl, opts.port) != 0 ) {
+    perror("init_dtp_server");
+    return 1;
+  }
+  if( !opts.quiet )
+    fprintf(stderr, "dtpcp: serving %s on port %u\n", opts.dir, opts.port);
+  while( 1 ) {
+    set_opts(&ctl);
+    if( dtp_listen(&ctl, host, &port) != 0 ) {
+      perror("dtp_listen");
+      return 1;
+    }
+    if( !opts.quiet )
+      fprintf(stderr, "dtpcp: session from %s:%u\n", host, port);
+    start_session(&ctl);
+    close_dtp_gate(&ctl);
+  }
+  return 0;
+}
+
+/* -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- */
+/* Sender. */
+
+struct cli_file {
+  char *src, *rel;
+  uint64_t size;
+  int64_t mtime;
+  uint32_t mode;
+};
+
+struct job {
+  uint32_t file;
+  uint64_t index;
+};
+
+static struct {
+  struct cli_file *files;
+  uint32_t nfiles, cap;
+  size_t skip;			/* Prefix of the current root not sent. */
+
+  pthread_mutex_t mtx;
+  pthread_cond_t var;
+  struct job *todo;		/* Chunks to send, then retries. */
+  size_t ntodo, next, cap_todo;
+  size_t pending;		/* Taken but not acknowledged. */
+  uint64_t bytes, total;	/* Acknowledged, to send. */
+  uint64_t delta, literal;	/* Of bytes, sent as deltas; their literals. */
+  int failed;
+} cli = { NULL, 0, 0, 0, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER };
+
+static int add_file (const char *path, const struct stat *st, int type, struct FTW *ftw) {
+  if( type != FTW_F || !S_ISREG(st->st_mode) )
+    return 0;
+  if( cli.nfiles == cli.cap ) {
+    cli.cap = cli.cap ? 2 * cli.cap : 64;
+    cli.files = realloc(cli.files, cli.cap * sizeof(struct cli_file));
+    if( cli.files == NULL )
+      return -1;
+  }
+  struct cli_file *f = cli.files + cli.nfiles++;
+  f->src = strdup(path);
+  f->rel = strdup(path + cli.skip);
+  f->size = st->st_size;
+  f->mtime = st->st_mtime;
+  f->mode = st->st_mode;
+  return f->src == NULL || f->rel == NULL ? -1 : 0;
+}
+
+/* Files are sent relative to the parent of each argument. */
+static int add_path (const char *arg) {
+  char path[CP_PATH];
+  size_t n = strlen(arg);
+  if( n == 0 || n >= sizeof(path) )
+    return -1;
+  strcpy(path, arg);
+  while( n > 1 && path[n - 1] == '/' )
+    path[--n] = '\0';
+  char *slash = strrchr(path, '/');
+  cli.skip = slash != NULL ? (size_t) (slash - path) + 1 : 0;
+  return nftw(path, add_file, 64, FTW_PHYS);
+}
+
+static int add_job (uint32_t file, uint64_t index) {
+  if( cli.ntodo == cli.cap_todo ) {
+    cli.cap_todo = cli.cap_todo ? 2 * cli.cap_todo : 1024;
+    cli.todo = realloc(cli.todo, cli.cap_todo * sizeof(struct job));
+    if( cli.todo == NULL )
+      return -1;
+  }
+  cli.todo[cli.ntodo].file = file;
+  cli.todo[cli.ntodo].index = index;
+  cli.ntodo++;
+  return 0;
+}
+
+/**
+   Next chunk to send. Returns 0 once all are acknowledged, or, unless
+   wait is set, when none is queued right now.
+ */
+static int take_job (struct job *j, int wait) {
+  pthread_mutex_lock(&(cli.mtx));
+  while( wait && cli.next == cli.ntodo && cli.pending > 0 && !cli.failed )
+    pthread_cond_wait(&(cli.var), &(cli.mtx));
+  int got = cli.next < cli.ntodo && !cli.failed;
+  if( got ) {
+    *j = cli.todo[cli.next++];
+    cli.pending++;
+  }
+  pthread_mutex_unlock(&(cli.mtx));
+  return got;
+}
+
+static void done_job (const struct job *j, uint64_t len, int ok) {
+  pthread_mutex_lock(&(cli.mtx));
+  cli.pending--;
+  if( ok ) {
+    cli.bytes += len;
+    if( j->index == CP_WHOLE )
+      cli.delta += len;
+  } else if( j->index == CP_WHOLE ) {
+    uint64_t c, n = nchunks(cli.files[j->file].size, opts.chunk);
+    for( c = 0; c < n; c++ )	/* Again, in chunks. */
+      if( add_job(j->file, c) != 0 )
+	cli.failed = 1;
+  } else if( add_job(j->file, j->index) != 0 )
+    cli.failed = 1;
+  pthread_cond_broadcast(&(cli.var));
+  pthread_mutex_unlock(&(cli.mtx));
+}
+
+static uint64_t job_len (const struct job *j) {
+  const struct cli_file *f = cli.files + j->file;
+  if( j->index == CP_WHOLE )
+    return f->size;
+  uint64_t off = j->index * opts.chunk;
+  return f->size - off < opts.chunk ? f->size - off : opts.chunk;
+}
+
+struct sender {
+  const char *host;
+  port_t port;
+  pthread_t tid;
+};
+
+/* Reads the oldest acknowledgement of a stream. */
+static int reap (dtp_client *gate, struct job *fly, int *n) {
+  struct cp_ack ack;
+  if( recv_all(gate, &ack, sizeof(ack)) != 0 ||
+      ack.file != fly[0].file || ack.index != fly[0].index )
+    return -1;
+  done_job(fly, job_len(fly), ack.ok);
+  if( !ack.ok && fly[0].index == CP_WHOLE )
+    fprintf(stderr, "dtpcp: %s delta rejected, resending in chunks\n",
+	    cli.files[fly[0].file].rel);
+  else if( !ack.ok )
+    fprintf(stderr, "dtpcp: %s chunk %llu rejected, resending\n",
+	    cli.files[fly[0].file].rel, (unsigned long long) fly[0].index);
+  memmove(fly, fly + 1, (*n - 1) * sizeof(struct job));
+  (*n)--;
+  return 0;
+}
+
+static void send_literal (dtp_client *gate, const byte_t *p, uint64_t len,
+			  uint64_t *literal) {
+  while( len > 0 ) {
+    struct cp_op op = { CP_OP_DATA, 0, len < CP_LITERAL ? len : CP_LITERAL };
+    dtp_send(gate, &op, sizeof(op));
+    dtp_send(gate, p, op.arg);
+    *literal += op.arg;
+    p += op.arg;
+    len -= op.arg;
+  }
+}
+
+static void send_copy (dtp_client *gate, uint64_t block, uint64_t count) {
+  struct cp_op op = { CP_OP_COPY, count, block };
+  dtp_send(gate, &op, sizeof(op));
+}
+
+static uint32_t bucket (uint32_t weak, uint32_t mask) {
+  return (weak ^ weak >> 15) & mask;
+}
+
+/* Bit of a weak checksum in a filter of mask + 1 bits. */
+static uint32_t filter_bit (uint32_t weak, uint32_t mask) {
+  return (weak * 0x9e3779b1u >> 7) & mask;
+}
+
+/**
+   Delta of a file, mapped at p, against the server's copy : build the
+   table of its block checksums as they arrive, then look up the one
+   starting at each offset of ours, rolling, and block by block past
+   a match. Returns nonzero if the stream is broken.
+ */
+static int delta_send (dtp_client *gate, const struct job *j, const byte_t *p) {
+  const struct cli_file *f = cli.files + j->file;
+  struct cp_chunk c = { j->file, 0, CP_WHOLE, 0, 0 };
+  dtp_send(gate, &c, sizeof(c));
+
+  /* Our chunk checksums, while the server reads its copy. */
+  uint64_t i, k, m, n = nchunks(f->size, opts.chunk);
+  uint64_t *sums = malloc((n + 1) * sizeof(uint64_t));
+  if( sums == NULL )
+    return -1;
+  for( i = 0; i < n; i++ ) {
+    uint64_t off = i * opts.chunk;
+    sums[i] = chunk_sum(p + off, f->size - off < opts.chunk ? f->size - off : opts.chunk);
+  }
+  dtp_send(gate, sums, n * sizeof(uint64_t));
+
+  struct cp_sigs sh;
+  struct cp_sig *sig = NULL;
+  uint32_t *head = NULL, *next = NULL, mask = 0, fmask;
+  byte_t *filter = NULL;	/* Most offsets match nothing : one load
+				   tells, not a walk of the table. */
+  int err = recv_all(gate, &sh, sizeof(sh)) != 0 || sh.block == 0 ||
+    sh.block > CP_BLOCK_MAX || sh.count >= 0xffffffffu;
+  if( !err ) {
+    while( mask + 1 < sh.count )
+      mask = mask << 1 | 1;
+    sig = malloc((sh.count + 1) * sizeof(struct cp_sig));
+    head = malloc((mask + 1) * sizeof(uint32_t));
+    next = malloc((sh.count + 1) * sizeof(uint32_t));
+    fmask = (mask + 1) * 32 - 1;
+    filter = calloc((fmask >> 3) + 1, 1);
+    err = sig == NULL || head == NULL || next == NULL || filter == NULL;
+  }
+  if( !err )
+    memset(head, 0xff, (mask + 1) * sizeof(uint32_t));
+  for( i = 0; i < sh.count && !err; i += m ) {
+    m = sh.count - i < CP_SIGBATCH ? sh.count - i : CP_SIGBATCH;
+    err = recv_all(gate, sig + i, m * sizeof(struct cp_sig)) != 0;
+    for( k = i; k < i + m && !err; k++ ) {
+      uint32_t h = bucket(sig[k].weak, mask), b = filter_bit(sig[k].weak, fmask);
+      next[k] = head[h];
+      head[h] = k;
+      filter[b >> 3] |= 1 << (b & 7);
+    }
+  }
+
+  /* Pending : literal bytes from lit, a run of blocks from run. */
+  const uint64_t bs = sh.block, none = ~0ull;
+  uint64_t pos = 0, lit = 0, run = 0, runlen = 0, literal = 0;
+  uint32_t w = 0;
+  int rolled = 0;
+  while( !err && sh.count > 0 && pos + bs <= f->size ) {
+    if( !rolled )
+      w = weak_sum(p + pos, bs);
+    uint64_t hit = none, strong = 0;
+    uint32_t b = filter_bit(w, fmask);
+    int have = 0;
+    /* The next block of the run first : runs stay whole. */
+    if( runlen > 0 && run + runlen < sh.count && sig[run + runlen].weak == w ) {
+      strong = chunk_sum(p + pos, bs);
+      have = 1;
+      if( strong == sig[run + runlen].strong )
+	hit = run + runlen;
+    }
+    if( !(filter[b >> 3] & 1 << (b & 7)) )
+      k = 0xffffffffu;
+    else
+      k = head[bucket(w, mask)];
+    for( ; hit == none && k != 0xffffffffu; k = next[k] ) {
+      if( sig[k].weak != w )
+	continue;
+      if( !have )
+	strong = chunk_sum(p + pos, bs);
+      have = 1;
+      if( strong == sig[k].strong )
+	hit = k;
+    }
+
+    if( hit != none ) {
+      send_literal(gate, p + lit, pos - lit, &literal);
+      if( runlen > 0 && hit == run + runlen )
+	runlen++;
+      else {
+	if( runlen > 0 )
+	  send_copy(gate, run, runlen);
+	run = hit;
+	runlen = 1;
+      }
+      pos += bs;
+      lit = pos;
+      rolled = 0;
+    } else {
+      if( runlen > 0 )
+	send_copy(gate, run, runlen);
+      runlen = 0;
+      rolled = pos + bs < f->size;
+      if( rolled )
+	w = weak_roll(w, bs, p[pos], p[pos + bs]);
+      pos++;
+      if( pos - lit == CP_LITERAL ) {
+	send_literal(gate, p + lit, pos - lit, &literal);
+	lit = pos;
+      }
+    }
+  }
+  if( !err ) {
+    if( runlen > 0 )
+      send_copy(gate, run, runlen);
+    send_literal(gate, p + lit, f->size - lit, &literal);
+    struct cp_op end = { CP_OP_END, 0, 0 };
+    dtp_send(gate, &end, sizeof(end));
+    pthread_mutex_lock(&(cli.mtx));
+    cli.literal += literal;
+    pthread_mutex_unlock(&(cli.mtx));
+  }
+  free(sums);
+  free(sig);
+  free(head);
+  free(next);
+  free(filter);
+  return err;
+}
+
+static void * send_main (void *arg) {
+  struct sender *sd = (struct sender*) arg;
+  dtp_client gate;
+  struct job fly[CP_INFLIGHT], j;
+  int nfly = 0, err = 0, tries;
+  byte_t *buf = malloc(opts.chunk);
+
+  if( buf == NULL || init_dtp_client(&gate, sd->host, sd->port) != 0 )
+    goto fail;
+  set_opts(&gate);
+  for( tries = 0; tries < CP_TRIES; tries++ )
+    if( dtp_connect(&gate) == 0 )
+      break;
+  if( tries == CP_TRIES )
+    goto fail;
+
+  while( !err ) {
+    if( !take_job(&j, nfly == 0) ) {
+      if( nfly == 0 )
+	break;
+      err = reap(&gate, fly, &nfly); /* Retries come from acks. */
+      continue;
+    }
+    const struct cli_file *f = cli.files + j.file;
+    if( j.index == CP_WHOLE ) {
+      while( !err && nfly > 0 )	/* Its checksums come after those. */
+	err = reap(&gate, fly, &nfly);
+      int fd = open(f->src, O_RDONLY);
+      byte_t *map = fd >= 0 && f->size > 0 ?
+	mmap(NULL, f->size, PROT_READ, MAP_PRIVATE, fd, 0) : NULL;
+      if( fd < 0 || map == MAP_FAILED ) {
+	fprintf(stderr, "dtpcp: %s : %s\n", f->src, strerror(errno));
+	if( fd >= 0 )
+	  close(fd);
+	done_job(&j, 0, 1);
+	cli.failed = 1;
+	break;
+      }
+      if( map != NULL )
+	madvise(map, f->size, MADV_SEQUENTIAL);
+      fly[nfly++] = j;
+      if( !err )
+	err = delta_send(&gate, &j, map);
+      if( map != NULL )
+	munmap(map, f->size);
+      close(fd);
+      continue;
+    }
+    struct cp_chunk c = { j.file, 0, j.index, job_len(&j), 0 };
+    int fd = open(f->src, O_RDONLY);
+    if( fd < 0 || read_at(fd, buf, c.len, j.index * opts.chunk) != 0 ) {
+      fprintf(stderr, "dtpcp: %s : %s\n", f->src, strerror(errno));
+      if( fd >= 0 )
+	close(fd);
+      done_job(&j, 0, 1);	/* Unreadable, give up on it. */
+      cli.failed = 1;
+      break;
+    }
+    close(fd);
+    c.sum = chunk_sum(buf, c.len);
+    dtp_send(&gate, &c, sizeof(c));
+    dtp_send(&gate, buf, c.len);
+    fly[nfly++] = j;
+    if( nfly == CP_INFLIGHT )
+      err = reap(&gate, fly, &nfly);
+  }
+  while( !err && nfly > 0 )
+    err = reap(&gate, fly, &nfly);
+  struct cp_chunk end = { CP_END, 0, 0, 0, 0 };
+  dtp_send(&gate, &end, sizeof(end));
+  close_dtp_gate(&gate);
+  close(gate.socket);
+  if( err )
+    goto fail;
+  free(buf);
+  return NULL;
+
+ fail:
+  fprintf(stderr, "dtpcp: stream to %s:%u failed\n", sd->host, sd->port);
+  pthread_mutex_lock(&(cli.mtx));
+  cli.failed = 1;
+  cli.pending -= nfly;
+  pthread_cond_broadcast(&(cli.var));
+  pthread_mutex_unlock(&(cli.mtx));
+  free(buf);
+  return NULL;
+}
+
+static int send_files (const char *host, port_t port, char **paths, int npaths) {
+  int i;
+  for( i = 0; i < npaths; i++ )
+    if( add_path(paths[i]) != 0 ) {
+      fprintf(stderr, "dtpcp: %s : %s\n", paths[i], strerror(errno));
+      return 1;
+    }
+
+  dtp_client ctl;
+  if( init_dtp_client(&ctl, host, port) != 0 ) {
+    perror("init_dtp_client");
+    return 1;
+  }
+  set_opts(&ctl);
+  int tries = 0;		/* The server takes one sender at a time. */
+  while( dtp_connect(&ctl) != 0 && ++tries < CP_TRIES )
+    ;
+  if( tries == CP_TRIES ) {
+    perror("dtp_connect");
+    return 1;
+  }
+  struct cp_hello hello = { CP_MAGIC, CP_VERSION, cli.nfiles, opts.streams, opts.chunk,
+			    opts.delta ? CP_DELTA : 0, 0 };
+  dtp_cork(&ctl);		/* One stream of packets for the table. */
+  dtp_send(&ctl, &hello, sizeof(hello));
+  uint32_t k;
+  for( k = 0; k < cli.nfiles; k++ ) {
+    struct cli_file *f = cli.files + k;
+    struct cp_file cf = { f->size, f->mtime, f->mode, strlen(f->rel) };
+    dtp_send(&ctl, &cf, sizeof(cf));
+    dtp_send(&ctl, f->rel, cf.pathlen);
+  }
+  dtp_uncork(&ctl);
+
+  struct cp_welcome w;
+  if( recv_all(&ctl, &w, sizeof(w)) != 0 || w.status != 0 ) {
+    fprintf(stderr, "dtpcp: server refused : %s\n", strerror(w.status));
+    return 1;
+  }
+  for( k = 0; k < cli.nfiles; k++ ) {
+    struct cli_file *f = cli.files + k;
+    uint64_t c, n = nchunks(f->size, opts.chunk);
+    for( c = 0; c < n; c++ ) {
+      byte_t have;
+      if( recv_all(&ctl, &have, 1) != 0 )
+	return 1;
+      if( have == 1 || (have == 2 && c > 0) )
+	continue;
+      if( add_job(k, have == 2 ? CP_WHOLE : c) != 0 )
+	return 1;
+      cli.total += job_len(cli.todo + cli.ntodo - 1);
+    }
+  }
+  close_dtp_gate(&ctl);
+  close(ctl.socket);
+
+  struct sender *sd = calloc(w.streams, sizeof(struct sender));
+  double t0 = now_s(), last = t0;
+  for( k = 0; k < w.streams; k++ ) {
+    sd[k].host = host;
+    sd[k].port = w.port[k];
+    pthread_create(&(sd[k].tid), NULL, send_main, sd + k);
+  }
+
+  /* Progress once a second until every chunk is in. */
+  pthread_mutex_lock(&(cli.mtx));
+  while( !cli.failed && (cli.next < cli.ntodo || cli.pending > 0) ) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec++;
+    pthread_cond_timedwait(&(cli.var), &(cli.mtx), &ts);
+    double t = now_s();
+    if( !opts.quiet && t - last >= 1.0 ) {
+      fprintf(stderr, "\r%llu / %llu MiB, %.1f MiB/s   ",
+	      (unsigned long long) (cli.bytes >> 20),
+	      (unsigned long long) (cli.total >> 20),
+	      cli.bytes / (t - t0) / (1 << 20));
+      last = t;
+    }
+  }
+  pthread_mutex_unlock(&(cli.mtx));
+  for( k = 0; k < w.streams; k++ )
+    pthread_join(sd[k].tid, NULL);
+  free(sd);
+
+  double secs = now_s() - t0;
+  if( !opts.quiet )
+    fprintf(stderr, "\r%u files, %llu bytes sent in %.2f s, %.1f MiB/s%s\n",
+	    cli.nfiles, (unsigned long long) cli.bytes, secs,
+	    secs > 0 ? cli.bytes / secs / (1 << 20) : 0.0,
+	    cli.failed ? ", incomplete (run again to resume)" : "");
+  if( !opts.quiet && cli.delta > 0 )
+    fprintf(stderr, "%llu bytes as deltas, %llu of them literal\n",
+	    (unsigned long long) cli.delta, (unsigned long long) cli.literal);
+  return cli.failed;
+}
+
+/* -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- -*- */
+
+static void usage (const char *prog) {
+  fprintf(stderr,
+	  "Usage: %s serve [-p port] [-d dir] [options]\n"
+	  "       %s send [-j streams] [-c MiB] [options] host port path...\n"
+	  "  -p <port>  control port (default 9400)\n"
+	  "  -d <dir>   directory files are received into (default .)\n"
+	  "  -j <n>     data gates per transfer (default 4)\n"
+	  "  -c <MiB>   chunk size (default 4)\n"
+	  "  -w <slots> buffer slots per gate (default 4096)\n"
+	  "  -z         negotiate compression\n"
+	  "  -D         send : deltas against older copies on the server\n"
+	  "  -q         no progress output\n", prog, prog);
+}
+
+int main (int argc, char *argv[]) {
+  if( argc < 2 ) {
+    usage(argv[0]);
+    return 1;
+  }
+  int opt;
+  optind = 2;
+  while( (opt = getopt(argc, argv, "p:d:j:c:w:zDq")) != -1 ) {
+    switch( opt ) {
+    case 'p': opts.port = atoi(optarg); break;
+    case 'd': opts.dir = optarg; break;
+    case 'j': opts.streams = atoi(optarg); break;
+    case 'c': opts.chunk = strtoull(optarg, NULL, 0) << 20; break;
+    case 'w': opts.window = atoi(optarg); break;
+    case 'z': opts.compress = 1; break;
+    case 'D': opts.delta = 1; break;
+    case 'q': opts.quiet = 1; break;
+    default: usage(argv[0]); return 1;
+    }
+  }
+  if( opts.streams < 1 || opts.streams > CP_STREAMS_MAX ||
+      opts.chunk == 0 || opts.chunk > CP_CHUNK_MAX ) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  if( strcmp(argv[1], "serve") == 0 && optind == argc )
+    return serve();
+  if( strcmp(argv[1], "send") == 0 && argc - optind >= 3 )
+    return send_files(argv[optind], atoi(argv[optind + 1]),
+		      argv + optind + 2, argc - optind - 2);
+  usage(argv[0]);
+  return 1;
+}